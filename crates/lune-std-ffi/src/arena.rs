@@ -0,0 +1,239 @@
+//! Allocation for short-lived cdata.
+//!
+//! `Arena` is a bump allocator behind `ffi.arena()`: objects are carved out of large chunks and
+//! released all at once by `reset`, which keeps the chunks for reuse. Owned cdata created by
+//! `ffi.new` instead go through `pool_alloc`, which recycles small blocks through free lists per
+//! size class rather than returning each one to malloc.
+
+use std::alloc::{self, Layout};
+use std::cell::RefCell;
+use std::ffi::c_void;
+use std::ptr::{self, NonNull};
+
+use libc::{calloc, free, size_t};
+use mlua::prelude::*;
+
+// No C type in the tree needs stronger alignment than this
+const MAX_ALIGN: usize = 16;
+const DEFAULT_CHUNK_SIZE: usize = 64 * 1024;
+
+struct Chunk {
+    ptr: NonNull<u8>,
+    layout: Layout,
+}
+
+pub struct Arena {
+    chunks: Vec<Chunk>,
+    chunk_size: usize,
+    // Chunk currently bumped into, and the first free byte in it
+    current: usize,
+    offset: usize,
+}
+
+impl Arena {
+    pub fn new(chunk_size: Option<usize>) -> LuaResult<Self> {
+        let chunk_size = chunk_size.unwrap_or(DEFAULT_CHUNK_SIZE);
+        if chunk_size == 0 {
+            return Err(LuaError::runtime(
+                "arena chunk size must be positive".to_string(),
+            ));
+        }
+        Ok(Self {
+            chunks: Vec::new(),
+            chunk_size,
+            current: 0,
+            offset: 0,
+        })
+    }
+
+    fn push_chunk(&mut self, min_size: usize) -> LuaResult<()> {
+        let size = self.chunk_size.max(min_size);
+        let layout = Layout::from_size_align(size, MAX_ALIGN)
+            .map_err(|_| LuaError::runtime(format!("arena chunk of {size} bytes is too large")))?;
+        let ptr = NonNull::new(unsafe { alloc::alloc(layout) }).ok_or_else(|| {
+            LuaError::runtime(format!("failed to allocate arena chunk of {size} bytes"))
+        })?;
+        self.chunks.push(Chunk { ptr, layout });
+        Ok(())
+    }
+
+    /// Returns zeroed storage that stays valid until the next `reset` or until the arena is
+    /// dropped.
+    pub fn alloc(&mut self, size: usize, align: usize) -> LuaResult<*mut c_void> {
+        let align = align.max(1);
+        if !align.is_power_of_two() || align > MAX_ALIGN {
+            return Err(LuaError::runtime(format!(
+                "unsupported arena alignment {align}"
+            )));
+        }
+
+        loop {
+            if let Some(chunk) = self.chunks.get(self.current) {
+                let start = self.offset.next_multiple_of(align);
+                let end = start.saturating_add(size);
+                if end <= chunk.layout.size() {
+                    self.offset = end;
+                    unsafe {
+                        let ptr = chunk.ptr.as_ptr().add(start);
+                        ptr::write_bytes(ptr, 0, size);
+                        return Ok(ptr as *mut c_void);
+                    }
+                }
+                // Chunks kept from before a reset are reused as long as the object fits
+                self.current += 1;
+                self.offset = 0;
+                if self.current < self.chunks.len() {
+                    continue;
+                }
+            }
+            self.push_chunk(size)?;
+            self.current = self.chunks.len() - 1;
+            self.offset = 0;
+        }
+    }
+
+    pub fn reset(&mut self) {
+        self.current = 0;
+        self.offset = 0;
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.chunks.iter().map(|chunk| chunk.layout.size()).sum()
+    }
+}
+
+impl Drop for Arena {
+    fn drop(&mut self) {
+        for chunk in self.chunks.drain(..) {
+            unsafe { alloc::dealloc(chunk.ptr.as_ptr(), chunk.layout) };
+        }
+    }
+}
+
+impl LuaUserData for Arena {}
+
+const SIZE_CLASSES: [usize; 4] = [16, 32, 64, 128];
+// Free blocks kept per class; blocks freed beyond this go back to malloc
+const MAX_FREE_PER_CLASS: usize = 1024;
+
+struct Pool {
+    free_lists: [Vec<*mut c_void>; SIZE_CLASSES.len()],
+}
+
+impl Drop for Pool {
+    fn drop(&mut self) {
+        for list in &mut self.free_lists {
+            for block in list.drain(..) {
+                unsafe { free(block) };
+            }
+        }
+    }
+}
+
+thread_local! {
+    static POOL: RefCell<Pool> = RefCell::new(Pool {
+        free_lists: Default::default(),
+    });
+}
+
+fn size_class(size: usize) -> Option<usize> {
+    SIZE_CLASSES.iter().position(|&class| size <= class)
+}
+
+/// Returns zeroed storage for `size` bytes, to be released with `pool_free` and the same size.
+pub fn pool_alloc(size: usize) -> LuaResult<*mut c_void> {
+    let ptr = match size_class(size) {
+        Some(class) => {
+            let recycled = POOL
+                .try_with(|pool| pool.borrow_mut().free_lists[class].pop())
+                .ok()
+                .flatten();
+            match recycled {
+                Some(block) => {
+                    unsafe { ptr::write_bytes(block as *mut u8, 0, SIZE_CLASSES[class]) };
+                    block
+                }
+                None => unsafe { calloc(1, SIZE_CLASSES[class] as size_t) },
+            }
+        }
+        None => unsafe { calloc(1, size as size_t) },
+    };
+
+    if ptr.is_null() {
+        return Err(LuaError::runtime(format!(
+            "failed to allocate {size} bytes"
+        )));
+    }
+    Ok(ptr)
+}
+
+/// # Safety
+/// `ptr` must come from `pool_alloc(size)` and must not be used afterwards.
+pub unsafe fn pool_free(ptr: *mut c_void, size: usize) {
+    if ptr.is_null() {
+        return;
+    }
+    if let Some(class) = size_class(size) {
+        // Blocks freed while the thread shuts down go straight back to malloc
+        let kept = POOL
+            .try_with(|pool| {
+                let mut pool = pool.borrow_mut();
+                let list = &mut pool.free_lists[class];
+                if list.len() < MAX_FREE_PER_CLASS {
+                    list.push(ptr);
+                    true
+                } else {
+                    false
+                }
+            })
+            .unwrap_or(false);
+        if kept {
+            return;
+        }
+    }
+    unsafe { free(ptr) };
+}
+
+fn byte_count(value: u64) -> LuaResult<usize> {
+    usize::try_from(value)
+        .map_err(|_| LuaError::runtime("allocation size does not fit usize".to_string()))
+}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    let arena_fn = lua.create_function(|lua, chunk_size: Option<u64>| {
+        let chunk_size = chunk_size.map(byte_count).transpose()?;
+        lua.create_userdata(Arena::new(chunk_size)?)
+    })?;
+    exports.set("arena", arena_fn)?;
+
+    let arena_alloc_fn = lua.create_function(
+        |_, (arena, size, align): (LuaAnyUserData, u64, Option<u64>)| {
+            let mut arena = arena.borrow_mut::<Arena>()?;
+            let ptr = arena.alloc(byte_count(size)?, byte_count(align.unwrap_or(1))?)?;
+            Ok(LuaLightUserData(ptr))
+        },
+    )?;
+    exports.set("arenaAlloc", arena_alloc_fn)?;
+
+    let arena_reset_fn = lua.create_function(|_, arena: LuaAnyUserData| {
+        arena.borrow_mut::<Arena>()?.reset();
+        Ok(())
+    })?;
+    exports.set("arenaReset", arena_reset_fn)?;
+
+    let arena_capacity_fn =
+        lua.create_function(|_, arena: LuaAnyUserData| Ok(arena.borrow::<Arena>()?.capacity()))?;
+    exports.set("arenaCapacity", arena_capacity_fn)?;
+
+    let pool_alloc_fn =
+        lua.create_function(|_, size: u64| Ok(LuaLightUserData(pool_alloc(byte_count(size)?)?)))?;
+    exports.set("poolAlloc", pool_alloc_fn)?;
+
+    let pool_free_fn = lua.create_function(|_, (ptr, size): (LuaLightUserData, u64)| {
+        unsafe { pool_free(ptr.0, byte_count(size)?) };
+        Ok(())
+    })?;
+    exports.set("poolFree", pool_free_fn)?;
+
+    Ok(())
+}
@@ -1,15 +1,44 @@
+use std::cell::RefCell;
 use std::convert::TryFrom;
-use std::ffi::{CString, c_void};
+use std::ffi::c_void;
 use std::ptr;
+use std::rc::Rc;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Instant;
 
 use libffi::middle::{Arg, Cif, CodePtr, Type};
-use mlua::prelude::*;
+use mlua::{Buffer as LuaBuffer, prelude::*};
+use mlua_luau_scheduler::LuaSpawnExt;
+use smallvec::SmallVec;
 
+use crate::arena;
+use crate::cdata;
+use crate::direct::{self, DirectStub};
+use crate::int64;
+use crate::record::{self, RecordLayout};
 use crate::signature::{CType, Signature};
+use crate::stats::{self, CallTimer};
+use crate::trace;
 use crate::types::{self, TypeCode};
 
+// Calls with up to this many arguments marshal them without touching the heap
+const INLINE_ARGS: usize = 8;
+
+type ArgValues = SmallVec<[ArgValue; INLINE_ARGS]>;
+type ArgTypes = SmallVec<[Type; INLINE_ARGS]>;
+// Lua values whose memory is passed by pointer, kept referenced until the call returns
+type HeldValues = SmallVec<[LuaValue; INLINE_ARGS]>;
+// Word-aligned storage for struct arguments built from table initializers
+type RecordWords = SmallVec<[u64; 4]>;
+// The types of the trailing arguments of a variadic call, which pick its cif
+type VariadicCodes = SmallVec<[TypeCode; INLINE_ARGS]>;
+
+// Variadic cifs kept per prepared signature; call sites tend to repeat a few argument shapes
+const VARIADIC_CIFS: usize = 8;
+
 #[derive(Debug)]
-enum ArgValue {
+pub(crate) enum ArgValue {
     Int8(i8),
     UInt8(u8),
     Int16(i16),
@@ -21,6 +50,9 @@ enum ArgValue {
     Float32(f32),
     Float64(f64),
     Pointer(*mut c_void),
+    // A struct value read in place from existing storage
+    Record(*mut c_void),
+    RecordInline(RecordWords),
 }
 
 impl ArgValue {
@@ -37,6 +69,26 @@ impl ArgValue {
             ArgValue::Float32(value) => Arg::new(value),
             ArgValue::Float64(value) => Arg::new(value),
             ArgValue::Pointer(value) => Arg::new(value),
+            ArgValue::Record(storage) => Arg::new(unsafe { &*(*storage as *const u8) }),
+            ArgValue::RecordInline(words) => Arg::new(&words[0]),
+        }
+    }
+
+    fn as_raw(&self) -> *mut c_void {
+        match self {
+            ArgValue::Int8(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::UInt8(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::Int16(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::UInt16(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::Int32(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::UInt32(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::Int64(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::UInt64(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::Float32(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::Float64(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::Pointer(value) => ptr::from_ref(value) as *mut c_void,
+            ArgValue::Record(storage) => *storage,
+            ArgValue::RecordInline(words) => words.as_ptr() as *mut c_void,
         }
     }
 }
@@ -47,68 +99,12 @@ struct CDataInfo {
     type_code: Option<TypeCode>,
 }
 
-fn extract_cdata_info(table: &LuaTable) -> LuaResult<Option<CDataInfo>> {
-    let marker = table.raw_get::<LuaValue>("__ffi_cdata")?;
-    if !matches!(marker, LuaValue::Boolean(true)) {
-        return Ok(None);
-    }
-
-    let ptr_value = table.raw_get::<LuaValue>("__ptr")?;
-    let ptr = match ptr_value {
-        LuaValue::LightUserData(ptr) => Some(ptr.0),
-        LuaValue::Nil => None,
-        other => {
-            return Err(LuaError::runtime(format!(
-                "cdata object missing native pointer (found {other:?})",
-            )));
-        }
-    };
-
-    let type_value = table.raw_get::<LuaValue>("__ctype")?;
-    let type_code = match type_value {
-        LuaValue::Nil => None,
-        LuaValue::String(code) => {
-            let normalized = types::normalize_code(code.to_str()?.as_ref());
-            match TypeCode::from_code(&normalized) {
-                Ok(code) => Some(code),
-                Err(_) => None,
-            }
-        }
-        LuaValue::Table(descriptor) => {
-            let code_value = descriptor.raw_get::<LuaValue>("code")?;
-            match code_value {
-                LuaValue::String(code) => {
-                    let normalized = types::normalize_code(code.to_str()?.as_ref());
-                    match TypeCode::from_code(&normalized) {
-                        Ok(code) => Some(code),
-                        Err(_) => None,
-                    }
-                }
-                LuaValue::Nil => None,
-                other => {
-                    return Err(LuaError::runtime(format!(
-                        "cdata descriptor missing string code (found {other:?})",
-                    )));
-                }
-            }
-        }
-        other => {
-            return Err(LuaError::runtime(format!(
-                "cdata object has invalid __ctype field (found {other:?})",
-            )));
-        }
-    };
-
-    Ok(Some(CDataInfo { ptr, type_code }))
-}
-
-fn extract_cdata_pointer(table: &LuaTable) -> LuaResult<Option<*mut c_void>> {
-    let info = match extract_cdata_info(table)? {
-        Some(info) => info,
-        None => return Ok(None),
-    };
-
-    Ok(Some(info.ptr.unwrap_or(std::ptr::null_mut())))
+fn extract_cdata_info(value: &LuaValue) -> Option<CDataInfo> {
+    let (ptr, type_code) = cdata::cdata_info(value)?;
+    Some(CDataInfo {
+        ptr: (!ptr.is_null()).then_some(ptr),
+        type_code,
+    })
 }
 
 fn convert_cdata_variadic_argument(
@@ -190,11 +186,76 @@ fn convert_cdata_variadic_argument(
     }
 }
 
+// Luau keeps every string NUL-terminated, so its bytes are passed in place instead of being
+// copied into a CString
+fn string_pointer(s: LuaString, held: &mut HeldValues) -> LuaResult<*mut c_void> {
+    let ptr = {
+        let bytes = s.as_bytes();
+        if bytes.contains(&0) {
+            return Err(LuaError::runtime(
+                "string argument contains NUL byte".to_string(),
+            ));
+        }
+        bytes.as_ptr() as *mut c_void
+    };
+    held.push(LuaValue::String(s));
+    Ok(ptr)
+}
+
+// Buffers are fixed-size and never move, so native code can read and write their storage
+// directly for the duration of the call
+fn buffer_pointer(buffer: LuaBuffer, held: &mut HeldValues) -> *mut c_void {
+    let value = LuaValue::Buffer(buffer);
+    let ptr = value.to_pointer() as *mut c_void;
+    held.push(value);
+    ptr
+}
+
+// Struct values are passed from the storage of cdata, buffers and raw pointers in place; only
+// table initializers are written out first, into inline storage
+fn record_argument(
+    value: LuaValue,
+    layout: &RecordLayout,
+    held: &mut HeldValues,
+) -> LuaResult<ArgValue> {
+    match value {
+        LuaValue::UserData(_) => match record::cdata_storage(&value)? {
+            Some(storage) => Ok(ArgValue::Record(storage as *mut c_void)),
+            None => Err(LuaError::runtime(
+                "cannot convert userdata value to struct argument".to_string(),
+            )),
+        },
+        LuaValue::Table(table) => {
+            let mut words = RecordWords::from_elem(0, layout.size().div_ceil(8));
+            unsafe { layout.write_table(words.as_mut_ptr() as *mut u8, &table)? };
+            Ok(ArgValue::RecordInline(words))
+        }
+        LuaValue::LightUserData(ptr) if !ptr.0.is_null() => Ok(ArgValue::Record(ptr.0)),
+        LuaValue::Buffer(buffer) => {
+            if buffer.len() < layout.size() {
+                return Err(LuaError::runtime(format!(
+                    "buffer of {} bytes is too small for a struct of {} bytes",
+                    buffer.len(),
+                    layout.size()
+                )));
+            }
+            Ok(ArgValue::Record(buffer_pointer(buffer, held)))
+        }
+        other => Err(LuaError::runtime(format!(
+            "cannot convert value {other:?} to struct argument"
+        ))),
+    }
+}
+
 fn convert_typed_argument(
     value: LuaValue,
     ty: &CType,
-    string_refs: &mut Vec<CString>,
+    held: &mut HeldValues,
 ) -> LuaResult<(ArgValue, TypeCode)> {
+    if let Some(layout) = ty.record() {
+        return Ok((record_argument(value, layout, held)?, ty.code()));
+    }
+
     match ty.code() {
         TypeCode::Void => Err(LuaError::runtime(
             "void type cannot be used as a function argument".to_string(),
@@ -256,9 +317,12 @@ fn convert_typed_argument(
                 ArgValue::Float32(if b { 1.0 } else { 0.0 }),
                 TypeCode::Float32,
             )),
-            other => Err(LuaError::runtime(format!(
-                "expected numeric value for float argument, got {other:?}"
-            ))),
+            other => match int64::boxed(&other) {
+                Some(boxed) => Ok((ArgValue::Float32(boxed.to_f64() as f32), TypeCode::Float32)),
+                None => Err(LuaError::runtime(format!(
+                    "expected numeric value for float argument, got {other:?}"
+                ))),
+            },
         },
         TypeCode::Float64 => match value {
             LuaValue::Number(n) => Ok((ArgValue::Float64(n), TypeCode::Float64)),
@@ -267,17 +331,24 @@ fn convert_typed_argument(
                 ArgValue::Float64(if b { 1.0 } else { 0.0 }),
                 TypeCode::Float64,
             )),
-            other => Err(LuaError::runtime(format!(
-                "expected numeric value for double argument, got {other:?}"
-            ))),
+            other => match int64::boxed(&other) {
+                Some(boxed) => Ok((ArgValue::Float64(boxed.to_f64()), TypeCode::Float64)),
+                None => Err(LuaError::runtime(format!(
+                    "expected numeric value for double argument, got {other:?}"
+                ))),
+            },
         },
         TypeCode::Pointer => match value {
             LuaValue::Nil => Ok((ArgValue::Pointer(std::ptr::null_mut()), TypeCode::Pointer)),
             LuaValue::LightUserData(ptr) => Ok((ArgValue::Pointer(ptr.0), TypeCode::Pointer)),
-            LuaValue::Table(table) => match extract_cdata_pointer(&table)? {
-                Some(ptr) => Ok((ArgValue::Pointer(ptr), TypeCode::Pointer)),
-                None => Err(LuaError::runtime(
-                    "cannot convert table value to pointer argument".to_string(),
+            LuaValue::UserData(_) => match (cdata::cdata_info(&value), int64::boxed(&value)) {
+                (Some((ptr, _)), _) => Ok((ArgValue::Pointer(ptr), TypeCode::Pointer)),
+                (None, Some(boxed)) => Ok((
+                    ArgValue::Pointer(boxed.bits() as usize as *mut c_void),
+                    TypeCode::Pointer,
+                )),
+                (None, None) => Err(LuaError::runtime(
+                    "cannot convert userdata value to pointer argument".to_string(),
                 )),
             },
             LuaValue::Integer(i) => Ok((
@@ -309,14 +380,14 @@ fn convert_typed_argument(
                     TypeCode::Pointer,
                 ))
             }
-            LuaValue::String(s) => {
-                let owned = CString::new(s.as_bytes().as_ref()).map_err(|_| {
-                    LuaError::runtime("string argument contains NUL byte".to_string())
-                })?;
-                let ptr = owned.as_ptr() as *mut c_void;
-                string_refs.push(owned);
-                Ok((ArgValue::Pointer(ptr), TypeCode::Pointer))
-            }
+            LuaValue::String(s) => Ok((
+                ArgValue::Pointer(string_pointer(s, held)?),
+                TypeCode::Pointer,
+            )),
+            LuaValue::Buffer(buffer) => Ok((
+                ArgValue::Pointer(buffer_pointer(buffer, held)),
+                TypeCode::Pointer,
+            )),
             other => Err(LuaError::runtime(format!(
                 "cannot convert value {other:?} to pointer argument"
             ))),
@@ -326,13 +397,21 @@ fn convert_typed_argument(
 
 fn convert_variadic_argument(
     value: LuaValue,
-    string_refs: &mut Vec<CString>,
+    held: &mut HeldValues,
 ) -> LuaResult<(ArgValue, TypeCode)> {
     match value {
         LuaValue::Nil => Ok((ArgValue::Pointer(std::ptr::null_mut()), TypeCode::Pointer)),
         LuaValue::LightUserData(ptr) => Ok((ArgValue::Pointer(ptr.0), TypeCode::Pointer)),
-        LuaValue::Table(table) => {
-            if let Some(info) = extract_cdata_info(&table)? {
+        LuaValue::UserData(_) => {
+            // Boxes pass as the 64-bit type they came from
+            if let Some(boxed) = int64::boxed(&value) {
+                return Ok(if boxed.is_unsigned() {
+                    (ArgValue::UInt64(boxed.bits()), TypeCode::UInt64)
+                } else {
+                    (ArgValue::Int64(boxed.bits() as i64), TypeCode::Int64)
+                });
+            }
+            if let Some(info) = extract_cdata_info(&value) {
                 if let Some(type_code) = info.type_code {
                     if matches!(type_code, TypeCode::Pointer) {
                         let ptr = info.ptr.unwrap_or(std::ptr::null_mut());
@@ -351,16 +430,17 @@ fn convert_variadic_argument(
             }
 
             Err(LuaError::runtime(
-                "cannot infer C type for variadic table argument".to_string(),
+                "cannot infer C type for variadic userdata argument".to_string(),
             ))
         }
-        LuaValue::String(s) => {
-            let owned = CString::new(s.as_bytes().as_ref())
-                .map_err(|_| LuaError::runtime("string argument contains NUL byte".to_string()))?;
-            let ptr = owned.as_ptr() as *mut c_void;
-            string_refs.push(owned);
-            Ok((ArgValue::Pointer(ptr), TypeCode::Pointer))
-        }
+        LuaValue::String(s) => Ok((
+            ArgValue::Pointer(string_pointer(s, held)?),
+            TypeCode::Pointer,
+        )),
+        LuaValue::Buffer(buffer) => Ok((
+            ArgValue::Pointer(buffer_pointer(buffer, held)),
+            TypeCode::Pointer,
+        )),
         LuaValue::Boolean(b) => {
             let value = if b { 1 } else { 0 };
             Ok((ArgValue::Int32(value), TypeCode::Int32))
@@ -390,21 +470,15 @@ fn convert_variadic_argument(
 fn convert_argument(
     value: LuaValue,
     ty: Option<&CType>,
-    string_refs: &mut Vec<CString>,
+    held: &mut HeldValues,
 ) -> LuaResult<(ArgValue, TypeCode)> {
     match ty {
-        Some(ty) => convert_typed_argument(value, ty, string_refs),
-        None => convert_variadic_argument(value, string_refs),
+        Some(ty) => convert_typed_argument(value, ty, held),
+        None => convert_variadic_argument(value, held),
     }
 }
 
-fn collect_arguments(
-    args_table: LuaTable,
-    signature: &Signature,
-) -> LuaResult<(Vec<ArgValue>, Vec<Type>, Vec<CString>)> {
-    let explicit_n = args_table.get::<Option<u32>>("n")?.map(|n| n as usize);
-    let arg_count = explicit_n.unwrap_or_else(|| args_table.raw_len() as usize);
-
+fn check_arity(signature: &Signature, arg_count: usize) -> LuaResult<()> {
     if signature.is_variadic() {
         if arg_count < signature.fixed_count() {
             return Err(LuaError::runtime(format!(
@@ -420,13 +494,55 @@ fn collect_arguments(
             )));
         }
     }
+    Ok(())
+}
+
+fn packed_count(args_table: &LuaTable) -> LuaResult<usize> {
+    let explicit_n = args_table.get::<Option<u32>>("n")?.map(|n| n as usize);
+    Ok(explicit_n.unwrap_or_else(|| args_table.raw_len() as usize))
+}
+
+fn packed_values(
+    args_table: &LuaTable,
+    arg_count: usize,
+) -> impl Iterator<Item = LuaResult<LuaValue>> + '_ {
+    (0..arg_count).map(move |index| args_table.raw_get::<LuaValue>(index as i64 + 1))
+}
+
+fn collect_fixed_arguments(
+    arg_count: usize,
+    args: impl Iterator<Item = LuaResult<LuaValue>>,
+    signature: &Signature,
+) -> LuaResult<(ArgValues, HeldValues)> {
+    check_arity(signature, arg_count)?;
+
+    let mut values = ArgValues::with_capacity(arg_count);
+    let mut held = HeldValues::new();
+
+    for (value, ty) in args.zip(signature.args()) {
+        let (arg, _) = convert_typed_argument(value?, ty, &mut held)?;
+        values.push(arg);
+    }
+
+    Ok((values, held))
+}
+
+// The codes of the trailing arguments are only returned when they alone determine the cif,
+// which is not the case when one of them is a struct
+fn collect_arguments(
+    arg_count: usize,
+    args: impl Iterator<Item = LuaResult<LuaValue>>,
+    signature: &Signature,
+) -> LuaResult<(ArgValues, ArgTypes, Option<VariadicCodes>, HeldValues)> {
+    check_arity(signature, arg_count)?;
 
-    let mut values = Vec::with_capacity(arg_count);
-    let mut arg_types = Vec::with_capacity(arg_count);
-    let mut string_refs = Vec::new();
+    let mut values = ArgValues::with_capacity(arg_count);
+    let mut arg_types = ArgTypes::with_capacity(arg_count);
+    let mut codes = Some(VariadicCodes::new());
+    let mut held = HeldValues::new();
 
-    for index in 0..arg_count {
-        let value = args_table.raw_get::<LuaValue>(index as i64 + 1)?;
+    for (index, value) in args.enumerate() {
+        let value = value?;
         let type_hint = signature.args().get(index);
 
         if index < signature.fixed_count() {
@@ -437,7 +553,7 @@ fn collect_arguments(
                 ))
             })?;
 
-            let (arg, _) = convert_argument(value, Some(ty), &mut string_refs)?;
+            let (arg, _) = convert_argument(value, Some(ty), &mut held)?;
             arg_types.push(ty.to_libffi_type());
             values.push(arg);
             continue;
@@ -450,28 +566,37 @@ fn collect_arguments(
                     index + 1
                 ))
             })?;
-            let (arg, _) = convert_argument(value, Some(ty), &mut string_refs)?;
+            let (arg, _) = convert_argument(value, Some(ty), &mut held)?;
             arg_types.push(ty.to_libffi_type());
             values.push(arg);
             continue;
         }
 
-        let (arg, inferred) = convert_argument(value, type_hint, &mut string_refs)?;
+        let (arg, inferred) = convert_argument(value, type_hint, &mut held)?;
         let ffi_type = match type_hint {
             Some(ty) => ty.to_libffi_type(),
-            None => CType { code: inferred }.to_libffi_type(),
+            None => CType::scalar(inferred).to_libffi_type(),
         };
+        match type_hint {
+            Some(ty) if ty.record().is_some() => codes = None,
+            _ => {
+                if let Some(codes) = &mut codes {
+                    codes.push(inferred);
+                }
+            }
+        }
         arg_types.push(ffi_type);
         values.push(arg);
     }
 
-    Ok((values, arg_types, string_refs))
+    Ok((values, arg_types, codes, held))
 }
 
 fn call_with_signature(
+    lua: &Lua,
     signature: &Signature,
     func: LuaLightUserData,
-    cif: Cif,
+    cif: &Cif,
     args: &[Arg],
 ) -> LuaResult<LuaValue> {
     let code_ptr = CodePtr::from_ptr(func.0 as *const c_void);
@@ -508,20 +633,16 @@ fn call_with_signature(
             }
             TypeCode::Int64 => {
                 let value: i64 = cif.call(code_ptr, args);
-                Ok(LuaValue::Integer(value))
+                int64::signed_value(lua, value)
             }
             TypeCode::UInt64 => {
                 let value: u64 = cif.call(code_ptr, args);
-                if value <= i64::MAX as u64 {
-                    Ok(LuaValue::Integer(value as i64))
-                } else {
-                    Ok(LuaValue::Number(value as f64))
-                }
+                int64::unsigned_value(lua, value)
             }
             TypeCode::IntPtr => {
                 if cfg!(target_pointer_width = "64") {
                     let value: i64 = cif.call(code_ptr, args);
-                    Ok(LuaValue::Integer(value))
+                    int64::signed_value(lua, value)
                 } else {
                     let value: i32 = cif.call(code_ptr, args);
                     Ok(LuaValue::Integer(value.into()))
@@ -530,11 +651,7 @@ fn call_with_signature(
             TypeCode::UIntPtr => {
                 if cfg!(target_pointer_width = "64") {
                     let value: u64 = cif.call(code_ptr, args);
-                    if value <= i64::MAX as u64 {
-                        Ok(LuaValue::Integer(value as i64))
-                    } else {
-                        Ok(LuaValue::Number(value as f64))
-                    }
+                    int64::unsigned_value(lua, value)
                 } else {
                     let value: u32 = cif.call(code_ptr, args);
                     Ok(LuaValue::Integer((value as i64).into()))
@@ -560,17 +677,399 @@ fn call_with_signature(
     }
 }
 
+// Struct results land in fresh zeroed pool storage, which the returned cdata takes ownership of
+fn call_returning_record(
+    func: LuaLightUserData,
+    cif: &Cif,
+    arg_values: &[ArgValue],
+    layout: &RecordLayout,
+) -> LuaResult<LuaValue> {
+    // libffi writes small results as a whole register, which the smallest size class covers
+    let storage = arena::pool_alloc(layout.size())?;
+
+    let mut arg_ptrs: SmallVec<[*mut c_void; INLINE_ARGS]> =
+        arg_values.iter().map(ArgValue::as_raw).collect();
+    let code_ptr = CodePtr::from_ptr(func.0 as *const c_void);
+    unsafe {
+        libffi::raw::ffi_call(
+            cif.as_raw_ptr(),
+            Some(*code_ptr.as_fun()),
+            storage,
+            arg_ptrs.as_mut_ptr(),
+        );
+    }
+    Ok(LuaValue::LightUserData(LuaLightUserData(storage)))
+}
+
+fn invoke(
+    lua: &Lua,
+    signature: &Signature,
+    func: LuaLightUserData,
+    cif: &Cif,
+    arg_values: &[ArgValue],
+) -> LuaResult<LuaValue> {
+    if let Some(layout) = signature.result().record() {
+        return call_returning_record(func, cif, arg_values, layout);
+    }
+    let arg_refs: SmallVec<[Arg; INLINE_ARGS]> = arg_values.iter().map(ArgValue::as_arg).collect();
+    call_with_signature(lua, signature, func, cif, &arg_refs)
+}
+
+/// A function signature parsed once, with the Cif of fixed-arity signatures prepared up front.
+/// Variadic signatures need a Cif per shape of trailing arguments, known only from the values
+/// passed, so the last few are kept keyed by those types. Common shapes also get a direct stub,
+/// see `direct`.
+pub struct PreparedSignature {
+    signature: Signature,
+    cif: Option<Cif>,
+    direct: Option<DirectStub>,
+    // Most recently used first
+    variadic_cifs: RefCell<Vec<(VariadicCodes, Rc<Cif>)>>,
+    // Symbol the calls are profiled under, see `stats`
+    name: Option<Arc<str>>,
+}
+
+impl PreparedSignature {
+    pub fn from_table(signature_table: LuaTable) -> LuaResult<Self> {
+        let signature = Signature::from_table(signature_table)?;
+        let cif = if signature.is_variadic() {
+            None
+        } else {
+            Some(signature.build_cif(&signature.arg_types()))
+        };
+        let direct = direct::stub_for(&signature);
+        Ok(Self {
+            signature,
+            cif,
+            direct,
+            variadic_cifs: RefCell::new(Vec::new()),
+            name: None,
+        })
+    }
+
+    pub fn with_name(mut self, name: Option<String>) -> Self {
+        self.name = name.map(Arc::from);
+        self
+    }
+
+    fn variadic_cif(&self, codes: Option<VariadicCodes>, arg_types: &[Type]) -> Rc<Cif> {
+        let Some(codes) = codes else {
+            return Rc::new(self.signature.build_cif(arg_types));
+        };
+        let mut cached = self.variadic_cifs.borrow_mut();
+        if let Some(index) = cached.iter().position(|(key, _)| *key == codes) {
+            cached[..=index].rotate_right(1);
+            return Rc::clone(&cached[0].1);
+        }
+        let cif = Rc::new(self.signature.build_cif(arg_types));
+        cached.truncate(VARIADIC_CIFS - 1);
+        cached.insert(0, (codes, Rc::clone(&cif)));
+        cif
+    }
+}
+
+impl LuaUserData for PreparedSignature {}
+
+// Marks the end of argument conversion for profiling, and the start of the traced native call
+fn marshalled(timer: &mut Option<CallTimer>, name: &Option<Arc<str>>) -> Option<Instant> {
+    if let Some(timer) = timer {
+        timer.marshalled();
+    }
+    (name.is_some() && trace::enabled()).then(Instant::now)
+}
+
+fn call_with_values(
+    lua: &Lua,
+    func: LuaLightUserData,
+    prepared: &PreparedSignature,
+    arg_count: usize,
+    args: impl Iterator<Item = LuaResult<LuaValue>>,
+) -> LuaResult<LuaValue> {
+    let mut timer = prepared.name.as_ref().and_then(|_| CallTimer::start());
+    let signature = &prepared.signature;
+    let (result, traced) = match &prepared.cif {
+        Some(cif) => {
+            let (arg_values, _held) = collect_fixed_arguments(arg_count, args, signature)?;
+            let traced = marshalled(&mut timer, &prepared.name);
+            let result = match prepared.direct {
+                Some(stub) => unsafe { stub(lua, func.0 as *const c_void, &arg_values) },
+                None => invoke(lua, signature, func, cif, &arg_values),
+            };
+            (result, traced)
+        }
+        None => {
+            let (arg_values, arg_types, codes, _held) =
+                collect_arguments(arg_count, args, signature)?;
+            let cif = prepared.variadic_cif(codes, &arg_types);
+            let traced = marshalled(&mut timer, &prepared.name);
+            (invoke(lua, signature, func, &cif, &arg_values), traced)
+        }
+    };
+    if let Some(name) = &prepared.name {
+        if let Some(started) = traced {
+            trace::complete_symbol(name, started);
+        }
+        if let Some(timer) = timer {
+            timer.finish(name);
+        }
+    }
+    result
+}
+
+pub fn call_prepared(
+    lua: &Lua,
+    func: LuaLightUserData,
+    prepared: &PreparedSignature,
+    args_table: LuaTable,
+) -> LuaResult<LuaValue> {
+    let arg_count = packed_count(&args_table)?;
+    call_with_values(
+        lua,
+        func,
+        prepared,
+        arg_count,
+        packed_values(&args_table, arg_count),
+    )
+}
+
+/// Calls with the arguments taken straight from the Lua stack, without packing them into a table.
+pub fn callv(
+    lua: &Lua,
+    func: LuaLightUserData,
+    prepared: &PreparedSignature,
+    args: LuaMultiValue,
+) -> LuaResult<LuaValue> {
+    let arg_count = args.len();
+    call_with_values(lua, func, prepared, arg_count, args.into_iter().map(Ok))
+}
+
 pub fn call(
-    _lua: &Lua,
+    lua: &Lua,
     func: LuaLightUserData,
     signature_table: LuaTable,
     args_table: LuaTable,
 ) -> LuaResult<LuaValue> {
-    let signature = Signature::from_table(signature_table)?;
-    let (arg_values, arg_types, _owned_strings) = collect_arguments(args_table, &signature)?;
-    let arg_refs: Vec<Arg> = arg_values.iter().map(ArgValue::as_arg).collect();
-    let cif = signature.build_cif(&arg_types);
-    call_with_signature(&signature, func, cif, &arg_refs)
+    let prepared = PreparedSignature::from_table(signature_table)?;
+    call_prepared(lua, func, &prepared, args_table)
+}
+
+// Room for any scalar result; libffi widens integral results narrower than a word to a word
+type ResultSlot = [u64; 2];
+
+/// A call marshalled on the Lua thread, to be made on a blocking worker. The cif is its own
+/// copy and the argument values are owned, so nothing here points into Lua state except the
+/// memory of the argument values, which an `InFlight` keeps referenced until the call returns.
+struct OffloadedCall {
+    func: *const c_void,
+    cif: Cif,
+    arg_values: ArgValues,
+    // Storage for a struct result, or null to use the result slot
+    record: *mut c_void,
+}
+
+// Safety: the raw pointers are only used by the worker, and what they point to is kept alive by
+// the call's `InFlight` until the worker reports it done
+unsafe impl Send for OffloadedCall {}
+
+impl OffloadedCall {
+    fn run(self) -> ResultSlot {
+        let mut slot: ResultSlot = [0; 2];
+        let mut arg_ptrs: SmallVec<[*mut c_void; INLINE_ARGS]> =
+            self.arg_values.iter().map(ArgValue::as_raw).collect();
+        let result = if self.record.is_null() {
+            slot.as_mut_ptr() as *mut c_void
+        } else {
+            self.record
+        };
+        let code_ptr = CodePtr::from_ptr(self.func);
+        unsafe {
+            libffi::raw::ffi_call(
+                self.cif.as_raw_ptr(),
+                Some(*code_ptr.as_fun()),
+                result,
+                arg_ptrs.as_mut_ptr(),
+            );
+        }
+        slot
+    }
+}
+
+fn load_result(lua: &Lua, slot: &ResultSlot, code: TypeCode) -> LuaResult<LuaValue> {
+    let word = unsafe { ptr::read(slot.as_ptr() as *const usize) };
+    Ok(match code {
+        TypeCode::Void => LuaValue::Nil,
+        TypeCode::Int8 => LuaValue::Integer(word as i8 as i64),
+        TypeCode::UInt8 => LuaValue::Integer(word as u8 as i64),
+        TypeCode::Int16 => LuaValue::Integer(word as i16 as i64),
+        TypeCode::UInt16 => LuaValue::Integer(word as u16 as i64),
+        TypeCode::Int32 => LuaValue::Integer(word as i32 as i64),
+        TypeCode::UInt32 => LuaValue::Integer(word as u32 as i64),
+        TypeCode::Int64 => int64::signed_value(lua, slot[0] as i64)?,
+        TypeCode::UInt64 => int64::unsigned_value(lua, slot[0])?,
+        TypeCode::IntPtr => int64::signed_value(lua, word as isize as i64)?,
+        TypeCode::UIntPtr => int64::unsigned_value(lua, word as u64)?,
+        TypeCode::Float32 => {
+            LuaValue::Number(unsafe { ptr::read(slot.as_ptr() as *const f32) } as f64)
+        }
+        TypeCode::Float64 => LuaValue::Number(unsafe { ptr::read(slot.as_ptr() as *const f64) }),
+        TypeCode::Pointer if word == 0 => LuaValue::Nil,
+        TypeCode::Pointer => LuaValue::LightUserData(LuaLightUserData(word as *mut c_void)),
+    })
+}
+
+// What the arguments of an async call point into, and its struct result storage, which must
+// outlive the native call even when the waiting Luau thread is dropped before it returns
+struct Pinned {
+    done: Arc<AtomicBool>,
+    _held: HeldValues,
+    _args: LuaMultiValue,
+    record: *mut c_void,
+    record_size: usize,
+}
+
+impl Drop for Pinned {
+    fn drop(&mut self) {
+        // Only reached once the worker is done; a result nobody collected is freed here
+        unsafe { arena::pool_free(self.record, self.record_size) };
+    }
+}
+
+// Calls whose Luau thread went away while the worker was still in them
+struct ParkedCalls(Vec<Pinned>);
+
+// Releases the parked calls the workers are done with
+fn sweep_parked(lua: &Lua) {
+    let finished = match lua.app_data_mut::<ParkedCalls>() {
+        Some(mut parked) => {
+            let (finished, running) = std::mem::take(&mut parked.0)
+                .into_iter()
+                .partition(|call| call.done.load(Ordering::Acquire));
+            parked.0 = running;
+            finished
+        }
+        None => Vec::new(),
+    };
+    drop(finished);
+}
+
+// Owned by the future of an async call; dropped before the worker is done, it parks the pinned
+// memory with the state for a later call to release
+struct InFlight {
+    lua: Lua,
+    pinned: Option<Pinned>,
+}
+
+impl InFlight {
+    // Hands the struct result storage, if any, to the caller
+    fn finish(mut self) -> *mut c_void {
+        self.pinned.take().map_or(ptr::null_mut(), |mut pinned| {
+            std::mem::replace(&mut pinned.record, ptr::null_mut())
+        })
+    }
+}
+
+impl Drop for InFlight {
+    fn drop(&mut self) {
+        let Some(pinned) = self.pinned.take() else {
+            return;
+        };
+        if pinned.done.load(Ordering::Acquire) {
+            return;
+        }
+        if let Some(mut parked) = self.lua.app_data_mut::<ParkedCalls>() {
+            parked.0.push(pinned);
+            return;
+        }
+        self.lua.set_app_data(ParkedCalls(vec![pinned]));
+    }
+}
+
+/// Like `callv`, but the native call runs on the scheduler's blocking pool while the calling
+/// Luau thread yields. Arguments are converted before yielding, and the values they came from
+/// are held until the call returns, so strings and buffers passed by pointer stay valid. The
+/// worker cannot be stopped, so if the thread is cancelled or collected meanwhile, they stay
+/// held, along with any struct result, until a later async call finds the worker done.
+pub async fn callv_async(
+    lua: Lua,
+    func: LuaLightUserData,
+    prepared: LuaAnyUserData,
+    args: LuaMultiValue,
+) -> LuaResult<LuaValue> {
+    sweep_parked(&lua);
+    let started = stats::enabled().then(Instant::now);
+    let (job, record_size, code, name, traced, held) = {
+        let prepared = prepared.borrow::<PreparedSignature>()?;
+        let signature = &prepared.signature;
+        let arg_count = args.len();
+        let values = args.iter().cloned().map(Ok);
+        let (arg_values, cif, held) = match &prepared.cif {
+            Some(cif) => {
+                let (arg_values, held) = collect_fixed_arguments(arg_count, values, signature)?;
+                (arg_values, cif.clone(), held)
+            }
+            None => {
+                let (arg_values, arg_types, codes, held) =
+                    collect_arguments(arg_count, values, signature)?;
+                let cif = prepared.variadic_cif(codes, &arg_types);
+                (arg_values, Cif::clone(&cif), held)
+            }
+        };
+        let (record, record_size) = match signature.result().record() {
+            Some(layout) => (arena::pool_alloc(layout.size())?, layout.size()),
+            None => (ptr::null_mut(), 0),
+        };
+        let job = OffloadedCall {
+            func: func.0 as *const c_void,
+            cif,
+            arg_values,
+            record,
+        };
+        let name = prepared.name.clone().filter(|_| started.is_some());
+        let traced = prepared.name.clone().filter(|_| trace::enabled());
+        let code = signature.result().code();
+        (job, record_size, code, name, traced, held)
+    };
+
+    let done = Arc::new(AtomicBool::new(false));
+    let in_flight = InFlight {
+        lua: lua.clone(),
+        pinned: Some(Pinned {
+            done: Arc::clone(&done),
+            _held: held,
+            record: job.record,
+            record_size,
+            _args: args,
+        }),
+    };
+
+    // Only the time on the worker counts as time in the call, not the wait for a free worker
+    let marshal = started.map(|started| started.elapsed());
+    let (slot, elapsed) = lua
+        .spawn_blocking(move || {
+            let started = (marshal.is_some() || traced.is_some()).then(Instant::now);
+            let slot = job.run();
+            done.store(true, Ordering::Release);
+            if let (Some(name), Some(started)) = (&traced, started) {
+                trace::complete_symbol(name, started);
+            }
+            (
+                slot,
+                started
+                    .filter(|_| marshal.is_some())
+                    .map(|started| started.elapsed()),
+            )
+        })
+        .await;
+    let record = in_flight.finish();
+    if let (Some(name), Some(marshal), Some(elapsed)) = (name, marshal, elapsed) {
+        stats::record_call(&name, marshal, elapsed);
+    }
+
+    if record.is_null() {
+        load_result(&lua, &slot, code)
+    } else {
+        Ok(LuaValue::LightUserData(LuaLightUserData(record)))
+    }
 }
 
 #[cfg(test)]
@@ -581,6 +1080,13 @@ mod tests {
 
     struct RawBox<T>(*mut T);
 
+    #[repr(C)]
+    #[derive(Clone, Copy, Debug, PartialEq)]
+    struct RuntimeStructInit {
+        x: i32,
+        y: f64,
+    }
+
     impl<T> RawBox<T> {
         fn new(value: T) -> Self {
             RawBox(Box::into_raw(Box::new(value)))
@@ -604,6 +1110,8 @@ mod tests {
 
     unsafe extern "C" {
         fn luneffi_test_add_ints(a: i32, b: i32) -> i32;
+        fn luneffi_test_struct_sum(value: RuntimeStructInit) -> f64;
+        fn luneffi_test_struct_make(x: i32, y: f64) -> RuntimeStructInit;
         fn luneffi_test_variadic_sum(count: i32, ...) -> i32;
         fn luneffi_test_variadic_format(
             buffer: *mut c_char,
@@ -647,17 +1155,16 @@ mod tests {
         Ok(args)
     }
 
-    fn make_cdata_table(lua: &Lua, code: &str, ptr: *mut c_void) -> LuaResult<LuaTable> {
-        let table = lua.create_table()?;
-        table.raw_set("__ffi_cdata", LuaValue::Boolean(true))?;
-        table.raw_set("__ptr", LuaValue::LightUserData(LuaLightUserData(ptr)))?;
+    fn make_cdata(lua: &Lua, descriptor: &LuaTable, ptr: *mut c_void) -> LuaResult<LuaValue> {
+        let object = cdata::create(lua, descriptor, ptr, None, LuaValue::Nil)?;
+        Ok(LuaValue::UserData(object))
+    }
 
+    fn make_primitive_cdata(lua: &Lua, code: &str, ptr: *mut c_void) -> LuaResult<LuaValue> {
         let descriptor = lua.create_table()?;
         descriptor.set("code", code)?;
         descriptor.set("kind", "primitive")?;
-        table.raw_set("__ctype", LuaValue::Table(descriptor))?;
-
-        Ok(table)
+        make_cdata(lua, &descriptor, ptr)
     }
 
     #[test]
@@ -674,6 +1181,140 @@ mod tests {
         Ok(())
     }
 
+    #[test]
+    fn call_prepared_reuses_signature() -> LuaResult<()> {
+        let lua = Lua::new();
+        let signature = make_signature(&lua, "int32", &["int32", "int32"], false, 2)?;
+        let prepared = PreparedSignature::from_table(signature)?;
+        let func = LuaLightUserData(luneffi_test_add_ints as *const () as *mut c_void);
+        for index in 0..4 {
+            let args = pack_args(&lua, vec![LuaValue::Integer(index), LuaValue::Integer(40)])?;
+            match call_prepared(&lua, func, &prepared, args)? {
+                LuaValue::Integer(value) => assert_eq!(value, index + 40),
+                other => panic!("unexpected result: {other:?}"),
+            }
+        }
+
+        let args = pack_args(&lua, vec![LuaValue::Integer(1)])?;
+        assert!(call_prepared(&lua, func, &prepared, args).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn call_prepared_direct_stub_matches_cif() -> LuaResult<()> {
+        let lua = Lua::new();
+        let signature = make_signature(&lua, "int32", &["int32", "int32"], false, 2)?;
+        let mut prepared = PreparedSignature::from_table(signature)?;
+        assert!(prepared.direct.is_some());
+
+        let func = LuaLightUserData(luneffi_test_add_ints as *const () as *mut c_void);
+        let args = pack_args(&lua, vec![LuaValue::Integer(-7), LuaValue::Integer(49)])?;
+        let direct = call_prepared(&lua, func, &prepared, args)?;
+
+        prepared.direct = None;
+        let args = pack_args(&lua, vec![LuaValue::Integer(-7), LuaValue::Integer(49)])?;
+        let through_cif = call_prepared(&lua, func, &prepared, args)?;
+
+        match (direct, through_cif) {
+            (LuaValue::Integer(a), LuaValue::Integer(b)) => assert_eq!((a, b), (42, 42)),
+            other => panic!("unexpected results: {other:?}"),
+        }
+
+        let narrow = make_signature(&lua, "int8", &["int8"], false, 1)?;
+        assert!(PreparedSignature::from_table(narrow)?.direct.is_none());
+        Ok(())
+    }
+
+    fn make_struct_descriptor(lua: &Lua) -> LuaResult<LuaTable> {
+        let field = |name: &str, offset: usize, code: &str| -> LuaResult<LuaTable> {
+            let ctype = lua.create_table()?;
+            ctype.set("kind", "primitive")?;
+            ctype.set("code", code)?;
+            let field = lua.create_table()?;
+            field.set("name", name)?;
+            field.set("offset", offset)?;
+            field.set("ctype", ctype)?;
+            Ok(field)
+        };
+
+        let descriptor = lua.create_table()?;
+        descriptor.set("kind", "struct")?;
+        descriptor.set("name", "RuntimeStructInit")?;
+        descriptor.set("size", std::mem::size_of::<RuntimeStructInit>())?;
+        descriptor.set(
+            "fields",
+            lua.create_sequence_from([field("x", 0, "int32")?, field("y", 8, "double")?])?,
+        )?;
+        Ok(descriptor)
+    }
+
+    #[test]
+    fn call_passes_and_returns_structs_by_value() -> LuaResult<()> {
+        let lua = Lua::new();
+        let descriptor = make_struct_descriptor(&lua)?;
+
+        let signature = lua.create_table()?;
+        signature.set("result", "double")?;
+        signature.set("args", lua.create_sequence_from([descriptor.clone()])?)?;
+        let prepared = PreparedSignature::from_table(signature)?;
+        assert!(prepared.direct.is_none());
+
+        let func = LuaLightUserData(luneffi_test_struct_sum as *const () as *mut c_void);
+        let init = lua.create_table()?;
+        init.set("y", 0.5)?;
+        init.set(1, 41)?;
+        let args = LuaMultiValue::from_vec(vec![LuaValue::Table(init)]);
+        match callv(&lua, func, &prepared, args)? {
+            LuaValue::Number(value) => assert_eq!(value, 41.5),
+            other => panic!("unexpected result: {other:?}"),
+        }
+
+        let storage = RawBox::new(RuntimeStructInit { x: 2, y: 0.25 });
+        let cdata = make_cdata(&lua, &descriptor, storage.ptr() as *mut c_void)?;
+        let args = LuaMultiValue::from_vec(vec![cdata]);
+        match callv(&lua, func, &prepared, args)? {
+            LuaValue::Number(value) => assert_eq!(value, 2.25),
+            other => panic!("unexpected result: {other:?}"),
+        }
+
+        let signature = lua.create_table()?;
+        signature.set("result", descriptor)?;
+        signature.set("args", lua.create_sequence_from(["int32", "double"])?)?;
+        let prepared = PreparedSignature::from_table(signature)?;
+        let func = LuaLightUserData(luneffi_test_struct_make as *const () as *mut c_void);
+        let args = LuaMultiValue::from_vec(vec![LuaValue::Integer(7), LuaValue::Number(1.5)]);
+        let result = match callv(&lua, func, &prepared, args)? {
+            LuaValue::LightUserData(ptr) => ptr.0 as *mut RuntimeStructInit,
+            other => panic!("unexpected result: {other:?}"),
+        };
+        assert_eq!(unsafe { *result }, RuntimeStructInit { x: 7, y: 1.5 });
+        unsafe {
+            arena::pool_free(
+                result as *mut c_void,
+                std::mem::size_of::<RuntimeStructInit>(),
+            )
+        };
+        Ok(())
+    }
+
+    #[test]
+    fn callv_takes_arguments_from_multivalue() -> LuaResult<()> {
+        let lua = Lua::new();
+        let signature = make_signature(&lua, "int32", &["int32"], true, 1)?;
+        let prepared = PreparedSignature::from_table(signature)?;
+        let args = LuaMultiValue::from_vec(vec![
+            LuaValue::Integer(2),
+            LuaValue::Integer(19),
+            LuaValue::Integer(23),
+        ]);
+        let func = LuaLightUserData(luneffi_test_variadic_sum as *const () as *mut c_void);
+        match callv(&lua, func, &prepared, args)? {
+            LuaValue::Integer(value) => assert_eq!(value, 42),
+            other => panic!("unexpected result: {other:?}"),
+        }
+        Ok(())
+    }
+
     #[test]
     fn call_variadic_sum_infers_arguments() -> LuaResult<()> {
         let lua = Lua::new();
@@ -696,6 +1337,33 @@ mod tests {
         Ok(())
     }
 
+    #[test]
+    fn call_variadic_reuses_cifs_per_argument_shape() -> LuaResult<()> {
+        let lua = Lua::new();
+        let prepared =
+            PreparedSignature::from_table(make_signature(&lua, "int32", &["int32"], true, 1)?)?;
+        let func = LuaLightUserData(luneffi_test_variadic_sum as *const () as *mut c_void);
+        let sum = |values: Vec<LuaValue>| -> LuaResult<LuaValue> {
+            callv(&lua, func, &prepared, LuaMultiValue::from_vec(values))
+        };
+
+        for _ in 0..3 {
+            let result = sum(vec![
+                LuaValue::Integer(2),
+                LuaValue::Integer(4),
+                LuaValue::Integer(5),
+            ])?;
+            assert!(matches!(result, LuaValue::Integer(9)));
+        }
+        assert_eq!(prepared.variadic_cifs.borrow().len(), 1);
+
+        let result = sum(vec![LuaValue::Integer(1), LuaValue::Integer(7)])?;
+        assert!(matches!(result, LuaValue::Integer(7)));
+        assert_eq!(prepared.variadic_cifs.borrow().len(), 2);
+        assert_eq!(prepared.variadic_cifs.borrow()[0].0.len(), 1);
+        Ok(())
+    }
+
     #[test]
     fn call_variadic_format_handles_strings() -> LuaResult<()> {
         let lua = Lua::new();
@@ -729,6 +1397,28 @@ mod tests {
         Ok(())
     }
 
+    #[test]
+    fn call_rejects_strings_with_nul_bytes() -> LuaResult<()> {
+        let lua = Lua::new();
+        let signature = make_signature(&lua, "int32", &["pointer", "size_t", "pointer"], true, 3)?;
+
+        let mut buffer: [c_char; 16] = [0; 16];
+        let format = lua.create_string(b"%d\0%d")?;
+        let args = pack_args(
+            &lua,
+            vec![
+                LuaValue::LightUserData(LuaLightUserData(buffer.as_mut_ptr() as *mut c_void)),
+                LuaValue::Integer(buffer.len() as i64),
+                LuaValue::String(format),
+                LuaValue::Integer(1),
+            ],
+        )?;
+
+        let func = LuaLightUserData(luneffi_test_variadic_format as *const () as *mut c_void);
+        assert!(call(&lua, func, signature, args).is_err());
+        Ok(())
+    }
+
     #[test]
     fn call_variadic_uses_cdata_type_information() -> LuaResult<()> {
         let lua = Lua::new();
@@ -742,8 +1432,8 @@ mod tests {
         let big_value = RawBox::new(big_value_raw);
         let float_value = RawBox::new(float_value_raw);
 
-        let int_cdata = make_cdata_table(&lua, "int64", big_value.ptr() as *mut c_void)?;
-        let float_cdata = make_cdata_table(&lua, "float", float_value.ptr() as *mut c_void)?;
+        let int_cdata = make_primitive_cdata(&lua, "int64", big_value.ptr() as *mut c_void)?;
+        let float_cdata = make_primitive_cdata(&lua, "float", float_value.ptr() as *mut c_void)?;
 
         let args = pack_args(
             &lua,
@@ -751,8 +1441,8 @@ mod tests {
                 LuaValue::LightUserData(LuaLightUserData(buffer.as_mut_ptr() as *mut c_void)),
                 LuaValue::Integer(buffer.len() as i64),
                 LuaValue::String(format),
-                LuaValue::Table(int_cdata),
-                LuaValue::Table(float_cdata),
+                int_cdata,
+                float_cdata,
             ],
         )?;
 
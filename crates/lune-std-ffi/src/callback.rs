@@ -1,353 +1,703 @@
+//! Luau functions exposed to C as function pointers.
+//!
+//! Each pointer is a libffi closure over a `CallbackData` that names the Luau function to call.
+//! Closures are bound to a signature but not to a function or state, so once a callback is
+//! released its closure is parked in a per-thread pool keyed by signature, and the next callback
+//! with the same signature rebinds it instead of preparing a cif and allocating trampoline pages.
+
+use std::cell::RefCell;
+use std::collections::HashMap;
 use std::ffi::c_void;
 use std::ptr;
+use std::rc::Rc;
+use std::sync::mpsc::{self, SyncSender};
+use std::sync::{Arc, Mutex, PoisonError, Weak};
+use std::thread::{self, ThreadId};
+use std::time::Instant;
 
+use async_channel::Sender;
 use libffi::middle::Closure;
 use mlua::RegistryKey;
 use mlua::prelude::*;
+use mlua_luau_scheduler::LuaSpawnExt;
 
+use crate::cdata;
+use crate::int64;
+use crate::memory;
 use crate::signature::{CType, Signature};
+use crate::stats;
+use crate::trace;
 use crate::types::{self, TypeCode};
 
 const CALLBACK_RESULT_SIZE: usize = 16;
 
-struct CallbackData {
-    lua: Lua,
-    function_key: Option<RegistryKey>,
-    signature: Signature,
-}
-
-impl CallbackData {
-    fn new(lua: Lua, signature: Signature, function_key: RegistryKey) -> Self {
-        Self {
-            lua,
-            function_key: Some(function_key),
-            signature,
-        }
-    }
-
-    fn signature(&self) -> &Signature {
-        &self.signature
-    }
+// Idle closures kept per signature; callbacks are usually created in bursts of the same few types
+const MAX_IDLE_PER_SIGNATURE: usize = 32;
 
-    fn get_function(&self) -> LuaResult<LuaFunction> {
-        let key = self
-            .function_key
-            .as_ref()
-            .ok_or_else(|| LuaError::runtime("callback function has been released".to_string()))?;
-        self.lua.registry_value(key)
-    }
+thread_local! {
+    static IDLE: RefCell<HashMap<String, Vec<Trampoline>>> = RefCell::new(HashMap::new());
+}
 
-    fn read_argument(
-        &self,
-        args: *const *const c_void,
-        index: usize,
-        ty: &CType,
-    ) -> LuaResult<LuaValue> {
-        unsafe {
-            let arg_ptr = *args.add(index);
-            match ty.code() {
-                TypeCode::Void => Err(LuaError::runtime(
-                    "void type cannot be used as a callback argument".to_string(),
-                )),
-                TypeCode::Int8 => Ok(LuaValue::Integer(*(arg_ptr as *const i8) as i64)),
-                TypeCode::UInt8 => Ok(LuaValue::Integer(*(arg_ptr as *const u8) as i64)),
-                TypeCode::Int16 => Ok(LuaValue::Integer(*(arg_ptr as *const i16) as i64)),
-                TypeCode::UInt16 => Ok(LuaValue::Integer(*(arg_ptr as *const u16) as i64)),
-                TypeCode::Int32 => Ok(LuaValue::Integer(*(arg_ptr as *const i32) as i64)),
-                TypeCode::UInt32 => Ok(LuaValue::Integer(*(arg_ptr as *const u32) as i64)),
-                TypeCode::Int64 => Ok(LuaValue::Integer(*(arg_ptr as *const i64))),
-                TypeCode::UInt64 => {
-                    let value = *(arg_ptr as *const u64);
-                    if value <= i64::MAX as u64 {
-                        Ok(LuaValue::Integer(value as i64))
-                    } else {
-                        Ok(LuaValue::Number(value as f64))
-                    }
-                }
-                TypeCode::IntPtr => {
-                    if usize::BITS == 64 {
-                        Ok(LuaValue::Integer(*(arg_ptr as *const i64)))
-                    } else {
-                        Ok(LuaValue::Integer(*(arg_ptr as *const i32) as i64))
-                    }
-                }
-                TypeCode::UIntPtr => {
-                    if usize::BITS == 64 {
-                        let value = *(arg_ptr as *const u64);
-                        if value <= i64::MAX as u64 {
-                            Ok(LuaValue::Integer(value as i64))
-                        } else {
-                            Ok(LuaValue::Number(value as f64))
-                        }
-                    } else {
-                        Ok(LuaValue::Integer(*(arg_ptr as *const u32) as i64))
-                    }
-                }
-                TypeCode::Float32 => Ok(LuaValue::Number(*(arg_ptr as *const f32) as f64)),
-                TypeCode::Float64 => Ok(LuaValue::Number(*(arg_ptr as *const f64))),
-                TypeCode::Pointer => {
-                    let value = *(arg_ptr as *const *mut c_void);
-                    if value.is_null() {
-                        Ok(LuaValue::Nil)
-                    } else {
-                        Ok(LuaValue::LightUserData(LuaLightUserData(value)))
-                    }
-                }
-            }
-        }
-    }
+// Signatures that lower to the same libffi call can share closures
+fn signature_key(signature: &Signature) -> String {
+    let args: Vec<TypeCode> = signature.args().iter().map(CType::code).collect();
+    format!(
+        "{:?}:{:?}:{args:?}",
+        signature.abi,
+        signature.result().code()
+    )
+}
 
-    fn pointer_from_value(&self, value: &LuaValue) -> LuaResult<*mut c_void> {
-        match value {
-            LuaValue::Nil => Ok(ptr::null_mut()),
-            LuaValue::LightUserData(ptr) => Ok(ptr.0),
-            LuaValue::Boolean(false) => Ok(ptr::null_mut()),
-            LuaValue::Boolean(true) => Err(LuaError::runtime(
-                "cannot convert boolean 'true' to pointer".to_string(),
+/// # Safety
+/// `arg_ptr` must point to a readable value of type `code`.
+unsafe fn read_argument(lua: &Lua, arg_ptr: *const c_void, code: TypeCode) -> LuaResult<LuaValue> {
+    unsafe {
+        match code {
+            TypeCode::Void => Err(LuaError::runtime(
+                "void type cannot be used as a callback argument".to_string(),
             )),
-            LuaValue::Integer(i) => {
-                if *i < 0 {
-                    return Err(LuaError::runtime(
-                        "pointer value must be non-negative".to_string(),
-                    ));
+            TypeCode::Int8 => Ok(LuaValue::Integer(*(arg_ptr as *const i8) as i64)),
+            TypeCode::UInt8 => Ok(LuaValue::Integer(*(arg_ptr as *const u8) as i64)),
+            TypeCode::Int16 => Ok(LuaValue::Integer(*(arg_ptr as *const i16) as i64)),
+            TypeCode::UInt16 => Ok(LuaValue::Integer(*(arg_ptr as *const u16) as i64)),
+            TypeCode::Int32 => Ok(LuaValue::Integer(*(arg_ptr as *const i32) as i64)),
+            TypeCode::UInt32 => Ok(LuaValue::Integer(*(arg_ptr as *const u32) as i64)),
+            TypeCode::Int64 => int64::signed_value(lua, *(arg_ptr as *const i64)),
+            TypeCode::UInt64 => int64::unsigned_value(lua, *(arg_ptr as *const u64)),
+            TypeCode::IntPtr => {
+                if usize::BITS == 64 {
+                    int64::signed_value(lua, *(arg_ptr as *const i64))
+                } else {
+                    Ok(LuaValue::Integer(*(arg_ptr as *const i32) as i64))
                 }
-                Ok((*i as u64) as usize as *mut c_void)
             }
-            LuaValue::Number(n) => {
-                if !n.is_finite() {
-                    return Err(LuaError::runtime(
-                        "pointer value must be finite".to_string(),
-                    ));
-                }
-                if *n < 0.0 {
-                    return Err(LuaError::runtime(
-                        "pointer value must be non-negative".to_string(),
-                    ));
-                }
-                if (n.trunc() - n).abs() > f64::EPSILON {
-                    return Err(LuaError::runtime(
-                        "pointer value must be integral".to_string(),
-                    ));
+            TypeCode::UIntPtr => {
+                if usize::BITS == 64 {
+                    int64::unsigned_value(lua, *(arg_ptr as *const u64))
+                } else {
+                    Ok(LuaValue::Integer(*(arg_ptr as *const u32) as i64))
                 }
-                Ok((*n as u64) as usize as *mut c_void)
             }
-            LuaValue::Table(table) => {
-                let marker = table.raw_get::<LuaValue>("__ffi_cdata")?;
-                if !matches!(marker, LuaValue::Boolean(true)) {
-                    return Err(LuaError::runtime(
-                        "cannot convert table value to pointer".to_string(),
-                    ));
-                }
-                let inner = table.raw_get::<LuaValue>("__ptr")?;
-                match inner {
-                    LuaValue::LightUserData(ptr) => Ok(ptr.0),
-                    LuaValue::Nil => Ok(ptr::null_mut()),
-                    other => Err(LuaError::runtime(format!(
-                        "cdata object missing native pointer (found {other:?})",
-                    ))),
+            TypeCode::Float32 => Ok(LuaValue::Number(*(arg_ptr as *const f32) as f64)),
+            TypeCode::Float64 => Ok(LuaValue::Number(*(arg_ptr as *const f64))),
+            TypeCode::Pointer => {
+                let value = *(arg_ptr as *const *mut c_void);
+                if value.is_null() {
+                    Ok(LuaValue::Nil)
+                } else {
+                    Ok(LuaValue::LightUserData(LuaLightUserData(value)))
                 }
             }
-            other => Err(LuaError::runtime(format!(
-                "cannot convert value {other:?} to pointer",
-            ))),
         }
     }
+}
 
-    fn write_result(
-        &self,
-        buffer: &mut [u8; CALLBACK_RESULT_SIZE],
-        value: LuaValue,
-    ) -> LuaResult<()> {
-        buffer.fill(0);
-        match self.signature().result().code() {
-            TypeCode::Void => Ok(()),
-            TypeCode::Int8 => {
-                let v = types::clamp_signed(types::lua_value_to_i64(&value)?, 8)? as i8;
-                buffer[..1].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
+fn pointer_from_value(value: &LuaValue) -> LuaResult<*mut c_void> {
+    match value {
+        LuaValue::Nil => Ok(ptr::null_mut()),
+        LuaValue::LightUserData(ptr) => Ok(ptr.0),
+        LuaValue::Boolean(false) => Ok(ptr::null_mut()),
+        LuaValue::Boolean(true) => Err(LuaError::runtime(
+            "cannot convert boolean 'true' to pointer".to_string(),
+        )),
+        LuaValue::Integer(i) => {
+            if *i < 0 {
+                return Err(LuaError::runtime(
+                    "pointer value must be non-negative".to_string(),
+                ));
             }
-            TypeCode::UInt8 => {
-                let v = types::clamp_unsigned(types::lua_value_to_u64(&value)?, 8)? as u8;
-                buffer[..1].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
-            }
-            TypeCode::Int16 => {
-                let v = types::clamp_signed(types::lua_value_to_i64(&value)?, 16)? as i16;
-                buffer[..2].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
-            }
-            TypeCode::UInt16 => {
-                let v = types::clamp_unsigned(types::lua_value_to_u64(&value)?, 16)? as u16;
-                buffer[..2].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
-            }
-            TypeCode::Int32 => {
-                let v = types::clamp_signed(types::lua_value_to_i64(&value)?, 32)? as i32;
-                buffer[..4].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
+            Ok((*i as u64) as usize as *mut c_void)
+        }
+        LuaValue::Number(n) => {
+            if !n.is_finite() {
+                return Err(LuaError::runtime(
+                    "pointer value must be finite".to_string(),
+                ));
             }
-            TypeCode::UInt32 => {
-                let v = types::clamp_unsigned(types::lua_value_to_u64(&value)?, 32)? as u32;
-                buffer[..4].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
+            if *n < 0.0 {
+                return Err(LuaError::runtime(
+                    "pointer value must be non-negative".to_string(),
+                ));
             }
-            TypeCode::Int64 => {
-                let v = types::lua_value_to_i64(&value)?;
-                buffer[..8].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
+            if (n.trunc() - n).abs() > f64::EPSILON {
+                return Err(LuaError::runtime(
+                    "pointer value must be integral".to_string(),
+                ));
             }
-            TypeCode::UInt64 => {
-                let v = types::lua_value_to_u64(&value)?;
-                buffer[..8].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
+            Ok((*n as u64) as usize as *mut c_void)
+        }
+        LuaValue::UserData(_) => match cdata::cdata_info(value) {
+            Some((ptr, _)) => Ok(ptr),
+            None if int64::boxed(value).is_some() => {
+                Ok(types::lua_value_to_u64(value)? as usize as *mut c_void)
             }
-            TypeCode::IntPtr => {
-                let bits = usize::BITS;
-                let value = types::clamp_signed(types::lua_value_to_i64(&value)?, bits)?;
-                if bits == 64 {
-                    buffer[..8].copy_from_slice(&value.to_ne_bytes());
-                } else {
-                    let narrowed = value as i32;
-                    buffer[..4].copy_from_slice(&narrowed.to_ne_bytes());
-                }
-                Ok(())
+            None => Err(LuaError::runtime(
+                "cannot convert userdata value to pointer".to_string(),
+            )),
+        },
+        other => Err(LuaError::runtime(format!(
+            "cannot convert value {other:?} to pointer",
+        ))),
+    }
+}
+
+fn write_result(
+    buffer: &mut [u8; CALLBACK_RESULT_SIZE],
+    code: TypeCode,
+    value: LuaValue,
+) -> LuaResult<()> {
+    buffer.fill(0);
+    match code {
+        TypeCode::Void => Ok(()),
+        TypeCode::Int8 => {
+            let v = types::clamp_signed(types::lua_value_to_i64(&value)?, 8)? as i8;
+            buffer[..1].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::UInt8 => {
+            let v = types::clamp_unsigned(types::lua_value_to_u64(&value)?, 8)? as u8;
+            buffer[..1].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::Int16 => {
+            let v = types::clamp_signed(types::lua_value_to_i64(&value)?, 16)? as i16;
+            buffer[..2].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::UInt16 => {
+            let v = types::clamp_unsigned(types::lua_value_to_u64(&value)?, 16)? as u16;
+            buffer[..2].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::Int32 => {
+            let v = types::clamp_signed(types::lua_value_to_i64(&value)?, 32)? as i32;
+            buffer[..4].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::UInt32 => {
+            let v = types::clamp_unsigned(types::lua_value_to_u64(&value)?, 32)? as u32;
+            buffer[..4].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::Int64 => {
+            let v = types::lua_value_to_i64(&value)?;
+            buffer[..8].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::UInt64 => {
+            let v = types::lua_value_to_u64(&value)?;
+            buffer[..8].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::IntPtr => {
+            let bits = usize::BITS;
+            let value = types::clamp_signed(types::lua_value_to_i64(&value)?, bits)?;
+            if bits == 64 {
+                buffer[..8].copy_from_slice(&value.to_ne_bytes());
+            } else {
+                let narrowed = value as i32;
+                buffer[..4].copy_from_slice(&narrowed.to_ne_bytes());
             }
-            TypeCode::UIntPtr => {
-                let bits = usize::BITS;
-                let value = types::clamp_unsigned(types::lua_value_to_u64(&value)?, bits)?;
-                if bits == 64 {
-                    buffer[..8].copy_from_slice(&value.to_ne_bytes());
-                } else {
-                    let narrowed = value as u32;
-                    buffer[..4].copy_from_slice(&narrowed.to_ne_bytes());
-                }
-                Ok(())
+            Ok(())
+        }
+        TypeCode::UIntPtr => {
+            let bits = usize::BITS;
+            let value = types::clamp_unsigned(types::lua_value_to_u64(&value)?, bits)?;
+            if bits == 64 {
+                buffer[..8].copy_from_slice(&value.to_ne_bytes());
+            } else {
+                let narrowed = value as u32;
+                buffer[..4].copy_from_slice(&narrowed.to_ne_bytes());
             }
-            TypeCode::Float32 => {
-                let v = match value {
-                    LuaValue::Number(n) => n as f32,
-                    LuaValue::Integer(i) => i as f32,
-                    LuaValue::Boolean(b) => {
-                        if b {
-                            1.0
-                        } else {
-                            0.0
-                        }
+            Ok(())
+        }
+        TypeCode::Float32 => {
+            let v = match value {
+                LuaValue::Number(n) => n as f32,
+                LuaValue::Integer(i) => i as f32,
+                LuaValue::Boolean(b) => {
+                    if b {
+                        1.0
+                    } else {
+                        0.0
                     }
-                    other => {
+                }
+                other => match int64::boxed(&other) {
+                    Some(boxed) => boxed.to_f64() as f32,
+                    None => {
                         return Err(LuaError::runtime(format!(
                             "expected numeric value for float result, got {other:?}"
                         )));
                     }
-                };
-                buffer[..4].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
-            }
-            TypeCode::Float64 => {
-                let v = match value {
-                    LuaValue::Number(n) => n,
-                    LuaValue::Integer(i) => i as f64,
-                    LuaValue::Boolean(b) => {
-                        if b {
-                            1.0
-                        } else {
-                            0.0
-                        }
+                },
+            };
+            buffer[..4].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::Float64 => {
+            let v = match value {
+                LuaValue::Number(n) => n,
+                LuaValue::Integer(i) => i as f64,
+                LuaValue::Boolean(b) => {
+                    if b {
+                        1.0
+                    } else {
+                        0.0
                     }
-                    other => {
+                }
+                other => match int64::boxed(&other) {
+                    Some(boxed) => boxed.to_f64(),
+                    None => {
                         return Err(LuaError::runtime(format!(
                             "expected numeric value for double result, got {other:?}"
                         )));
                     }
-                };
-                buffer[..8].copy_from_slice(&v.to_ne_bytes());
-                Ok(())
+                },
+            };
+            buffer[..8].copy_from_slice(&v.to_ne_bytes());
+            Ok(())
+        }
+        TypeCode::Pointer => {
+            let ptr = pointer_from_value(&value)?;
+            let bytes = (ptr as usize).to_ne_bytes();
+            let size = std::mem::size_of::<*mut c_void>();
+            buffer[..size].copy_from_slice(&bytes[..size]);
+            Ok(())
+        }
+    }
+}
+
+// The function a closure calls, shareable with the invocations queued for it
+struct BoundFunction {
+    key: RegistryKey,
+    args: Arc<[TypeCode]>,
+    result: TypeCode,
+}
+
+impl BoundFunction {
+    fn call(&self, lua: &Lua, args: &[*const c_void]) -> LuaResult<[u8; CALLBACK_RESULT_SIZE]> {
+        let callback: LuaFunction = lua.registry_value(&self.key)?;
+        let mut result = [0; CALLBACK_RESULT_SIZE];
+        call_function(lua, &callback, &self.args, self.result, args, &mut result)?;
+        Ok(result)
+    }
+}
+
+// Up to four arguments go to the function as a tuple, which pushes them straight onto the Lua
+// stack; only wider signatures collect them into a list first
+fn call_function(
+    lua: &Lua,
+    callback: &LuaFunction,
+    codes: &[TypeCode],
+    result_code: TypeCode,
+    args: &[*const c_void],
+    result: &mut [u8; CALLBACK_RESULT_SIZE],
+) -> LuaResult<()> {
+    stats::record_callback();
+    let traced = trace::enabled().then(Instant::now);
+    let arg = |index: usize| unsafe { read_argument(lua, args[index], codes[index]) };
+    let returned: LuaValue = match codes.len() {
+        0 => callback.call(())?,
+        1 => callback.call(arg(0)?)?,
+        2 => callback.call((arg(0)?, arg(1)?))?,
+        3 => callback.call((arg(0)?, arg(1)?, arg(2)?))?,
+        4 => callback.call((arg(0)?, arg(1)?, arg(2)?, arg(3)?))?,
+        count => {
+            let values = (0..count).map(&arg).collect::<LuaResult<Vec<_>>>()?;
+            callback.call(LuaMultiValue::from_vec(values))?
+        }
+    };
+    if let Some(started) = traced {
+        trace::complete("callback", started);
+    }
+    write_result(result, result_code, returned)
+}
+
+/// How a callback behaves when C calls it from a thread other than its state's.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum CallbackMode {
+    // Refused with a warning and a zeroed result, since Lua cannot run there
+    Sync,
+    // Queued for the state's thread; the C thread returns a zeroed result at once
+    Async,
+    // Queued for the state's thread, with the C thread blocked until the result is ready
+    Blocking,
+}
+
+impl CallbackMode {
+    fn from_option(value: Option<String>) -> LuaResult<Self> {
+        match value.as_deref() {
+            None | Some("sync") => Ok(CallbackMode::Sync),
+            Some("async") => Ok(CallbackMode::Async),
+            Some("blocking") => Ok(CallbackMode::Blocking),
+            Some(other) => Err(LuaError::runtime(format!(
+                "unknown callback mode '{other}'"
+            ))),
+        }
+    }
+}
+
+// What the closure calls on its state's thread
+struct Binding {
+    lua: Lua,
+    // Resolved once, so calls on the state's thread skip the registry
+    callback: LuaFunction,
+    mode: CallbackMode,
+}
+
+// What the closure does when a foreign thread calls it; kept apart from the binding, which only
+// the state's thread may touch
+#[derive(Clone)]
+enum Remote {
+    Released,
+    Refused,
+    Queued {
+        function: Arc<BoundFunction>,
+        mode: CallbackMode,
+        // The pump stops once the last async callback holding it is released
+        queue: Arc<Sender<Invocation>>,
+    },
+}
+
+struct CallbackData {
+    // The closure never leaves the thread whose pool it was made for
+    thread: ThreadId,
+    // Unbound while the closure is idle, so that a pooled closure keeps no state alive; shared
+    // with the call in progress, so that the function may rebind or free its own callback
+    binding: RefCell<Option<Rc<Binding>>>,
+    // Swapped under the lock, so that a foreign call in flight keeps the function it found
+    // while the state's thread rebinds or releases the closure
+    remote: Mutex<Remote>,
+    args: Arc<[TypeCode]>,
+    result: TypeCode,
+}
+
+impl CallbackData {
+    fn new(signature: &Signature) -> Self {
+        Self {
+            thread: thread::current().id(),
+            binding: RefCell::new(None),
+            remote: Mutex::new(Remote::Released),
+            args: signature.args().iter().map(CType::code).collect(),
+            result: signature.result().code(),
+        }
+    }
+
+    fn mode(&self) -> Option<CallbackMode> {
+        self.binding.borrow().as_ref().map(|binding| binding.mode)
+    }
+
+    fn bind(&self, lua: &Lua, func: LuaFunction, mode: CallbackMode) -> LuaResult<()> {
+        let remote = match mode {
+            CallbackMode::Sync => Remote::Refused,
+            CallbackMode::Async | CallbackMode::Blocking => Remote::Queued {
+                function: Arc::new(BoundFunction {
+                    key: lua.create_registry_value(func.clone())?,
+                    args: Arc::clone(&self.args),
+                    result: self.result,
+                }),
+                mode,
+                queue: async_queue(lua),
+            },
+        };
+        let binding = Rc::new(Binding {
+            lua: lua.clone(),
+            callback: func,
+            mode,
+        });
+        self.set_remote(remote);
+        drop(self.binding.replace(Some(binding)));
+        Ok(())
+    }
+
+    fn release(&self) {
+        self.set_remote(Remote::Released);
+        drop(self.binding.take());
+    }
+
+    // The previous value is dropped after the lock is released
+    fn set_remote(&self, remote: Remote) -> Remote {
+        let mut current = self.remote.lock().unwrap_or_else(PoisonError::into_inner);
+        std::mem::replace(&mut *current, remote)
+    }
+
+    fn invoke(&self, result: &mut [u8; CALLBACK_RESULT_SIZE], args: *const *const c_void) {
+        let args = unsafe { std::slice::from_raw_parts(args, self.args.len()) };
+        if thread::current().id() == self.thread {
+            self.invoke_here(result, args);
+        } else {
+            self.invoke_remote(result, args);
+        }
+    }
+
+    fn invoke_here(&self, result: &mut [u8; CALLBACK_RESULT_SIZE], args: &[*const c_void]) {
+        let Some(binding) = self.binding.borrow().clone() else {
+            eprintln!("ffi: callback called after its function was released");
+            return;
+        };
+        let called = call_function(
+            &binding.lua,
+            &binding.callback,
+            &self.args,
+            self.result,
+            args,
+            result,
+        );
+        if let Err(err) = called {
+            result.fill(0);
+            report_error(&binding.lua, err);
+        }
+    }
+
+    fn invoke_remote(&self, result: &mut [u8; CALLBACK_RESULT_SIZE], args: &[*const c_void]) {
+        let remote = self
+            .remote
+            .lock()
+            .unwrap_or_else(PoisonError::into_inner)
+            .clone();
+        let (function, mode, queue) = match remote {
+            Remote::Released => {
+                eprintln!("ffi: callback called after its function was released");
+                return;
             }
-            TypeCode::Pointer => {
-                let ptr = self.pointer_from_value(&value)?;
-                let bytes = (ptr as usize).to_ne_bytes();
-                let size = std::mem::size_of::<*mut c_void>();
-                buffer[..size].copy_from_slice(&bytes[..size]);
-                Ok(())
+            Remote::Refused => {
+                eprintln!(
+                    "ffi: callback called from a foreign thread; create it with ffi.callback and mode 'async' or 'blocking'"
+                );
+                return;
             }
+            Remote::Queued {
+                function,
+                mode,
+                queue,
+            } => (function, mode, queue),
+        };
+        let (reply, response) = match mode {
+            CallbackMode::Blocking => {
+                let (reply, response) = mpsc::sync_channel(1);
+                (Some(reply), Some(response))
+            }
+            _ => (None, None),
+        };
+        let invocation = Invocation {
+            function,
+            args: args
+                .iter()
+                .zip(self.args.iter())
+                .map(|(&arg_ptr, &code)| copy_argument(arg_ptr, code))
+                .collect(),
+            reply,
+        };
+        if trace::enabled() {
+            trace::instant("callback queued");
+        }
+        if queue.send_blocking(invocation).is_err() {
+            return;
+        }
+        // A dropped reply means the call failed, and the error was reported on the Lua side
+        if let Some(value) = response.and_then(|response| response.recv().ok()) {
+            *result = value;
         }
     }
+}
 
-    fn invoke(
-        &mut self,
-        result: &mut [u8; CALLBACK_RESULT_SIZE],
-        args: *const *const c_void,
-    ) -> LuaResult<()> {
-        let mut values = Vec::with_capacity(self.signature().args().len());
-        for (index, ty) in self.signature().args().iter().enumerate() {
-            let value = self.read_argument(args, index, ty)?;
-            values.push(value);
-        }
-        let lua_args = LuaMultiValue::from_vec(values);
-        let callback = self.get_function()?;
-        let returned = callback.call::<LuaValue>(lua_args)?;
-        self.write_result(result, returned)
+fn report_error(lua: &Lua, err: LuaError) {
+    let message = format!("ffi: error in callback: {err}");
+    if let Ok(warn) = lua.globals().get::<LuaFunction>("warn") {
+        let _ = warn.call::<()>(message.clone());
+        return;
     }
+    eprintln!("{message}");
+}
 
-    fn report_error(&self, err: LuaError) {
-        let message = format!("ffi: error in callback: {err}");
-        let globals = self.lua.globals();
-        if let Ok(warn) = globals.get::<LuaFunction>("warn") {
-            let _ = warn.call::<()>(message.clone());
-            return;
+// Arguments queued from a foreign thread, copied out of its stack; scalars are at most 8 bytes
+type QueuedArgument = [u8; 8];
+
+fn copy_argument(arg_ptr: *const c_void, code: TypeCode) -> QueuedArgument {
+    let mut copy = [0; 8];
+    let size = code.size_of().min(copy.len());
+    unsafe { ptr::copy_nonoverlapping(arg_ptr as *const u8, copy.as_mut_ptr(), size) };
+    copy
+}
+
+/// A call made on a foreign thread, waiting to run on the thread of the callback's state.
+struct Invocation {
+    function: Arc<BoundFunction>,
+    args: Vec<QueuedArgument>,
+    reply: Option<SyncSender<[u8; CALLBACK_RESULT_SIZE]>>,
+}
+
+impl Invocation {
+    fn run(self, lua: &Lua) {
+        let args: Vec<*const c_void> = self
+            .args
+            .iter()
+            .map(|arg| arg.as_ptr() as *const c_void)
+            .collect();
+        match self.function.call(lua, &args) {
+            Ok(value) => {
+                if let Some(reply) = self.reply {
+                    let _ = reply.send(value);
+                }
+            }
+            Err(err) => report_error(lua, err),
         }
-        eprintln!("{message}");
     }
 }
 
-struct CallbackHandle {
+// The queue every async callback of a state shares, found through its app data
+struct AsyncQueue(Weak<Sender<Invocation>>);
+
+// Starts the pump on first use: a local task on the scheduler that runs queued invocations,
+// and that ends, no longer keeping the script alive, once no async callback is bound
+fn async_queue(lua: &Lua) -> Arc<Sender<Invocation>> {
+    let existing = lua
+        .app_data_ref::<AsyncQueue>()
+        .and_then(|queue| queue.0.upgrade());
+    if let Some(sender) = existing {
+        return sender;
+    }
+
+    let (sender, receiver) = async_channel::unbounded::<Invocation>();
+    let sender = Arc::new(sender);
+    lua.set_app_data(AsyncQueue(Arc::downgrade(&sender)));
+    let pump_lua = lua.clone();
+    lua.spawn_local(async move {
+        while let Ok(invocation) = receiver.recv().await {
+            invocation.run(&pump_lua);
+        }
+    });
+    sender
+}
+
+// A prepared closure together with the data its trampoline receives
+struct Trampoline {
     closure: Option<Closure<'static>>,
     data: *mut CallbackData,
 }
 
+impl Trampoline {
+    fn new(signature: Signature) -> Self {
+        let arg_types = signature.arg_types();
+        let cif = signature.build_cif(&arg_types);
+        let data = Box::into_raw(Box::new(CallbackData::new(&signature)));
+        let closure = Closure::new(cif, callback_trampoline, unsafe { &*data });
+        Self {
+            closure: Some(closure),
+            data,
+        }
+    }
+
+    fn code_ptr(&self) -> *mut c_void {
+        match &self.closure {
+            Some(closure) => *closure.code_ptr() as *const () as *mut c_void,
+            None => ptr::null_mut(),
+        }
+    }
+
+    fn data(&self) -> &CallbackData {
+        unsafe { &*self.data }
+    }
+}
+
+impl Drop for Trampoline {
+    fn drop(&mut self) {
+        drop(self.closure.take());
+        if !self.data.is_null() {
+            drop(unsafe { Box::from_raw(self.data) });
+        }
+    }
+}
+
+fn take_idle(key: &str) -> Option<Trampoline> {
+    IDLE.with(|idle| idle.borrow_mut().get_mut(key).and_then(Vec::pop))
+}
+
+fn park_idle(key: String, trampoline: Trampoline) {
+    trampoline.data().release();
+    // Anything past the bound is freed, after the pool borrow ends
+    let _overflow = IDLE.with(|idle| {
+        let mut idle = idle.borrow_mut();
+        let parked = idle.entry(key).or_default();
+        if parked.len() < MAX_IDLE_PER_SIGNATURE {
+            parked.push(trampoline);
+            None
+        } else {
+            Some(trampoline)
+        }
+    });
+}
+
+struct CallbackHandle {
+    trampoline: Option<Trampoline>,
+    key: String,
+}
+
 impl CallbackHandle {
     fn new(
         lua: &Lua,
         signature: Signature,
         func: LuaFunction,
+        mode: CallbackMode,
     ) -> LuaResult<(Self, LuaLightUserData)> {
         if signature.is_variadic() {
             return Err(LuaError::runtime(
                 "TODO(@lune/ffi/callback): variadic callbacks not supported yet".to_string(),
             ));
         }
+        if signature.has_records() {
+            return Err(LuaError::runtime(
+                "TODO(@lune/ffi/callback): struct-by-value callbacks not supported yet".to_string(),
+            ));
+        }
 
-        let arg_types = signature.arg_types();
-        let cif = signature.build_cif(&arg_types);
-        let registry_key = lua.create_registry_value(func)?;
-        let data = CallbackData::new(lua.clone(), signature, registry_key);
-        let data_ptr = Box::into_raw(Box::new(data));
-        let closure = Closure::new_mut(cif, callback_trampoline, unsafe { &mut *data_ptr });
-        let code_ptr = closure.code_ptr();
-        let raw_ptr = *code_ptr as *const () as *mut c_void;
+        let key = signature_key(&signature);
+        let trampoline = take_idle(&key).unwrap_or_else(|| Trampoline::new(signature));
+        trampoline.data().bind(lua, func, mode)?;
+        memory::track(
+            lua,
+            trampoline.data as *const c_void,
+            "callback",
+            std::mem::size_of::<CallbackData>(),
+        );
+        let code_ptr = trampoline.code_ptr();
         Ok((
             Self {
-                closure: Some(closure),
-                data: data_ptr,
+                trampoline: Some(trampoline),
+                key,
             },
-            LuaLightUserData(raw_ptr),
+            LuaLightUserData(code_ptr),
         ))
     }
+
+    // The pointer keeps its address, so C code holding it calls the new function from now on;
+    // a foreign thread already inside the old one finishes that call first
+    fn set(&mut self, lua: &Lua, func: LuaFunction) -> LuaResult<()> {
+        match &self.trampoline {
+            Some(trampoline) => {
+                let data = trampoline.data();
+                data.bind(lua, func, data.mode().unwrap_or(CallbackMode::Sync))
+            }
+            None => Err(LuaError::runtime(
+                "cannot set a callback that has been freed".to_string(),
+            )),
+        }
+    }
+
+    // Returns the closure to the pool ahead of collection. The pointer must not be called again:
+    // a pooled closure only warns, but one past the pool bound is freed outright, so C threads
+    // calling it must be stopped before the handle is freed or collected
+    fn free(&mut self) {
+        if let Some(trampoline) = self.trampoline.take() {
+            memory::untrack(trampoline.data as *const c_void);
+            park_idle(std::mem::take(&mut self.key), trampoline);
+        }
+    }
 }
 
 impl Drop for CallbackHandle {
     fn drop(&mut self) {
-        unsafe {
-            if let Some(closure) = self.closure.take() {
-                drop(closure);
-            }
-            if !self.data.is_null() {
-                let mut data = Box::from_raw(self.data);
-                if let Some(key) = data.function_key.take() {
-                    drop(key);
-                }
-            }
-        }
+        self.free();
     }
 }
 
@@ -357,26 +707,162 @@ unsafe extern "C" fn callback_trampoline(
     _cif: &libffi::low::ffi_cif,
     result: &mut [u8; CALLBACK_RESULT_SIZE],
     args: *const *const c_void,
-    userdata: &mut CallbackData,
+    userdata: &CallbackData,
 ) {
     result.fill(0);
-    if let Err(err) = userdata.invoke(result, args) {
-        userdata.report_error(err);
-    }
+    userdata.invoke(result, args);
 }
 
 pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
-    let factory =
-        lua.create_function(|lua, (signature_table, func): (LuaTable, LuaFunction)| {
+    let factory = lua.create_function(
+        |lua, (signature_table, func, mode): (LuaTable, LuaFunction, Option<String>)| {
             let signature = Signature::from_table(signature_table)?;
-            let (handle, ptr) = CallbackHandle::new(lua, signature, func)?;
+            let mode = CallbackMode::from_option(mode)?;
+            let (handle, ptr) = CallbackHandle::new(lua, signature, func, mode)?;
             let userdata = lua.create_userdata(handle)?;
             Ok(LuaMultiValue::from_vec(vec![
                 LuaValue::LightUserData(ptr),
                 LuaValue::UserData(userdata),
             ]))
-        })?;
+        },
+    )?;
 
     exports.set("createCallback", factory)?;
+
+    let set_fn = lua.create_function(|lua, (handle, func): (LuaAnyUserData, LuaFunction)| {
+        handle.borrow_mut::<CallbackHandle>()?.set(lua, func)
+    })?;
+    exports.set("setCallback", set_fn)?;
+
+    let free_fn = lua.create_function(|_, handle: LuaAnyUserData| {
+        handle.borrow_mut::<CallbackHandle>()?.free();
+        Ok(())
+    })?;
+    exports.set("freeCallback", free_fn)?;
+
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+    use super::*;
+
+    fn unary_signature(lua: &Lua) -> LuaResult<Signature> {
+        let table = lua.create_table()?;
+        table.set("result", "int32")?;
+        table.set("args", lua.create_sequence_from(["int32"])?)?;
+        Signature::from_table(table)
+    }
+
+    #[test]
+    fn released_closures_are_reused_for_the_same_signature() -> LuaResult<()> {
+        let lua = Lua::new();
+        let double = lua.load("return function(x) return x * 2 end").eval()?;
+        let (mut first, first_ptr) =
+            CallbackHandle::new(&lua, unary_signature(&lua)?, double, CallbackMode::Sync)?;
+        first.free();
+
+        let negate = lua.load("return function(x) return -x end").eval()?;
+        let (second, second_ptr) =
+            CallbackHandle::new(&lua, unary_signature(&lua)?, negate, CallbackMode::Sync)?;
+        assert_eq!(first_ptr.0, second_ptr.0);
+
+        let callback: extern "C" fn(i32) -> i32 = unsafe { std::mem::transmute(second_ptr.0) };
+        assert_eq!(callback(5), -5);
+        drop(second);
+        Ok(())
+    }
+
+    #[test]
+    fn arguments_reach_the_function_at_any_arity() -> LuaResult<()> {
+        let lua = Lua::new();
+        let table = lua.create_table()?;
+        table.set("result", "int32")?;
+        table.set("args", lua.create_sequence_from(["int32"; 5])?)?;
+        let signature = Signature::from_table(table)?;
+        let func = lua
+            .load("return function(a, b, c, d, e) return a - b + c - d + e * 10 end")
+            .eval()?;
+        let (handle, ptr) = CallbackHandle::new(&lua, signature, func, CallbackMode::Sync)?;
+
+        let callback: extern "C" fn(i32, i32, i32, i32, i32) -> i32 =
+            unsafe { std::mem::transmute(ptr.0) };
+        assert_eq!(callback(5, 4, 3, 2, 1), 12);
+        drop(handle);
+        Ok(())
+    }
+
+    #[test]
+    fn sync_callbacks_refuse_foreign_threads() -> LuaResult<()> {
+        let lua = Lua::new();
+        let func = lua
+            .load("called = false; return function(x) called = true; return x end")
+            .eval()?;
+        let (handle, ptr) =
+            CallbackHandle::new(&lua, unary_signature(&lua)?, func, CallbackMode::Sync)?;
+
+        let address = ptr.0 as usize;
+        let returned = thread::spawn(move || {
+            let callback: extern "C" fn(i32) -> i32 = unsafe { std::mem::transmute(address) };
+            callback(7)
+        })
+        .join()
+        .unwrap();
+        assert_eq!(returned, 0);
+        assert!(!lua.globals().get::<bool>("called")?);
+        drop(handle);
+        Ok(())
+    }
+
+    #[test]
+    fn foreign_threads_keep_calling_while_the_callback_is_rebound() -> LuaResult<()> {
+        let lua = Lua::new();
+        // Stands in for the scheduler's pump, so queued calls can be run here afterwards
+        let (sender, receiver) = async_channel::unbounded();
+        let sender = Arc::new(sender);
+        lua.set_app_data(AsyncQueue(Arc::downgrade(&sender)));
+
+        let func = lua.load("return function(x) return x end").eval()?;
+        let (mut handle, ptr) =
+            CallbackHandle::new(&lua, unary_signature(&lua)?, func, CallbackMode::Async)?;
+
+        let address = ptr.0 as usize;
+        let stop = Arc::new(AtomicBool::new(false));
+        let calls = Arc::new(AtomicUsize::new(0));
+        let caller = {
+            let (stop, calls) = (Arc::clone(&stop), Arc::clone(&calls));
+            thread::spawn(move || {
+                let callback: extern "C" fn(i32) -> i32 = unsafe { std::mem::transmute(address) };
+                while !stop.load(Ordering::Acquire) {
+                    assert_eq!(callback(1), 0);
+                    calls.fetch_add(1, Ordering::Release);
+                }
+            })
+        };
+
+        lua.globals().set("total", 0)?;
+        let mut rebinds = 0;
+        while rebinds < 1000 || calls.load(Ordering::Acquire) < 1000 {
+            let func = lua
+                .load("return function(x) total += x end")
+                .eval::<LuaFunction>()?;
+            handle.set(&lua, func)?;
+            rebinds += 1;
+        }
+        stop.store(true, Ordering::Release);
+        caller.join().unwrap();
+        handle.free();
+
+        let mut queued = 0;
+        while let Ok(invocation) = receiver.try_recv() {
+            invocation.run(&lua);
+            queued += 1;
+        }
+        assert_eq!(queued, calls.load(Ordering::Acquire));
+        // The calls queued before the first rebind went to the identity function
+        assert!(lua.globals().get::<usize>("total")? <= queued);
+        Ok(())
+    }
+}
@@ -0,0 +1,1068 @@
+//! Native cdata objects.
+//!
+//! A cdata is a userdata holding its storage pointer, the id of its C type and a few flags;
+//! whatever it has to keep alive (the object it is a view into, its arena, a callback) is its
+//! user value. Type ids index the descriptors the Luau frontend creates. The first access through
+//! a type reads the layout `ensure_layout` computed into native field and element tables, so
+//! `s.x`, `p.x`, `a[i]` and `p[i]` are served here without a round trip through Luau. Metatype
+//! handlers, aggregate assignment and the remaining metamethods are delegated to the handlers
+//! the frontend installs with `cdataHandlers`.
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::ffi::c_void;
+use std::ptr;
+use std::rc::Rc;
+
+use mlua::prelude::*;
+
+use crate::arena;
+use crate::memory;
+use crate::native::{load_scalar, store_scalar};
+use crate::types::{self, TypeCode};
+
+// The storage came from the pool and goes back to it with the cdata
+const OWNED: u8 = 1;
+
+#[derive(Clone, Copy, Debug)]
+enum Access {
+    Scalar(TypeCode),
+    Pointer,
+    Aggregate,
+    Bitfield {
+        code: TypeCode,
+        shift: u32,
+        width: u32,
+    },
+    Opaque,
+}
+
+#[derive(Debug)]
+struct Field {
+    name: LuaString,
+    offset: usize,
+    ctype: u32,
+    access: Access,
+}
+
+// Accessors for every field, compiled once per type: offset, scalar code and bitfield mask are
+// fixed, so reading or writing one is a lookup and a load or store
+#[derive(Debug, Default)]
+struct Record {
+    // In declaration order, for positional initializers
+    fields: Vec<Field>,
+    by_name: HashMap<Box<[u8]>, usize>,
+    union: bool,
+}
+
+#[derive(Debug)]
+enum Shape {
+    Plain,
+    Record(Record),
+    Array { element: u32, length: Option<usize> },
+    // Pointee of pointers that can be dereferenced
+    Pointer(Option<u32>),
+}
+
+#[derive(Debug)]
+struct TypeInfo {
+    access: Access,
+    size: Option<usize>,
+    shape: Shape,
+}
+
+// Where a key points into an object
+#[derive(Clone, Copy)]
+struct Slot {
+    ptr: *mut u8,
+    ctype: u32,
+    access: Access,
+}
+
+// Finalizers cannot run while the collector drops a cdata, so its storage is queued with the
+// finalizer and handed to a new cdata for it by `run_finalizers`
+struct Pending {
+    finalizer: Box<Finalizer>,
+    ptr: *mut c_void,
+    size: usize,
+    ctype: u32,
+    code: Option<TypeCode>,
+    flags: u8,
+}
+
+type PendingQueue = Rc<RefCell<Vec<Pending>>>;
+
+struct Finalizer {
+    function: LuaRegistryKey,
+    queue: PendingQueue,
+    // Native bytes the finalizer releases, as given to `ffi.gc`, charged until it ran
+    released: usize,
+}
+
+impl Finalizer {
+    // Identifies the bytes it releases to `memory` tracking, as long as it is queued or set
+    fn key(&self) -> *const c_void {
+        (self as *const Self).cast()
+    }
+
+    // Its bytes are released by now, or never will be
+    fn settle(&self) {
+        memory::untrack(self.key());
+        memory::release(self.released);
+    }
+}
+
+pub(crate) struct CData {
+    ptr: *mut c_void,
+    // Size of owned storage, to return it to the right pool class
+    size: usize,
+    ctype: u32,
+    // Scalar type of the value, for inferring variadic arguments
+    code: Option<TypeCode>,
+    flags: u8,
+    finalizer: Option<Box<Finalizer>>,
+}
+
+impl Drop for CData {
+    fn drop(&mut self) {
+        if let Some(finalizer) = self.finalizer.take() {
+            let queue = Rc::clone(&finalizer.queue);
+            if let Ok(mut queue) = queue.try_borrow_mut() {
+                queue.push(Pending {
+                    finalizer,
+                    ptr: self.ptr,
+                    size: self.size,
+                    ctype: self.ctype,
+                    code: self.code,
+                    flags: self.flags,
+                });
+                return;
+            }
+            finalizer.settle();
+        }
+        if self.flags & OWNED != 0 {
+            memory::untrack(self.ptr);
+            unsafe { arena::pool_free(self.ptr, self.size) };
+            memory::release(self.size);
+        }
+    }
+}
+
+struct Types {
+    // Descriptor by id + 1, and id by descriptor; types stay registered for the lifetime of the
+    // state, as the descriptors they come from mostly do
+    descriptors: LuaRegistryKey,
+    ids: LuaRegistryKey,
+    infos: RefCell<Vec<Option<Rc<TypeInfo>>>>,
+    handlers: RefCell<Option<LuaRegistryKey>>,
+    pending: PendingQueue,
+}
+
+#[derive(Clone)]
+struct TypeTable(Rc<Types>);
+
+fn types(lua: &Lua) -> LuaResult<Rc<Types>> {
+    if let Some(table) = lua.app_data_ref::<TypeTable>() {
+        return Ok(Rc::clone(&table.0));
+    }
+    let types = Rc::new(Types {
+        descriptors: lua.create_registry_value(lua.create_table()?)?,
+        ids: lua.create_registry_value(lua.create_table()?)?,
+        infos: RefCell::new(Vec::new()),
+        handlers: RefCell::new(None),
+        pending: PendingQueue::default(),
+    });
+    lua.set_app_data(TypeTable(Rc::clone(&types)));
+    Ok(types)
+}
+
+fn access_of(descriptor: &LuaTable) -> LuaResult<Access> {
+    let kind: Option<String> = descriptor.raw_get("kind")?;
+    Ok(match kind.as_deref() {
+        Some("primitive") => {
+            let code: String = descriptor.raw_get("code")?;
+            match TypeCode::from_code(&types::normalize_code(&code))? {
+                TypeCode::Void => Access::Opaque,
+                code => Access::Scalar(code),
+            }
+        }
+        Some("enum") => Access::Scalar(TypeCode::Int32),
+        Some("pointer") => Access::Pointer,
+        Some("struct" | "union" | "array") => Access::Aggregate,
+        _ => Access::Opaque,
+    })
+}
+
+impl Types {
+    fn intern(&self, lua: &Lua, descriptor: &LuaTable) -> LuaResult<u32> {
+        let ids: LuaTable = lua.registry_value(&self.ids)?;
+        if let Some(id) = ids.raw_get::<Option<u32>>(descriptor.clone())? {
+            return Ok(id);
+        }
+
+        let id = {
+            let mut infos = self.infos.borrow_mut();
+            infos.push(None);
+            infos.len() - 1
+        };
+        let id = u32::try_from(id)
+            .map_err(|_| LuaError::runtime("too many C types registered".to_string()))?;
+        let descriptors: LuaTable = lua.registry_value(&self.descriptors)?;
+        descriptors.raw_set(i64::from(id) + 1, descriptor.clone())?;
+        ids.raw_set(descriptor.clone(), id)?;
+        Ok(id)
+    }
+
+    fn descriptor(&self, lua: &Lua, id: u32) -> LuaResult<LuaTable> {
+        let descriptors: LuaTable = lua.registry_value(&self.descriptors)?;
+        descriptors.raw_get(i64::from(id) + 1)
+    }
+
+    fn type_name(&self, lua: &Lua, id: u32) -> String {
+        self.descriptor(lua, id)
+            .and_then(|descriptor| descriptor.raw_get::<Option<String>>("name"))
+            .ok()
+            .flatten()
+            .unwrap_or_else(|| "<unknown>".to_string())
+    }
+
+    fn handler(&self, lua: &Lua, name: &str) -> LuaResult<LuaFunction> {
+        let handlers = self.handlers.borrow();
+        let key = handlers
+            .as_ref()
+            .ok_or_else(|| LuaError::runtime("cdata handlers are not installed".to_string()))?;
+        let table: LuaTable = lua.registry_value(key)?;
+        table.raw_get(name)
+    }
+
+    fn info(&self, lua: &Lua, id: u32) -> LuaResult<Rc<TypeInfo>> {
+        if let Some(Some(info)) = self.infos.borrow().get(id as usize) {
+            return Ok(Rc::clone(info));
+        }
+
+        let descriptor = self.descriptor(lua, id)?;
+        let (info, complete) = self.build_info(lua, &descriptor)?;
+        let info = Rc::new(info);
+        if complete {
+            self.infos.borrow_mut()[id as usize] = Some(Rc::clone(&info));
+        }
+        Ok(info)
+    }
+
+    // Returns whether the layout is final; opaque records may still be defined later
+    fn build_info(&self, lua: &Lua, descriptor: &LuaTable) -> LuaResult<(TypeInfo, bool)> {
+        let kind: Option<String> = descriptor.raw_get("kind")?;
+        let aggregate = matches!(kind.as_deref(), Some("struct" | "union" | "array"));
+        let unlaid = descriptor.raw_get::<LuaValue>("size")?.is_nil()
+            && descriptor.raw_get::<LuaValue>("align")?.is_nil();
+        if aggregate && unlaid {
+            self.handler(lua, "layout")?
+                .call::<()>(descriptor.clone())?;
+        }
+
+        let access = access_of(descriptor)?;
+        let size: Option<usize> = descriptor.raw_get("size")?;
+        let shape = match kind.as_deref() {
+            Some("struct" | "union") => {
+                let mut record = Record {
+                    union: kind.as_deref() == Some("union"),
+                    ..Record::default()
+                };
+                let Some(fields) = descriptor.raw_get::<Option<LuaTable>>("fields")? else {
+                    let info = TypeInfo {
+                        access,
+                        size,
+                        shape: Shape::Record(record),
+                    };
+                    return Ok((info, false));
+                };
+
+                for field in fields.sequence_values::<LuaTable>() {
+                    let field = field?;
+                    let name: LuaString = field.raw_get("name")?;
+                    let ctype: LuaTable = field.raw_get("ctype")?;
+                    let access = match field.raw_get::<Option<u32>>("bitWidth")? {
+                        Some(width) => match access_of(&ctype)? {
+                            Access::Scalar(code) => Access::Bitfield {
+                                code,
+                                shift: field.raw_get::<Option<u32>>("bitOffset")?.unwrap_or(0),
+                                width,
+                            },
+                            _ => Access::Opaque,
+                        },
+                        None => access_of(&ctype)?,
+                    };
+                    record
+                        .by_name
+                        .insert(Box::from(&*name.as_bytes()), record.fields.len());
+                    record.fields.push(Field {
+                        name,
+                        offset: field.raw_get::<Option<usize>>("offset")?.unwrap_or(0),
+                        ctype: self.intern(lua, &ctype)?,
+                        access,
+                    });
+                }
+                Shape::Record(record)
+            }
+            Some("array") => {
+                let base: LuaTable = descriptor.raw_get("base")?;
+                Shape::Array {
+                    element: self.intern(lua, &base)?,
+                    length: descriptor.raw_get("length")?,
+                }
+            }
+            Some("pointer") => {
+                let target = match descriptor.raw_get::<Option<LuaTable>>("base")? {
+                    Some(base) if !matches!(access_of(&base)?, Access::Opaque) => {
+                        Some(self.intern(lua, &base)?)
+                    }
+                    _ => None,
+                };
+                Shape::Pointer(target)
+            }
+            _ => Shape::Plain,
+        };
+
+        Ok((
+            TypeInfo {
+                access,
+                size,
+                shape,
+            },
+            true,
+        ))
+    }
+
+    fn element_slot(
+        &self,
+        lua: &Lua,
+        base: *mut c_void,
+        element: u32,
+        index: i64,
+    ) -> LuaResult<Slot> {
+        if base.is_null() {
+            return Err(LuaError::runtime(
+                "attempt to index a NULL pointer".to_string(),
+            ));
+        }
+        let info = self.info(lua, element)?;
+        let stride = info.size.unwrap_or(0) as isize;
+        Ok(Slot {
+            ptr: (base as *mut u8).wrapping_offset((index as isize).wrapping_mul(stride)),
+            ctype: element,
+            access: info.access,
+        })
+    }
+
+    // Fields of records and of the records pointers point to; elements of arrays and pointers
+    fn resolve(
+        &self,
+        lua: &Lua,
+        id: u32,
+        base: *mut c_void,
+        key: &LuaValue,
+    ) -> LuaResult<Option<Slot>> {
+        let info = self.info(lua, id)?;
+        match (&info.shape, key) {
+            (Shape::Record(record), LuaValue::String(name)) => field_slot(record, base, name),
+            (Shape::Pointer(Some(target)), LuaValue::String(name)) => {
+                match &self.info(lua, *target)?.shape {
+                    Shape::Record(record) => field_slot(record, base, name),
+                    _ => Ok(None),
+                }
+            }
+            (Shape::Array { element, length }, key) => {
+                let Some(index) = element_index(key)? else {
+                    return Ok(None);
+                };
+                if index < 0 || length.is_some_and(|length| index as u64 >= length as u64) {
+                    return Err(LuaError::runtime(format!(
+                        "array index {index} out of bounds for '{}'",
+                        self.type_name(lua, id)
+                    )));
+                }
+                self.element_slot(lua, base, *element, index).map(Some)
+            }
+            (Shape::Pointer(Some(target)), key) => match element_index(key)? {
+                Some(index) => self.element_slot(lua, base, *target, index).map(Some),
+                None => Ok(None),
+            },
+            _ => Ok(None),
+        }
+    }
+
+    fn read(&self, lua: &Lua, object: &LuaAnyUserData, slot: Slot) -> LuaResult<LuaValue> {
+        match slot.access {
+            Access::Scalar(code) => load_scalar(lua, slot.ptr as *mut c_void, code),
+            Access::Pointer => {
+                let value = unsafe { ptr::read(slot.ptr as *const *mut c_void) };
+                let pointer = self.create(lua, slot.ctype, value, None, LuaValue::Nil)?;
+                Ok(LuaValue::UserData(pointer))
+            }
+            // Records and arrays inside an object are views into it, which they keep alive
+            Access::Aggregate => {
+                let view = self.create(
+                    lua,
+                    slot.ctype,
+                    slot.ptr as *mut c_void,
+                    None,
+                    LuaValue::UserData(object.clone()),
+                )?;
+                Ok(LuaValue::UserData(view))
+            }
+            Access::Bitfield { code, shift, width } => Ok(LuaValue::Integer(unsafe {
+                read_bitfield(slot.ptr, code, shift, width)
+            })),
+            Access::Opaque => Err(LuaError::runtime(format!(
+                "cannot read value of type '{}'",
+                self.type_name(lua, slot.ctype)
+            ))),
+        }
+    }
+
+    fn write(&self, lua: &Lua, slot: Slot, value: LuaValue) -> LuaResult<()> {
+        match slot.access {
+            Access::Scalar(code) => store_scalar(slot.ptr as *mut c_void, code, &value),
+            Access::Pointer => store_scalar(slot.ptr as *mut c_void, TypeCode::Pointer, &value),
+            Access::Bitfield { code, shift, width } => unsafe {
+                write_bitfield(slot.ptr, code, shift, width, &value)
+            },
+            // Records and arrays accept tables, strings and other cdata, as in `ffi.new`
+            Access::Aggregate => self.handler(lua, "store")?.call((
+                LuaLightUserData(slot.ptr as *mut c_void),
+                self.descriptor(lua, slot.ctype)?,
+                value,
+            )),
+            Access::Opaque => Err(LuaError::runtime(format!(
+                "cannot assign value of type '{}'",
+                self.type_name(lua, slot.ctype)
+            ))),
+        }
+    }
+
+    /// Fills a record from a table initializer: fields by name, or positionally for the fields
+    /// not named, like `ffi.new`. Only the first field given is written for unions.
+    ///
+    /// # Safety
+    /// `base` must point to storage of the record type `id`.
+    unsafe fn init_record(
+        &self,
+        lua: &Lua,
+        id: u32,
+        base: *mut c_void,
+        init: &LuaTable,
+    ) -> LuaResult<()> {
+        let info = self.info(lua, id)?;
+        let Shape::Record(record) = &info.shape else {
+            return Err(LuaError::runtime(format!(
+                "'{}' is not a struct or union",
+                self.type_name(lua, id)
+            )));
+        };
+
+        let mut positional = 1;
+        for field in &record.fields {
+            let mut value = init.raw_get::<LuaValue>(field.name.clone())?;
+            if value.is_nil() {
+                value = init.raw_get::<LuaValue>(positional)?;
+                if !value.is_nil() {
+                    positional += 1;
+                }
+            }
+            if value.is_nil() {
+                continue;
+            }
+
+            let slot = Slot {
+                ptr: (base as *mut u8).wrapping_add(field.offset),
+                ctype: field.ctype,
+                access: field.access,
+            };
+            self.write(lua, slot, value)?;
+            if record.union {
+                break;
+            }
+        }
+        Ok(())
+    }
+
+    fn create(
+        &self,
+        lua: &Lua,
+        ctype: u32,
+        ptr: *mut c_void,
+        owned_size: Option<usize>,
+        owner: LuaValue,
+    ) -> LuaResult<LuaAnyUserData> {
+        let code = match self.info(lua, ctype)?.access {
+            Access::Scalar(code) => Some(code),
+            Access::Pointer => Some(TypeCode::Pointer),
+            _ => None,
+        };
+        if let Some(size) = owned_size {
+            memory::charge(lua, size)?;
+            if memory::tracking() {
+                memory::track(lua, ptr, &self.type_name(lua, ctype), size);
+            }
+        }
+        let cdata = CData {
+            ptr,
+            size: owned_size.unwrap_or(0),
+            ctype,
+            code,
+            flags: if owned_size.is_some() { OWNED } else { 0 },
+            finalizer: None,
+        };
+        let object = lua.create_userdata(cdata)?;
+        if !owner.is_nil() {
+            object.set_user_value(owner)?;
+        }
+        Ok(object)
+    }
+}
+
+fn field_slot(record: &Record, base: *mut c_void, name: &LuaString) -> LuaResult<Option<Slot>> {
+    let Some(&index) = record.by_name.get(&*name.as_bytes()) else {
+        return Ok(None);
+    };
+    let field = &record.fields[index];
+    if base.is_null() {
+        return Err(LuaError::runtime(
+            "attempt to index a NULL pointer".to_string(),
+        ));
+    }
+    Ok(Some(Slot {
+        ptr: (base as *mut u8).wrapping_add(field.offset),
+        ctype: field.ctype,
+        access: field.access,
+    }))
+}
+
+fn element_index(key: &LuaValue) -> LuaResult<Option<i64>> {
+    match key {
+        LuaValue::Integer(index) => Ok(Some(*index)),
+        LuaValue::Number(index) => {
+            if !index.is_finite() || index.fract() != 0.0 {
+                return Err(LuaError::runtime(
+                    "array index must be an integer".to_string(),
+                ));
+            }
+            Ok(Some(*index as i64))
+        }
+        _ => Ok(None),
+    }
+}
+
+fn is_signed(code: TypeCode) -> bool {
+    matches!(
+        code,
+        TypeCode::Int8 | TypeCode::Int16 | TypeCode::Int32 | TypeCode::Int64 | TypeCode::IntPtr
+    )
+}
+
+fn bit_mask(width: u32) -> u64 {
+    if width >= 64 {
+        u64::MAX
+    } else {
+        (1 << width) - 1
+    }
+}
+
+unsafe fn read_unit(ptr: *const u8, size: usize) -> u64 {
+    unsafe {
+        match size {
+            1 => u64::from(ptr::read(ptr)),
+            2 => u64::from(ptr::read(ptr as *const u16)),
+            4 => u64::from(ptr::read(ptr as *const u32)),
+            _ => ptr::read(ptr as *const u64),
+        }
+    }
+}
+
+unsafe fn write_unit(ptr: *mut u8, size: usize, value: u64) {
+    unsafe {
+        match size {
+            1 => ptr::write(ptr, value as u8),
+            2 => ptr::write(ptr as *mut u16, value as u16),
+            4 => ptr::write(ptr as *mut u32, value as u32),
+            _ => ptr::write(ptr as *mut u64, value),
+        }
+    }
+}
+
+/// # Safety
+/// `ptr` must point to the storage unit of the bitfield.
+unsafe fn read_bitfield(ptr: *const u8, code: TypeCode, shift: u32, width: u32) -> i64 {
+    let bits = (unsafe { read_unit(ptr, code.size_of()) } >> shift) & bit_mask(width);
+    let negative = is_signed(code) && width > 0 && width < 64 && bits >> (width - 1) & 1 == 1;
+    if negative {
+        (bits | !bit_mask(width)) as i64
+    } else {
+        bits as i64
+    }
+}
+
+/// # Safety
+/// `ptr` must point to the storage unit of the bitfield.
+unsafe fn write_bitfield(
+    ptr: *mut u8,
+    code: TypeCode,
+    shift: u32,
+    width: u32,
+    value: &LuaValue,
+) -> LuaResult<()> {
+    if width == 0 {
+        return Ok(());
+    }
+    let value = types::lua_value_to_i64(value)?;
+    let (min, max) = if is_signed(code) {
+        (-(1i128 << (width - 1)), (1i128 << (width - 1)) - 1)
+    } else {
+        (0, (1i128 << width) - 1)
+    };
+    if i128::from(value) < min || i128::from(value) > max {
+        return Err(LuaError::runtime(format!(
+            "bitfield value {value} out of range"
+        )));
+    }
+
+    let size = code.size_of();
+    let mask = bit_mask(width) << shift;
+    unsafe {
+        let unit = read_unit(ptr, size);
+        write_unit(
+            ptr,
+            size,
+            (unit & !mask) | (((value as u64) << shift) & mask),
+        );
+    }
+    Ok(())
+}
+
+fn index(lua: &Lua, object: LuaAnyUserData, key: LuaValue) -> LuaResult<LuaValue> {
+    let types = types(lua)?;
+    let (ptr, ctype) = {
+        let cdata = object.borrow::<CData>()?;
+        (cdata.ptr, cdata.ctype)
+    };
+    match types.resolve(lua, ctype, ptr, &key)? {
+        Some(slot) => types.read(lua, &object, slot),
+        None => types.handler(lua, "index")?.call((object, key)),
+    }
+}
+
+fn new_index(lua: &Lua, object: LuaAnyUserData, key: LuaValue, value: LuaValue) -> LuaResult<()> {
+    let types = types(lua)?;
+    let (ptr, ctype) = {
+        let cdata = object.borrow::<CData>()?;
+        (cdata.ptr, cdata.ctype)
+    };
+    match types.resolve(lua, ctype, ptr, &key)? {
+        Some(slot) => types.write(lua, slot, value),
+        None => types.handler(lua, "newindex")?.call((object, key, value)),
+    }
+}
+
+impl LuaUserData for CData {
+    fn add_fields<F: LuaUserDataFields<Self>>(fields: &mut F) {
+        fields.add_meta_field(LuaMetaMethod::Type, "cdata");
+    }
+
+    fn add_methods<M: LuaUserDataMethods<Self>>(methods: &mut M) {
+        methods.add_meta_function(
+            LuaMetaMethod::Index,
+            |lua, (object, key): (LuaAnyUserData, LuaValue)| index(lua, object, key),
+        );
+        methods.add_meta_function(
+            LuaMetaMethod::NewIndex,
+            |lua, (object, key, value): (LuaAnyUserData, LuaValue, LuaValue)| {
+                new_index(lua, object, key, value)
+            },
+        );
+        methods.add_meta_function(LuaMetaMethod::Len, |lua, object: LuaAnyUserData| {
+            let types = types(lua)?;
+            let ctype = object.borrow::<CData>()?.ctype;
+            if let Shape::Array {
+                length: Some(length),
+                ..
+            } = types.info(lua, ctype)?.shape
+            {
+                return Ok(LuaValue::Integer(length as i64));
+            }
+            types.handler(lua, "len")?.call(object)
+        });
+        methods.add_meta_function(LuaMetaMethod::ToString, |lua, object: LuaAnyUserData| {
+            types(lua)?
+                .handler(lua, "tostring")?
+                .call::<LuaValue>(object)
+        });
+        methods.add_meta_function(
+            LuaMetaMethod::Call,
+            |lua, (object, args): (LuaAnyUserData, LuaMultiValue)| {
+                types(lua)?
+                    .handler(lua, "call")?
+                    .call::<LuaMultiValue>((object, args))
+            },
+        );
+        methods.add_meta_function(
+            LuaMetaMethod::Eq,
+            |lua, (object, other): (LuaAnyUserData, LuaValue)| {
+                types(lua)?
+                    .handler(lua, "eq")?
+                    .call::<bool>((object, other))
+            },
+        );
+    }
+}
+
+/// Wraps `ptr` as cdata of the type `descriptor`; when `owned_size` is given, the storage came
+/// from `arena::pool_alloc`, is charged to `memory` and is released when the cdata is collected.
+pub(crate) fn create(
+    lua: &Lua,
+    descriptor: &LuaTable,
+    ptr: *mut c_void,
+    owned_size: Option<usize>,
+    owner: LuaValue,
+) -> LuaResult<LuaAnyUserData> {
+    let types = types(lua)?;
+    let ctype = types.intern(lua, descriptor)?;
+    types.create(lua, ctype, ptr, owned_size, owner)
+}
+
+/// The storage pointer and scalar type of `value`, if it is cdata.
+pub(crate) fn cdata_info(value: &LuaValue) -> Option<(*mut c_void, Option<TypeCode>)> {
+    match value {
+        LuaValue::UserData(object) => {
+            let cdata = object.borrow::<CData>().ok()?;
+            Some((cdata.ptr, cdata.code))
+        }
+        _ => None,
+    }
+}
+
+// Finalizers of collected cdata run from the next allocation, each with a new cdata over the
+// storage it was collected with
+fn run_finalizers(lua: &Lua) -> LuaResult<()> {
+    let types = types(lua)?;
+    if types.pending.borrow().is_empty() {
+        return Ok(());
+    }
+
+    let pending = std::mem::take(&mut *types.pending.borrow_mut());
+    let finalize = types.handler(lua, "finalize");
+    // Every entry is settled and its storage handed to a CData, which frees it, even after one
+    // failed; the first error is reported once all of them are done
+    let mut result = Ok(());
+    for entry in pending {
+        let object = CData {
+            ptr: entry.ptr,
+            size: entry.size,
+            ctype: entry.ctype,
+            code: entry.code,
+            flags: entry.flags,
+            finalizer: None,
+        };
+        let finalized = call_finalizer(lua, &finalize, &entry.finalizer.function, object);
+        entry.finalizer.settle();
+        let Finalizer { function, .. } = *entry.finalizer;
+        let removed = lua.remove_registry_value(function);
+        if result.is_ok() {
+            result = finalized.and(removed);
+        }
+    }
+    result
+}
+
+fn call_finalizer(
+    lua: &Lua,
+    finalize: &LuaResult<LuaFunction>,
+    function: &LuaRegistryKey,
+    object: CData,
+) -> LuaResult<()> {
+    let finalize = finalize.as_ref().map_err(LuaError::clone)?;
+    let function: LuaFunction = lua.registry_value(function)?;
+    let object = lua.create_userdata(object)?;
+    finalize.call::<()>((function, object))
+}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    let cdata_fn = lua.create_function(
+        |lua,
+         (descriptor, ptr, owned_size, owner): (
+            LuaTable,
+            Option<LuaLightUserData>,
+            Option<usize>,
+            LuaValue,
+        )| {
+            run_finalizers(lua)?;
+            let ptr = ptr.map_or(ptr::null_mut(), |ptr| ptr.0);
+            create(lua, &descriptor, ptr, owned_size, owner)
+        },
+    )?;
+    exports.set("cdata", cdata_fn)?;
+
+    let ptr_fn = lua.create_function(|_, object: LuaAnyUserData| {
+        let ptr = object.borrow::<CData>()?.ptr;
+        Ok(if ptr.is_null() {
+            LuaValue::Nil
+        } else {
+            LuaValue::LightUserData(LuaLightUserData(ptr))
+        })
+    })?;
+    exports.set("cdataPtr", ptr_fn)?;
+
+    let type_fn = lua.create_function(|lua, object: LuaAnyUserData| {
+        let ctype = object.borrow::<CData>()?.ctype;
+        types(lua)?.descriptor(lua, ctype)
+    })?;
+    exports.set("cdataType", type_fn)?;
+
+    let owner_fn = lua.create_function(|_, object: LuaAnyUserData| {
+        object.borrow::<CData>()?;
+        object.user_value::<LuaValue>()
+    })?;
+    exports.set("cdataOwner", owner_fn)?;
+
+    let handlers_fn = lua.create_function(|lua, handlers: LuaTable| {
+        let key = lua.create_registry_value(handlers)?;
+        *types(lua)?.handlers.borrow_mut() = Some(key);
+        Ok(())
+    })?;
+    exports.set("cdataHandlers", handlers_fn)?;
+
+    let set_finalizer_fn = lua.create_function(
+        |lua,
+         (object, function, released): (
+            LuaAnyUserData,
+            Option<LuaFunction>,
+            Option<usize>,
+        )| {
+            // Without a finalizer nothing releases the bytes
+            let released = function.as_ref().and(released).unwrap_or(0);
+            let finalizer = match function {
+                Some(function) => Some(Box::new(Finalizer {
+                    function: lua.create_registry_value(function)?,
+                    queue: Rc::clone(&types(lua)?.pending),
+                    released,
+                })),
+                None => None,
+            };
+            if let Some(finalizer) = finalizer.as_ref().filter(|_| memory::tracking()) {
+                let ctype = object.borrow::<CData>()?.ctype;
+                let name = types(lua)?.type_name(lua, ctype);
+                memory::track(lua, finalizer.key(), &name, released);
+            }
+            let replaced =
+                std::mem::replace(&mut object.borrow_mut::<CData>()?.finalizer, finalizer);
+            if let Some(replaced) = replaced {
+                replaced.settle();
+                let Finalizer { function, .. } = *replaced;
+                lua.remove_registry_value(function)?;
+            }
+            memory::charge(lua, released)?;
+            Ok(())
+        },
+    )?;
+    exports.set("cdataSetFinalizer", set_finalizer_fn)?;
+
+    let init_record_fn = lua.create_function(
+        |lua, (ptr, descriptor, init): (LuaLightUserData, LuaTable, LuaTable)| {
+            let types = types(lua)?;
+            let id = types.intern(lua, &descriptor)?;
+            unsafe { types.init_record(lua, id, ptr.0, &init) }
+        },
+    )?;
+    exports.set("cdataInitRecord", init_record_fn)?;
+
+    let run_finalizers_fn = lua.create_function(|lua, ()| run_finalizers(lua))?;
+    exports.set("runFinalizers", run_finalizers_fn)?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn fields_and_elements_resolve_natively() -> LuaResult<()> {
+        let lua = Lua::new();
+        let (points, flags) = lua
+            .load(
+                r#"
+                local int = { kind = "primitive", code = "int", size = 4, align = 4 }
+                local double = { kind = "primitive", code = "double", size = 8, align = 8 }
+                local point = { kind = "struct", name = "Point", size = 16, align = 8, fields = {
+                    { name = "x", ctype = int, offset = 0 },
+                    { name = "y", ctype = double, offset = 8 },
+                } }
+                local flags = { kind = "struct", name = "Flags", size = 4, align = 4, fields = {
+                    { name = "low", ctype = int, offset = 0, bitWidth = 3, bitOffset = 0 },
+                    { name = "high", ctype = int, offset = 0, bitWidth = 5, bitOffset = 3 },
+                } }
+                local points = { kind = "array", name = "Point[2]", base = point, length = 2, size = 32, align = 8 }
+                return points, flags
+                "#,
+            )
+            .eval::<(LuaTable, LuaTable)>()?;
+
+        let points = create(
+            &lua,
+            &points,
+            arena::pool_alloc(32)?,
+            Some(32),
+            LuaValue::Nil,
+        )?;
+        let flags = create(&lua, &flags, arena::pool_alloc(4)?, Some(4), LuaValue::Nil)?;
+        let flags_ptr = flags.borrow::<CData>()?.ptr as *const u32;
+        lua.globals().set("points", points)?;
+        lua.globals().set("flags", flags)?;
+
+        lua.load(
+            r#"
+            assert(typeof(points) == "cdata")
+            assert(#points == 2)
+            points[1].x = 7
+            points[1].y = 0.5
+            local second = points[1]
+            assert(second.x == 7 and second.y == 0.5)
+            assert(points[0].x == 0)
+            assert(not pcall(function() return points[2] end))
+
+            flags.low = -2
+            flags.high = 17
+            assert(flags.low == -2 and flags.high == 17)
+            assert(not pcall(function() flags.low = 4 end))
+            "#,
+        )
+        .exec()?;
+
+        assert_eq!(unsafe { *flags_ptr }, (17 << 3) | 0b110);
+        Ok(())
+    }
+    #[test]
+    fn record_initializers_write_fields_in_place() -> LuaResult<()> {
+        let lua = Lua::new();
+        let (pair, tagged, pair_init, tagged_init) = lua
+            .load(
+                r#"
+                local int = { kind = "primitive", code = "int", size = 4, align = 4 }
+                local uint = { kind = "primitive", code = "uint32", size = 4, align = 4 }
+                local pair = { kind = "struct", name = "Pair", size = 12, align = 4, fields = {
+                    { name = "a", ctype = int, offset = 0 },
+                    { name = "b", ctype = int, offset = 4 },
+                    { name = "bits", ctype = uint, offset = 8, bitWidth = 4, bitOffset = 2 },
+                } }
+                local tagged = { kind = "union", name = "Tagged", size = 4, align = 4, fields = {
+                    { name = "lo", ctype = int, offset = 0 },
+                    { name = "hi", ctype = int, offset = 0 },
+                } }
+                return pair, tagged, { 5, b = 9, true }, { 3, 4 }
+                "#,
+            )
+            .eval::<(LuaTable, LuaTable, LuaTable, LuaTable)>()?;
+
+        let types = types(&lua)?;
+        let mut pair_storage = [0u32; 3];
+        let mut tagged_storage = [0u32; 1];
+        unsafe {
+            let id = types.intern(&lua, &pair)?;
+            types.init_record(
+                &lua,
+                id,
+                pair_storage.as_mut_ptr() as *mut c_void,
+                &pair_init,
+            )?;
+            let id = types.intern(&lua, &tagged)?;
+            types.init_record(
+                &lua,
+                id,
+                tagged_storage.as_mut_ptr() as *mut c_void,
+                &tagged_init,
+            )?;
+        }
+
+        assert_eq!(pair_storage, [5, 9, 1 << 2]);
+        assert_eq!(tagged_storage, [3]);
+        Ok(())
+    }
+
+    #[test]
+    fn native_memory_is_charged_until_released() -> LuaResult<()> {
+        let lua = Lua::new();
+        register(&lua, &lua.globals())?;
+        lua.globals().set(
+            "handlers",
+            lua.load("return { finalize = function(f, object) f(object) end }")
+                .eval::<LuaTable>()?,
+        )?;
+        let int = lua
+            .load(r#"return { kind = "primitive", code = "int", size = 4, align = 4 }"#)
+            .eval::<LuaTable>()?;
+        let before = memory::live();
+
+        let owned = create(&lua, &int, arena::pool_alloc(4)?, Some(4), LuaValue::Nil)?;
+        let hinted = create(&lua, &int, ptr::null_mut(), None, LuaValue::Nil)?;
+        assert_eq!(memory::live(), before + 4);
+        lua.globals().set("owned", owned)?;
+        lua.globals().set("hinted", hinted)?;
+
+        lua.load(
+            r#"
+            cdataHandlers(handlers)
+            finalized = 0
+            cdataSetFinalizer(hinted, function() finalized += 1 end, 1000)
+            cdataSetFinalizer(hinted, function() finalized += 10 end, 300)
+            "#,
+        )
+        .exec()?;
+        assert_eq!(memory::live(), before + 304);
+
+        lua.load("owned, hinted = nil, nil").exec()?;
+        lua.gc_collect()?;
+        assert_eq!(memory::live(), before + 300);
+        run_finalizers(&lua)?;
+        assert_eq!(lua.globals().get::<i64>("finalized")?, 10);
+        assert_eq!(memory::live(), before);
+        Ok(())
+    }
+
+    #[test]
+    fn failed_finalizers_release_every_pending_entry() -> LuaResult<()> {
+        let lua = Lua::new();
+        register(&lua, &lua.globals())?;
+        lua.globals().set(
+            "handlers",
+            lua.load("return { finalize = function() error(\"boom\") end }")
+                .eval::<LuaTable>()?,
+        )?;
+        let int = lua
+            .load(r#"return { kind = "primitive", code = "int", size = 4, align = 4 }"#)
+            .eval::<LuaTable>()?;
+        let before = memory::live();
+
+        let first = create(&lua, &int, arena::pool_alloc(4)?, Some(4), LuaValue::Nil)?;
+        let second = create(&lua, &int, arena::pool_alloc(4)?, Some(4), LuaValue::Nil)?;
+        lua.globals().set("first", first)?;
+        lua.globals().set("second", second)?;
+        lua.load(
+            r#"
+            cdataHandlers(handlers)
+            cdataSetFinalizer(first, function() end, 100)
+            cdataSetFinalizer(second, function() end, 200)
+            first, second = nil, nil
+            "#,
+        )
+        .exec()?;
+        assert_eq!(memory::live(), before + 308);
+
+        lua.gc_collect()?;
+        assert!(run_finalizers(&lua).is_err());
+        // The entry after the failed one was settled and freed all the same
+        assert!(types(&lua)?.pending.borrow().is_empty());
+        lua.gc_collect()?;
+        assert_eq!(memory::live(), before);
+        run_finalizers(&lua)?;
+        Ok(())
+    }
+}
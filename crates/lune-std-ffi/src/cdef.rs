@@ -0,0 +1,302 @@
+//! Lexing for `ffi.cdef` headers.
+//!
+//! Comments are stripped, the header is split into top-level statements and each statement is
+//! tokenized here rather than one character at a time in Luau; the frontend parses the tokens
+//! into descriptors, since those belong to the type registry of its state. Lexing depends on the
+//! header text alone, so lexed headers are also kept for the whole process, keyed by their text,
+//! and a header declared again by any state only has its token tables rebuilt.
+
+use std::collections::HashMap;
+use std::sync::{Arc, LazyLock, Mutex};
+
+use mlua::prelude::*;
+
+// Headers are bindings that scripts declare once, so this only bounds runaway generated ones
+const MAX_HEADERS: usize = 256;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum TokenKind {
+    Identifier,
+    Number,
+    Symbol,
+    Ellipsis,
+}
+
+impl TokenKind {
+    fn name(self) -> &'static str {
+        match self {
+            TokenKind::Identifier => "identifier",
+            TokenKind::Number => "number",
+            TokenKind::Symbol => "symbol",
+            TokenKind::Ellipsis => "ellipsis",
+        }
+    }
+}
+
+type Token = (TokenKind, Box<[u8]>);
+
+struct Statement {
+    text: Box<[u8]>,
+    tokens: Vec<Token>,
+}
+
+type Header = Arc<[Statement]>;
+
+static HEADERS: LazyLock<Mutex<HashMap<Box<[u8]>, Header>>> =
+    LazyLock::new(|| Mutex::new(HashMap::new()));
+
+// The characters Luau's `%s` matches
+fn is_space(byte: u8) -> bool {
+    matches!(byte, b' ' | b'\t' | b'\n' | b'\x0b' | b'\x0c' | b'\r')
+}
+
+fn is_symbol(byte: u8) -> bool {
+    matches!(
+        byte,
+        b'(' | b')' | b',' | b'*' | b'{' | b'}' | b'[' | b']' | b';' | b':' | b'=' | b'?'
+    )
+}
+
+fn trim(bytes: &[u8]) -> &[u8] {
+    let start = bytes.iter().position(|&byte| !is_space(byte));
+    let end = bytes.iter().rposition(|&byte| !is_space(byte));
+    match (start, end) {
+        (Some(start), Some(end)) => &bytes[start..=end],
+        _ => &[],
+    }
+}
+
+// Line comments keep their newline; block comments vanish, and an unterminated one runs to the
+// end of the header
+fn strip_comments(input: &[u8]) -> Vec<u8> {
+    let mut result = Vec::with_capacity(input.len());
+    let mut index = 0;
+    while index < input.len() {
+        match &input[index..] {
+            [b'/', b'/', ..] => match input[index + 2..].iter().position(|&byte| byte == b'\n') {
+                Some(newline) => {
+                    result.push(b'\n');
+                    index += 2 + newline + 1;
+                }
+                None => index = input.len(),
+            },
+            [b'/', b'*', rest @ ..] => match rest.windows(2).position(|pair| pair == b"*/") {
+                Some(end) => index += 2 + end + 2,
+                None => index = input.len(),
+            },
+            [byte, ..] => {
+                result.push(*byte);
+                index += 1;
+            }
+            [] => unreachable!(),
+        }
+    }
+    result
+}
+
+// Statements end at semicolons outside of parentheses, braces and brackets
+fn split_statements(input: &[u8]) -> LuaResult<Vec<&[u8]>> {
+    let mut statements = Vec::new();
+    let (mut paren, mut brace, mut bracket) = (0i32, 0i32, 0i32);
+    let mut start = 0;
+
+    for (index, &byte) in input.iter().enumerate() {
+        let (depth, what) = match byte {
+            b'(' | b')' => (&mut paren, "parentheses"),
+            b'{' | b'}' => (&mut brace, "braces"),
+            b'[' | b']' => (&mut bracket, "brackets"),
+            b';' if paren == 0 && brace == 0 && bracket == 0 => {
+                let statement = trim(&input[start..index]);
+                if !statement.is_empty() {
+                    statements.push(statement);
+                }
+                start = index + 1;
+                continue;
+            }
+            _ => continue,
+        };
+        if matches!(byte, b'(' | b'{' | b'[') {
+            *depth += 1;
+        } else {
+            *depth -= 1;
+            if *depth < 0 {
+                return Err(LuaError::runtime(format!("unbalanced {what} in cdef")));
+            }
+        }
+    }
+
+    if paren != 0 || brace != 0 || bracket != 0 {
+        return Err(LuaError::runtime(
+            "unterminated declaration in cdef".to_string(),
+        ));
+    }
+    let statement = trim(&input[start..]);
+    if !statement.is_empty() {
+        statements.push(statement);
+    }
+    Ok(statements)
+}
+
+fn tokenize(statement: &[u8]) -> LuaResult<Vec<Token>> {
+    let mut tokens = Vec::new();
+    let mut index = 0;
+    while index < statement.len() {
+        let byte = statement[index];
+        let start = index;
+        let kind = if is_space(byte) {
+            index += 1;
+            continue;
+        } else if statement[index..].starts_with(b"...") {
+            index += 3;
+            TokenKind::Ellipsis
+        } else if byte.is_ascii_alphabetic() || byte == b'_' {
+            index += 1;
+            while index < statement.len()
+                && (statement[index].is_ascii_alphanumeric() || statement[index] == b'_')
+            {
+                index += 1;
+            }
+            TokenKind::Identifier
+        } else if byte.is_ascii_digit() {
+            index += 1;
+            while index < statement.len() && statement[index].is_ascii_digit() {
+                index += 1;
+            }
+            TokenKind::Number
+        } else if is_symbol(byte) {
+            index += 1;
+            TokenKind::Symbol
+        } else {
+            return Err(LuaError::runtime(format!(
+                "unexpected character '{}' in declaration",
+                String::from_utf8_lossy(&statement[index..=index])
+            )));
+        };
+        tokens.push((kind, Box::from(&statement[start..index])));
+    }
+    Ok(tokens)
+}
+
+fn lex(source: &[u8]) -> LuaResult<Header> {
+    let cleaned = strip_comments(source);
+    let mut statements = Vec::new();
+    for text in split_statements(&cleaned)? {
+        statements.push(Statement {
+            text: Box::from(text),
+            tokens: tokenize(text)?,
+        });
+    }
+    Ok(statements.into())
+}
+
+fn lex_cached(source: &[u8]) -> LuaResult<Header> {
+    if let Some(header) = HEADERS
+        .lock()
+        .ok()
+        .and_then(|headers| headers.get(source).cloned())
+    {
+        return Ok(header);
+    }
+    let header = lex(source)?;
+    if let Ok(mut headers) = HEADERS.lock() {
+        if headers.len() < MAX_HEADERS {
+            headers.insert(Box::from(source), Arc::clone(&header));
+        }
+    }
+    Ok(header)
+}
+
+// Tokens in the frontend's shape: `{ { kind = string, value = string } }`
+fn tokens_to_lua(lua: &Lua, tokens: &[Token]) -> LuaResult<LuaTable> {
+    let list = lua.create_table_with_capacity(tokens.len(), 0)?;
+    for (kind, value) in tokens {
+        let token = lua.create_table_with_capacity(0, 2)?;
+        token.raw_set("kind", kind.name())?;
+        token.raw_set("value", lua.create_string(value)?)?;
+        list.raw_push(token)?;
+    }
+    Ok(list)
+}
+
+fn statements_to_lua(lua: &Lua, header: &[Statement]) -> LuaResult<LuaTable> {
+    let list = lua.create_table_with_capacity(header.len(), 0)?;
+    for statement in header {
+        let entry = lua.create_table_with_capacity(0, 2)?;
+        entry.raw_set("statement", lua.create_string(&statement.text)?)?;
+        entry.raw_set("tokens", tokens_to_lua(lua, &statement.tokens)?)?;
+        list.raw_push(entry)?;
+    }
+    Ok(list)
+}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    let lex_fn = lua.create_function(|lua, source: LuaString| {
+        statements_to_lua(lua, &lex_cached(&source.as_bytes())?)
+    })?;
+    exports.set("cdefLex", lex_fn)?;
+
+    let tokenize_fn = lua.create_function(|lua, statement: LuaString| {
+        tokens_to_lua(lua, &tokenize(&statement.as_bytes())?)
+    })?;
+    exports.set("cdefTokenize", tokenize_fn)?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn values(statement: &Statement) -> Vec<&str> {
+        statement
+            .tokens
+            .iter()
+            .map(|(_, value)| std::str::from_utf8(value).unwrap())
+            .collect()
+    }
+
+    #[test]
+    fn headers_split_into_tokenized_statements() -> LuaResult<()> {
+        let header = lex(b"// lead\n typedef struct { int a[4]; } S; /* gone */\n\
+              int f(const char* fmt, ...) ;;")?;
+        assert_eq!(header.len(), 2);
+        assert_eq!(&*header[0].text, b"typedef struct { int a[4]; } S");
+        assert_eq!(
+            values(&header[0]),
+            [
+                "typedef", "struct", "{", "int", "a", "[", "4", "]", ";", "}", "S"
+            ]
+        );
+        assert_eq!(
+            values(&header[1]),
+            [
+                "int", "f", "(", "const", "char", "*", "fmt", ",", "...", ")"
+            ]
+        );
+        assert_eq!(header[1].tokens[8].0, TokenKind::Ellipsis);
+        assert_eq!(header[0].tokens[6].0, TokenKind::Number);
+        Ok(())
+    }
+
+    #[test]
+    fn malformed_headers_are_rejected() {
+        for (source, message) in [
+            (&b"int f(int a;"[..], "unterminated declaration in cdef"),
+            (b"int f(int a));", "unbalanced parentheses in cdef"),
+            (b"struct S { int a; }};", "unbalanced braces in cdef"),
+            (b"int $x;", "unexpected character '$' in declaration"),
+        ] {
+            let err = lex(source).err().expect("header should not lex");
+            assert!(err.to_string().contains(message), "{err}");
+        }
+    }
+
+    #[test]
+    fn lexed_headers_are_shared_between_calls() -> LuaResult<()> {
+        let source = b"int cdef_cache_test(void);";
+        let first = lex_cached(source)?;
+        let second = lex_cached(source)?;
+        assert!(Arc::ptr_eq(&first, &second));
+        Ok(())
+    }
+}
@@ -0,0 +1,278 @@
+//! Direct calls for the most common fixed-arity signatures.
+//!
+//! A prepared signature whose shape is listed below gets a monomorphic stub that casts the target
+//! to the matching `extern "C"` function pointer and calls it, skipping libffi's marshalling.
+//! Every other shape, and any signature with an explicit ABI or struct values, keeps going
+//! through its Cif.
+
+use std::ffi::c_void;
+
+use mlua::prelude::*;
+
+use crate::call::ArgValue;
+use crate::int64;
+use crate::signature::Signature;
+use crate::types::TypeCode;
+
+pub(crate) type DirectStub = unsafe fn(&Lua, *const c_void, &[ArgValue]) -> LuaResult<LuaValue>;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum Kind {
+    Void,
+    I32,
+    U32,
+    I64,
+    U64,
+    F32,
+    F64,
+    Ptr,
+}
+
+impl Kind {
+    fn from_code(code: TypeCode) -> Option<Self> {
+        match code {
+            TypeCode::Void => Some(Kind::Void),
+            TypeCode::Int32 => Some(Kind::I32),
+            TypeCode::UInt32 => Some(Kind::U32),
+            TypeCode::Int64 => Some(Kind::I64),
+            TypeCode::UInt64 => Some(Kind::U64),
+            TypeCode::IntPtr if cfg!(target_pointer_width = "64") => Some(Kind::I64),
+            TypeCode::IntPtr => Some(Kind::I32),
+            TypeCode::UIntPtr if cfg!(target_pointer_width = "64") => Some(Kind::U64),
+            TypeCode::UIntPtr => Some(Kind::U32),
+            TypeCode::Float32 => Some(Kind::F32),
+            TypeCode::Float64 => Some(Kind::F64),
+            TypeCode::Pointer => Some(Kind::Ptr),
+            // Narrow integers need the caller-side extension libffi takes care of
+            TypeCode::Int8 | TypeCode::UInt8 | TypeCode::Int16 | TypeCode::UInt16 => None,
+        }
+    }
+}
+
+trait DirectArg: Sized {
+    fn from_arg(value: &ArgValue) -> Self;
+}
+
+macro_rules! impl_direct_arg {
+    ($($ty:ty => $variant:ident),* $(,)?) => {
+        $(
+            impl DirectArg for $ty {
+                fn from_arg(value: &ArgValue) -> Self {
+                    match value {
+                        ArgValue::$variant(value) => *value,
+                        other => unreachable!("direct stub received mismatched argument {other:?}"),
+                    }
+                }
+            }
+        )*
+    };
+}
+
+impl_direct_arg! {
+    i32 => Int32,
+    u32 => UInt32,
+    i64 => Int64,
+    u64 => UInt64,
+    f32 => Float32,
+    f64 => Float64,
+    *mut c_void => Pointer,
+}
+
+trait DirectResult {
+    fn into_lua_value(self, lua: &Lua) -> LuaResult<LuaValue>;
+}
+
+impl DirectResult for () {
+    fn into_lua_value(self, _lua: &Lua) -> LuaResult<LuaValue> {
+        Ok(LuaValue::Nil)
+    }
+}
+
+impl DirectResult for i32 {
+    fn into_lua_value(self, _lua: &Lua) -> LuaResult<LuaValue> {
+        Ok(LuaValue::Integer(self.into()))
+    }
+}
+
+impl DirectResult for u32 {
+    fn into_lua_value(self, _lua: &Lua) -> LuaResult<LuaValue> {
+        Ok(LuaValue::Integer(self.into()))
+    }
+}
+
+impl DirectResult for i64 {
+    fn into_lua_value(self, lua: &Lua) -> LuaResult<LuaValue> {
+        int64::signed_value(lua, self)
+    }
+}
+
+impl DirectResult for u64 {
+    fn into_lua_value(self, lua: &Lua) -> LuaResult<LuaValue> {
+        int64::unsigned_value(lua, self)
+    }
+}
+
+impl DirectResult for f32 {
+    fn into_lua_value(self, _lua: &Lua) -> LuaResult<LuaValue> {
+        Ok(LuaValue::Number(self as f64))
+    }
+}
+
+impl DirectResult for f64 {
+    fn into_lua_value(self, _lua: &Lua) -> LuaResult<LuaValue> {
+        Ok(LuaValue::Number(self))
+    }
+}
+
+impl DirectResult for *mut c_void {
+    fn into_lua_value(self, _lua: &Lua) -> LuaResult<LuaValue> {
+        if self.is_null() {
+            Ok(LuaValue::Nil)
+        } else {
+            Ok(LuaValue::LightUserData(LuaLightUserData(self)))
+        }
+    }
+}
+
+trait DirectArgs {
+    unsafe fn invoke<R: DirectResult>(func: *const c_void, args: &[ArgValue]) -> R;
+}
+
+macro_rules! impl_direct_args {
+    ($($name:ident: $index:tt),*) => {
+        impl<$($name: DirectArg),*> DirectArgs for ($($name,)*) {
+            #[allow(unused_variables)]
+            unsafe fn invoke<R: DirectResult>(func: *const c_void, args: &[ArgValue]) -> R {
+                let func: unsafe extern "C" fn($($name),*) -> R =
+                    unsafe { std::mem::transmute_copy(&func) };
+                unsafe { func($($name::from_arg(&args[$index])),*) }
+            }
+        }
+    };
+}
+
+impl_direct_args!();
+impl_direct_args!(A: 0);
+impl_direct_args!(A: 0, B: 1);
+impl_direct_args!(A: 0, B: 1, C: 2);
+impl_direct_args!(A: 0, B: 1, C: 2, D: 3);
+
+unsafe fn direct_stub<Args: DirectArgs, R: DirectResult>(
+    lua: &Lua,
+    func: *const c_void,
+    args: &[ArgValue],
+) -> LuaResult<LuaValue> {
+    unsafe { Args::invoke::<R>(func, args) }.into_lua_value(lua)
+}
+
+macro_rules! direct_type {
+    (Void) => { () };
+    (I32) => { i32 };
+    (U32) => { u32 };
+    (I64) => { i64 };
+    (U64) => { u64 };
+    (F32) => { f32 };
+    (F64) => { f64 };
+    (Ptr) => { *mut c_void };
+}
+
+macro_rules! direct_shapes {
+    ($( ($($arg:ident),*) -> $ret:ident ),* $(,)?) => {
+        fn select(result: Kind, args: &[Kind]) -> Option<DirectStub> {
+            match (result, args) {
+                $(
+                    (Kind::$ret, [$(Kind::$arg),*]) => {
+                        Some(direct_stub::<($(direct_type!($arg),)*), direct_type!($ret)>)
+                    }
+                )*
+                _ => None,
+            }
+        }
+    };
+}
+
+direct_shapes! {
+    () -> Void,
+    () -> I32,
+    () -> U32,
+    () -> I64,
+    () -> U64,
+    () -> F64,
+    () -> Ptr,
+
+    (I32) -> Void,
+    (I32) -> I32,
+    (I32) -> I64,
+    (I32) -> F64,
+    (I32) -> Ptr,
+    (U32) -> Void,
+    (U32) -> U32,
+    (I64) -> Void,
+    (I64) -> I64,
+    (U64) -> Void,
+    (U64) -> U64,
+    (U64) -> Ptr,
+    (F32) -> F32,
+    (F64) -> F64,
+    (F64) -> I32,
+    (Ptr) -> Void,
+    (Ptr) -> I32,
+    (Ptr) -> U32,
+    (Ptr) -> I64,
+    (Ptr) -> U64,
+    (Ptr) -> F64,
+    (Ptr) -> Ptr,
+
+    (I32, I32) -> Void,
+    (I32, I32) -> I32,
+    (I64, I64) -> I64,
+    (U64, U64) -> U64,
+    (F32, F32) -> F32,
+    (F64, F64) -> F64,
+    (F64, I32) -> F64,
+    (Ptr, I32) -> Void,
+    (Ptr, I32) -> I32,
+    (Ptr, I32) -> Ptr,
+    (Ptr, U64) -> Void,
+    (Ptr, U64) -> I32,
+    (Ptr, U64) -> U64,
+    (Ptr, U64) -> Ptr,
+    (Ptr, Ptr) -> Void,
+    (Ptr, Ptr) -> I32,
+    (Ptr, Ptr) -> Ptr,
+
+    (Ptr, I32, U64) -> Ptr,
+    (Ptr, I32, I32) -> I32,
+    (Ptr, Ptr, U64) -> Void,
+    (Ptr, Ptr, U64) -> I32,
+    (Ptr, Ptr, U64) -> I64,
+    (Ptr, Ptr, U64) -> Ptr,
+    (Ptr, U64, Ptr) -> I32,
+    (Ptr, U64, U64) -> U64,
+    (Ptr, Ptr, Ptr) -> I32,
+
+    (Ptr, U64, U64, Ptr) -> U64,
+    (Ptr, Ptr, U64, Ptr) -> I32,
+}
+
+/// Picks the direct stub for a signature, if its shape has one.
+pub(crate) fn stub_for(signature: &Signature) -> Option<DirectStub> {
+    if signature.is_variadic() || signature.abi.explicit().is_some() || signature.has_records() {
+        return None;
+    }
+
+    let result = Kind::from_code(signature.result().code())?;
+    let mut args = [Kind::Void; 4];
+    if signature.args().len() > args.len() {
+        return None;
+    }
+    for (slot, ty) in args.iter_mut().zip(signature.args()) {
+        let kind = Kind::from_code(ty.code())?;
+        if kind == Kind::Void {
+            return None;
+        }
+        *slot = kind;
+    }
+
+    select(result, &args[..signature.args().len()])
+}
@@ -0,0 +1,381 @@
+//! Boxed 64-bit integers.
+//!
+//! Luau numbers are doubles, exact only up to 2^53, so 64-bit handles, hashes and file offsets
+//! beyond that would come back rounded. Integer results that a number cannot hold exactly (call
+//! results, loads, callback arguments) come back as an `Int64` instead: a userdata with the bits
+//! and whether its C type is unsigned, nothing else. Arithmetic and comparisons are metamethods
+//! and wrap around like C's; the bitwise operations, which Luau has no operators for, are
+//! methods. Boxes pass to native code wherever an integer or pointer is taken, converting like a
+//! C cast.
+
+use mlua::prelude::*;
+
+// Every integer up to this magnitude is exact as a double
+const MAX_EXACT: u64 = 1 << 53;
+// Bounds of the signed and unsigned ranges, exact as doubles
+const TWO_63: f64 = 9_223_372_036_854_775_808.0;
+const TWO_64: f64 = 18_446_744_073_709_551_616.0;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub(crate) struct Int64 {
+    bits: u64,
+    unsigned: bool,
+}
+
+impl Int64 {
+    pub(crate) const fn signed(value: i64) -> Self {
+        Self {
+            bits: value as u64,
+            unsigned: false,
+        }
+    }
+
+    pub(crate) const fn unsigned(value: u64) -> Self {
+        Self {
+            bits: value,
+            unsigned: true,
+        }
+    }
+
+    pub(crate) const fn bits(self) -> u64 {
+        self.bits
+    }
+
+    pub(crate) const fn is_unsigned(self) -> bool {
+        self.unsigned
+    }
+
+    pub(crate) fn to_f64(self) -> f64 {
+        if self.unsigned {
+            self.bits as f64
+        } else {
+            self.bits as i64 as f64
+        }
+    }
+
+    // Like C, an operation on a signed and an unsigned value is unsigned
+    fn with(self, other: Self, bits: u64) -> Self {
+        Self {
+            bits,
+            unsigned: self.unsigned || other.unsigned,
+        }
+    }
+
+    fn divide(self, other: Self, floor: bool) -> LuaResult<(Self, Self)> {
+        if other.bits == 0 {
+            return Err(LuaError::runtime("integer division by zero".to_string()));
+        }
+        if self.unsigned || other.unsigned {
+            let (a, b) = (self.bits, other.bits);
+            return Ok((self.with(other, a / b), self.with(other, a % b)));
+        }
+        let (a, b) = (self.bits as i64, other.bits as i64);
+        let (mut quotient, mut remainder) = (a.wrapping_div(b), a.wrapping_rem(b));
+        // Luau rounds towards negative infinity, C towards zero
+        if floor && remainder != 0 && (remainder < 0) != (b < 0) {
+            quotient -= 1;
+            remainder += b;
+        }
+        Ok((Self::signed(quotient), Self::signed(remainder)))
+    }
+
+    fn power(self, other: Self) -> Self {
+        let mut exponent = other.bits;
+        if !self.unsigned && !other.unsigned && (exponent as i64) < 0 {
+            // Only 1 and -1 have integral negative powers
+            return Self::signed(match self.bits as i64 {
+                1 => 1,
+                -1 if exponent & 1 == 1 => -1,
+                -1 => 1,
+                _ => 0,
+            });
+        }
+        let (mut base, mut result) = (self.bits, 1u64);
+        while exponent > 0 {
+            if exponent & 1 == 1 {
+                result = result.wrapping_mul(base);
+            }
+            base = base.wrapping_mul(base);
+            exponent >>= 1;
+        }
+        self.with(other, result)
+    }
+
+    fn less_than(self, other: Self, equal: bool) -> bool {
+        let ordering = if self.unsigned || other.unsigned {
+            self.bits.cmp(&other.bits)
+        } else {
+            (self.bits as i64).cmp(&(other.bits as i64))
+        };
+        ordering.is_lt() || (equal && ordering.is_eq())
+    }
+}
+
+/// `value` as a number when one holds it exactly, boxed otherwise.
+pub(crate) fn signed_value(lua: &Lua, value: i64) -> LuaResult<LuaValue> {
+    if value.unsigned_abs() <= MAX_EXACT {
+        return Ok(LuaValue::Integer(value));
+    }
+    lua.create_userdata(Int64::signed(value))
+        .map(LuaValue::UserData)
+}
+
+/// `value` as a number when one holds it exactly, boxed otherwise.
+pub(crate) fn unsigned_value(lua: &Lua, value: u64) -> LuaResult<LuaValue> {
+    if value <= MAX_EXACT {
+        return Ok(LuaValue::Integer(value as i64));
+    }
+    lua.create_userdata(Int64::unsigned(value))
+        .map(LuaValue::UserData)
+}
+
+/// The box `value` is, if it is one.
+pub(crate) fn boxed(value: &LuaValue) -> Option<Int64> {
+    match value {
+        LuaValue::UserData(object) => object.borrow::<Int64>().ok().map(|boxed| *boxed),
+        _ => None,
+    }
+}
+
+// Numbers take part in box arithmetic as signed 64-bit values
+fn operand(value: &LuaValue) -> LuaResult<Int64> {
+    if let Some(boxed) = boxed(value) {
+        return Ok(boxed);
+    }
+    let number = match value {
+        LuaValue::Integer(i) => return Ok(Int64::signed(*i)),
+        LuaValue::Number(n) => *n,
+        other => {
+            return Err(LuaError::runtime(format!(
+                "attempt to perform arithmetic on a 64-bit integer and {}",
+                other.type_name()
+            )));
+        }
+    };
+    if number.fract() != 0.0 || !(-TWO_63..TWO_63).contains(&number) {
+        return Err(LuaError::runtime(format!(
+            "{number} is not an integer in the range of a 64-bit integer"
+        )));
+    }
+    Ok(Int64::signed(number as i64))
+}
+
+// Numbers outside the signed range are taken as unsigned, strings in decimal or hexadecimal
+fn convert(value: &LuaValue, unsigned: bool) -> LuaResult<Int64> {
+    let converted = match value {
+        LuaValue::String(text) => {
+            let text = text.to_str()?;
+            let trimmed = text.trim();
+            let (negative, digits) = match trimmed.strip_prefix('-') {
+                Some(rest) => (true, rest),
+                None => (false, trimmed),
+            };
+            let parsed = match digits
+                .strip_prefix("0x")
+                .or_else(|| digits.strip_prefix("0X"))
+            {
+                Some(hex) => u64::from_str_radix(hex, 16),
+                None => digits.parse::<u64>(),
+            }
+            .map_err(|_| LuaError::runtime(format!("invalid 64-bit integer '{trimmed}'")))?;
+            if negative && parsed > i64::MIN.unsigned_abs() {
+                return Err(LuaError::runtime(format!(
+                    "'{trimmed}' is out of the range of a 64-bit integer"
+                )));
+            }
+            Int64::signed(if negative {
+                parsed.wrapping_neg() as i64
+            } else {
+                parsed as i64
+            })
+        }
+        LuaValue::Number(n) if (TWO_63..TWO_64).contains(n) => {
+            if n.fract() != 0.0 {
+                return Err(LuaError::runtime(format!("{n} is not an integer")));
+            }
+            Int64::unsigned(*n as u64)
+        }
+        other => operand(other)?,
+    };
+    Ok(Int64 {
+        bits: converted.bits,
+        unsigned,
+    })
+}
+
+fn shift_amount(value: &LuaValue) -> LuaResult<u32> {
+    let amount = operand(value)?.bits;
+    u32::try_from(amount)
+        .ok()
+        .filter(|amount| *amount < 64)
+        .ok_or_else(|| LuaError::runtime("shift amount must be between 0 and 63".to_string()))
+}
+
+impl LuaUserData for Int64 {
+    fn add_fields<F: LuaUserDataFields<Self>>(fields: &mut F) {
+        fields.add_meta_field(LuaMetaMethod::Type, "int64");
+    }
+
+    fn add_methods<M: LuaUserDataMethods<Self>>(methods: &mut M) {
+        fn arithmetic<M: LuaUserDataMethods<Int64>>(
+            methods: &mut M,
+            method: LuaMetaMethod,
+            apply: fn(Int64, Int64) -> LuaResult<Int64>,
+        ) {
+            methods.add_meta_function(method, move |_, (a, b): (LuaValue, LuaValue)| {
+                apply(operand(&a)?, operand(&b)?)
+            });
+        }
+
+        arithmetic(methods, LuaMetaMethod::Add, |a, b| {
+            Ok(a.with(b, a.bits.wrapping_add(b.bits)))
+        });
+        arithmetic(methods, LuaMetaMethod::Sub, |a, b| {
+            Ok(a.with(b, a.bits.wrapping_sub(b.bits)))
+        });
+        arithmetic(methods, LuaMetaMethod::Mul, |a, b| {
+            Ok(a.with(b, a.bits.wrapping_mul(b.bits)))
+        });
+        // `/` truncates like C and LuaJIT, `//` and `%` round down like Luau
+        arithmetic(methods, LuaMetaMethod::Div, |a, b| {
+            Ok(a.divide(b, false)?.0)
+        });
+        arithmetic(methods, LuaMetaMethod::IDiv, |a, b| {
+            Ok(a.divide(b, true)?.0)
+        });
+        arithmetic(methods, LuaMetaMethod::Mod, |a, b| Ok(a.divide(b, true)?.1));
+        arithmetic(methods, LuaMetaMethod::Pow, |a, b| Ok(a.power(b)));
+        methods.add_meta_method(LuaMetaMethod::Unm, |_, this, ()| {
+            Ok(Int64 {
+                bits: this.bits.wrapping_neg(),
+                unsigned: this.unsigned,
+            })
+        });
+
+        // Luau compares only values of the same type, so numbers need boxing first
+        methods.add_meta_function(LuaMetaMethod::Eq, |_, (a, b): (LuaValue, LuaValue)| {
+            Ok(operand(&a)?.bits == operand(&b)?.bits)
+        });
+        methods.add_meta_function(LuaMetaMethod::Lt, |_, (a, b): (LuaValue, LuaValue)| {
+            Ok(operand(&a)?.less_than(operand(&b)?, false))
+        });
+        methods.add_meta_function(LuaMetaMethod::Le, |_, (a, b): (LuaValue, LuaValue)| {
+            Ok(operand(&a)?.less_than(operand(&b)?, true))
+        });
+        methods.add_meta_method(LuaMetaMethod::ToString, |_, this, ()| {
+            Ok(if this.unsigned {
+                format!("{}ULL", this.bits)
+            } else {
+                format!("{}LL", this.bits as i64)
+            })
+        });
+
+        methods.add_method("tonumber", |_, this, ()| Ok(this.to_f64()));
+        methods.add_method("tohex", |_, this, ()| Ok(format!("{:016x}", this.bits)));
+        methods.add_method("band", |_, this, other: LuaValue| {
+            let other = operand(&other)?;
+            Ok(this.with(other, this.bits & other.bits))
+        });
+        methods.add_method("bor", |_, this, other: LuaValue| {
+            let other = operand(&other)?;
+            Ok(this.with(other, this.bits | other.bits))
+        });
+        methods.add_method("bxor", |_, this, other: LuaValue| {
+            let other = operand(&other)?;
+            Ok(this.with(other, this.bits ^ other.bits))
+        });
+        methods.add_method("bnot", |_, this, ()| {
+            Ok(Int64 {
+                bits: !this.bits,
+                unsigned: this.unsigned,
+            })
+        });
+        methods.add_method("lshift", |_, this, amount: LuaValue| {
+            Ok(Int64 {
+                bits: this.bits << shift_amount(&amount)?,
+                unsigned: this.unsigned,
+            })
+        });
+        methods.add_method("rshift", |_, this, amount: LuaValue| {
+            Ok(Int64 {
+                bits: this.bits >> shift_amount(&amount)?,
+                unsigned: this.unsigned,
+            })
+        });
+        methods.add_method("arshift", |_, this, amount: LuaValue| {
+            Ok(Int64 {
+                bits: ((this.bits as i64) >> shift_amount(&amount)?) as u64,
+                unsigned: this.unsigned,
+            })
+        });
+    }
+}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    let int64_fn = lua.create_function(|_, (value, unsigned): (LuaValue, Option<bool>)| {
+        convert(&value, unsigned.unwrap_or(false))
+    })?;
+    exports.set("int64", int64_fn)?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn results_stay_numbers_while_exact() -> LuaResult<()> {
+        let lua = Lua::new();
+        assert!(matches!(
+            signed_value(&lua, -(1 << 53))?,
+            LuaValue::Integer(_)
+        ));
+        assert!(matches!(
+            unsigned_value(&lua, 1 << 53)?,
+            LuaValue::Integer(_)
+        ));
+        assert_eq!(
+            boxed(&signed_value(&lua, i64::MIN)?),
+            Some(Int64::signed(i64::MIN))
+        );
+        assert_eq!(
+            boxed(&unsigned_value(&lua, u64::MAX)?),
+            Some(Int64::unsigned(u64::MAX))
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn arithmetic_wraps_and_compares_like_c() -> LuaResult<()> {
+        let lua = Lua::new();
+        register(&lua, &lua.globals())?;
+        lua.load(
+            r#"
+            local max = int64("0xffffffffffffffff", true)
+            assert(tostring(max) == "18446744073709551615ULL")
+            assert(tostring(max + 1) == "0ULL")
+            local big = int64("9007199254740993")
+            assert(tostring(big * 2 - 1) == "18014398509481985LL")
+            assert(tostring(int64(-7) / 2) == "-3LL")
+            assert(tostring(int64(-7) // 2) == "-4LL")
+            assert(tostring(int64(-7) % 2) == "1LL")
+            assert(tostring(int64(3) ^ 39) == "4052555153018976267LL")
+            assert(tostring(int64(-1) ^ -3) == "-1LL")
+            assert(tostring(-int64("-9223372036854775808")) == "-9223372036854775808LL")
+            assert(int64(-1) < int64(0))
+            assert(not (int64(-1, true) < int64(0, true)))
+            assert(int64(5) == int64(5, true))
+            assert(int64(5) <= 5 + int64(0))
+            assert(max:band(0xff):tonumber() == 255)
+            assert(int64(1):lshift(63):tohex() == "8000000000000000")
+            assert(tostring(int64(1):lshift(63):arshift(63)) == "-1LL")
+            assert(tostring(int64(0):bnot()) == "-1LL")
+            assert(typeof(max) == "int64")
+            assert(not pcall(function() return int64(1) / 0 end))
+            assert(not pcall(function() return int64(1) + 0.5 end))
+            assert(not pcall(int64, "12abc"))
+            "#,
+        )
+        .exec()
+    }
+}
@@ -2,10 +2,20 @@
 
 use mlua::prelude::*;
 
+mod arena;
 mod call;
 mod callback;
+mod cdata;
+mod cdef;
+mod direct;
+mod int64;
+mod library;
+mod memory;
 mod native;
+mod record;
 mod signature;
+mod stats;
+mod trace;
 mod types;
 
 const MODULE_SOURCE: &str = include_str!(concat!(
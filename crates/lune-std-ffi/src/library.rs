@@ -0,0 +1,380 @@
+//! Shared library handles and their symbols.
+//!
+//! Handles are kept for the whole process rather than per Lua state: a library is keyed by its
+//! canonical path (or by its name when the loader's search path finds it), opened once and
+//! reference counted across every state that loads it, and closed when the last of them
+//! releases it. Symbols resolved through a handle are cached with it, so other states loading
+//! the same library skip their `dlsym` calls.
+
+use std::cell::Cell;
+use std::collections::HashMap;
+use std::ffi::{CStr, CString};
+use std::os::raw::{c_char, c_int, c_void};
+use std::path::Path;
+use std::sync::{LazyLock, Mutex, MutexGuard};
+
+use libc::size_t;
+use mlua::prelude::*;
+
+#[allow(improper_ctypes)]
+unsafe extern "C" {
+    fn luneffi_dlopen_ex(path: *const c_char, flags: c_int) -> *mut c_void;
+    fn luneffi_dlsym(handle: *mut c_void, name: *const c_char) -> *mut c_void;
+    fn luneffi_dlsym_many(
+        handle: *mut c_void,
+        names: *const *const c_char,
+        out: *mut *mut c_void,
+        count: size_t,
+    ) -> size_t;
+    fn luneffi_dlclose(handle: *mut c_void) -> c_int;
+    fn luneffi_dlerror() -> *const c_char;
+}
+
+// Names for the luneffi_dlopen_ex flags in luneffi_loader.h
+const DLOPEN_FLAGS: [(&str, c_int); 9] = [
+    ("now", 0x1),
+    ("global", 0x2),
+    ("nodelete", 0x4),
+    ("deepbind", 0x8),
+    ("search_dll_load_dir", 0x10),
+    ("search_application_dir", 0x20),
+    ("search_user_dirs", 0x40),
+    ("search_system32", 0x80),
+    ("search_default_dirs", 0x100),
+];
+
+fn dlopen_flags(names: &[String]) -> LuaResult<c_int> {
+    names.iter().try_fold(0, |flags, name| {
+        DLOPEN_FLAGS
+            .iter()
+            .find(|(flag, _)| flag == name)
+            .map(|(_, bit)| flags | bit)
+            .ok_or_else(|| LuaError::runtime(format!("unknown ffi.load flag '{name}'")))
+    })
+}
+
+fn last_error() -> Option<String> {
+    let ptr = unsafe { luneffi_dlerror() };
+    if ptr.is_null() {
+        return None;
+    }
+    let c_str = unsafe { CStr::from_ptr(ptr) };
+    Some(c_str.to_string_lossy().into_owned())
+}
+
+fn symbol_name(name: &str) -> LuaResult<CString> {
+    CString::new(name)
+        .map_err(|_| LuaError::runtime(format!("Symbol name contains NUL byte: {name}")))
+}
+
+// Handles and symbols are stored as addresses so the cache can be shared between threads
+struct Library {
+    // Lua-side references; the handle is closed once the last one is released
+    refs: usize,
+    // Times dlopen returned this handle, all of which are undone when it is closed
+    opens: usize,
+    symbols: HashMap<String, usize>,
+}
+
+#[derive(Default)]
+struct Libraries {
+    handles: HashMap<String, usize>,
+    libraries: HashMap<usize, Library>,
+}
+
+static LIBRARIES: LazyLock<Mutex<Libraries>> = LazyLock::new(Mutex::default);
+
+fn libraries() -> MutexGuard<'static, Libraries> {
+    // The cache stays consistent across panics, as every update is a single insert or remove
+    LIBRARIES
+        .lock()
+        .unwrap_or_else(|poisoned| poisoned.into_inner())
+}
+
+// Paths are canonicalized so that different spellings share a handle; bare names are resolved
+// through the loader's search path and are keyed as given
+fn library_key(path: Option<&str>) -> String {
+    let Some(path) = path else {
+        return String::new();
+    };
+    if Path::new(path).components().count() <= 1 {
+        return path.to_string();
+    }
+    std::fs::canonicalize(path)
+        .map(|canonical| canonical.to_string_lossy().into_owned())
+        .unwrap_or_else(|_| path.to_string())
+}
+
+/// Opens the library, or takes another reference to it if any state already has; the flags of
+/// the first open apply.
+fn open(path: Option<&str>, flags: c_int) -> LuaResult<*mut c_void> {
+    let key = library_key(path);
+    let mut cache = libraries();
+    if let Some(&handle) = cache.handles.get(&key) {
+        if let Some(library) = cache.libraries.get_mut(&handle) {
+            library.refs += 1;
+            return Ok(handle as *mut c_void);
+        }
+    }
+
+    let c_path = path
+        .map(|path| {
+            CString::new(path)
+                .map_err(|_| LuaError::runtime(format!("Library path contains NUL byte: {path}")))
+        })
+        .transpose()?;
+    let ptr = unsafe {
+        luneffi_dlopen_ex(
+            c_path.as_ref().map_or(std::ptr::null(), |s| s.as_ptr()),
+            flags,
+        )
+    };
+    if ptr.is_null() {
+        let err = last_error().unwrap_or_else(|| "Failed to load library".to_string());
+        return Err(LuaError::runtime(err));
+    }
+
+    // Another spelling of the path may already have opened the same handle
+    let library = cache
+        .libraries
+        .entry(ptr as usize)
+        .or_insert_with(|| Library {
+            refs: 0,
+            opens: 0,
+            symbols: HashMap::new(),
+        });
+    library.refs += 1;
+    library.opens += 1;
+    cache.handles.insert(key, ptr as usize);
+    Ok(ptr)
+}
+
+fn close(handle: *mut c_void) -> LuaResult<()> {
+    let address = handle as usize;
+    let mut cache = libraries();
+    let opens = match cache.libraries.get_mut(&address) {
+        Some(library) if library.refs > 1 => {
+            library.refs -= 1;
+            return Ok(());
+        }
+        Some(library) => library.opens,
+        None => 1,
+    };
+    cache.libraries.remove(&address);
+    cache.handles.retain(|_, cached| *cached != address);
+    // A state opening the library again meanwhile gets its own reference from the loader
+    drop(cache);
+
+    for _ in 0..opens {
+        let rc = unsafe { luneffi_dlclose(handle) };
+        if rc != 0 {
+            let err = last_error().unwrap_or_else(|| "dlclose failed".to_string());
+            return Err(LuaError::runtime(err));
+        }
+    }
+    Ok(())
+}
+
+fn symbol(handle: *mut c_void, name: &str) -> Result<*mut c_void, String> {
+    let mut cache = libraries();
+    let library = cache.libraries.get_mut(&(handle as usize));
+    if let Some(&address) = library
+        .as_ref()
+        .and_then(|library| library.symbols.get(name))
+    {
+        return Ok(address as *mut c_void);
+    }
+
+    let c_name = symbol_name(name).map_err(|err| err.to_string())?;
+    let ptr = unsafe { luneffi_dlsym(handle, c_name.as_ptr()) };
+    if ptr.is_null() {
+        return Err(last_error().unwrap_or_else(|| "symbol lookup failed".to_string()));
+    }
+    if let Some(library) = library {
+        library.symbols.insert(name.to_string(), ptr as usize);
+    }
+    Ok(ptr)
+}
+
+// Resolves every name, looking up only those not cached yet; missing names are null
+fn symbols(handle: *mut c_void, names: &[String]) -> LuaResult<(Vec<*mut c_void>, Option<String>)> {
+    let mut cache = libraries();
+    let mut library = cache.libraries.get_mut(&(handle as usize));
+    let mut resolved = vec![std::ptr::null_mut(); names.len()];
+    let mut pending = Vec::new();
+    for (index, name) in names.iter().enumerate() {
+        match library
+            .as_ref()
+            .and_then(|library| library.symbols.get(name))
+        {
+            Some(&address) => resolved[index] = address as *mut c_void,
+            None => pending.push(index),
+        }
+    }
+    if pending.is_empty() {
+        return Ok((resolved, None));
+    }
+
+    let c_names = pending
+        .iter()
+        .map(|&index| symbol_name(&names[index]))
+        .collect::<LuaResult<Vec<_>>>()?;
+    let name_ptrs: Vec<*const c_char> = c_names.iter().map(|name| name.as_ptr()).collect();
+    let mut found = vec![std::ptr::null_mut(); pending.len()];
+    let count = unsafe {
+        luneffi_dlsym_many(
+            handle,
+            name_ptrs.as_ptr(),
+            found.as_mut_ptr(),
+            pending.len() as size_t,
+        )
+    };
+    let err = if count < pending.len() {
+        Some(last_error().unwrap_or_else(|| "symbol lookup failed".to_string()))
+    } else {
+        None
+    };
+
+    for (&index, &ptr) in pending.iter().zip(&found) {
+        resolved[index] = ptr;
+        if ptr.is_null() {
+            continue;
+        }
+        if let Some(library) = library.as_mut() {
+            library.symbols.insert(names[index].clone(), ptr as usize);
+        }
+    }
+    Ok((resolved, err))
+}
+
+/// Releases a library when the Lua state forgets it: the frontend keeps the guard in the
+/// library's state, so collection is all it takes, and closing it explicitly disarms it.
+struct LibraryGuard {
+    handle: Cell<Option<usize>>,
+}
+
+impl LibraryGuard {
+    fn release(&self) -> LuaResult<bool> {
+        let Some(handle) = self.handle.get() else {
+            return Ok(false);
+        };
+        // Left armed when closing fails, so that collection tries once more
+        close(handle as *mut c_void)?;
+        self.handle.set(None);
+        Ok(true)
+    }
+}
+
+impl Drop for LibraryGuard {
+    fn drop(&mut self) {
+        // Nothing can report the error from a collection
+        let _ = self.release();
+    }
+}
+
+impl LuaUserData for LibraryGuard {}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    let dlopen_fn =
+        lua.create_function(|_, (path, flags): (Option<String>, Option<Vec<String>>)| {
+            let flags = dlopen_flags(flags.as_deref().unwrap_or_default())?;
+            open(path.as_deref(), flags).map(LuaLightUserData)
+        })?;
+    exports.set("dlopen", dlopen_fn)?;
+
+    let dlsym_fn = lua.create_function(|lua, (handle, name): (LuaLightUserData, String)| {
+        match symbol(handle.0, &name) {
+            Ok(ptr) => Ok((
+                LuaValue::LightUserData(LuaLightUserData(ptr)),
+                LuaValue::Nil,
+            )),
+            Err(err) => Ok((LuaValue::Nil, LuaValue::String(lua.create_string(err)?))),
+        }
+    })?;
+    exports.set("dlsym", dlsym_fn)?;
+
+    // Resolves a list of names at once; returns the pointers found by name, then the names that
+    // were not found and the error for the first of them
+    let dlsym_many_fn =
+        lua.create_function(|lua, (handle, names): (LuaLightUserData, Vec<String>)| {
+            let (resolved, err) = symbols(handle.0, &names)?;
+            let symbols = lua.create_table_with_capacity(0, names.len())?;
+            let missing = lua.create_table()?;
+            for (name, ptr) in names.iter().zip(&resolved) {
+                if ptr.is_null() {
+                    missing.raw_push(name.as_str())?;
+                } else {
+                    symbols.raw_set(name.as_str(), LuaLightUserData(*ptr))?;
+                }
+            }
+            Ok((symbols, missing, err))
+        })?;
+    exports.set("dlsymMany", dlsym_many_fn)?;
+
+    let dlclose_fn = lua.create_function(|_, handle: LuaLightUserData| close(handle.0))?;
+    exports.set("dlclose", dlclose_fn)?;
+
+    let guard_fn = lua.create_function(|lua, handle: LuaLightUserData| {
+        lua.create_userdata(LibraryGuard {
+            handle: Cell::new(Some(handle.0 as usize)),
+        })
+    })?;
+    exports.set("libraryGuard", guard_fn)?;
+
+    let release_fn =
+        lua.create_function(|_, guard: LuaAnyUserData| guard.borrow::<LibraryGuard>()?.release())?;
+    exports.set("releaseLibrary", release_fn)?;
+
+    // Libraries listed in the file named by LUNE_FFI_PRELOAD are loaded when the module starts
+    let preload_manifest_fn = lua.create_function(|_, ()| {
+        let Some(path) = std::env::var_os("LUNE_FFI_PRELOAD") else {
+            return Ok((None, None));
+        };
+        let display = path.to_string_lossy().into_owned();
+        let contents = std::fs::read_to_string(&path).map_err(|err| {
+            LuaError::runtime(format!(
+                "failed to read LUNE_FFI_PRELOAD '{display}': {err}"
+            ))
+        })?;
+        Ok((Some(display), Some(contents)))
+    })?;
+    exports.set("preloadManifest", preload_manifest_fn)?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn process_handle_is_shared_and_caches_symbols() -> LuaResult<()> {
+        let first = open(None, 0)?;
+        let second = open(None, 0)?;
+        assert_eq!(first, second);
+
+        let name = "strlen";
+        let ptr = symbol(first, name).map_err(LuaError::runtime)?;
+        assert!(!ptr.is_null());
+        let cached = libraries().libraries[&(first as usize)]
+            .symbols
+            .get(name)
+            .copied();
+        assert_eq!(cached, Some(ptr as usize));
+
+        let (resolved, err) =
+            symbols(second, &[name.to_string(), "__luneffi_missing".to_string()])?;
+        assert_eq!(resolved[0], ptr);
+        assert!(resolved[1].is_null());
+        assert!(err.is_some());
+
+        close(second)?;
+        assert!(libraries().libraries.contains_key(&(first as usize)));
+        let guard = LibraryGuard {
+            handle: Cell::new(Some(first as usize)),
+        };
+        assert!(guard.release()?);
+        assert!(!guard.release()?);
+        Ok(())
+    }
+}
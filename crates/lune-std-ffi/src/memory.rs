@@ -0,0 +1,275 @@
+//! Native memory accounted against the Luau collector.
+//!
+//! Storage behind cdata comes from the pool or from C, so a cdata looks tiny to the collector
+//! however much it holds, and a loop creating large ones can pile up native memory long before
+//! a collection frees it. The bytes owned cdata hold, and those `ffi.gc` is told a finalizer
+//! releases, are charged here as they are handed out: once enough are outstanding the collector
+//! is stepped as if they had been allocated on its heap, and releasing them before that cancels
+//! the debt. Like the states using them, the counters belong to the thread.
+//!
+//! While tracking is on, every owned cdata, `ffi.gc` size, `native.alloc` block and callback is
+//! also recorded with its type and the script line that created it until it is released, so a
+//! growing process can be narrowed down to what it keeps alive. When off, recording costs a
+//! thread-local flag check.
+
+use std::cell::{Cell, RefCell};
+use std::collections::HashMap;
+use std::ffi::{c_int, c_void};
+use std::rc::Rc;
+
+use mlua::prelude::*;
+
+// Debt worth a collector step, so small cdata are not each followed by one
+const STEP_BYTES: usize = 64 * 1024;
+// Allocation sites reported, those holding the most bytes
+const TOP_SITES: usize = 16;
+// Frames searched for the first one outside the ffi module
+const MAX_SITE_DEPTH: usize = 32;
+// Chunk name of the ffi module, whose frames the site skips
+const MODULE_CHUNK: &str = "@lune/ffi/init";
+
+struct Allocation {
+    name: Rc<str>,
+    site: Rc<str>,
+    bytes: usize,
+}
+
+#[derive(Clone, Default)]
+struct Totals {
+    bytes: usize,
+    count: usize,
+    // Recorded since tracking started, released ones included
+    allocations: u64,
+}
+
+impl Totals {
+    fn add(&mut self, bytes: usize) {
+        self.bytes += bytes;
+        self.count += 1;
+        self.allocations += 1;
+    }
+
+    fn remove(&mut self, bytes: usize) {
+        self.bytes -= bytes;
+        self.count -= 1;
+    }
+}
+
+#[derive(Default)]
+struct Tracker {
+    // By the address identifying the allocation: its storage, or its finalizer or callback data
+    live: HashMap<usize, Allocation>,
+    types: HashMap<Rc<str>, Totals>,
+    sites: HashMap<Rc<str>, Totals>,
+}
+
+// The key of `map` equal to `name`, shared rather than allocated again
+fn intern(map: &HashMap<Rc<str>, Totals>, name: &str) -> Rc<str> {
+    map.get_key_value(name)
+        .map_or_else(|| Rc::from(name), |(key, _)| Rc::clone(key))
+}
+
+thread_local! {
+    static LIVE: Cell<usize> = const { Cell::new(0) };
+    static DEBT: Cell<usize> = const { Cell::new(0) };
+    static TRACKING: Cell<bool> = const { Cell::new(false) };
+    static TRACKER: RefCell<Tracker> = RefCell::new(Tracker::default());
+}
+
+/// Charges `bytes` now held natively, stepping the collector once enough are outstanding.
+pub(crate) fn charge(lua: &Lua, bytes: usize) -> LuaResult<()> {
+    LIVE.with(|live| live.set(live.get().saturating_add(bytes)));
+    pace(lua, bytes)
+}
+
+/// Counts `bytes` allocated natively towards the next collector step without holding them
+/// against a cdata, for memory whose release is not seen here.
+pub(crate) fn pace(lua: &Lua, bytes: usize) -> LuaResult<()> {
+    if bytes == 0 {
+        return Ok(());
+    }
+    let debt = DEBT.with(|debt| {
+        debt.set(debt.get().saturating_add(bytes));
+        debt.get()
+    });
+    if debt < STEP_BYTES {
+        return Ok(());
+    }
+    let kbytes = c_int::try_from(debt / 1024).unwrap_or(c_int::MAX);
+    DEBT.with(|debt| debt.set(debt.get() - kbytes as usize * 1024));
+    lua.gc_step_kbytes(kbytes)?;
+    Ok(())
+}
+
+/// Releases `bytes` charged earlier; those the collector was not stepped for yet need no step.
+pub(crate) fn release(bytes: usize) {
+    if bytes == 0 {
+        return;
+    }
+    LIVE.with(|live| live.set(live.get().saturating_sub(bytes)));
+    DEBT.with(|debt| debt.set(debt.get().saturating_sub(bytes)));
+}
+
+/// Bytes charged and not released yet.
+pub(crate) fn live() -> usize {
+    LIVE.with(Cell::get)
+}
+
+pub(crate) fn tracking() -> bool {
+    TRACKING.with(Cell::get)
+}
+
+// `source:line` of the innermost script frame outside the ffi module, asked of `debug.info` as
+// it knows Luau's frames
+fn call_site(lua: &Lua) -> String {
+    let info = lua
+        .globals()
+        .get::<LuaTable>("debug")
+        .and_then(|debug| debug.get::<LuaFunction>("info"));
+    if let Ok(info) = info {
+        for level in 1..=MAX_SITE_DEPTH {
+            let Ok((source, line)) = info.call::<(Option<String>, Option<i64>)>((level, "sl"))
+            else {
+                break;
+            };
+            let Some(source) = source else {
+                break;
+            };
+            if source.starts_with('=') || source == MODULE_CHUNK {
+                continue;
+            }
+            let source = source.strip_prefix('@').unwrap_or(&source);
+            return format!("{source}:{}", line.unwrap_or(0));
+        }
+    }
+    "<native>".to_string()
+}
+
+/// Records `bytes` identified by `key` as held by an object of type `name`, while tracking.
+/// Callers check `tracking` first when the name costs something to build.
+pub(crate) fn track(lua: &Lua, key: *const c_void, name: &str, bytes: usize) {
+    if !tracking() || key.is_null() {
+        return;
+    }
+    let site = call_site(lua);
+    TRACKER.with(|tracker| {
+        let mut tracker = tracker.borrow_mut();
+        let name = intern(&tracker.types, name);
+        let site = intern(&tracker.sites, &site);
+        tracker
+            .types
+            .entry(Rc::clone(&name))
+            .or_default()
+            .add(bytes);
+        tracker
+            .sites
+            .entry(Rc::clone(&site))
+            .or_default()
+            .add(bytes);
+        if let Some(replaced) = tracker
+            .live
+            .insert(key as usize, Allocation { name, site, bytes })
+        {
+            forget(&mut tracker, &replaced);
+        }
+    });
+}
+
+/// Drops the record `track` made for `key`, if any.
+pub(crate) fn untrack(key: *const c_void) {
+    if !tracking() {
+        return;
+    }
+    TRACKER.with(|tracker| {
+        let mut tracker = tracker.borrow_mut();
+        if let Some(allocation) = tracker.live.remove(&(key as usize)) {
+            forget(&mut tracker, &allocation);
+        }
+    });
+}
+
+fn forget(tracker: &mut Tracker, allocation: &Allocation) {
+    if let Some(totals) = tracker.types.get_mut(&allocation.name) {
+        totals.remove(allocation.bytes);
+    }
+    if let Some(totals) = tracker.sites.get_mut(&allocation.site) {
+        totals.remove(allocation.bytes);
+    }
+}
+
+fn totals_table(lua: &Lua, totals: &Totals) -> LuaResult<LuaTable> {
+    let table = lua.create_table_with_capacity(0, 3)?;
+    table.raw_set("bytes", totals.bytes as u64)?;
+    table.raw_set("count", totals.count as u64)?;
+    table.raw_set("allocations", totals.allocations)?;
+    Ok(table)
+}
+
+// `{ tracking, nativeBytes, bytes, count, types = { [name] = { bytes, count, allocations } },
+// sites = { { site, bytes, count, allocations } } }`, the sites holding the most bytes first
+fn snapshot(lua: &Lua) -> LuaResult<LuaTable> {
+    // Copied out first: creating the tables may collect cdata, which untrack themselves
+    let (types, mut held, bytes, count) = TRACKER.with(|tracker| {
+        let tracker = tracker.borrow();
+        let types: Vec<(Rc<str>, Totals)> = tracker
+            .types
+            .iter()
+            .map(|(name, totals)| (Rc::clone(name), totals.clone()))
+            .collect();
+        let held: Vec<(Rc<str>, Totals)> = tracker
+            .sites
+            .iter()
+            .filter(|(_, totals)| totals.count > 0)
+            .map(|(site, totals)| (Rc::clone(site), totals.clone()))
+            .collect();
+        let bytes: usize = tracker
+            .live
+            .values()
+            .map(|allocation| allocation.bytes)
+            .sum();
+        (types, held, bytes, tracker.live.len())
+    });
+
+    let types_table = lua.create_table_with_capacity(0, types.len())?;
+    for (name, totals) in &types {
+        types_table.raw_set(&**name, totals_table(lua, totals)?)?;
+    }
+    held.sort_by(|a, b| b.1.bytes.cmp(&a.1.bytes).then_with(|| a.0.cmp(&b.0)));
+    held.truncate(TOP_SITES);
+    let sites = lua.create_table_with_capacity(held.len(), 0)?;
+    for (site, totals) in &held {
+        let entry = totals_table(lua, totals)?;
+        entry.raw_set("site", &**site)?;
+        sites.raw_push(entry)?;
+    }
+
+    let table = lua.create_table_with_capacity(0, 6)?;
+    table.raw_set("tracking", tracking())?;
+    table.raw_set("nativeBytes", live() as u64)?;
+    table.raw_set("bytes", bytes as u64)?;
+    table.raw_set("count", count as u64)?;
+    table.raw_set("types", types_table)?;
+    table.raw_set("sites", sites)?;
+    Ok(table)
+}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    let native_memory_fn = lua.create_function(|_, ()| Ok(live() as u64))?;
+    exports.set("nativeMemory", native_memory_fn)?;
+
+    let memstats_fn = lua.create_function(|lua, ()| snapshot(lua))?;
+    exports.set("memstats", memstats_fn)?;
+
+    // Forgets the records, and turns tracking on or off if `enable` is given; allocations made
+    // before are not known to it and their release goes unnoticed
+    let reset_memstats_fn = lua.create_function(|_, enable: Option<bool>| {
+        TRACKER.with(|tracker| *tracker.borrow_mut() = Tracker::default());
+        if let Some(enable) = enable {
+            TRACKING.with(|flag| flag.set(enable));
+        }
+        Ok(())
+    })?;
+    exports.set("resetMemstats", reset_memstats_fn)?;
+
+    Ok(())
+}
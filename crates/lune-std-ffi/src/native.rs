@@ -1,12 +1,20 @@
-use std::ffi::{CStr, CString};
+use std::ffi::CStr;
 use std::os::raw::{c_char, c_int, c_void};
 use std::ptr;
 use std::slice;
 
 use mlua::prelude::*;
 
+use crate::arena;
 use crate::call;
 use crate::callback;
+use crate::cdata;
+use crate::cdef;
+use crate::int64;
+use crate::library;
+use crate::memory;
+use crate::stats;
+use crate::trace;
 use crate::types::{self, TypeCode};
 
 type TestCallback = unsafe extern "C" fn(c_int) -> c_int;
@@ -21,7 +29,7 @@ unsafe extern "C" {
 static LUNEFFI_KEEP_TEST_CALLBACK: unsafe extern "C" fn(Option<TestCallback>, c_int) -> c_int =
     luneffi_test_call_callback;
 
-use libc::{calloc, free, memcpy, size_t};
+use libc::{calloc, free, memcpy, memmove, memset, size_t};
 
 cfg_if::cfg_if! {
     if #[cfg(any(
@@ -104,23 +112,6 @@ fn set_errno(value: c_int) {
     }
 }
 
-#[allow(improper_ctypes)]
-unsafe extern "C" {
-    fn luneffi_dlopen(path: *const c_char) -> *mut c_void;
-    fn luneffi_dlsym(handle: *mut c_void, name: *const c_char) -> *mut c_void;
-    fn luneffi_dlclose(handle: *mut c_void) -> c_int;
-    fn luneffi_dlerror() -> *const c_char;
-}
-
-fn last_error() -> Option<String> {
-    let ptr = unsafe { luneffi_dlerror() };
-    if ptr.is_null() {
-        return None;
-    }
-    let c_str = unsafe { CStr::from_ptr(ptr) };
-    Some(c_str.to_string_lossy().into_owned())
-}
-
 fn detect_os() -> &'static str {
     if cfg!(target_os = "windows") {
         "Windows"
@@ -304,29 +295,20 @@ fn lua_value_to_pointer(value: &LuaValue) -> LuaResult<*mut c_void> {
             }
             Ok((*n as u64) as usize as *mut c_void)
         }
-        LuaValue::Table(table) => {
-            let marker = table.raw_get::<LuaValue>("__ffi_cdata")?;
-            if !matches!(marker, LuaValue::Boolean(true)) {
-                return Err(LuaError::runtime(
-                    "cannot convert table value to native pointer".to_string(),
-                ));
-            }
-            let inner = table.raw_get::<LuaValue>("__ptr")?;
-            match inner {
-                LuaValue::LightUserData(ptr) => Ok(ptr.0),
-                LuaValue::Nil => Ok(ptr::null_mut()),
-                other => Err(LuaError::runtime(format!(
-                    "cdata object missing native pointer (found {other:?})",
-                ))),
-            }
-        }
+        LuaValue::UserData(_) => match (cdata::cdata_info(value), int64::boxed(value)) {
+            (Some((ptr, _)), _) => Ok(ptr),
+            (None, Some(boxed)) => Ok(boxed.bits() as usize as *mut c_void),
+            (None, None) => Err(LuaError::runtime(
+                "cannot convert userdata value to native pointer".to_string(),
+            )),
+        },
         other => Err(LuaError::runtime(format!(
             "cannot convert value {other:?} to native pointer"
         ))),
     }
 }
 
-fn store_scalar(ptr: *mut c_void, ty: TypeCode, value: &LuaValue) -> LuaResult<()> {
+pub(crate) fn store_scalar(ptr: *mut c_void, ty: TypeCode, value: &LuaValue) -> LuaResult<()> {
     unsafe {
         match ty {
             TypeCode::Void => {
@@ -395,11 +377,14 @@ fn store_scalar(ptr: *mut c_void, ty: TypeCode, value: &LuaValue) -> LuaResult<(
                             0.0
                         }
                     }
-                    other => {
-                        return Err(LuaError::runtime(format!(
-                            "expected numeric value for float storage, got {other:?}"
-                        )));
-                    }
+                    other => match int64::boxed(other) {
+                        Some(boxed) => boxed.to_f64() as f32,
+                        None => {
+                            return Err(LuaError::runtime(format!(
+                                "expected numeric value for float storage, got {other:?}"
+                            )));
+                        }
+                    },
                 };
                 ptr::write(ptr as *mut f32, v);
             }
@@ -414,11 +399,14 @@ fn store_scalar(ptr: *mut c_void, ty: TypeCode, value: &LuaValue) -> LuaResult<(
                             0.0
                         }
                     }
-                    other => {
-                        return Err(LuaError::runtime(format!(
-                            "expected numeric value for double storage, got {other:?}"
-                        )));
-                    }
+                    other => match int64::boxed(other) {
+                        Some(boxed) => boxed.to_f64(),
+                        None => {
+                            return Err(LuaError::runtime(format!(
+                                "expected numeric value for double storage, got {other:?}"
+                            )));
+                        }
+                    },
                 };
                 ptr::write(ptr as *mut f64, v);
             }
@@ -432,7 +420,7 @@ fn store_scalar(ptr: *mut c_void, ty: TypeCode, value: &LuaValue) -> LuaResult<(
     Ok(())
 }
 
-fn load_scalar(_lua: &Lua, ptr: *mut c_void, ty: TypeCode) -> LuaResult<LuaValue> {
+pub(crate) fn load_scalar(lua: &Lua, ptr: *mut c_void, ty: TypeCode) -> LuaResult<LuaValue> {
     unsafe {
         match ty {
             TypeCode::Void => Err(LuaError::runtime(
@@ -444,30 +432,18 @@ fn load_scalar(_lua: &Lua, ptr: *mut c_void, ty: TypeCode) -> LuaResult<LuaValue
             TypeCode::UInt16 => Ok(LuaValue::Integer(ptr::read(ptr as *const u16) as i64)),
             TypeCode::Int32 => Ok(LuaValue::Integer(ptr::read(ptr as *const i32) as i64)),
             TypeCode::UInt32 => Ok(LuaValue::Integer(ptr::read(ptr as *const u32) as i64)),
-            TypeCode::Int64 => Ok(LuaValue::Integer(ptr::read(ptr as *const i64))),
-            TypeCode::UInt64 => {
-                let value = ptr::read(ptr as *const u64);
-                if value <= i64::MAX as u64 {
-                    Ok(LuaValue::Integer(value as i64))
-                } else {
-                    Ok(LuaValue::Number(value as f64))
-                }
-            }
+            TypeCode::Int64 => int64::signed_value(lua, ptr::read(ptr as *const i64)),
+            TypeCode::UInt64 => int64::unsigned_value(lua, ptr::read(ptr as *const u64)),
             TypeCode::IntPtr => {
                 if usize::BITS == 64 {
-                    Ok(LuaValue::Integer(ptr::read(ptr as *const i64)))
+                    int64::signed_value(lua, ptr::read(ptr as *const i64))
                 } else {
                     Ok(LuaValue::Integer(ptr::read(ptr as *const i32) as i64))
                 }
             }
             TypeCode::UIntPtr => {
                 if usize::BITS == 64 {
-                    let value = ptr::read(ptr as *const u64);
-                    if value <= i64::MAX as u64 {
-                        Ok(LuaValue::Integer(value as i64))
-                    } else {
-                        Ok(LuaValue::Number(value as f64))
-                    }
+                    int64::unsigned_value(lua, ptr::read(ptr as *const u64))
                 } else {
                     Ok(LuaValue::Integer(ptr::read(ptr as *const u32) as i64))
                 }
@@ -482,6 +458,142 @@ fn load_scalar(_lua: &Lua, ptr: *mut c_void, ty: TypeCode) -> LuaResult<LuaValue
     }
 }
 
+// Native memory, or a Luau buffer whose fixed-size storage never moves and can be addressed
+// directly while the buffer is referenced
+fn memory_region(value: &LuaValue) -> LuaResult<(*mut c_void, Option<usize>)> {
+    match value {
+        LuaValue::LightUserData(ptr) => Ok((ptr.0, None)),
+        LuaValue::Buffer(buffer) => Ok((value.to_pointer() as *mut c_void, Some(buffer.len()))),
+        other => Err(LuaError::runtime(format!(
+            "expected pointer or buffer, got {other:?}"
+        ))),
+    }
+}
+
+fn checked_region(
+    dest: &LuaValue,
+    source: Option<&LuaValue>,
+    len: u64,
+) -> LuaResult<(*mut c_void, *const c_void, size_t)> {
+    let len = size_t::try_from(len)
+        .map_err(|_| LuaError::runtime("memory length does not fit size_t".to_string()))?;
+
+    let (dest_ptr, dest_len) = memory_region(dest)?;
+    let (source_ptr, source_len) = match source {
+        Some(source) => memory_region(source)?,
+        None => (ptr::null_mut(), None),
+    };
+
+    if len > 0 {
+        if dest_ptr.is_null() {
+            return Err(LuaError::runtime(
+                "attempt to write to null pointer".to_string(),
+            ));
+        }
+        if source.is_some() && source_ptr.is_null() {
+            return Err(LuaError::runtime(
+                "attempt to read from null pointer".to_string(),
+            ));
+        }
+    }
+    if dest_len.is_some_and(|size| len > size) || source_len.is_some_and(|size| len > size) {
+        return Err(LuaError::runtime(format!(
+            "memory length {len} exceeds buffer size"
+        )));
+    }
+
+    Ok((dest_ptr, source_ptr as *const c_void, len))
+}
+
+// Arrays are read and written in one native call for the whole range, instead of one
+// loadScalar/storeScalar round trip per element
+fn array_elements(
+    ptr_value: LuaLightUserData,
+    code: &str,
+    count: u64,
+) -> LuaResult<(TypeCode, usize, usize)> {
+    let ty = TypeCode::from_code(&types::normalize_code(code))?;
+    let stride = ty.size_of();
+    if stride == 0 {
+        return Err(LuaError::runtime(
+            "array elements cannot have type 'void'".to_string(),
+        ));
+    }
+    let count = usize::try_from(count)
+        .ok()
+        .filter(|count| count.checked_mul(stride).is_some())
+        .ok_or_else(|| LuaError::runtime("array length does not fit usize".to_string()))?;
+    if count > 0 && ptr_value.0.is_null() {
+        return Err(LuaError::runtime(
+            "attempt to access array through null pointer".to_string(),
+        ));
+    }
+    Ok((ty, stride, count))
+}
+
+// `const char*` slots for every string of `strings` and a null one after them, followed in the
+// same block by the strings themselves; borrowed arrays point into the Luau strings instead,
+// returned as the owner keeping them alive. Gives the block, its size and the string count.
+fn pack_string_array(
+    lua: &Lua,
+    strings: &LuaTable,
+    borrowed: bool,
+) -> LuaResult<(LuaLightUserData, usize, usize, LuaValue)> {
+    let count = strings.raw_len();
+    let mut values = Vec::with_capacity(count);
+    let mut bytes = 0usize;
+    for index in 1..=count {
+        let LuaValue::String(value) = strings.raw_get::<LuaValue>(index)? else {
+            return Err(LuaError::runtime(format!(
+                "string array entry {index} is not a string"
+            )));
+        };
+        let length = value.as_bytes().len();
+        if value.as_bytes().contains(&0) {
+            return Err(LuaError::runtime(format!(
+                "string array entry {index} contains NUL byte"
+            )));
+        }
+        bytes = bytes.saturating_add(length + 1);
+        values.push(value);
+    }
+
+    // Made before the block, so nothing can fail once it is allocated
+    let owner = if borrowed {
+        LuaValue::Table(lua.create_sequence_from(values.iter().cloned())?)
+    } else {
+        LuaValue::Nil
+    };
+
+    let slots = (count + 1) * std::mem::size_of::<*const c_char>();
+    let size = if borrowed {
+        slots
+    } else {
+        slots.saturating_add(bytes)
+    };
+    let block = arena::pool_alloc(size)?;
+    let table = block as *mut *const c_char;
+    let mut text = unsafe { (block as *mut u8).add(slots) };
+    for (index, value) in values.iter().enumerate() {
+        let value = value.as_bytes();
+        unsafe {
+            if borrowed {
+                *table.add(index) = value.as_ptr() as *const c_char;
+            } else {
+                ptr::copy_nonoverlapping(value.as_ptr(), text, value.len());
+                // The pool hands out zeroed blocks, so the terminator is already there
+                *table.add(index) = text as *const c_char;
+                text = text.add(value.len() + 1);
+            }
+        }
+    }
+    if !borrowed {
+        stats::record_written(bytes);
+    }
+
+    Ok((LuaLightUserData(block), size, count, owner))
+}
+
 pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
     let table = lua.create_table()?;
 
@@ -513,52 +625,6 @@ pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
     let abi_info = build_abi_info(lua)?;
     table.set("abiInfo", abi_info)?;
 
-    let dlopen_fn = lua.create_function(|_, path: Option<String>| {
-        let c_path =
-            match path {
-                Some(ref p) => Some(CString::new(p.as_str()).map_err(|_| {
-                    LuaError::runtime(format!("Library path contains NUL byte: {p}"))
-                })?),
-                None => None,
-            };
-
-        let ptr =
-            unsafe { luneffi_dlopen(c_path.as_ref().map_or(std::ptr::null(), |s| s.as_ptr())) };
-
-        if ptr.is_null() {
-            let err = last_error().unwrap_or_else(|| "Failed to load library".to_string());
-            return Err(LuaError::runtime(err));
-        }
-
-        Ok(LuaLightUserData(ptr))
-    })?;
-    table.set("dlopen", dlopen_fn)?;
-
-    let dlsym_fn = lua.create_function(|lua, (handle, name): (LuaLightUserData, String)| {
-        let c_name = CString::new(name.as_str())
-            .map_err(|_| LuaError::runtime(format!("Symbol name contains NUL byte: {name}")))?;
-        let ptr = unsafe { luneffi_dlsym(handle.0, c_name.as_ptr()) };
-        if ptr.is_null() {
-            let err = last_error().unwrap_or_else(|| "symbol lookup failed".to_string());
-            let err_value = LuaValue::String(lua.create_string(err)?);
-            Ok(LuaMultiValue::from_vec(vec![LuaValue::Nil, err_value]))
-        } else {
-            let symbol = LuaValue::LightUserData(LuaLightUserData(ptr));
-            Ok(LuaMultiValue::from_vec(vec![symbol]))
-        }
-    })?;
-    table.set("dlsym", dlsym_fn)?;
-
-    let dlclose_fn = lua.create_function(|_, handle: LuaLightUserData| {
-        let rc = unsafe { luneffi_dlclose(handle.0) };
-        if rc != 0 {
-            let err = last_error().unwrap_or_else(|| "dlclose failed".to_string());
-            return Err(LuaError::runtime(err));
-        }
-        Ok(())
-    })?;
-    table.set("dlclose", dlclose_fn)?;
-
     let errno_get_fn = lua.create_function(|_, ()| Ok(i64::from(get_errno())))?;
     table.set("getErrno", errno_get_fn)?;
 
@@ -574,7 +640,7 @@ pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
     })?;
     table.set("setErrno", errno_set_fn)?;
 
-    let alloc_fn = lua.create_function(|_, size: u64| {
+    let alloc_fn = lua.create_function(|lua, size: u64| {
         let bytes = usize::try_from(size)
             .map_err(|_| LuaError::runtime("allocation size does not fit usize".to_string()))?;
         let ptr = unsafe { calloc(1, bytes as size_t) };
@@ -583,6 +649,10 @@ pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
                 "failed to allocate {bytes} byte(s)"
             )));
         }
+        // `free` is not told the size, so the bytes only pace the collector; `ffi.gc` with a
+        // size accounts memory that lives as long as a cdata
+        memory::pace(lua, bytes)?;
+        memory::track(lua, ptr, "alloc", bytes);
         Ok(LuaLightUserData(ptr))
     })?;
     table.set("alloc", alloc_fn)?;
@@ -590,6 +660,7 @@ pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
     let free_fn = lua.create_function(|_, ptr_value: LuaLightUserData| {
         unsafe {
             if !ptr_value.0.is_null() {
+                memory::untrack(ptr_value.0);
                 free(ptr_value.0);
             }
         }
@@ -614,27 +685,33 @@ pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
     })?;
     table.set("loadScalar", load_fn)?;
 
-    let read_string_fn =
-        lua.create_function(|lua, (ptr_value, len): (LuaLightUserData, Option<u64>)| {
+    // `offset` bytes past the pointer, for records of a buffer handed over as a base and offsets
+    let read_string_fn = lua.create_function(
+        |lua, (ptr_value, len, offset): (LuaLightUserData, Option<u64>, Option<u64>)| {
             if ptr_value.0.is_null() {
                 return Err(LuaError::runtime(
                     "attempt to read string from null pointer".to_string(),
                 ));
             }
+            let offset = usize::try_from(offset.unwrap_or(0))
+                .map_err(|_| LuaError::runtime("string offset does not fit usize".to_string()))?;
+            let start = (ptr_value.0 as *const u8).wrapping_add(offset);
 
             let bytes = match len {
                 Some(count) => {
                     let count = usize::try_from(count).map_err(|_| {
                         LuaError::runtime("string length does not fit usize".to_string())
                     })?;
-                    unsafe { slice::from_raw_parts(ptr_value.0 as *const u8, count) }
+                    unsafe { slice::from_raw_parts(start, count) }
                 }
-                None => unsafe { CStr::from_ptr(ptr_value.0 as *const c_char).to_bytes() },
+                None => unsafe { CStr::from_ptr(start as *const c_char).to_bytes() },
             };
 
+            stats::record_read(bytes.len());
             let lua_string = lua.create_string(bytes)?;
             Ok(LuaValue::String(lua_string))
-        })?;
+        },
+    )?;
     table.set("readString", read_string_fn)?;
 
     let write_bytes_fn = lua.create_function(
@@ -647,6 +724,7 @@ pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
 
             let bytes = data.as_bytes();
             let length = bytes.len();
+            stats::record_written(length);
 
             unsafe {
                 memcpy(dest.0, bytes.as_ptr() as *const c_void, length as size_t);
@@ -662,14 +740,165 @@ pub fn create(lua: &Lua) -> LuaResult<LuaTable> {
     )?;
     table.set("writeBytes", write_bytes_fn)?;
 
+    let string_array_fn =
+        lua.create_function(|lua, (strings, borrowed): (LuaTable, Option<bool>)| {
+            pack_string_array(lua, &strings, borrowed.unwrap_or(false))
+        })?;
+    table.set("stringArray", string_array_fn)?;
+
+    let copy_fn = lua.create_function(|_, (dest, source, len): (LuaValue, LuaValue, u64)| {
+        let (dest, source, len) = checked_region(&dest, Some(&source), len)?;
+        unsafe {
+            memcpy(dest, source, len);
+        }
+        Ok(())
+    })?;
+    table.set("copy", copy_fn)?;
+
+    let move_fn = lua.create_function(|_, (dest, source, len): (LuaValue, LuaValue, u64)| {
+        let (dest, source, len) = checked_region(&dest, Some(&source), len)?;
+        unsafe {
+            memmove(dest, source, len);
+        }
+        Ok(())
+    })?;
+    table.set("move", move_fn)?;
+
+    let fill_fn = lua.create_function(|_, (dest, len, byte): (LuaValue, u64, Option<u8>)| {
+        let (dest, _, len) = checked_region(&dest, None, len)?;
+        unsafe {
+            memset(dest, c_int::from(byte.unwrap_or(0)), len);
+        }
+        Ok(())
+    })?;
+    table.set("fill", fill_fn)?;
+
+    let read_buffer_fn =
+        lua.create_function(|lua, (ptr_value, len): (LuaLightUserData, u64)| {
+            let len = usize::try_from(len)
+                .map_err(|_| LuaError::runtime("buffer length does not fit usize".to_string()))?;
+            if len == 0 {
+                return lua.create_buffer(b"");
+            }
+            if ptr_value.0.is_null() {
+                return Err(LuaError::runtime(
+                    "attempt to read buffer from null pointer".to_string(),
+                ));
+            }
+            let bytes = unsafe { slice::from_raw_parts(ptr_value.0 as *const u8, len) };
+            lua.create_buffer(bytes)
+        })?;
+    table.set("readBuffer", read_buffer_fn)?;
+
+    let read_array_fn = lua.create_function(
+        |lua, (ptr_value, code, count): (LuaLightUserData, String, u64)| {
+            let (ty, stride, count) = array_elements(ptr_value, &code, count)?;
+            let values = lua.create_table_with_capacity(count, 0)?;
+            let base = ptr_value.0 as *mut u8;
+            for index in 0..count {
+                let element = unsafe { base.add(index * stride) } as *mut c_void;
+                values.raw_set(index + 1, load_scalar(lua, element, ty)?)?;
+            }
+            Ok(values)
+        },
+    )?;
+    table.set("readArray", read_array_fn)?;
+
+    let write_array_fn = lua.create_function(
+        |_, (ptr_value, code, values, count): (LuaLightUserData, String, LuaTable, Option<u64>)| {
+            let count = count.unwrap_or(values.raw_len() as u64);
+            let (ty, stride, count) = array_elements(ptr_value, &code, count)?;
+            let base = ptr_value.0 as *mut u8;
+            for index in 0..count {
+                let value = values.raw_get::<LuaValue>(index + 1)?;
+                let element = unsafe { base.add(index * stride) } as *mut c_void;
+                store_scalar(element, ty, &value)?;
+            }
+            Ok(())
+        },
+    )?;
+    table.set("writeArray", write_array_fn)?;
+
+    let ptr_add_fn = lua.create_function(|_, (base, offset): (LuaLightUserData, i64)| {
+        let offset = isize::try_from(offset)
+            .map_err(|_| LuaError::runtime("pointer offset does not fit isize".to_string()))?;
+        if (base.0 as usize).checked_add_signed(offset).is_none() {
+            return Err(LuaError::runtime(
+                "pointer arithmetic overflowed the address space".to_string(),
+            ));
+        }
+        Ok(LuaLightUserData(base.0.wrapping_byte_offset(offset)))
+    })?;
+    table.set("ptrAdd", ptr_add_fn)?;
+
+    let ptr_diff_fn = lua.create_function(|_, (a, b): (LuaLightUserData, LuaLightUserData)| {
+        Ok((a.0 as isize).wrapping_sub(b.0 as isize) as i64)
+    })?;
+    table.set("ptrDiff", ptr_diff_fn)?;
+
+    let ptr_to_int_fn = lua.create_function(|_, ptr_value: LuaLightUserData| {
+        let address = ptr_value.0 as usize as u64;
+        if address <= i64::MAX as u64 {
+            Ok(LuaValue::Integer(address as i64))
+        } else {
+            Ok(LuaValue::Number(address as f64))
+        }
+    })?;
+    table.set("ptrToInt", ptr_to_int_fn)?;
+
+    let prepare_fn = lua.create_function(|_, (signature, name): (LuaTable, Option<String>)| {
+        Ok(call::PreparedSignature::from_table(signature)?.with_name(name))
+    })?;
+    table.set("prepare", prepare_fn)?;
+
     let call_fn = lua.create_function(
-        |lua, (func, signature, args): (LuaLightUserData, LuaTable, LuaTable)| {
-            call::call(lua, func, signature, args)
+        |lua, (func, signature, args): (LuaLightUserData, LuaValue, LuaTable)| match signature {
+            LuaValue::Table(signature) => call::call(lua, func, signature, args),
+            LuaValue::UserData(prepared) => {
+                let prepared = prepared.borrow::<call::PreparedSignature>()?;
+                call::call_prepared(lua, func, &prepared, args)
+            }
+            other => Err(LuaError::runtime(format!(
+                "expected function signature table or prepared signature, got {other:?}"
+            ))),
         },
     )?;
     table.set("call", call_fn)?;
 
+    let callv_fn = lua.create_function(
+        |lua, (func, prepared, args): (LuaLightUserData, LuaAnyUserData, LuaMultiValue)| {
+            let prepared = prepared.borrow::<call::PreparedSignature>()?;
+            call::callv(lua, func, &prepared, args)
+        },
+    )?;
+    table.set("callv", callv_fn)?;
+
+    // errno is read before anything else runs on this thread after the call, in the same crossing
+    let callv_errno_fn = lua.create_function(
+        |lua, (func, prepared, args): (LuaLightUserData, LuaAnyUserData, LuaMultiValue)| {
+            let prepared = prepared.borrow::<call::PreparedSignature>()?;
+            let result = call::callv(lua, func, &prepared, args)?;
+            Ok((result, i64::from(get_errno())))
+        },
+    )?;
+    table.set("callvErrno", callv_errno_fn)?;
+
+    let callv_async_fn = lua.create_async_function(
+        |lua, (func, prepared, args): (LuaLightUserData, LuaAnyUserData, LuaMultiValue)| {
+            call::callv_async(lua, func, prepared, args)
+        },
+    )?;
+    table.set("callvAsync", callv_async_fn)?;
+
     callback::register(lua, &table)?;
+    arena::register(lua, &table)?;
+    cdata::register(lua, &table)?;
+    cdef::register(lua, &table)?;
+    int64::register(lua, &table)?;
+    library::register(lua, &table)?;
+    memory::register(lua, &table)?;
+    stats::register(lua, &table)?;
+    trace::register(lua, &table)?;
 
     Ok(table)
 }
@@ -0,0 +1,222 @@
+//! Structs passed and returned by value.
+//!
+//! The Luau side lays records out with `ensure_layout` before a signature is prepared, so the
+//! descriptor tables already carry `size`, `align` and each field's `offset`. This module reads
+//! that layout once, builds the matching libffi struct type from it and writes Lua table
+//! initializers into argument storage.
+
+use std::ffi::c_void;
+use std::ptr;
+
+use libffi::middle::Type;
+use mlua::prelude::*;
+
+use crate::cdata;
+use crate::native::store_scalar;
+use crate::signature::scalar_type;
+use crate::types::{self, TypeCode};
+
+#[derive(Debug)]
+enum FieldType {
+    Scalar(TypeCode),
+    Record(RecordLayout),
+    Array {
+        element: Box<FieldType>,
+        length: usize,
+        stride: usize,
+    },
+}
+
+#[derive(Debug)]
+struct RecordField {
+    name: String,
+    offset: usize,
+    ty: FieldType,
+}
+
+#[derive(Debug)]
+pub(crate) struct RecordLayout {
+    name: String,
+    size: usize,
+    fields: Vec<RecordField>,
+}
+
+impl FieldType {
+    fn from_descriptor(descriptor: &LuaTable) -> LuaResult<Self> {
+        let kind: Option<String> = descriptor.get("kind")?;
+        match kind.as_deref() {
+            Some("struct") => Ok(FieldType::Record(RecordLayout::from_descriptor(
+                descriptor,
+            )?)),
+            Some("union") => Err(LuaError::runtime(
+                "TODO(@lune/ffi/call): unions cannot be passed by value yet".to_string(),
+            )),
+            Some("enum") => Ok(FieldType::Scalar(TypeCode::Int32)),
+            Some("array") => {
+                let length: Option<usize> = descriptor.get("length")?;
+                let length = length.ok_or_else(|| {
+                    LuaError::runtime("unsized array cannot be part of a struct value".to_string())
+                })?;
+                let base: LuaTable = descriptor.get("base")?;
+                let element = FieldType::from_descriptor(&base)?;
+                let stride = element.size();
+                Ok(FieldType::Array {
+                    element: Box::new(element),
+                    length,
+                    stride,
+                })
+            }
+            _ => {
+                let code: String = descriptor.get("code")?;
+                Ok(FieldType::Scalar(TypeCode::from_code(
+                    &types::normalize_code(&code),
+                )?))
+            }
+        }
+    }
+
+    fn size(&self) -> usize {
+        match self {
+            FieldType::Scalar(code) => code.size_of(),
+            FieldType::Record(layout) => layout.size,
+            FieldType::Array { length, stride, .. } => length * stride,
+        }
+    }
+
+    // libffi has no array types, so arrays contribute one element per entry, as C lays them out
+    fn push_libffi_types(&self, out: &mut Vec<Type>) {
+        match self {
+            FieldType::Scalar(code) => out.push(scalar_type(*code)),
+            FieldType::Record(layout) => out.push(layout.to_libffi_type()),
+            FieldType::Array {
+                element, length, ..
+            } => {
+                for _ in 0..*length {
+                    element.push_libffi_types(out);
+                }
+            }
+        }
+    }
+
+    /// # Safety
+    /// `dest` must be valid for writes of `self.size()` bytes.
+    unsafe fn write(&self, dest: *mut u8, value: &LuaValue) -> LuaResult<()> {
+        match (self, value) {
+            (_, LuaValue::Nil) => Ok(()),
+            (FieldType::Scalar(code), value) => store_scalar(dest as *mut c_void, *code, value),
+            (_, LuaValue::UserData(_)) => {
+                let source = cdata_storage(value)?.ok_or_else(|| {
+                    LuaError::runtime(format!("cannot initialize aggregate field from {value:?}"))
+                })?;
+                unsafe { ptr::copy_nonoverlapping(source, dest, self.size()) };
+                Ok(())
+            }
+            (_, LuaValue::Table(table)) => match self {
+                FieldType::Record(layout) => unsafe { layout.write_table(dest, table) },
+                FieldType::Array {
+                    element,
+                    length,
+                    stride,
+                } => {
+                    for index in 0..*length {
+                        let item = table.raw_get::<LuaValue>(index + 1)?;
+                        unsafe { element.write(dest.add(index * stride), &item)? };
+                    }
+                    Ok(())
+                }
+                FieldType::Scalar(_) => unreachable!(),
+            },
+            (_, other) => Err(LuaError::runtime(format!(
+                "cannot initialize aggregate field from {other:?}"
+            ))),
+        }
+    }
+}
+
+impl RecordLayout {
+    pub(crate) fn from_descriptor(descriptor: &LuaTable) -> LuaResult<Self> {
+        let name: String = descriptor
+            .get::<Option<String>>("name")?
+            .unwrap_or_else(|| "struct".to_string());
+        let size: Option<usize> = descriptor.get("size")?;
+        let size = size.ok_or_else(|| {
+            LuaError::runtime(format!("struct '{name}' has no layout to pass it by value"))
+        })?;
+
+        let mut fields = Vec::new();
+        if let Some(fields_table) = descriptor.get::<Option<LuaTable>>("fields")? {
+            for field in fields_table.sequence_values::<LuaTable>() {
+                let field = field?;
+                let field_name: String = field.get("name")?;
+                if field.get::<Option<u32>>("bitWidth")?.is_some() {
+                    return Err(LuaError::runtime(format!(
+                        "TODO(@lune/ffi/call): struct '{name}' has bitfields and cannot be passed by value yet"
+                    )));
+                }
+                let offset: usize = field.get("offset")?;
+                let ctype: LuaTable = field.get("ctype")?;
+                fields.push(RecordField {
+                    name: field_name,
+                    offset,
+                    ty: FieldType::from_descriptor(&ctype)?,
+                });
+            }
+        }
+
+        if fields.is_empty() || size == 0 {
+            return Err(LuaError::runtime(format!(
+                "empty struct '{name}' cannot be passed by value"
+            )));
+        }
+
+        Ok(Self { name, size, fields })
+    }
+
+    pub(crate) fn size(&self) -> usize {
+        self.size
+    }
+
+    pub(crate) fn to_libffi_type(&self) -> Type {
+        let mut elements = Vec::with_capacity(self.fields.len());
+        for field in &self.fields {
+            field.ty.push_libffi_types(&mut elements);
+        }
+        Type::structure(elements)
+    }
+
+    /// Fills `dest` from a table initializer: fields by name, or positionally for the fields
+    /// not named, like `ffi.new` does.
+    ///
+    /// # Safety
+    /// `dest` must be valid for writes of `self.size()` bytes and already zeroed.
+    pub(crate) unsafe fn write_table(&self, dest: *mut u8, table: &LuaTable) -> LuaResult<()> {
+        let mut positional = 1;
+        for field in &self.fields {
+            let mut value = table.raw_get::<LuaValue>(field.name.as_str())?;
+            if value.is_nil() {
+                value = table.raw_get::<LuaValue>(positional)?;
+                if !value.is_nil() {
+                    positional += 1;
+                }
+            }
+            unsafe { field.ty.write(dest.add(field.offset), &value) }.map_err(|err| {
+                LuaError::runtime(format!(
+                    "invalid value for field '{}' of '{}': {err}",
+                    field.name, self.name
+                ))
+            })?;
+        }
+        Ok(())
+    }
+}
+
+// The storage of cdata (or the target of a cdata pointer), if `value` is cdata
+pub(crate) fn cdata_storage(value: &LuaValue) -> LuaResult<Option<*const u8>> {
+    match cdata::cdata_info(value) {
+        Some((ptr, _)) if ptr.is_null() => Err(LuaError::runtime(
+            "cannot read struct value through null cdata".to_string(),
+        )),
+        Some((ptr, _)) => Ok(Some(ptr as *const u8)),
+        None => Ok(None),
+    }
+}
@@ -1,29 +1,55 @@
+use std::rc::Rc;
+
 use cfg_if::cfg_if;
 use libffi::middle::{self, Cif, Type};
 use mlua::prelude::*;
 
+use crate::record::RecordLayout;
+use crate::stats;
 use crate::types::{self, TypeCode};
 
 #[derive(Clone, Debug)]
 pub struct CType {
+    // `Void` for records, which callers dispatch on through `record()` first
     pub(crate) code: TypeCode,
+    pub(crate) record: Option<Rc<RecordLayout>>,
 }
 
 impl CType {
+    pub(crate) fn scalar(code: TypeCode) -> Self {
+        Self { code, record: None }
+    }
+
     pub(crate) fn from_lua(value: LuaValue) -> LuaResult<Self> {
         match value {
             LuaValue::String(code) => {
                 let normalized = types::normalize_code(code.to_str()?.as_ref());
                 let ty = TypeCode::from_code(&normalized)?;
-                Ok(Self { code: ty })
+                Ok(Self::scalar(ty))
             }
             LuaValue::Table(table) => {
+                match table.get::<Option<String>>("kind")?.as_deref() {
+                    Some("struct") => {
+                        let layout = RecordLayout::from_descriptor(&table)?;
+                        return Ok(Self {
+                            code: TypeCode::Void,
+                            record: Some(Rc::new(layout)),
+                        });
+                    }
+                    Some("union") => {
+                        return Err(LuaError::runtime(
+                            "TODO(@lune/ffi/call): unions cannot be passed by value yet"
+                                .to_string(),
+                        ));
+                    }
+                    _ => {}
+                }
                 let code: String = table.get("code").map_err(|_| {
                     LuaError::runtime("Type descriptor missing 'code' field".to_string())
                 })?;
                 let normalized = types::normalize_code(&code);
                 let ty = TypeCode::from_code(&normalized)?;
-                Ok(Self { code: ty })
+                Ok(Self::scalar(ty))
             }
             other => Err(LuaError::runtime(format!(
                 "Invalid type descriptor (expected table or string, got {other:?})"
@@ -32,39 +58,50 @@ impl CType {
     }
 
     pub(crate) fn to_libffi_type(&self) -> Type {
-        match self.code {
-            TypeCode::Void => Type::void(),
-            TypeCode::Int8 => Type::i8(),
-            TypeCode::UInt8 => Type::u8(),
-            TypeCode::Int16 => Type::i16(),
-            TypeCode::UInt16 => Type::u16(),
-            TypeCode::Int32 => Type::i32(),
-            TypeCode::UInt32 => Type::u32(),
-            TypeCode::Int64 => Type::i64(),
-            TypeCode::UInt64 => Type::u64(),
-            TypeCode::IntPtr => {
-                if cfg!(target_pointer_width = "64") {
-                    Type::i64()
-                } else {
-                    Type::i32()
-                }
-            }
-            TypeCode::UIntPtr => {
-                if cfg!(target_pointer_width = "64") {
-                    Type::u64()
-                } else {
-                    Type::u32()
-                }
-            }
-            TypeCode::Float32 => Type::f32(),
-            TypeCode::Float64 => Type::f64(),
-            TypeCode::Pointer => Type::pointer(),
+        match &self.record {
+            Some(layout) => layout.to_libffi_type(),
+            None => scalar_type(self.code),
         }
     }
 
     pub(crate) fn code(&self) -> TypeCode {
         self.code
     }
+
+    pub(crate) fn record(&self) -> Option<&RecordLayout> {
+        self.record.as_deref()
+    }
+}
+
+pub(crate) fn scalar_type(code: TypeCode) -> Type {
+    match code {
+        TypeCode::Void => Type::void(),
+        TypeCode::Int8 => Type::i8(),
+        TypeCode::UInt8 => Type::u8(),
+        TypeCode::Int16 => Type::i16(),
+        TypeCode::UInt16 => Type::u16(),
+        TypeCode::Int32 => Type::i32(),
+        TypeCode::UInt32 => Type::u32(),
+        TypeCode::Int64 => Type::i64(),
+        TypeCode::UInt64 => Type::u64(),
+        TypeCode::IntPtr => {
+            if cfg!(target_pointer_width = "64") {
+                Type::i64()
+            } else {
+                Type::i32()
+            }
+        }
+        TypeCode::UIntPtr => {
+            if cfg!(target_pointer_width = "64") {
+                Type::u64()
+            } else {
+                Type::u32()
+            }
+        }
+        TypeCode::Float32 => Type::f32(),
+        TypeCode::Float64 => Type::f64(),
+        TypeCode::Pointer => Type::pointer(),
+    }
 }
 
 #[derive(Clone, Copy, Debug)]
@@ -194,6 +231,10 @@ impl Signature {
         &self.result
     }
 
+    pub(crate) fn has_records(&self) -> bool {
+        self.result.record().is_some() || self.args.iter().any(|ty| ty.record().is_some())
+    }
+
     pub(crate) fn is_variadic(&self) -> bool {
         self.variadic
     }
@@ -207,6 +248,7 @@ impl Signature {
     }
 
     pub(crate) fn build_cif(&self, arg_types: &[Type]) -> Cif {
+        stats::record_cif_build();
         let result_type = self.result.to_libffi_type();
 
         let mut cif = if self.variadic {
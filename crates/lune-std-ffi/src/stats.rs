@@ -0,0 +1,286 @@
+//! Opt-in profiling of calls across the FFI boundary.
+//!
+//! While enabled, every call through a prepared symbol counts the time spent converting its
+//! arguments apart from the time spent in the native function, the latter also into a latency
+//! histogram, and callback invocations and bytes copied by `readString`/`writeBytes` are
+//! counted. Counters belong to the thread, as do the Lua states calling through them; when
+//! disabled, recording costs a thread-local flag check. Cif preparations are counted always,
+//! being rare next to the calls, so benchmarks can see them without the cost of profiling.
+
+use std::cell::{Cell, RefCell};
+use std::collections::HashMap;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use mlua::prelude::*;
+
+// Log-linear buckets over nanoseconds: one bucket per value below SUB_BUCKETS, then every power
+// of two split into SUB_BUCKETS buckets, so a value is reported at most 1/8 too high
+const SUB_BUCKET_BITS: u32 = 3;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+// 2^40 ns, about 18 minutes; longer calls share the last bucket
+const MAX_EXPONENT: u32 = 40;
+const BUCKETS: usize = SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) as usize * SUB_BUCKETS;
+
+struct Histogram {
+    counts: Box<[u64; BUCKETS]>,
+}
+
+impl Histogram {
+    fn new() -> Self {
+        Self {
+            counts: Box::new([0; BUCKETS]),
+        }
+    }
+
+    fn bucket(nanos: u64) -> usize {
+        if nanos < SUB_BUCKETS as u64 {
+            return nanos as usize;
+        }
+        let exponent = 63 - nanos.leading_zeros();
+        if exponent >= MAX_EXPONENT {
+            return BUCKETS - 1;
+        }
+        let sub_bucket = (nanos >> (exponent - SUB_BUCKET_BITS)) as usize & (SUB_BUCKETS - 1);
+        SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) as usize * SUB_BUCKETS + sub_bucket
+    }
+
+    // Largest value counted in the bucket
+    fn upper_bound(index: usize) -> u64 {
+        if index < SUB_BUCKETS {
+            return index as u64;
+        }
+        let shift = ((index - SUB_BUCKETS) / SUB_BUCKETS) as u32;
+        let sub_bucket = ((index - SUB_BUCKETS) % SUB_BUCKETS) as u64;
+        ((SUB_BUCKETS as u64 + sub_bucket) << shift) + (1 << shift) - 1
+    }
+
+    fn record(&mut self, nanos: u64) {
+        self.counts[Self::bucket(nanos)] += 1;
+    }
+
+    fn percentile(&self, percentile: f64) -> u64 {
+        let total: u64 = self.counts.iter().sum();
+        if total == 0 {
+            return 0;
+        }
+        let rank = ((percentile / 100.0 * total as f64).ceil() as u64).clamp(1, total);
+        let mut seen = 0;
+        for (index, count) in self.counts.iter().enumerate() {
+            seen += count;
+            if seen >= rank {
+                return Self::upper_bound(index);
+            }
+        }
+        Self::upper_bound(BUCKETS - 1)
+    }
+}
+
+struct SymbolStats {
+    calls: u64,
+    marshal: Duration,
+    call: Duration,
+    latency: Histogram,
+}
+
+#[derive(Default)]
+struct Stats {
+    symbols: HashMap<Arc<str>, SymbolStats>,
+    callbacks: u64,
+    bytes_read: u64,
+    bytes_written: u64,
+}
+
+thread_local! {
+    static ENABLED: Cell<bool> = const { Cell::new(false) };
+    static STATS: RefCell<Stats> = RefCell::new(Stats::default());
+    static CIF_BUILDS: Cell<u64> = const { Cell::new(0) };
+}
+
+pub(crate) fn enabled() -> bool {
+    ENABLED.with(Cell::get)
+}
+
+/// Times one call while profiling is on: `marshalled` marks the end of the argument conversion
+/// and `finish` records both phases under the symbol's name.
+pub(crate) struct CallTimer {
+    started: Instant,
+    marshalled: Option<Instant>,
+}
+
+impl CallTimer {
+    pub(crate) fn start() -> Option<Self> {
+        enabled().then(|| Self {
+            started: Instant::now(),
+            marshalled: None,
+        })
+    }
+
+    pub(crate) fn marshalled(&mut self) {
+        self.marshalled = Some(Instant::now());
+    }
+
+    pub(crate) fn finish(self, name: &Arc<str>) {
+        let marshalled = self.marshalled.unwrap_or(self.started);
+        record_call(name, marshalled - self.started, marshalled.elapsed());
+    }
+}
+
+pub(crate) fn record_call(name: &Arc<str>, marshal: Duration, call: Duration) {
+    STATS.with(|stats| {
+        // Cloning the name only bumps its count, the key is allocated once per symbol
+        let mut stats = stats.borrow_mut();
+        let entry = stats
+            .symbols
+            .entry(Arc::clone(name))
+            .or_insert_with(|| SymbolStats {
+                calls: 0,
+                marshal: Duration::ZERO,
+                call: Duration::ZERO,
+                latency: Histogram::new(),
+            });
+        entry.calls += 1;
+        entry.marshal += marshal;
+        entry.call += call;
+        entry.latency.record(nanos(call));
+    });
+}
+
+pub(crate) fn record_callback() {
+    if enabled() {
+        STATS.with(|stats| stats.borrow_mut().callbacks += 1);
+    }
+}
+
+pub(crate) fn record_read(bytes: usize) {
+    if enabled() {
+        STATS.with(|stats| stats.borrow_mut().bytes_read += bytes as u64);
+    }
+}
+
+pub(crate) fn record_written(bytes: usize) {
+    if enabled() {
+        STATS.with(|stats| stats.borrow_mut().bytes_written += bytes as u64);
+    }
+}
+
+pub(crate) fn record_cif_build() {
+    CIF_BUILDS.with(|builds| builds.set(builds.get() + 1));
+}
+
+fn nanos(duration: Duration) -> u64 {
+    u64::try_from(duration.as_nanos()).unwrap_or(u64::MAX)
+}
+
+// `{ enabled, callbacks, bytesRead, bytesWritten, symbols = { [name] = { calls, marshalNs,
+// callNs, p50Ns, p90Ns, p99Ns, maxNs } } }`
+fn snapshot(lua: &Lua) -> LuaResult<LuaTable> {
+    STATS.with(|stats| {
+        let stats = stats.borrow();
+        let symbols = lua.create_table_with_capacity(0, stats.symbols.len())?;
+        for (name, entry) in &stats.symbols {
+            let symbol = lua.create_table_with_capacity(0, 7)?;
+            symbol.raw_set("calls", entry.calls)?;
+            symbol.raw_set("marshalNs", nanos(entry.marshal))?;
+            symbol.raw_set("callNs", nanos(entry.call))?;
+            symbol.raw_set("p50Ns", entry.latency.percentile(50.0))?;
+            symbol.raw_set("p90Ns", entry.latency.percentile(90.0))?;
+            symbol.raw_set("p99Ns", entry.latency.percentile(99.0))?;
+            symbol.raw_set("maxNs", entry.latency.percentile(100.0))?;
+            symbols.raw_set(&**name, symbol)?;
+        }
+
+        let table = lua.create_table_with_capacity(0, 5)?;
+        table.raw_set("enabled", enabled())?;
+        table.raw_set("callbacks", stats.callbacks)?;
+        table.raw_set("bytesRead", stats.bytes_read)?;
+        table.raw_set("bytesWritten", stats.bytes_written)?;
+        table.raw_set("symbols", symbols)?;
+        Ok(table)
+    })
+}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    let stats_fn = lua.create_function(|lua, ()| snapshot(lua))?;
+    exports.set("stats", stats_fn)?;
+
+    // Clears the counters, and turns profiling on or off if `enable` is given
+    let reset_stats_fn = lua.create_function(|_, enable: Option<bool>| {
+        STATS.with(|stats| *stats.borrow_mut() = Stats::default());
+        if let Some(enable) = enable {
+            ENABLED.with(|flag| flag.set(enable));
+        }
+        Ok(())
+    })?;
+    exports.set("resetStats", reset_stats_fn)?;
+
+    let cif_builds_fn = lua.create_function(|_, ()| Ok(CIF_BUILDS.with(Cell::get)))?;
+    exports.set("cifBuilds", cif_builds_fn)?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn histogram_buckets_bound_their_values() {
+        for nanos in [
+            0,
+            1,
+            7,
+            8,
+            9,
+            15,
+            16,
+            17,
+            1000,
+            123_456,
+            1 << 39,
+            (1 << 40) - 1,
+        ] {
+            let index = Histogram::bucket(nanos);
+            assert!(Histogram::upper_bound(index) >= nanos, "{nanos}");
+            if index > 0 {
+                assert!(Histogram::upper_bound(index - 1) < nanos, "{nanos}");
+            }
+        }
+        assert_eq!(Histogram::bucket(u64::MAX), BUCKETS - 1);
+    }
+
+    #[test]
+    fn calls_are_only_counted_while_enabled() -> LuaResult<()> {
+        let lua = Lua::new();
+        let exports = lua.create_table()?;
+        register(&lua, &exports)?;
+        let reset: LuaFunction = exports.get("resetStats")?;
+        let name: Arc<str> = Arc::from("stats_test_symbol");
+
+        reset.call::<()>(false)?;
+        assert!(CallTimer::start().is_none());
+        record_read(4);
+
+        reset.call::<()>(true)?;
+        for micros in [10, 20, 30, 1000] {
+            record_call(
+                &name,
+                Duration::from_nanos(5),
+                Duration::from_micros(micros),
+            );
+        }
+        record_read(4);
+
+        let stats = snapshot(&lua)?;
+        reset.call::<()>(false)?;
+        assert_eq!(stats.get::<u64>("bytesRead")?, 4);
+        let symbol: LuaTable = stats.get::<LuaTable>("symbols")?.get("stats_test_symbol")?;
+        assert_eq!(symbol.get::<u64>("calls")?, 4);
+        assert_eq!(symbol.get::<u64>("marshalNs")?, 20);
+        assert_eq!(symbol.get::<u64>("callNs")?, 1_060_000);
+        let p50: u64 = symbol.get("p50Ns")?;
+        assert!((20_000..=22_500).contains(&p50), "{p50}");
+        assert!(symbol.get::<u64>("maxNs")? >= 1_000_000);
+        Ok(())
+    }
+}
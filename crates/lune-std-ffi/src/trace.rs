@@ -0,0 +1,330 @@
+//! Event tracing across the FFI boundary, dumped as Chrome `trace_event` JSON.
+//!
+//! While started, calls through prepared symbols and callback invocations are recorded as
+//! complete events with their duration, each thread into a ring buffer of its own, so the
+//! newest events win once a ring is full. Native libraries record into the same timeline
+//! through the C sink returned by `traceSink`, from any thread: the libcpr bridge reports
+//! transfer phases and thread pool tasks that way. When stopped, recording costs one relaxed
+//! atomic load.
+
+use std::cell::RefCell;
+use std::collections::VecDeque;
+use std::ffi::{CStr, c_char, c_void};
+use std::fmt::Write as _;
+use std::fs;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Arc, LazyLock, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use mlua::prelude::*;
+
+const DEFAULT_CAPACITY: usize = 1 << 14;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static CAPACITY: AtomicUsize = AtomicUsize::new(DEFAULT_CAPACITY);
+static EPOCH: LazyLock<Instant> = LazyLock::new(Instant::now);
+static RINGS: Mutex<Vec<Arc<Ring>>> = Mutex::new(Vec::new());
+
+enum Name {
+    Static(&'static str),
+    Symbol(Arc<str>),
+    // Given by native code, which keeps the string alive for the whole process
+    Foreign(*const c_char),
+}
+
+struct Event {
+    name: Name,
+    phase: u8,
+    // Since EPOCH
+    start: Duration,
+    duration: Duration,
+}
+
+struct Ring {
+    thread: String,
+    tid: u64,
+    events: Mutex<VecDeque<Event>>,
+}
+
+// Safety: the only raw pointers are the foreign names, which point at immutable static strings
+unsafe impl Send for Ring {}
+unsafe impl Sync for Ring {}
+
+thread_local! {
+    static LOCAL: RefCell<Option<Arc<Ring>>> = const { RefCell::new(None) };
+}
+
+pub(crate) fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+fn with_local_ring<R>(f: impl FnOnce(&Ring) -> R) -> R {
+    LOCAL.with(|local| {
+        let mut local = local.borrow_mut();
+        let ring = local.get_or_insert_with(|| {
+            static NEXT_TID: AtomicUsize = AtomicUsize::new(1);
+            let ring = Arc::new(Ring {
+                thread: thread::current().name().unwrap_or("native").to_string(),
+                tid: NEXT_TID.fetch_add(1, Ordering::Relaxed) as u64,
+                events: Mutex::new(VecDeque::new()),
+            });
+            if let Ok(mut rings) = RINGS.lock() {
+                rings.push(Arc::clone(&ring));
+            }
+            ring
+        });
+        f(ring)
+    })
+}
+
+fn push(event: Event) {
+    with_local_ring(|ring| {
+        let Ok(mut events) = ring.events.lock() else {
+            return;
+        };
+        let capacity = CAPACITY.load(Ordering::Relaxed);
+        while events.len() >= capacity {
+            events.pop_front();
+        }
+        events.push_back(event);
+    });
+}
+
+/// A complete event, timed from `start` to now.
+pub(crate) fn complete(name: &'static str, start: Instant) {
+    record_complete(Name::Static(name), start);
+}
+
+pub(crate) fn complete_symbol(name: &Arc<str>, start: Instant) {
+    record_complete(Name::Symbol(Arc::clone(name)), start);
+}
+
+fn record_complete(name: Name, start: Instant) {
+    push(Event {
+        name,
+        phase: b'X',
+        start: start.saturating_duration_since(*EPOCH),
+        duration: start.elapsed(),
+    });
+}
+
+pub(crate) fn instant(name: &'static str) {
+    push(Event {
+        name: Name::Static(name),
+        phase: b'i',
+        start: EPOCH.elapsed(),
+        duration: Duration::ZERO,
+    });
+}
+
+/// The sink native code records through: `phase` is a Chrome phase (`B`, `E`, `X` or `i`),
+/// the event started `ago_ns` before the call and, for `X`, lasted `duration_ns`. `name` must
+/// stay valid for the rest of the process, like a string literal.
+extern "C" fn foreign_sink(name: *const c_char, phase: c_char, ago_ns: u64, duration_ns: u64) {
+    if !enabled() || name.is_null() {
+        return;
+    }
+    let phase = match phase as u8 {
+        phase @ (b'B' | b'E' | b'X' | b'i') => phase,
+        _ => return,
+    };
+    push(Event {
+        name: Name::Foreign(name),
+        phase,
+        start: EPOCH.elapsed().saturating_sub(Duration::from_nanos(ago_ns)),
+        duration: Duration::from_nanos(duration_ns),
+    });
+}
+
+fn escape_json(out: &mut String, text: &str) {
+    for c in text.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if (c as u32) < 0x20 => {
+                let _ = write!(out, "\\u{:04x}", c as u32);
+            }
+            c => out.push(c),
+        }
+    }
+}
+
+fn micros(duration: Duration) -> f64 {
+    duration.as_nanos() as f64 / 1000.0
+}
+
+// Every ring's events, oldest first per thread, plus a thread name record per ring. Rings of
+// threads that have exited are dropped once dumped.
+fn render() -> (String, usize) {
+    let rings: Vec<Arc<Ring>> = match RINGS.lock() {
+        Ok(mut rings) => {
+            let all = rings.clone();
+            rings.retain(|ring| Arc::strong_count(ring) > 2);
+            all
+        }
+        Err(_) => Vec::new(),
+    };
+
+    let pid = std::process::id();
+    let mut out = String::from("{\"traceEvents\":[");
+    let mut count = 0;
+    let mut first = true;
+    let mut separator = |out: &mut String| {
+        if !first {
+            out.push(',');
+        }
+        first = false;
+    };
+    for ring in &rings {
+        separator(&mut out);
+        let _ = write!(
+            out,
+            "{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{pid},\"tid\":{},\"args\":{{\"name\":\"",
+            ring.tid
+        );
+        escape_json(&mut out, &ring.thread);
+        out.push_str("\"}}");
+
+        let Ok(events) = ring.events.lock() else {
+            continue;
+        };
+        for event in events.iter() {
+            separator(&mut out);
+            out.push_str("{\"name\":\"");
+            match &event.name {
+                Name::Static(name) => escape_json(&mut out, name),
+                Name::Symbol(name) => escape_json(&mut out, name),
+                Name::Foreign(name) => {
+                    escape_json(
+                        &mut out,
+                        &unsafe { CStr::from_ptr(*name) }.to_string_lossy(),
+                    );
+                }
+            }
+            let _ = write!(
+                out,
+                "\",\"cat\":\"ffi\",\"ph\":\"{}\",\"ts\":{:.3},\"pid\":{pid},\"tid\":{}",
+                event.phase as char,
+                micros(event.start),
+                ring.tid
+            );
+            match event.phase {
+                b'X' => {
+                    let _ = write!(out, ",\"dur\":{:.3}", micros(event.duration));
+                }
+                b'i' => out.push_str(",\"s\":\"t\""),
+                _ => {}
+            }
+            out.push('}');
+            count += 1;
+        }
+    }
+    out.push_str("]}");
+    (out, count)
+}
+
+fn clear() {
+    if let Ok(mut rings) = RINGS.lock() {
+        for ring in rings.iter() {
+            if let Ok(mut events) = ring.events.lock() {
+                events.clear();
+            }
+        }
+        rings.retain(|ring| Arc::strong_count(ring) > 1);
+    }
+}
+
+pub fn register(lua: &Lua, exports: &LuaTable) -> LuaResult<()> {
+    // Clears earlier events; `capacity` bounds the events kept per thread
+    let start_fn = lua.create_function(|_, capacity: Option<u64>| {
+        let capacity = match capacity {
+            None => DEFAULT_CAPACITY,
+            Some(0) => {
+                return Err(LuaError::runtime(
+                    "trace capacity must be positive".to_string(),
+                ));
+            }
+            Some(capacity) => usize::try_from(capacity)
+                .map_err(|_| LuaError::runtime("trace capacity does not fit usize".to_string()))?,
+        };
+        clear();
+        CAPACITY.store(capacity, Ordering::Relaxed);
+        LazyLock::force(&EPOCH);
+        ENABLED.store(true, Ordering::Relaxed);
+        Ok(())
+    })?;
+    exports.set("traceStart", start_fn)?;
+
+    let stop_fn = lua.create_function(|_, ()| {
+        ENABLED.store(false, Ordering::Relaxed);
+        Ok(())
+    })?;
+    exports.set("traceStop", stop_fn)?;
+
+    let dump_fn = lua.create_function(|_, path: String| {
+        let (json, count) = render();
+        fs::write(&path, json).map_err(|err| {
+            LuaError::runtime(format!("failed to write trace to '{path}': {err}"))
+        })?;
+        Ok(count)
+    })?;
+    exports.set("traceDump", dump_fn)?;
+
+    let sink_fn = lua.create_function(|_, ()| {
+        let sink: extern "C" fn(*const c_char, c_char, u64, u64) = foreign_sink;
+        Ok(LuaLightUserData(sink as *mut c_void))
+    })?;
+    exports.set("traceSink", sink_fn)?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // One test, since recording state is process-wide
+    #[test]
+    fn events_render_as_chrome_trace_json() {
+        ENABLED.store(true, Ordering::Relaxed);
+        let name: Arc<str> = Arc::from("trace_test \"symbol\"");
+        complete_symbol(&name, Instant::now());
+        instant("trace_test_instant");
+        foreign_sink(c"trace_test_foreign".as_ptr(), b'X' as c_char, 1_000, 500);
+        foreign_sink(c"trace_test_ignored".as_ptr(), b'?' as c_char, 0, 0);
+        ENABLED.store(false, Ordering::Relaxed);
+        foreign_sink(c"trace_test_disabled".as_ptr(), b'i' as c_char, 0, 0);
+
+        let (json, _) = render();
+        assert!(json.starts_with("{\"traceEvents\":["), "{json}");
+        assert!(
+            json.contains("\"name\":\"trace_test \\\"symbol\\\"\""),
+            "{json}"
+        );
+        assert!(json.contains("\"name\":\"trace_test_instant\",\"cat\":\"ffi\",\"ph\":\"i\""));
+        assert!(json.contains("\"name\":\"trace_test_foreign\",\"cat\":\"ffi\",\"ph\":\"X\""));
+        assert!(json.contains("\"dur\":0.500"), "{json}");
+        assert!(!json.contains("trace_test_ignored"));
+        assert!(!json.contains("trace_test_disabled"));
+        assert!(json.contains("\"ph\":\"M\""));
+
+        // A full ring drops its oldest events
+        let capacity = CAPACITY.swap(2, Ordering::Relaxed);
+        for name in ["ring_test_a", "ring_test_b", "ring_test_c"] {
+            instant(name);
+        }
+        CAPACITY.store(capacity, Ordering::Relaxed);
+        let names: Vec<&str> = with_local_ring(|ring| {
+            let events = ring.events.lock().unwrap();
+            events
+                .iter()
+                .filter_map(|event| match event.name {
+                    Name::Static(name) => Some(name),
+                    _ => None,
+                })
+                .collect()
+        });
+        assert_eq!(names, ["ring_test_b", "ring_test_c"]);
+    }
+}
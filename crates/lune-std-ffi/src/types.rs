@@ -2,6 +2,8 @@ use std::ffi::c_void;
 
 use mlua::prelude::*;
 
+use crate::int64;
+
 #[derive(Clone, Copy, Debug, PartialEq, Eq)]
 pub enum TypeCode {
     Void,
@@ -93,6 +95,10 @@ pub fn normalize_code(code: &str) -> String {
 }
 
 pub fn lua_value_to_i64(value: &LuaValue) -> LuaResult<i64> {
+    // Boxed values convert like a C cast, keeping their bits
+    if let Some(boxed) = int64::boxed(value) {
+        return Ok(boxed.bits() as i64);
+    }
     match value {
         LuaValue::Integer(i) => Ok(*i),
         LuaValue::Number(n) => {
@@ -117,6 +123,9 @@ pub fn lua_value_to_i64(value: &LuaValue) -> LuaResult<i64> {
 }
 
 pub fn lua_value_to_u64(value: &LuaValue) -> LuaResult<u64> {
+    if let Some(boxed) = int64::boxed(value) {
+        return Ok(boxed.bits());
+    }
     let signed = lua_value_to_i64(value)?;
     if signed < 0 {
         return Err(LuaError::runtime(
@@ -0,0 +1,482 @@
+//! FFI overhead benchmarks, off by default:
+//!
+//! ```sh
+//! cargo test -p lune-std-ffi --release --test bench_luau -- --ignored --nocapture
+//! ```
+//!
+//! `overhead` times requiring the module in fresh states, then runs
+//! `packages/ffi/bench/startup.luau` in each for the first `ffi.cdef`, layout and calls, and
+//! reports the median of those samples; `packages/ffi/bench/call_overhead.luau` follows, for the
+//! steady cost of calls.
+//!
+//! `libcpr_loopback` runs `packages/ffi/bench/libcpr_loopback.luau` too, requests through the
+//! libcpr bridge against a keep-alive HTTP/1.1 server on loopback, and only reports them.
+//!
+//! Every `overhead` run writes its results to `target/ffi-bench/latest.txt`. Given a copy of an
+//! earlier one in `LUNE_FFI_BENCH_BASELINE`, the run fails when a kernel got slower than the
+//! baseline by more than `LUNE_FFI_BENCH_THRESHOLD` (a ratio, 1.25 by default), allocates more
+//! per call, or prepares more cifs. `LUNE_FFI_BENCH_SCALE` multiplies the iterations and samples.
+//!
+//! Allocations are those made through the Rust allocator, which Luau's heap goes through too;
+//! C's `malloc`, behind the cdata pool, is not seen.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::collections::HashMap;
+use std::env;
+use std::fmt::Write as _;
+use std::fs;
+use std::io::{Read, Write};
+use std::net::{SocketAddr, TcpListener, TcpStream};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::thread;
+use std::time::Instant;
+
+use mlua::prelude::*;
+
+mod common;
+
+struct CountingAllocator;
+
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        unsafe { System.alloc_zeroed(layout) }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        unsafe { System.realloc(ptr, layout, new_size) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+const DEFAULT_THRESHOLD: f64 = 1.25;
+// Fresh states the startup costs are measured in at scale 1
+const STARTUP_SAMPLES: f64 = 21.0;
+// Slack on allocations per call, so an allocation amortized over many calls is not a regression
+const ALLOCATION_SLACK: f64 = 0.01;
+
+#[derive(Clone, Debug, PartialEq)]
+struct BenchResult {
+    name: String,
+    calls: u64,
+    ns_per_call: f64,
+    allocations_per_call: f64,
+    cif_builds: u64,
+}
+
+impl BenchResult {
+    fn from_table(table: &LuaTable) -> LuaResult<Self> {
+        Ok(Self {
+            name: table.get("name")?,
+            calls: table.get("calls")?,
+            ns_per_call: table.get("nsPerCall")?,
+            allocations_per_call: table.get("allocationsPerCall")?,
+            cif_builds: table.get("cifBuilds")?,
+        })
+    }
+
+    // `name<TAB>ns/call<TAB>allocations/call<TAB>cif builds<TAB>calls`, tabs as names have spaces
+    fn to_line(&self) -> String {
+        format!(
+            "{}\t{:.2}\t{:.4}\t{}\t{}",
+            self.name, self.ns_per_call, self.allocations_per_call, self.cif_builds, self.calls
+        )
+    }
+
+    fn from_line(line: &str) -> Option<Self> {
+        let mut fields = line.split('\t');
+        Some(Self {
+            name: fields.next()?.to_string(),
+            ns_per_call: fields.next()?.parse().ok()?,
+            allocations_per_call: fields.next()?.parse().ok()?,
+            cif_builds: fields.next()?.parse().ok()?,
+            calls: fields.next()?.parse().ok()?,
+        })
+    }
+
+    // Why this result is a regression from `baseline`, if it is one
+    fn regression(&self, baseline: &Self, threshold: f64) -> Option<String> {
+        if self.ns_per_call > baseline.ns_per_call * threshold {
+            return Some(format!(
+                "{}: {:.2} ns/call, baseline {:.2}",
+                self.name, self.ns_per_call, baseline.ns_per_call
+            ));
+        }
+        if self.allocations_per_call > baseline.allocations_per_call + ALLOCATION_SLACK {
+            return Some(format!(
+                "{}: {:.4} allocations/call, baseline {:.4}",
+                self.name, self.allocations_per_call, baseline.allocations_per_call
+            ));
+        }
+        if self.cif_builds > baseline.cif_builds {
+            return Some(format!(
+                "{}: {} cif builds, baseline {}",
+                self.name, self.cif_builds, baseline.cif_builds
+            ));
+        }
+        None
+    }
+}
+
+fn env_number(name: &str, default: f64) -> f64 {
+    env::var(name)
+        .ok()
+        .map(|value| {
+            value
+                .parse()
+                .unwrap_or_else(|_| panic!("{name} must be a number, got '{value}'"))
+        })
+        .unwrap_or(default)
+}
+
+// `ffi`, `now`, a clock in nanoseconds, `allocations`, a heap allocation counter, and `scale`
+// for a bench script
+fn bench_context(lua: &Lua, ffi: LuaTable) -> LuaResult<LuaTable> {
+    let started = Instant::now();
+    let ctx = lua.create_table()?;
+    ctx.set("ffi", ffi)?;
+    ctx.set(
+        "now",
+        lua.create_function(move |_, ()| Ok(started.elapsed().as_nanos() as f64))?,
+    )?;
+    ctx.set(
+        "allocations",
+        lua.create_function(|_, ()| Ok(ALLOCATIONS.load(Ordering::Relaxed)))?,
+    )?;
+    ctx.set("scale", env_number("LUNE_FFI_BENCH_SCALE", 1.0))?;
+    Ok(ctx)
+}
+
+fn read_repo_file(repo_root: &Path, name: &str) -> LuaResult<String> {
+    let path = repo_root.join(name);
+    fs::read_to_string(&path)
+        .map_err(|err| LuaError::external(format!("failed to read {path:?}: {err}")))
+}
+
+fn load_bench(lua: &Lua, repo_root: &Path, name: &str) -> LuaResult<LuaFunction> {
+    let script = read_repo_file(repo_root, name)?;
+    lua.load(&script).set_name(name).eval()
+}
+
+fn collect_results(results: LuaTable) -> LuaResult<Vec<BenchResult>> {
+    results
+        .sequence_values::<LuaTable>()
+        .map(|result| BenchResult::from_table(&result?))
+        .collect()
+}
+
+// Every `ffi.cdef` of the libcpr spec joined, the C side of a real binding
+fn libcpr_header(repo_root: &Path) -> LuaResult<String> {
+    let spec = read_repo_file(repo_root, "packages/ffi/tests/libcpr_spec.luau")?;
+    let blocks: Vec<&str> = spec
+        .split("ffi.cdef([[")
+        .skip(1)
+        .filter_map(|block| block.split_once("]])").map(|(header, _)| header))
+        .collect();
+    Ok(blocks.join("\n"))
+}
+
+// The sample with the median time of each kind, over all of their calls
+fn median_results(samples: Vec<BenchResult>) -> Vec<BenchResult> {
+    let mut names: Vec<String> = Vec::new();
+    let mut by_name: HashMap<String, Vec<BenchResult>> = HashMap::new();
+    for sample in samples {
+        if !by_name.contains_key(&sample.name) {
+            names.push(sample.name.clone());
+        }
+        by_name.entry(sample.name.clone()).or_default().push(sample);
+    }
+    names
+        .into_iter()
+        .filter_map(|name| {
+            let mut samples = by_name.remove(&name)?;
+            samples.sort_by(|a, b| a.ns_per_call.total_cmp(&b.ns_per_call));
+            let calls = samples.iter().map(|sample| sample.calls).sum();
+            let mut median = samples.swap_remove(samples.len() / 2);
+            median.calls = calls;
+            Some(median)
+        })
+        .collect()
+}
+
+fn run_startup(repo_root: &Path) -> LuaResult<Vec<BenchResult>> {
+    let header = libcpr_header(repo_root)?;
+    let script_name = "packages/ffi/bench/startup.luau";
+    let script = read_repo_file(repo_root, script_name)?;
+    let samples = (STARTUP_SAMPLES * env_number("LUNE_FFI_BENCH_SCALE", 1.0))
+        .round()
+        .max(1.0) as u64;
+
+    let mut results = Vec::new();
+    for sample in 0..samples {
+        let lua = Lua::new();
+        let allocated = ALLOCATIONS.load(Ordering::Relaxed);
+        let started = Instant::now();
+        let ffi = lune_std_ffi::module(lua.clone())?;
+        results.push(BenchResult {
+            name: "require @lune/ffi".to_string(),
+            calls: 1,
+            ns_per_call: started.elapsed().as_nanos() as f64,
+            allocations_per_call: (ALLOCATIONS.load(Ordering::Relaxed) - allocated) as f64,
+            cif_builds: 0,
+        });
+
+        let ctx = bench_context(&lua, ffi)?;
+        ctx.set("header", header.as_str())?;
+        ctx.set("sample", sample)?;
+        let bench: LuaFunction = lua.load(&script).set_name(script_name).eval()?;
+        results.extend(collect_results(bench.call(ctx)?)?);
+    }
+    Ok(median_results(results))
+}
+
+fn run_benchmarks(repo_root: &Path) -> LuaResult<Vec<BenchResult>> {
+    let mut results = run_startup(repo_root)?;
+
+    let lua = Lua::new();
+    let ctx = bench_context(&lua, lune_std_ffi::module(lua.clone())?)?;
+    let bench = load_bench(&lua, repo_root, "packages/ffi/bench/call_overhead.luau")?;
+    results.extend(collect_results(bench.call(ctx)?)?);
+    Ok(results)
+}
+
+#[test]
+#[ignore = "benchmark; run in release with --ignored --nocapture"]
+fn overhead() -> LuaResult<()> {
+    let repo_root = PathBuf::from(env!("CARGO_MANIFEST_DIR"))
+        .join("..")
+        .join("..");
+    let results = run_benchmarks(&repo_root)?;
+
+    let mut report = String::new();
+    println!(
+        "{:<40} {:>12} {:>14} {:>10}",
+        "kernel", "ns/call", "allocs/call", "cif builds"
+    );
+    for result in &results {
+        println!(
+            "{:<40} {:>12.2} {:>14.4} {:>10}",
+            result.name, result.ns_per_call, result.allocations_per_call, result.cif_builds
+        );
+        writeln!(report, "{}", result.to_line()).expect("writing to a string");
+    }
+
+    let out_dir = repo_root.join("target").join("ffi-bench");
+    fs::create_dir_all(&out_dir)
+        .and_then(|()| fs::write(out_dir.join("latest.txt"), &report))
+        .map_err(|err| LuaError::external(format!("failed to write bench results: {err}")))?;
+
+    let Ok(baseline_path) = env::var("LUNE_FFI_BENCH_BASELINE") else {
+        return Ok(());
+    };
+    let baseline_text = fs::read_to_string(&baseline_path).map_err(|err| {
+        LuaError::external(format!("failed to read baseline {baseline_path}: {err}"))
+    })?;
+    let baseline: HashMap<String, BenchResult> = baseline_text
+        .lines()
+        .filter_map(BenchResult::from_line)
+        .map(|result| (result.name.clone(), result))
+        .collect();
+
+    let threshold = env_number("LUNE_FFI_BENCH_THRESHOLD", DEFAULT_THRESHOLD);
+    let regressions: Vec<String> = results
+        .iter()
+        .filter_map(|result| {
+            baseline
+                .get(&result.name)
+                .and_then(|earlier| result.regression(earlier, threshold))
+        })
+        .collect();
+    assert!(
+        regressions.is_empty(),
+        "regressions against {baseline_path}:\n{}",
+        regressions.join("\n")
+    );
+    Ok(())
+}
+
+const LOOPBACK_BODY: &str = "Hello from the loopback bench";
+
+/// A keep-alive HTTP/1.1 server answering every request with `LOOPBACK_BODY`, a thread per
+/// connection, until dropped.
+struct LoopbackServer {
+    address: SocketAddr,
+    stopped: Arc<AtomicBool>,
+    acceptor: Option<thread::JoinHandle<()>>,
+}
+
+impl LoopbackServer {
+    fn start() -> LuaResult<Self> {
+        let listener = TcpListener::bind("127.0.0.1:0")
+            .and_then(|listener| Ok((listener.local_addr()?, listener)))
+            .map_err(|err| LuaError::external(format!("failed to bind loopback server: {err}")));
+        let (address, listener) = listener?;
+        let stopped = Arc::new(AtomicBool::new(false));
+
+        let acceptor = {
+            let stopped = Arc::clone(&stopped);
+            thread::spawn(move || {
+                for stream in listener.incoming() {
+                    if stopped.load(Ordering::Relaxed) {
+                        break;
+                    }
+                    if let Ok(stream) = stream {
+                        thread::spawn(move || serve_connection(stream));
+                    }
+                }
+            })
+        };
+
+        Ok(Self {
+            address,
+            stopped,
+            acceptor: Some(acceptor),
+        })
+    }
+
+    fn url(&self) -> String {
+        format!("http://{}/", self.address)
+    }
+}
+
+impl Drop for LoopbackServer {
+    fn drop(&mut self) {
+        self.stopped.store(true, Ordering::Relaxed);
+        // Wakes the acceptor, which sees the flag before serving this connection
+        let _ = TcpStream::connect(self.address);
+        if let Some(acceptor) = self.acceptor.take() {
+            let _ = acceptor.join();
+        }
+    }
+}
+
+// Answers request heads as they arrive, bodiless GETs being all the bench sends, until the
+// client closes the connection
+fn serve_connection(mut stream: TcpStream) {
+    let _ = stream.set_nodelay(true);
+    let response = format!(
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: {}\r\n\r\n{LOOPBACK_BODY}",
+        LOOPBACK_BODY.len()
+    );
+    let mut pending = Vec::new();
+    let mut buffer = [0u8; 4096];
+    loop {
+        let read = match stream.read(&mut buffer) {
+            Ok(0) | Err(_) => return,
+            Ok(read) => read,
+        };
+        pending.extend_from_slice(&buffer[..read]);
+        while let Some(end) = pending.windows(4).position(|window| window == b"\r\n\r\n") {
+            pending.drain(..end + 4);
+            if stream.write_all(response.as_bytes()).is_err() {
+                return;
+            }
+        }
+    }
+}
+
+#[test]
+#[ignore = "benchmark; run in release with --ignored --nocapture"]
+fn libcpr_loopback() -> LuaResult<()> {
+    let repo_root = PathBuf::from(env!("CARGO_MANIFEST_DIR"))
+        .join("..")
+        .join("..");
+    let library = common::build_libcpr_library(&repo_root)?;
+    let server = LoopbackServer::start()?;
+
+    let lua = Lua::new();
+    let ctx = bench_context(&lua, lune_std_ffi::module(lua.clone())?)?;
+    ctx.set("libraryPath", library.to_string_lossy().to_string())?;
+    ctx.set("url", server.url())?;
+    let bench = load_bench(&lua, &repo_root, "packages/ffi/bench/libcpr_loopback.luau")?;
+    let results: LuaTable = bench.call(ctx)?;
+    drop(server);
+
+    println!(
+        "{:<24} {:>10} {:>12} {:>12} {:>12} {:>8}",
+        "case", "requests", "req/s", "p50 us", "p99 us", "failed"
+    );
+    let mut failed = 0;
+    for result in results.sequence_values::<LuaTable>() {
+        let result = result?;
+        let name: String = result.get("name")?;
+        let requests: u64 = result.get("requests")?;
+        let requests_per_second: f64 = result.get("requestsPerSecond")?;
+        let p50: f64 = result.get("p50Us")?;
+        let p99: f64 = result.get("p99Us")?;
+        let case_failed: u64 = result.get("failed")?;
+        println!(
+            "{name:<24} {requests:>10} {requests_per_second:>12.0} {p50:>12.1} {p99:>12.1} {case_failed:>8}"
+        );
+        failed += case_failed;
+    }
+    assert_eq!(failed, 0, "loopback requests failed");
+    Ok(())
+}
+
+#[test]
+fn results_round_trip_and_compare() {
+    let baseline = BenchResult {
+        name: "int(int,int)".to_string(),
+        calls: 1000,
+        ns_per_call: 40.0,
+        allocations_per_call: 0.0,
+        cif_builds: 0,
+    };
+    assert_eq!(
+        BenchResult::from_line(&baseline.to_line()),
+        Some(baseline.clone())
+    );
+
+    let mut result = baseline.clone();
+    result.ns_per_call = 48.0;
+    assert_eq!(result.regression(&baseline, DEFAULT_THRESHOLD), None);
+    result.ns_per_call = 60.0;
+    assert!(result.regression(&baseline, DEFAULT_THRESHOLD).is_some());
+
+    result.ns_per_call = 40.0;
+    result.allocations_per_call = 1.0;
+    assert!(result.regression(&baseline, DEFAULT_THRESHOLD).is_some());
+
+    result.allocations_per_call = 0.0;
+    result.cif_builds = 1;
+    assert!(result.regression(&baseline, DEFAULT_THRESHOLD).is_some());
+}
+
+#[test]
+fn startup_samples_keep_the_median() {
+    let sample = |name: &str, ns_per_call: f64| BenchResult {
+        name: name.to_string(),
+        calls: 2,
+        ns_per_call,
+        allocations_per_call: 0.0,
+        cif_builds: 0,
+    };
+    let medians = median_results(vec![
+        sample("require", 30.0),
+        sample("first call", 5.0),
+        sample("require", 10.0),
+        sample("require", 20.0),
+    ]);
+    assert_eq!(medians.len(), 2);
+    assert_eq!(medians[0].name, "require");
+    assert_eq!(medians[0].ns_per_call, 20.0);
+    assert_eq!(medians[0].calls, 6);
+    assert_eq!(medians[1].name, "first call");
+}
@@ -0,0 +1,218 @@
+//! Helpers shared by the integration tests: building the native libraries they load.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use mlua::prelude::*;
+
+pub fn detect_target_triple() -> String {
+    option_env!("TARGET")
+        .map(str::to_owned)
+        .or_else(|| std::env::var("TARGET").ok())
+        .or_else(|| option_env!("HOST").map(str::to_owned))
+        .or_else(|| std::env::var("HOST").ok())
+        .unwrap_or_else(|| {
+            let arch = std::env::consts::ARCH;
+            if cfg!(target_os = "windows") {
+                format!("{arch}-pc-windows-msvc")
+            } else if cfg!(target_os = "macos") {
+                format!("{arch}-apple-darwin")
+            } else if cfg!(target_os = "linux") {
+                format!("{arch}-unknown-linux-gnu")
+            } else {
+                arch.to_string()
+            }
+        })
+}
+
+/// Builds the libcpr bridge and the vendored cpr sources into a shared library under `target`.
+pub fn build_libcpr_library(repo_root: &Path) -> LuaResult<PathBuf> {
+    let source_dir = repo_root
+        .join("packages")
+        .join("ffi")
+        .join("examples")
+        .join("native")
+        .join("libcpr");
+    let vendor_dir = source_dir.join("vendor");
+
+    let build_dir = repo_root.join("target").join("ffi-libcpr");
+    fs::create_dir_all(&build_dir).map_err(|err| {
+        LuaError::external(format!(
+            "failed to create libcpr build directory {build_dir:?}: {err}"
+        ))
+    })?;
+
+    let curl_lib = pkg_config::Config::new()
+        .cargo_metadata(false)
+        .probe("libcurl")
+        .map_err(|err| {
+            LuaError::external(format!("failed to locate libcurl with pkg-config: {err}"))
+        })?;
+    // Request body compression: gzip is required, zstd is compiled in when it is installed
+    let zlib_lib = pkg_config::Config::new()
+        .cargo_metadata(false)
+        .probe("zlib")
+        .map_err(|err| {
+            LuaError::external(format!("failed to locate zlib with pkg-config: {err}"))
+        })?;
+    let zstd_lib = pkg_config::Config::new()
+        .cargo_metadata(false)
+        .probe("libzstd")
+        .ok();
+    let libraries: Vec<&pkg_config::Library> =
+        [Some(&curl_lib), Some(&zlib_lib), zstd_lib.as_ref()]
+            .into_iter()
+            .flatten()
+            .collect();
+
+    let mut build = cc::Build::new();
+    build.cpp(true);
+    build.flag_if_supported("-std=c++17");
+    build.flag_if_supported("-fPIC");
+    build.opt_level(0);
+    build.include(vendor_dir.join("include"));
+    build.include(vendor_dir.join("cpr"));
+    build.define("CPR_USE_FLAT_HEADER", None);
+    if zstd_lib.is_some() {
+        build.define("CPR_ENABLE_ZSTD", None);
+    }
+    for include in libraries.iter().flat_map(|lib| &lib.include_paths) {
+        build.include(include);
+    }
+
+    build.file(source_dir.join("libcpr_ffi.cpp"));
+
+    let cpr_sources = [
+        "accept_encoding.cpp",
+        "async.cpp",
+        "auth.cpp",
+        "bandwidth_budget.cpp",
+        "body_pool.cpp",
+        "callback.cpp",
+        "cert_info.cpp",
+        "connection_pool.cpp",
+        "cookies.cpp",
+        "cprtypes.cpp",
+        "curl_container.cpp",
+        "curlholder.cpp",
+        "curlmultiholder.cpp",
+        "dns_cache.cpp",
+        "error.cpp",
+        "file.cpp",
+        "file_sink.cpp",
+        "header_parser.cpp",
+        "interceptor.cpp",
+        "metrics.cpp",
+        "multipart.cpp",
+        "multiperform.cpp",
+        "parameters.cpp",
+        "payload.cpp",
+        "proxies.cpp",
+        "proxyauth.cpp",
+        "redirect.cpp",
+        "request_compression.cpp",
+        "response.cpp",
+        "response_cache.cpp",
+        "segmented_download.cpp",
+        "session.cpp",
+        "single_flight.cpp",
+        "socket_action.cpp",
+        "ssl_ctx.cpp",
+        "threadpool.cpp",
+        "timeout.cpp",
+        "timer_wheel.cpp",
+        "trace.cpp",
+        "unix_socket.cpp",
+        "util.cpp",
+        "websocket.cpp",
+    ];
+
+    for source in &cpr_sources {
+        build.file(vendor_dir.join("cpr").join(source));
+    }
+
+    let target = detect_target_triple();
+    build.target(&target);
+    unsafe {
+        std::env::set_var("TARGET", &target);
+        std::env::set_var("OPT_LEVEL", "0");
+        std::env::set_var("HOST", &target);
+    }
+
+    let objects = build.compile_intermediates();
+    let compiler = build.get_compiler();
+
+    let lib_name = if cfg!(target_os = "windows") {
+        "cpr_ffi.dll"
+    } else if cfg!(target_os = "macos") {
+        "libcpr_ffi.dylib"
+    } else {
+        "libcpr_ffi.so"
+    };
+
+    let lib_path = build_dir.join(lib_name);
+    if lib_path.exists() {
+        fs::remove_file(&lib_path).map_err(|err| {
+            LuaError::external(format!(
+                "failed to remove previous libcpr library {lib_path:?}: {err}"
+            ))
+        })?;
+    }
+
+    let mut cmd = compiler.to_command();
+
+    if compiler.is_like_msvc() {
+        for object in &objects {
+            cmd.arg(object);
+        }
+        cmd.arg("/LD");
+        cmd.arg(format!("/Fe{}", lib_path.display()));
+        for link_path in libraries.iter().flat_map(|lib| &lib.link_paths) {
+            cmd.arg(format!("/LIBPATH:{}", link_path.display()));
+        }
+        for lib in libraries.iter().flat_map(|lib| &lib.libs) {
+            cmd.arg(format!("{lib}.lib"));
+        }
+    } else {
+        if cfg!(target_os = "macos") {
+            cmd.arg("-dynamiclib");
+        } else {
+            cmd.arg("-shared");
+        }
+        cmd.arg("-o");
+        cmd.arg(&lib_path);
+        for object in &objects {
+            cmd.arg(object);
+        }
+        for link_path in libraries.iter().flat_map(|lib| &lib.link_paths) {
+            cmd.arg("-L");
+            cmd.arg(link_path);
+        }
+        for lib in libraries.iter().flat_map(|lib| &lib.libs) {
+            cmd.arg(format!("-l{lib}"));
+        }
+        for framework_path in libraries.iter().flat_map(|lib| &lib.framework_paths) {
+            cmd.arg("-F");
+            cmd.arg(framework_path);
+        }
+        for framework in libraries.iter().flat_map(|lib| &lib.frameworks) {
+            cmd.arg("-framework");
+            cmd.arg(framework);
+        }
+    }
+
+    let command_display = format!("{cmd:?}");
+    let status = cmd.status().map_err(|err| {
+        LuaError::external(format!(
+            "failed to invoke compiler for libcpr library ({command_display}): {err}"
+        ))
+    })?;
+
+    if !status.success() {
+        return Err(LuaError::external(format!(
+            "libcpr library build failed with status {status} using {command_display}"
+        )));
+    }
+
+    Ok(lib_path)
+}
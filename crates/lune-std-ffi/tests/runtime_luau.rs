@@ -1,31 +1,15 @@
 use std::fs;
 use std::io::{self, Read, Write};
-use std::net::TcpListener;
+use std::net::{TcpListener, TcpStream};
 use std::path::{Path, PathBuf};
 use std::thread;
 use std::time::{Duration, Instant};
 
 use mlua::prelude::*;
 
-fn detect_target_triple() -> String {
-    option_env!("TARGET")
-        .map(str::to_owned)
-        .or_else(|| std::env::var("TARGET").ok())
-        .or_else(|| option_env!("HOST").map(str::to_owned))
-        .or_else(|| std::env::var("HOST").ok())
-        .unwrap_or_else(|| {
-            let arch = std::env::consts::ARCH;
-            if cfg!(target_os = "windows") {
-                format!("{arch}-pc-windows-msvc")
-            } else if cfg!(target_os = "macos") {
-                format!("{arch}-apple-darwin")
-            } else if cfg!(target_os = "linux") {
-                format!("{arch}-unknown-linux-gnu")
-            } else {
-                arch.to_string()
-            }
-        })
-}
+mod common;
+
+use common::{build_libcpr_library, detect_target_triple};
 
 fn build_example_library(repo_root: &Path) -> LuaResult<PathBuf> {
     let example_source = repo_root
@@ -111,162 +95,9 @@ fn build_example_library(repo_root: &Path) -> LuaResult<PathBuf> {
     Ok(lib_path)
 }
 
-fn build_libcpr_library(repo_root: &Path) -> LuaResult<PathBuf> {
-    let source_dir = repo_root
-        .join("packages")
-        .join("ffi")
-        .join("examples")
-        .join("native")
-        .join("libcpr");
-    let vendor_dir = source_dir.join("vendor");
-
-    let build_dir = repo_root.join("target").join("ffi-libcpr");
-    fs::create_dir_all(&build_dir).map_err(|err| {
-        LuaError::external(format!(
-            "failed to create libcpr build directory {build_dir:?}: {err}"
-        ))
-    })?;
-
-    let curl_lib = pkg_config::Config::new()
-        .cargo_metadata(false)
-        .probe("libcurl")
-        .map_err(|err| {
-            LuaError::external(format!("failed to locate libcurl with pkg-config: {err}"))
-        })?;
-
-    let mut build = cc::Build::new();
-    build.cpp(true);
-    build.flag_if_supported("-std=c++17");
-    build.flag_if_supported("-fPIC");
-    build.opt_level(0);
-    build.include(vendor_dir.join("include"));
-    build.include(vendor_dir.join("cpr"));
-    for include in &curl_lib.include_paths {
-        build.include(include);
-    }
-
-    build.file(source_dir.join("libcpr_ffi.cpp"));
-
-    let cpr_sources = [
-        "accept_encoding.cpp",
-        "async.cpp",
-        "auth.cpp",
-        "callback.cpp",
-        "cert_info.cpp",
-        "connection_pool.cpp",
-        "cookies.cpp",
-        "cprtypes.cpp",
-        "curl_container.cpp",
-        "curlholder.cpp",
-        "curlmultiholder.cpp",
-        "error.cpp",
-        "file.cpp",
-        "interceptor.cpp",
-        "multipart.cpp",
-        "multiperform.cpp",
-        "parameters.cpp",
-        "payload.cpp",
-        "proxies.cpp",
-        "proxyauth.cpp",
-        "redirect.cpp",
-        "response.cpp",
-        "session.cpp",
-        "ssl_ctx.cpp",
-        "threadpool.cpp",
-        "timeout.cpp",
-        "unix_socket.cpp",
-        "util.cpp",
-    ];
-
-    for source in &cpr_sources {
-        build.file(vendor_dir.join("cpr").join(source));
-    }
-
-    let target = detect_target_triple();
-    build.target(&target);
-    unsafe {
-        std::env::set_var("TARGET", &target);
-        std::env::set_var("OPT_LEVEL", "0");
-        std::env::set_var("HOST", &target);
-    }
-
-    let objects = build.compile_intermediates();
-    let compiler = build.get_compiler();
-
-    let lib_name = if cfg!(target_os = "windows") {
-        "cpr_ffi.dll"
-    } else if cfg!(target_os = "macos") {
-        "libcpr_ffi.dylib"
-    } else {
-        "libcpr_ffi.so"
-    };
-
-    let lib_path = build_dir.join(lib_name);
-    if lib_path.exists() {
-        fs::remove_file(&lib_path).map_err(|err| {
-            LuaError::external(format!(
-                "failed to remove previous libcpr library {lib_path:?}: {err}"
-            ))
-        })?;
-    }
-
-    let mut cmd = compiler.to_command();
-
-    if compiler.is_like_msvc() {
-        for object in &objects {
-            cmd.arg(object);
-        }
-        cmd.arg("/LD");
-        cmd.arg(format!("/Fe{}", lib_path.display()));
-        for link_path in &curl_lib.link_paths {
-            cmd.arg(format!("/LIBPATH:{}", link_path.display()));
-        }
-        for lib in &curl_lib.libs {
-            cmd.arg(format!("{lib}.lib"));
-        }
-    } else {
-        if cfg!(target_os = "macos") {
-            cmd.arg("-dynamiclib");
-        } else {
-            cmd.arg("-shared");
-        }
-        cmd.arg("-o");
-        cmd.arg(&lib_path);
-        for object in &objects {
-            cmd.arg(object);
-        }
-        for link_path in &curl_lib.link_paths {
-            cmd.arg("-L");
-            cmd.arg(link_path);
-        }
-        for lib in &curl_lib.libs {
-            cmd.arg(format!("-l{lib}"));
-        }
-        for framework_path in &curl_lib.framework_paths {
-            cmd.arg("-F");
-            cmd.arg(framework_path);
-        }
-        for framework in &curl_lib.frameworks {
-            cmd.arg("-framework");
-            cmd.arg(framework);
-        }
-    }
-
-    let command_display = format!("{cmd:?}");
-    let status = cmd.status().map_err(|err| {
-        LuaError::external(format!(
-            "failed to invoke compiler for libcpr library ({command_display}): {err}"
-        ))
-    })?;
-
-    if !status.success() {
-        return Err(LuaError::external(format!(
-            "libcpr library build failed with status {status} using {command_display}"
-        )));
-    }
-
-    Ok(lib_path)
-}
+/// Number of HTTP requests issued by `libcpr_spec.luau` and the libcpr example.
+const LIBCPR_TEST_REQUESTS: usize = 25;
+const LIBCPR_TEST_ETAG: &str = "\"libcpr-test\"";
 
 fn spawn_libcpr_test_server() -> LuaResult<(String, String, thread::JoinHandle<()>)> {
     let listener = TcpListener::bind("127.0.0.1:0")
@@ -279,23 +110,38 @@ fn spawn_libcpr_test_server() -> LuaResult<(String, String, thread::JoinHandle<(
         LuaError::external(format!("failed to read libcpr test server address: {err}"))
     })?;
 
+    // Revalidated on every use by the response cache spec, which gets a 304 once it sends the tag
     let body = "Hello from libcpr";
     let response = format!(
-        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: {}\r\nETag: {LIBCPR_TEST_ETAG}\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n{}",
         body.len(),
         body
     );
     let response_bytes = response.into_bytes();
+    let not_modified = format!(
+        "HTTP/1.1 304 Not Modified\r\nETag: {LIBCPR_TEST_ETAG}\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n"
+    )
+    .into_bytes();
 
     let handle = thread::spawn(move || {
         let deadline = Instant::now() + Duration::from_secs(5);
         let mut served = 0;
-        while served < 2 {
+        while served < LIBCPR_TEST_REQUESTS {
             match listener.accept() {
                 Ok((mut stream, _)) => {
-                    let mut buffer = [0u8; 1024];
-                    let _ = stream.read(&mut buffer);
-                    let _ = stream.write_all(&response_bytes);
+                    let head = read_request(&mut stream);
+                    let revalidated = head.lines().filter_map(|line| line.split_once(':')).any(
+                        |(name, value)| {
+                            name.trim().eq_ignore_ascii_case("if-none-match")
+                                && value.trim() == LIBCPR_TEST_ETAG
+                        },
+                    );
+                    let reply = if revalidated {
+                        &not_modified
+                    } else {
+                        &response_bytes
+                    };
+                    let _ = stream.write_all(reply);
                     let _ = stream.flush();
                     served += 1;
                 }
@@ -313,6 +159,36 @@ fn spawn_libcpr_test_server() -> LuaResult<(String, String, thread::JoinHandle<(
     Ok((format!("http://{address}"), body.to_string(), handle))
 }
 
+/// Reads the request head and a `Content-Length` body, so clients streaming
+/// their upload are not answered before they have sent it. Returns the head.
+fn read_request(stream: &mut TcpStream) -> String {
+    let _ = stream.set_nonblocking(false);
+    let _ = stream.set_read_timeout(Some(Duration::from_secs(2)));
+
+    let mut request = Vec::new();
+    let mut buffer = [0u8; 1024];
+    loop {
+        match stream.read(&mut buffer) {
+            Ok(0) | Err(_) => return String::from_utf8_lossy(&request).into_owned(),
+            Ok(read) => request.extend_from_slice(&buffer[..read]),
+        }
+
+        let Some(head_end) = request.windows(4).position(|window| window == b"\r\n\r\n") else {
+            continue;
+        };
+        let head = String::from_utf8_lossy(&request[..head_end]);
+        let body_length = head
+            .lines()
+            .filter_map(|line| line.split_once(':'))
+            .find(|(name, _)| name.trim().eq_ignore_ascii_case("content-length"))
+            .and_then(|(_, value)| value.trim().parse::<usize>().ok())
+            .unwrap_or(0);
+        if request.len() >= head_end + 4 + body_length {
+            return head.into_owned();
+        }
+    }
+}
+
 fn register_script_module(lua: &Lua, preload: &LuaTable, name: &str, path: &Path) -> LuaResult<()> {
     let source = fs::read_to_string(path)
         .map_err(|err| LuaError::external(format!("failed to read {path:?}: {err}")))?;
@@ -331,6 +207,14 @@ fn runtime_spec_passes() -> LuaResult<()> {
     let example_library = build_example_library(&repo_root)?;
     let libcpr_library = build_libcpr_library(&repo_root)?;
     let (libcpr_url, libcpr_body, libcpr_server) = spawn_libcpr_test_server()?;
+    let libcpr_download = libcpr_library.with_file_name("libcpr_download.txt");
+    if libcpr_download.exists() {
+        fs::remove_file(&libcpr_download).map_err(|err| {
+            LuaError::external(format!(
+                "failed to remove previous libcpr download {libcpr_download:?}: {err}"
+            ))
+        })?;
+    }
 
     let lua = Lua::new();
     let module = lune_std_ffi::module(lua.clone())?;
@@ -356,6 +240,10 @@ fn runtime_spec_passes() -> LuaResult<()> {
         .set("FFI_LIBCPR_TEST_URL", libcpr_url.clone())?;
     lua.globals()
         .set("FFI_LIBCPR_EXPECTED_BODY", libcpr_body.clone())?;
+    lua.globals().set(
+        "FFI_LIBCPR_DOWNLOAD_PATH",
+        libcpr_download.to_string_lossy().to_string(),
+    )?;
     lua.globals().set(
         "LIBCPR_LIBRARY_PATH",
         libcpr_library.to_string_lossy().to_string(),
@@ -437,5 +325,15 @@ end
 
     exec_result?;
 
+    let downloaded = fs::read_to_string(&libcpr_download).map_err(|err| {
+        LuaError::external(format!(
+            "failed to read libcpr download {libcpr_download:?}: {err}"
+        ))
+    })?;
+    assert_eq!(
+        downloaded, libcpr_body,
+        "libcpr download file content mismatch"
+    );
+
     Ok(())
 }
@@ -0,0 +1,558 @@
+/**
+ * Loopback benchmark of the vendored cpr layer, against an HTTP/1.1 and cleartext HTTP/2 server
+ * embedded below, so numbers only depend on the machine and not on a network or a remote server.
+ * Reports requests per second and the p50/p99 latency of
+ *   - a fresh cpr::Get per request and a reused Session, over HTTP/1.1 and HTTP/2,
+ *   - MultiPerform batches of 10 to 10000 requests, over both,
+ *   - cpr::async tasks on the GlobalThreadPool, each making a request with its own Session.
+ * The FFI bridge is measured end to end from Luau by crates/lune-std-ffi/tests/bench_luau.rs.
+ *
+ * POSIX only. Built against the vendored sources and the system libcurl, from this directory:
+ *
+ *   c++ -std=c++17 -O2 -DCPR_USE_FLAT_HEADER -I../vendor/include -I../vendor/cpr \
+ *       loopback_bench.cpp ../vendor/cpr/\*.cpp -o loopback_bench -lcurl -lz -lpthread
+ *
+ * Usage: loopback_bench [requests per case, default 2000] [batch sizes, default 10,100,1000,10000]
+ **/
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cpr/cpr.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::string_view kBody = "hello from the loopback bench\n";
+constexpr std::string_view kHttp2Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+// Batches this large are admitted through a Window, so the connections stay within fd limits
+constexpr size_t kMaxActive = 256;
+
+/**
+ * One connection of the server. HTTP/1.1 requests are answered in order as their headers end;
+ * HTTP/2 is spoken with prior knowledge only, answering every stream once the request ended,
+ * without looking at its headers: the reply is the same for every request.
+ **/
+class Connection {
+  public:
+    explicit Connection(int fd) : fd_(fd) {}
+    Connection(const Connection& other) = delete;
+    Connection& operator=(const Connection& other) = delete;
+    ~Connection() {
+        close(fd_);
+    }
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+
+    [[nodiscard]] bool wantsWrite() const {
+        return !output_.empty();
+    }
+
+    // False once the connection should be closed
+    bool readable() {
+        char chunk[16384];
+        while (true) {
+            const ssize_t count = recv(fd_, chunk, sizeof(chunk), 0);
+            if (count > 0) {
+                input_.append(chunk, static_cast<size_t>(count));
+                continue;
+            }
+            if (count == 0) {
+                return false;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        return process() && writable();
+    }
+
+    bool writable() {
+        while (written_ < output_.size()) {
+            const ssize_t count = send(fd_, output_.data() + written_, output_.size() - written_, MSG_NOSIGNAL);
+            if (count < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            written_ += static_cast<size_t>(count);
+        }
+        output_.clear();
+        written_ = 0;
+        return !closing_;
+    }
+
+  private:
+    enum class Protocol { UNKNOWN, HTTP1, HTTP2 };
+
+    struct PendingData {
+        uint32_t stream;
+        std::string_view body;
+    };
+
+    bool process() {
+        if (protocol_ == Protocol::UNKNOWN) {
+            const size_t compared = std::min(input_.size(), kHttp2Preface.size());
+            if (std::string_view{input_}.substr(0, compared) != kHttp2Preface.substr(0, compared)) {
+                protocol_ = Protocol::HTTP1;
+            } else if (input_.size() >= kHttp2Preface.size()) {
+                protocol_ = Protocol::HTTP2;
+                consumed_ = kHttp2Preface.size();
+                // An empty SETTINGS frame, taking every default
+                writeFrame(0x4, 0, 0, {});
+            } else {
+                return true;
+            }
+        }
+        const bool open = protocol_ == Protocol::HTTP1 ? processHttp1() : processHttp2();
+        input_.erase(0, consumed_);
+        consumed_ = 0;
+        return open;
+    }
+
+    bool processHttp1() {
+        while (true) {
+            const size_t end = input_.find("\r\n\r\n", consumed_);
+            if (end == std::string::npos) {
+                return true;
+            }
+            const std::string_view head = std::string_view{input_}.substr(consumed_, end - consumed_);
+            size_t body = 0;
+            const size_t length = head.find("Content-Length:");
+            if (length != std::string_view::npos) {
+                body = std::strtoull(head.data() + length + 15, nullptr, 10);
+            }
+            if (input_.size() < end + 4 + body) {
+                return true;
+            }
+            consumed_ = end + 4 + body;
+            output_ += "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: ";
+            output_ += std::to_string(kBody.size());
+            output_ += "\r\n\r\n";
+            output_ += kBody;
+        }
+    }
+
+    bool processHttp2() {
+        while (input_.size() - consumed_ >= 9) {
+            const auto* header = reinterpret_cast<const unsigned char*>(input_.data() + consumed_); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+            const size_t length = (size_t{header[0]} << 16) | (size_t{header[1]} << 8) | header[2];
+            if (input_.size() - consumed_ < 9 + length) {
+                return true;
+            }
+            const unsigned char type = header[3];
+            const unsigned char flags = header[4];
+            const uint32_t stream = readU32(header + 5) & 0x7fffffffU;
+            const unsigned char* payload = header + 9;
+            consumed_ += 9 + length;
+
+            switch (type) {
+                case 0x0: // DATA
+                    if (length > 0) {
+                        // Gives the window straight back, request bodies are dropped
+                        const std::string increment = u32(static_cast<uint32_t>(length));
+                        writeFrame(0x8, 0, 0, increment);
+                        writeFrame(0x8, 0, stream, increment);
+                    }
+                    if ((flags & 0x1) != 0) {
+                        respond(stream);
+                    }
+                    break;
+                case 0x1: // HEADERS
+                case 0x9: // CONTINUATION
+                    if (type == 0x1) {
+                        headersEndStream_ = (flags & 0x1) != 0;
+                    }
+                    if ((flags & 0x4) != 0 && headersEndStream_) {
+                        respond(stream);
+                    }
+                    break;
+                case 0x4: // SETTINGS
+                    if ((flags & 0x1) == 0) {
+                        applySettings(payload, length);
+                        writeFrame(0x4, 0x1, 0, {});
+                    }
+                    break;
+                case 0x6: // PING
+                    if ((flags & 0x1) == 0) {
+                        writeFrame(0x6, 0x1, 0, std::string_view{reinterpret_cast<const char*>(payload), length}); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+                    }
+                    break;
+                case 0x7: // GOAWAY
+                    closing_ = true;
+                    return true;
+                case 0x8: // WINDOW_UPDATE
+                    if (length == 4) {
+                        const int64_t increment = readU32(payload) & 0x7fffffffU;
+                        if (stream == 0) {
+                            connectionWindow_ += increment;
+                        } else {
+                            streamWindows_[stream] += increment;
+                        }
+                        flushData();
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        return true;
+    }
+
+    void applySettings(const unsigned char* payload, size_t length) {
+        for (size_t offset = 0; offset + 6 <= length; offset += 6) {
+            const unsigned id = (unsigned{payload[offset]} << 8) | payload[offset + 1];
+            if (id == 0x4) { // INITIAL_WINDOW_SIZE
+                const int64_t size = readU32(payload + offset + 2);
+                for (auto& [stream, window] : streamWindows_) {
+                    window += size - initialWindow_;
+                }
+                initialWindow_ = size;
+            }
+        }
+        flushData();
+    }
+
+    void respond(uint32_t stream) {
+        std::string block;
+        // :status 200 from the static table, then content-length (static name 28) as a literal
+        block += '\x88';
+        block += '\x0f';
+        block += '\x0d';
+        const std::string length = std::to_string(kBody.size());
+        block += static_cast<char>(length.size());
+        block += length;
+        writeFrame(0x1, 0x4, stream, block);
+        streamWindows_.emplace(stream, initialWindow_);
+        pending_.push_back(PendingData{stream, kBody});
+        flushData();
+    }
+
+    // Bodies go out as far as the flow-control windows let them
+    void flushData() {
+        while (!pending_.empty()) {
+            PendingData& data = pending_.front();
+            int64_t& window = streamWindows_[data.stream];
+            const auto size = static_cast<int64_t>(data.body.size());
+            if (connectionWindow_ < size || window < size) {
+                return;
+            }
+            connectionWindow_ -= size;
+            writeFrame(0x0, 0x1, data.stream, data.body);
+            streamWindows_.erase(data.stream);
+            pending_.pop_front();
+        }
+    }
+
+    void writeFrame(unsigned char type, unsigned char flags, uint32_t stream, std::string_view payload) {
+        const size_t length = payload.size();
+        output_ += static_cast<char>((length >> 16) & 0xff);
+        output_ += static_cast<char>((length >> 8) & 0xff);
+        output_ += static_cast<char>(length & 0xff);
+        output_ += static_cast<char>(type);
+        output_ += static_cast<char>(flags);
+        output_ += u32(stream);
+        output_ += payload;
+    }
+
+    static uint32_t readU32(const unsigned char* bytes) {
+        return (uint32_t{bytes[0]} << 24) | (uint32_t{bytes[1]} << 16) | (uint32_t{bytes[2]} << 8) | bytes[3];
+    }
+
+    static std::string u32(uint32_t value) {
+        return {static_cast<char>(value >> 24), static_cast<char>((value >> 16) & 0xff), static_cast<char>((value >> 8) & 0xff), static_cast<char>(value & 0xff)};
+    }
+
+    const int fd_;
+    Protocol protocol_{Protocol::UNKNOWN};
+    std::string input_;
+    size_t consumed_{0};
+    std::string output_;
+    size_t written_{0};
+    bool closing_{false};
+    bool headersEndStream_{false};
+    int64_t connectionWindow_{65535};
+    int64_t initialWindow_{65535};
+    std::unordered_map<uint32_t, int64_t> streamWindows_;
+    std::deque<PendingData> pending_;
+};
+
+/**
+ * The server, one thread polling every connection.
+ **/
+class LoopbackServer {
+  public:
+    LoopbackServer() {
+        listener_ = socket(AF_INET, SOCK_STREAM, 0);
+        const int enable = 1;
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        if (bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener_, SOMAXCONN) != 0) {
+            std::perror("loopback_bench: bind");
+            std::exit(1);
+        }
+        socklen_t size = sizeof(address);
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &size);
+        port_ = ntohs(address.sin_port);
+        makeNonBlocking(listener_);
+        if (pipe(wakeup_) != 0) {
+            std::perror("loopback_bench: pipe");
+            std::exit(1);
+        }
+        thread_ = std::thread([this]() { run(); });
+    }
+    LoopbackServer(const LoopbackServer& other) = delete;
+    LoopbackServer& operator=(const LoopbackServer& other) = delete;
+
+    ~LoopbackServer() {
+        stop_ = true;
+        const char byte = 0;
+        [[maybe_unused]] const ssize_t written = write(wakeup_[1], &byte, 1);
+        thread_.join();
+        close(listener_);
+        close(wakeup_[0]);
+        close(wakeup_[1]);
+    }
+
+    [[nodiscard]] std::string Url() const {
+        return "http://127.0.0.1:" + std::to_string(port_) + "/bench";
+    }
+
+  private:
+    static void makeNonBlocking(int fd) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    void run() {
+        std::vector<std::unique_ptr<Connection>> connections;
+        std::vector<pollfd> fds;
+        while (!stop_) {
+            fds.clear();
+            fds.push_back({listener_, POLLIN, 0});
+            fds.push_back({wakeup_[0], POLLIN, 0});
+            for (const auto& connection : connections) {
+                fds.push_back({connection->fd(), static_cast<short>(POLLIN | (connection->wantsWrite() ? POLLOUT : 0)), 0});
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                continue;
+            }
+
+            std::vector<std::unique_ptr<Connection>> open;
+            open.reserve(connections.size());
+            for (size_t index = 0; index < connections.size(); ++index) {
+                const short events = fds[index + 2].revents;
+                bool keep = true;
+                if ((events & (POLLIN | POLLHUP | POLLERR)) != 0) {
+                    keep = connections[index]->readable();
+                }
+                if (keep && (events & POLLOUT) != 0) {
+                    keep = connections[index]->writable();
+                }
+                if (keep) {
+                    open.push_back(std::move(connections[index]));
+                }
+            }
+            connections = std::move(open);
+
+            if ((fds[0].revents & POLLIN) != 0) {
+                while (true) {
+                    const int fd = accept(listener_, nullptr, nullptr);
+                    if (fd < 0) {
+                        break;
+                    }
+                    makeNonBlocking(fd);
+                    const int enable = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+                    connections.push_back(std::make_unique<Connection>(fd));
+                }
+            }
+        }
+    }
+
+    int listener_{-1};
+    int wakeup_[2]{-1, -1};
+    uint16_t port_{0};
+    std::atomic_bool stop_{false};
+    std::thread thread_;
+};
+
+struct Result {
+    std::string name;
+    size_t requests{0};
+    size_t failures{0};
+    double seconds{0};
+    // Per request, in microseconds
+    std::vector<double> latencies;
+};
+
+double percentile(std::vector<double>& values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    const auto rank = static_cast<size_t>(fraction * static_cast<double>(values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(rank), values.end());
+    return values[rank];
+}
+
+void report(Result result) {
+    const double p50 = percentile(result.latencies, 0.50);
+    const double p99 = percentile(result.latencies, 0.99);
+    std::printf("%-28s %8zu %12.0f %10.1f %10.1f %8zu\n", result.name.c_str(), result.requests, static_cast<double>(result.requests) / result.seconds, p50, p99, result.failures);
+    std::fflush(stdout);
+}
+
+double micros(Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+cpr::HttpVersion versionOf(bool http2) {
+    return cpr::HttpVersion{http2 ? cpr::HttpVersionCode::VERSION_2_0_PRIOR_KNOWLEDGE : cpr::HttpVersionCode::VERSION_1_1};
+}
+
+// Times `requests` calls of `request`, one after the other
+Result sequential(const std::string& name, size_t requests, const std::function<cpr::Response()>& request) {
+    Result result{name, requests, 0, 0, {}};
+    result.latencies.reserve(requests);
+    const Clock::time_point started = Clock::now();
+    for (size_t index = 0; index < requests; ++index) {
+        const Clock::time_point sent = Clock::now();
+        const cpr::Response response = request();
+        result.latencies.push_back(micros(Clock::now() - sent));
+        result.failures += response.status_code == 200 ? 0 : 1;
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    return result;
+}
+
+// A batch of `size` requests; latency is the time from the start of the batch to each completion
+Result batch(const std::string& url, size_t size, bool http2) {
+    cpr::MultiPerform multi;
+    if (size > kMaxActive) {
+        cpr::MultiPerform::Window window;
+        window.max_active = kMaxActive;
+        multi.SetWindow(window);
+    }
+    std::vector<std::shared_ptr<cpr::Session>> sessions;
+    sessions.reserve(size);
+    for (size_t index = 0; index < size; ++index) {
+        auto session = std::make_shared<cpr::Session>();
+        session->SetUrl(cpr::Url{url});
+        session->SetHttpVersion(versionOf(http2));
+        multi.AddSession(session, cpr::MultiPerform::HttpMethod::GET_REQUEST);
+        sessions.push_back(std::move(session));
+    }
+
+    Result result{std::string{"MultiPerform "} + (http2 ? "h2 " : "h1 ") + std::to_string(size), size, 0, 0, {}};
+    result.latencies.reserve(size);
+    std::mutex mutex;
+    const Clock::time_point started = Clock::now();
+    multi.Get([&](size_t /*index*/, cpr::Response&& response) {
+        const std::lock_guard<std::mutex> lock(mutex);
+        result.latencies.push_back(micros(Clock::now() - started));
+        result.failures += response.status_code == 200 ? 0 : 1;
+    });
+    result.seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    return result;
+}
+
+// `requests` cpr::async tasks submitted at once, each timed from its submission
+Result pooled(const std::string& url, size_t requests) {
+    Result result{"cpr::async GlobalThreadPool", requests, 0, 0, {}};
+    result.latencies.reserve(requests);
+    std::mutex mutex;
+    std::vector<cpr::AsyncWrapper<void>> tasks;
+    tasks.reserve(requests);
+    const Clock::time_point started = Clock::now();
+    for (size_t index = 0; index < requests; ++index) {
+        const Clock::time_point submitted = Clock::now();
+        tasks.push_back(cpr::async([&, submitted]() {
+            const cpr::Response response = cpr::Get(cpr::Url{url});
+            const std::lock_guard<std::mutex> lock(mutex);
+            result.latencies.push_back(micros(Clock::now() - submitted));
+            result.failures += response.status_code == 200 ? 0 : 1;
+        }));
+    }
+    for (auto& task : tasks) {
+        task.wait();
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    return result;
+}
+
+std::vector<size_t> parseSizes(const char* text) {
+    std::vector<size_t> sizes;
+    const std::string_view list{text};
+    size_t start = 0;
+    while (start <= list.size()) {
+        const size_t end = std::min(list.find(',', start), list.size());
+        const size_t size = std::strtoull(std::string{list.substr(start, end - start)}.c_str(), nullptr, 10);
+        if (size > 0) {
+            sizes.push_back(size);
+        }
+        start = end + 1;
+    }
+    return sizes;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t requests = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000;
+    const std::vector<size_t> sizes = parseSizes(argc > 2 ? argv[2] : "10,100,1000,10000");
+    if (requests == 0) {
+        std::fprintf(stderr, "usage: %s [requests] [batch sizes]\n", argv[0]);
+        return 2;
+    }
+
+    const LoopbackServer server;
+    const std::string url = server.Url();
+    std::printf("%-28s %8s %12s %10s %10s %8s\n", "case", "requests", "requests/s", "p50 us", "p99 us", "failed");
+
+    for (const bool http2 : {false, true}) {
+        const std::string suffix = http2 ? " h2" : " h1";
+        report(sequential("fresh cpr::Get" + suffix, requests, [&]() { return cpr::Get(cpr::Url{url}, versionOf(http2)); }));
+
+        cpr::Session session;
+        session.SetUrl(cpr::Url{url});
+        session.SetHttpVersion(versionOf(http2));
+        report(sequential("reused Session" + suffix, requests, [&]() { return session.Get(); }));
+    }
+    for (const bool http2 : {false, true}) {
+        for (const size_t size : sizes) {
+            report(batch(url, size, http2));
+        }
+    }
+    report(pooled(url, requests));
+    return 0;
+}
@@ -1,9 +1,27 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
 #include <cpr/cpr.h>
-#include <cstdlib>
+#include <cstddef>
 #include <cstring>
+#include <curl/curl.h>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 extern "C" {
 
@@ -17,70 +35,1797 @@ struct LuneCprResponse {
     int error_code;
     LuneCprString text;
     LuneCprString error;
+
+    // Not part of the C-visible layout: the views above point into this
+    // response, so the body filled by cpr::util::writeFunction is handed to
+    // Luau without being copied a second time.
+    cpr::Response storage;
+    // Set instead of storage for responses of luneffi_cpr_submit_shared,
+    // whose views all point into the one response of their shared transfer.
+    std::shared_ptr<const cpr::Response> shared;
+    // Ticket returned by luneffi_cpr_submit, 0 for synchronous requests.
+    unsigned long long ticket;
+};
+
+// Filled by luneffi_cpr_response_info, so a response is read in a single
+// call instead of one accessor per field. The views point into the response
+// and stay valid until it is freed.
+struct LuneCprResponseInfo {
+    int status_code;
+    int error_code;
+    LuneCprString text;
+    LuneCprString error;
+    LuneCprString headers;
+    double elapsed;
+    // cpr::TransferTimings, in microseconds since the start of the transfer
+    long long namelookup_us;
+    long long connect_us;
+    long long appconnect_us;
+    long long pretransfer_us;
+    long long starttransfer_us;
+    long long total_us;
+    long long num_connects;
+    int connection_reused;
+};
+
+// Filled by luneffi_cpr_metrics_snapshot from cpr::Metrics. Latencies are in
+// microseconds, each reported at most 1/8 too high by the histogram buckets.
+struct LuneCprHostMetrics {
+    char host[64];
+    unsigned long long requests;
+    unsigned long long errors;
+    long long p50_us;
+    long long p90_us;
+    long long p99_us;
+    long long max_us;
+};
+
+struct LuneCprMetrics {
+    unsigned long long in_flight;
+    unsigned long long requests;
+    unsigned long long reused_connections;
+    unsigned long long new_connections;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long multi_errors;
+    // Completed requests by cpr::ErrorCode, errors[0] being the successful
+    // ones and the last slot UNKNOWN_ERROR
+    unsigned long long errors[64];
+    // cpr::GlobalThreadPool, which runs cpr::async requests
+    unsigned long long pool_threads;
+    unsigned long long pool_idle_threads;
+    unsigned long long pool_queued_tasks;
+    // Up to 32 hosts, plus one entry with an empty name merging the rest
+    unsigned long long host_count;
+    LuneCprHostMetrics hosts[33];
+};
+
+// Lanes of cpr::GlobalThreadPool, indexed by cpr::ThreadPool::Priority:
+// interactive, normal and bulk.
+struct LuneCprPoolLanes {
+    int strict;
+    unsigned long long reserved_threads;
+    unsigned long long weights[3];
+    unsigned long long queued[3];
+};
+
+static_assert(sizeof(LuneCprPoolLanes::queued) / sizeof(unsigned long long) == cpr::ThreadPool::kPriorityCount);
+static_assert(sizeof(LuneCprMetrics::errors) / sizeof(unsigned long long) == cpr::Metrics::kErrorCodeCount);
+static_assert(sizeof(LuneCprMetrics::hosts) / sizeof(LuneCprHostMetrics) == cpr::Metrics::kMaxHosts + 1);
+static_assert(sizeof(LuneCprHostMetrics::host) == cpr::Metrics::kMaxHostLength);
+
+// Filled by luneffi_cpr_single_flight_stats: transfers started by
+// luneffi_cpr_submit_shared, tickets that joined one instead, and transfers
+// in flight.
+struct LuneCprSingleFlightStats {
+    unsigned long long transfers;
+    unsigned long long coalesced;
+    unsigned long long in_flight;
+};
+
+// Filled by luneffi_cpr_dns_stats from cpr::DnsCache::Stats.
+struct LuneCprDnsStats {
+    unsigned long long hits;
+    unsigned long long stale_hits;
+    unsigned long long misses;
+    unsigned long long resolutions;
+    unsigned long long refreshes;
+    unsigned long long failures;
+    unsigned long long entries;
+};
+
+// Filled by luneffi_cpr_connection_stats from cpr::ConnectionPool::Stats.
+struct LuneCprConnectionStats {
+    unsigned long long connected;
+    unsigned long long reused;
+    unsigned long long closed;
+    unsigned long long evicted;
+    unsigned long long open;
+    unsigned long long idle;
+};
+
+// Filled by luneffi_cpr_cache_stats from cpr::ResponseCache::Stats.
+struct LuneCprCacheStats {
+    unsigned long long hits;
+    unsigned long long revalidated;
+    unsigned long long misses;
+    unsigned long long stores;
+    unsigned long long evictions;
+    unsigned long long disk_hits;
+    unsigned long long entries;
+    unsigned long long bytes;
+};
+
+// Filled by luneffi_cpr_body_pool_stats from cpr::BodyPool::Stats.
+struct LuneCprBodyPoolStats {
+    unsigned long long acquires;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long releases;
+    unsigned long long discarded;
+    unsigned long long buffers;
+    unsigned long long bytes;
+};
+
+// Filled by luneffi_cpr_compression_stats from cpr::CompressorPool::Stats.
+struct LuneCprCompressionStats {
+    unsigned long long created;
+    unsigned long long reused;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long idle;
+};
+
+// Filled by luneffi_cpr_bandwidth_stats from cpr::BandwidthBudget::Stats.
+struct LuneCprBandwidthStats {
+    unsigned long long received;
+    unsigned long long sent;
+    unsigned long long pauses;
+};
+
+// A received WebSocket frame, viewed in place in its connection's ring by
+// luneffi_cpr_ws_frames. `flags` are libcurl's CURLWS_* bits: 1 for text,
+// 2 for binary, 4 on every fragment of a message but its last.
+struct LuneCprWsFrame {
+    const char* data;
+    unsigned long long length;
+    unsigned int flags;
+};
+
+// Filled by luneffi_cpr_ws_stats from cpr::WebSocket::Stats.
+struct LuneCprWsStats {
+    unsigned long long frames_received;
+    unsigned long long bytes_received;
+    unsigned long long frames_sent;
+    unsigned long long bytes_sent;
+    unsigned long long stalls;
+};
+
+static LuneCprString view_string(const std::string& input) {
+    return LuneCprString{input.data(), static_cast<unsigned long long>(input.size())};
+}
+
+// Sessions keep their curl easy handle between requests, so connections,
+// DNS lookups and TLS sessions are reused. A session must not be used from
+// more than one thread at a time.
+struct LuneCprSession {
+    cpr::Session session;
+    // Parts added for a multipart body, set on the session as a whole
+    std::vector<cpr::Part> parts;
+};
+
+// A response cache shared by every session it is set on, from any thread.
+struct LuneCprCache {
+    std::shared_ptr<cpr::ResponseCache> cache;
 };
 
-static LuneCprString make_string(const std::string& input) {
-    LuneCprString result{nullptr, 0};
+// A bandwidth budget shared by every session it is set on, from any thread.
+struct LuneCprBandwidth {
+    std::shared_ptr<cpr::BandwidthBudget> budget;
+};
+
+// Per-request policies of luneffi_cpr_get_many_with_policy, see
+// cpr::MultiPerform::RetryPolicy and HedgePolicy. A max_attempts of 1 or
+// less disables retries, a hedge_delay_ms of 0 or less hedging.
+struct LuneCprBatchPolicy {
+    unsigned long long max_attempts;
+    long long base_delay_ms;
+    long long max_delay_ms;
+    long long hedge_delay_ms;
+};
+
+// Filled by luneffi_cpr_batch_policy_stats from cpr::MultiPerform::PolicyStats.
+struct LuneCprBatchPolicyStats {
+    unsigned long long retries;
+    unsigned long long hedges;
+    unsigned long long hedges_won;
+};
+
+// Filled by luneffi_cpr_batch_deadline_stats from cpr::MultiPerform::PolicyStats.
+struct LuneCprBatchDeadlineStats {
+    unsigned long long shed;
+    unsigned long long expired;
+};
+
+// Results of luneffi_cpr_get_many. The responses are owned by the batch and
+// must not be passed to luneffi_cpr_response_free.
+struct LuneCprBatch {
+    std::unique_ptr<LuneCprResponse[]> responses;
+    unsigned long long count;
+    cpr::MultiPerform::PolicyStats policy_stats;
+};
+
+static void view_response(LuneCprResponse& target, const cpr::Response& stored) {
+    target.status_code = static_cast<int>(stored.status_code);
+    target.error_code = static_cast<int>(stored.error.code);
+    target.text = view_string(stored.text);
+    if (!stored.error.message.empty()) {
+        target.error = view_string(stored.error.message);
+    } else {
+        target.error = LuneCprString{nullptr, 0};
+    }
+}
+
+static void fill_response(LuneCprResponse& target, cpr::Response&& response) {
+    target.storage = std::move(response);
+    view_response(target, target.storage);
+}
+
+static const cpr::Response& stored_response(const LuneCprResponse& response) {
+    return response.shared ? *response.shared : response.storage;
+}
+
+static LuneCprResponse* make_response(cpr::Response&& response) {
+    auto* result = new (std::nothrow) LuneCprResponse{};
+    if (result == nullptr) {
+        return nullptr;
+    }
+
+    fill_response(*result, std::move(response));
+    return result;
+}
+
+static cpr::ConnectionPool& connection_pool();
+
+// Deadlines cross the bridge as milliseconds on the clock of
+// luneffi_cpr_now_ms, so one taken in Luau holds for every request made on
+// its behalf. 0 or less is no deadline.
+static std::optional<cpr::Deadline> deadline_at(long long deadline_ms) {
+    if (deadline_ms <= 0) {
+        return std::nullopt;
+    }
+    return cpr::Deadline{cpr::Deadline::Clock::time_point{std::chrono::milliseconds{deadline_ms}}};
+}
+
+static cpr::Response deadline_response(cpr::Session& session) {
+    cpr::Response response = session.Complete(CURLE_OPERATION_TIMEDOUT);
+    response.error.message = "Deadline passed before the request completed";
+    return response;
+}
+
+// Background transfer engine behind luneffi_cpr_submit. Transfers run on
+// shards, each a worker thread owning a curl multi handle, so TLS and
+// decompression of a large batch spread over the cores. Transfers go to the
+// shard of their origin, keeping the connections to a host on one multi
+// handle; every shard shares connection_pool()'s DNS and TLS session caches.
+// Submitted sessions are handed to a shard through its `submitted` queue and
+// finished responses come back through `completed`, so the calling (Luau)
+// thread never blocks on the network. Requests submitted with a coalescing
+// key join an identical one in flight through `flight_` instead of starting
+// a transfer of their own. Connected WebSockets are read by the shard of
+// their origin too, between transfers, waking it through their sockets.
+class LuneCprEngine {
+  public:
+    LuneCprEngine() : flight_(std::make_shared<cpr::SingleFlight>()) {}
+    LuneCprEngine(const LuneCprEngine& other) = delete;
+    LuneCprEngine& operator=(const LuneCprEngine& other) = delete;
+
+    ~LuneCprEngine() {
+        for (const std::unique_ptr<Shard>& shard : shards_) {
+            {
+                const std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->stop = true;
+            }
+            wakeup(*shard);
+        }
+        for (const std::unique_ptr<Shard>& shard : shards_) {
+            if (shard->worker.joinable()) {
+                shard->worker.join();
+            }
+            for (auto& [handle, transfer] : shard->active) {
+                curl_multi_remove_handle(shard->multi, handle);
+            }
+            shard->active.clear();
+            curl_multi_cleanup(shard->multi);
+        }
+        for (LuneCprResponse* response : completed_) {
+            delete response;
+        }
+    }
+
+    // Shards to start with, 0 for one per available CPU. Only possible until
+    // the first submission.
+    bool SetShardCount(size_t count) {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (!shards_.empty()) {
+            return false;
+        }
+        shard_count_ = count;
+        return true;
+    }
+
+    size_t ShardCount() {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (!shards_.empty()) {
+            return shards_.size();
+        }
+        return shard_count_ > 0 ? shard_count_ : cpr::AvailableConcurrency();
+    }
+
+    // With a non-empty `key`, the ticket joins a transfer in flight for the
+    // same key if there is one, and completes with its response.
+    unsigned long long Submit(std::shared_ptr<cpr::Session> session, std::string key = {}) {
+        const size_t origin = std::hash<std::string>{}(origin_of(session->GetFullRequestUrl()));
+
+        unsigned long long ticket = 0;
+        Shard* shard = nullptr;
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            if (!start_shards()) {
+                return 0;
+            }
+            const size_t index = origin % shards_.size();
+            shard = shards_[index].get();
+            ticket = ++next_ticket_;
+            outstanding_.emplace(ticket, index);
+            ++pending_;
+            if (!key.empty()) {
+                // The waiter runs on a worker once the transfer it joined
+                // finishes, after this lock is released
+                const uint64_t id = flight_->Join(key, [this, ticket](const cpr::SingleFlight::SharedResponse& response) { deliver(ticket, share_response(response)); });
+                if (id != 0) {
+                    followers_.emplace(ticket, Follower{std::move(key), id});
+                    return ticket;
+                }
+            }
+            const std::lock_guard<std::mutex> shard_lock(shard->mutex);
+            if (!shard->worker.joinable()) {
+                shard->worker = std::thread([this, shard] { run(*shard); });
+            }
+            shard->submitted.push_back(Transfer{ticket, std::move(session), std::move(key)});
+        }
+        wakeup(*shard);
+        return ticket;
+    }
+
+    // Hands the cancellation to the shard running the transfer, which removes
+    // it from its multi handle on its next wakeup. The transfer still
+    // completes, with ABORTED_BY_CALLBACK, unless it finished in the meantime.
+    // A ticket that joined another one's transfer leaves it right away.
+    bool Cancel(unsigned long long ticket) {
+        Shard* shard = nullptr;
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            auto outstanding = outstanding_.find(ticket);
+            if (outstanding == outstanding_.end()) {
+                return false;
+            }
+            auto follower = followers_.find(ticket);
+            if (follower != followers_.end()) {
+                // Otherwise its waiter is running and about to deliver it
+                if (flight_->Leave(follower->second.key, follower->second.id)) {
+                    followers_.erase(follower);
+                    complete(ticket, cancelled_response());
+                }
+            } else {
+                shard = shards_[outstanding->second].get();
+                const std::lock_guard<std::mutex> shard_lock(shard->mutex);
+                shard->cancelled.push_back(ticket);
+            }
+        }
+        completed_cond_.notify_all();
+        if (shard != nullptr) {
+            wakeup(*shard);
+        }
+        return true;
+    }
+
+    cpr::SingleFlight::Stats FlightStats() const {
+        return flight_->GetStats();
+    }
+
+    unsigned long long Poll(LuneCprResponse** out, unsigned long long max) {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        unsigned long long count = 0;
+        while (count < max && !completed_.empty()) {
+            out[count++] = completed_.front();
+            completed_.pop_front();
+        }
+        return count;
+    }
+
+    // Completions ready, plus WebSockets with frames that arrived since
+    // their reader last looked
+    unsigned long long Wait(long long timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        completed_cond_.wait_for(lock, std::chrono::milliseconds{timeout_ms}, [this] { return !completed_.empty() || streams_ready_ > 0 || pending_ == 0; });
+        return completed_.size() + streams_ready_;
+    }
+
+    // A connected WebSocket, read by the shard it went to as frames arrive
+    struct Stream {
+        std::shared_ptr<cpr::WebSocket> socket;
+        unsigned long long ticket{0};
+        size_t shard{0};
+        // Guarded by the engine's mutex_. Set when frames arrived, cleared
+        // by the reader looking at them.
+        bool signalled{false};
+        // Set while a frame waits for the reader to release room in the ring
+        std::atomic<bool> blocked{false};
+    };
+
+    // Hands `stream` to the shard of its origin and returns its ticket,
+    // which completes once the connection closed: with the close frame's
+    // status code and reason, or the error that ended it.
+    unsigned long long Open(const std::shared_ptr<Stream>& stream, const std::string& url) {
+        Shard* shard = nullptr;
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            if (!start_shards()) {
+                return 0;
+            }
+            stream->shard = std::hash<std::string>{}(origin_of(url)) % shards_.size();
+            stream->ticket = ++next_ticket_;
+            shard = shards_[stream->shard].get();
+            outstanding_.emplace(stream->ticket, stream->shard);
+            ++pending_;
+            const std::lock_guard<std::mutex> shard_lock(shard->mutex);
+            if (!shard->worker.joinable()) {
+                shard->worker = std::thread([this, shard] { run(*shard); });
+            }
+            shard->opened.push_back(stream);
+        }
+        wakeup(*shard);
+        return stream->ticket;
+    }
+
+    // Called by the reader before it looks at the frames of `stream`
+    void Acknowledge(Stream& stream) {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (stream.signalled) {
+            stream.signalled = false;
+            --streams_ready_;
+        }
+    }
+
+    // Has the shard of `stream` read it again, after the reader released
+    // room or closed it
+    void Nudge(Stream& stream) {
+        stream.blocked.store(false, std::memory_order_release);
+        wakeup(*shards_[stream.shard]);
+    }
+
+    unsigned long long Pending() {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        return pending_;
+    }
+
+  private:
+    struct Transfer {
+        // 0 once cancelled while other tickets still wait for the transfer
+        unsigned long long ticket;
+        std::shared_ptr<cpr::Session> session;
+        // Coalescing key, empty for transfers nobody can join
+        std::string key;
+    };
+
+    // Transfers of a shard start earliest deadline first, those without one last
+    static cpr::Deadline::Clock::time_point deadline_of(const Transfer& transfer) {
+        const std::optional<cpr::Deadline>& deadline = transfer.session->GetDeadline();
+        return deadline ? deadline->when : cpr::Deadline::Clock::time_point::max();
+    }
+
+    struct Follower {
+        std::string key;
+        uint64_t id;
+    };
+
+    struct Shard {
+        CURLM* multi{nullptr};
+        std::thread worker;
+        // Guards submitted, opened, cancelled and stop
+        std::mutex mutex;
+        std::deque<Transfer> submitted;
+        std::vector<std::shared_ptr<Stream>> opened;
+        std::vector<unsigned long long> cancelled;
+        bool stop{false};
+        // Worker-only
+        std::unordered_map<CURL*, Transfer> active;
+        // Worker-only index of active by ticket, for cancellation
+        std::unordered_map<unsigned long long, CURL*> tickets;
+        // Worker-only deadlines of active transfers, by ticket. Those that
+        // finished in time are skipped when they fire.
+        cpr::TimerWheel deadlines;
+        // Worker-only WebSockets still open
+        std::vector<std::shared_ptr<Stream>> streams;
+    };
+
+    // Scheme, host and port of `url`, lowercased
+    static std::string origin_of(const std::string& url) {
+        const size_t scheme_end = url.find("://");
+        const size_t authority_end = scheme_end == std::string::npos ? std::string::npos : url.find_first_of("/?#", scheme_end + 3);
+        std::string origin = url.substr(0, authority_end);
+        std::transform(origin.begin(), origin.end(), origin.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return origin;
+    }
+
+    // Called with mutex_ held. Workers start on a shard's first transfer.
+    bool start_shards() {
+        if (!shards_.empty()) {
+            return true;
+        }
+        const size_t count = shard_count_ > 0 ? shard_count_ : cpr::AvailableConcurrency();
+        for (size_t index = 0; index < count; ++index) {
+            auto shard = std::make_unique<Shard>();
+            shard->multi = curl_multi_init();
+            if (shard->multi == nullptr) {
+                for (const std::unique_ptr<Shard>& created : shards_) {
+                    curl_multi_cleanup(created->multi);
+                }
+                shards_.clear();
+                return false;
+            }
+            shards_.push_back(std::move(shard));
+        }
+        return true;
+    }
+
+    static void wakeup(Shard& shard) {
+#if LIBCURL_VERSION_NUM >= 0x074400 // 7.68.0
+        curl_multi_wakeup(shard.multi);
+#else
+        static_cast<void>(shard);
+#endif
+    }
+
+    void run(Shard& shard) {
+        std::deque<Transfer> incoming;
+        std::vector<unsigned long long> cancelled;
+        std::vector<uint64_t> expired;
+        std::vector<curl_waitfd> sockets;
+        while (true) {
+            {
+                const std::lock_guard<std::mutex> lock(shard.mutex);
+                if (shard.stop) {
+                    return;
+                }
+                incoming.swap(shard.submitted);
+                cancelled.swap(shard.cancelled);
+                std::move(shard.opened.begin(), shard.opened.end(), std::back_inserter(shard.streams));
+                shard.opened.clear();
+            }
+
+            if (!incoming.empty()) {
+                // Picks up limits changed since the shard started
+                connection_pool().SetupMulti(shard.multi);
+            }
+            // Limits of the pool queue transfers inside libcurl in the order they are added
+            std::stable_sort(incoming.begin(), incoming.end(), [](const Transfer& a, const Transfer& b) { return deadline_of(a) < deadline_of(b); });
+            for (Transfer& transfer : incoming) {
+                transfer.session->PrepareGet();
+                const std::optional<cpr::Deadline>& deadline = transfer.session->GetDeadline();
+                if (deadline && deadline->Expired()) {
+                    // Its caller gave up already, so it does not take a connection
+                    finish(transfer, deadline_response(*transfer.session));
+                    continue;
+                }
+                CURL* handle = transfer.session->GetCurlHolder()->handle;
+                if (curl_multi_add_handle(shard.multi, handle) != CURLM_OK) {
+                    finish(transfer, transfer.session->Complete(CURLE_FAILED_INIT));
+                    continue;
+                }
+                if (deadline) {
+                    shard.deadlines.Schedule(deadline->when, transfer.ticket);
+                }
+                shard.tickets.emplace(transfer.ticket, handle);
+                shard.active.emplace(handle, std::move(transfer));
+            }
+            incoming.clear();
+
+            for (const unsigned long long ticket : cancelled) {
+                cancel(shard, ticket);
+            }
+            cancelled.clear();
+
+            int still_running = 0;
+            curl_multi_perform(shard.multi, &still_running);
+
+            int queued = 0;
+            while (CURLMsg* message = curl_multi_info_read(shard.multi, &queued)) {
+                if (message->msg != CURLMSG_DONE) {
+                    continue;
+                }
+
+                auto it = shard.active.find(message->easy_handle);
+                if (it == shard.active.end()) {
+                    continue;
+                }
+
+                curl_multi_remove_handle(shard.multi, message->easy_handle);
+                Transfer transfer = std::move(it->second);
+                shard.active.erase(it);
+                shard.tickets.erase(transfer.ticket);
+                // NOLINTNEXTLINE (cppcoreguidelines-pro-type-union-access)
+                finish(transfer, transfer.session->Complete(message->data.result));
+            }
+
+            expired.clear();
+            shard.deadlines.Advance(std::chrono::steady_clock::now(), expired);
+            for (const uint64_t ticket : expired) {
+                expire(shard, ticket);
+            }
+
+            serve(shard);
+            // The multi handle wakes up for frames too, but not for streams
+            // waiting for their reader
+            sockets.clear();
+            for (const std::shared_ptr<Stream>& stream : shard.streams) {
+                const curl_socket_t socket = stream->socket->Socket();
+                if (socket != CURL_SOCKET_BAD && !stream->blocked.load(std::memory_order_acquire)) {
+                    sockets.push_back(curl_waitfd{socket, CURL_WAIT_POLLIN, 0});
+                }
+            }
+
+            int timeout_ms = 1000;
+#if LIBCURL_VERSION_NUM < 0x074400 // 7.68.0
+            timeout_ms = 50;
+#endif
+            if (const auto next = shard.deadlines.NextExpiry()) {
+                const auto left = std::chrono::ceil<std::chrono::milliseconds>(*next - std::chrono::steady_clock::now()).count();
+                timeout_ms = static_cast<int>(std::clamp<long long>(left, 0, timeout_ms));
+            }
+#if LIBCURL_VERSION_NUM >= 0x074400 // 7.68.0
+            curl_multi_poll(shard.multi, sockets.data(), static_cast<unsigned int>(sockets.size()), timeout_ms, nullptr);
+#else
+            curl_multi_wait(shard.multi, sockets.data(), static_cast<unsigned int>(sockets.size()), timeout_ms, nullptr);
+#endif
+        }
+    }
+
+    // Reads what arrived on the shard's WebSockets into their rings, without
+    // blocking, and completes the tickets of those that closed.
+    void serve(Shard& shard) {
+        for (size_t index = 0; index < shard.streams.size();) {
+            Stream& stream = *shard.streams[index];
+            if (stream.blocked.load(std::memory_order_acquire)) {
+                ++index;
+                continue;
+            }
+
+            const uint64_t before = stream.socket->GetStats().frames_received;
+            cpr::WebSocket::ReadResult result = stream.socket->Read();
+            if (result == cpr::WebSocket::ReadResult::FULL) {
+                stream.blocked.store(true, std::memory_order_release);
+                // The reader may have released room before it could see the flag
+                result = stream.socket->Read();
+                if (result != cpr::WebSocket::ReadResult::FULL) {
+                    stream.blocked.store(false, std::memory_order_release);
+                }
+            }
+            const bool arrived = stream.socket->GetStats().frames_received != before;
+            if (result != cpr::WebSocket::ReadResult::CLOSED) {
+                if (arrived) {
+                    {
+                        const std::lock_guard<std::mutex> lock(mutex_);
+                        if (!stream.signalled) {
+                            stream.signalled = true;
+                            ++streams_ready_;
+                        }
+                    }
+                    completed_cond_.notify_all();
+                }
+                ++index;
+                continue;
+            }
+
+            // Frames still in the ring stay readable through the handle
+            cpr::Response response;
+            response.status_code = stream.socket->GetCloseCode();
+            response.text = stream.socket->GetCloseReason();
+            response.error = stream.socket->GetError();
+            {
+                const std::lock_guard<std::mutex> lock(mutex_);
+                if (stream.signalled) {
+                    stream.signalled = false;
+                    --streams_ready_;
+                }
+                complete(stream.ticket, std::move(response));
+            }
+            completed_cond_.notify_all();
+            shard.streams[index] = std::move(shard.streams.back());
+            shard.streams.pop_back();
+        }
+    }
+
+    // Ends the transfer of `ticket` with OPERATION_TIMEDOUT once its deadline
+    // passed, unless it finished or was cancelled in the meantime.
+    void expire(Shard& shard, unsigned long long ticket) {
+        auto ticket_it = shard.tickets.find(ticket);
+        if (ticket_it == shard.tickets.end()) {
+            return;
+        }
+        auto it = shard.active.find(ticket_it->second);
+        shard.tickets.erase(ticket_it);
+        if (it == shard.active.end()) {
+            return;
+        }
+
+        curl_multi_remove_handle(shard.multi, it->first);
+        Transfer transfer = std::move(it->second);
+        shard.active.erase(it);
+        finish(transfer, deadline_response(*transfer.session));
+    }
+
+    // Removing the easy handle closes its connection if the response was not
+    // complete, so the socket is released right away rather than at the next
+    // progress callback.
+    void cancel(Shard& shard, unsigned long long ticket) {
+        auto ticket_it = shard.tickets.find(ticket);
+        if (ticket_it == shard.tickets.end()) {
+            // A WebSocket's ticket closes it, and completes as it would then
+            for (const std::shared_ptr<Stream>& stream : shard.streams) {
+                if (stream->ticket == ticket) {
+                    stream->socket->Close();
+                    stream->blocked.store(false, std::memory_order_release);
+                }
+            }
+            return;
+        }
+        auto it = shard.active.find(ticket_it->second);
+        shard.tickets.erase(ticket_it);
+        if (it == shard.active.end()) {
+            return;
+        }
+
+        // Tickets that joined the transfer still want its response, so only
+        // this one is cancelled and the transfer goes on without it
+        if (!it->second.key.empty() && flight_->Waiting(it->second.key) > 0) {
+            it->second.ticket = 0;
+            deliver(ticket, make_response(cancelled_response()));
+            return;
+        }
+
+        curl_multi_remove_handle(shard.multi, it->first);
+        Transfer transfer = std::move(it->second);
+        shard.active.erase(it);
+        cpr::Response response = transfer.session->Complete(CURLE_ABORTED_BY_CALLBACK);
+        response.error.message = "Request cancelled";
+        finish(transfer, std::move(response));
+    }
+
+    void finish(const Transfer& transfer, cpr::Response&& response) {
+        if (transfer.key.empty()) {
+            deliver(transfer.ticket, make_response(std::move(response)));
+            return;
+        }
+
+        // Every ticket that joined gets a view of the same response
+        auto shared = std::make_shared<const cpr::Response>(std::move(response));
+        flight_->Finish(transfer.key, shared);
+        if (transfer.ticket != 0) {
+            deliver(transfer.ticket, share_response(shared));
+        }
+    }
+
+    static LuneCprResponse* share_response(const cpr::SingleFlight::SharedResponse& response) {
+        auto* result = new (std::nothrow) LuneCprResponse{};
+        if (result != nullptr) {
+            result->shared = response;
+            view_response(*result, *result->shared);
+        }
+        return result;
+    }
+
+    static cpr::Response cancelled_response() {
+        cpr::Response response;
+        response.error = cpr::Error{CURLE_ABORTED_BY_CALLBACK, "Request cancelled"};
+        return response;
+    }
+
+    void deliver(unsigned long long ticket, LuneCprResponse* result) {
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            followers_.erase(ticket);
+            complete(ticket, result);
+        }
+        completed_cond_.notify_all();
+    }
+
+    void complete(unsigned long long ticket, cpr::Response&& response) {
+        complete(ticket, make_response(std::move(response)));
+    }
+
+    // Called with mutex_ held
+    void complete(unsigned long long ticket, LuneCprResponse* result) {
+        if (result != nullptr) {
+            result->ticket = ticket;
+        }
+        --pending_;
+        outstanding_.erase(ticket);
+        if (result != nullptr) {
+            completed_.push_back(result);
+        }
+    }
+
+    // Guards everything below but flight_. shards_ does not change once the
+    // first submission created it.
+    std::mutex mutex_;
+    std::condition_variable completed_cond_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    size_t shard_count_{0};
+    std::deque<LuneCprResponse*> completed_;
+    // Tickets submitted but not completed, with the shard they went to
+    std::unordered_map<unsigned long long, size_t> outstanding_;
+    // Tickets waiting for another ticket's transfer, by ticket
+    std::unordered_map<unsigned long long, Follower> followers_;
+    std::shared_ptr<cpr::SingleFlight> flight_;
+    unsigned long long next_ticket_{0};
+    unsigned long long pending_{0};
+    // Streams with their signalled flag set
+    unsigned long long streams_ready_{0};
+};
+
+// Resolves the hosts of the bridge's requests ahead of them, through
+// connection_pool(). Never destroyed, like the pool.
+static const std::shared_ptr<cpr::DnsCache>& dns_cache() {
+    static auto* cache = new std::shared_ptr<cpr::DnsCache>{std::make_shared<cpr::DnsCache>()};
+    return *cache;
+}
+
+// Recycles the bodies of the bridge's responses, given back by
+// luneffi_cpr_response_free and luneffi_cpr_batch_free. Never destroyed, like
+// connection_pool().
+static const std::shared_ptr<cpr::BodyPool>& body_pool() {
+    static auto* pool = new std::shared_ptr<cpr::BodyPool>{std::make_shared<cpr::BodyPool>()};
+    return *pool;
+}
+
+// Hands the body of `response` back to body_pool(). Responses sharing the
+// body of another transfer have none of their own.
+static void recycle_body(LuneCprResponse& response) {
+    body_pool()->Release(std::move(response.storage.text));
+}
+
+// Shared by every request made through the bridge, so connections, DNS
+// lookups and TLS sessions carry over between sessions, batches and the
+// completion queue. Never destroyed, since easy handles owned by other
+// statics still point at it during exit.
+static cpr::ConnectionPool& connection_pool() {
+    static auto* pool = [] {
+        cpr::ConnectionPoolOptions options;
+        options.share_dns = true;
+        options.share_ssl_session = true;
+        options.dns_cache = dns_cache();
+        options.body_pool = body_pool();
+        return new cpr::ConnectionPool{options};
+    }();
+    return *pool;
+}
+
+static LuneCprEngine& engine() {
+    static LuneCprEngine instance;
+    return instance;
+}
+
+LuneCprResponse* luneffi_cpr_get(const char* url) {
+    if (url == nullptr) {
+        return nullptr;
+    }
+
+    return make_response(cpr::Get(
+        cpr::Url{url},
+        cpr::Proxies{{"http", ""}, {"https", ""}},
+        cpr::Timeout{5000},
+        cpr::ResponseCookies{false},
+        connection_pool()
+    ));
+}
+
+// Downloads `url` straight into the file at `path` through cpr::FileSink,
+// so the body never sits in memory. The returned response carries status
+// and error, its text is empty. Returns null if the file can't be created.
+LuneCprResponse* luneffi_cpr_download_to_file(const char* url, const char* path) {
+    if (url == nullptr || path == nullptr) {
+        return nullptr;
+    }
+
+    cpr::FileSink sink{cpr::fs::u8path(path)};
+    if (!sink.IsOpen()) {
+        return nullptr;
+    }
+
+    cpr::Response response = cpr::Download(
+        sink,
+        cpr::Url{url},
+        cpr::Proxies{{"http", ""}, {"https", ""}},
+        cpr::ConnectTimeout{5000},
+        cpr::ResponseCookies{false},
+        connection_pool()
+    );
+    if (!sink.Close() && response.error.code == cpr::ErrorCode::OK) {
+        response.error = cpr::Error{CURLE_WRITE_ERROR, std::strerror(sink.GetError())};
+    }
+    return make_response(std::move(response));
+}
+
+// Like luneffi_cpr_download_to_file, but splits the body into up to
+// `segments` concurrent range requests over the shared connection pool.
+// Servers without range support are downloaded with a single request.
+LuneCprResponse* luneffi_cpr_download_segmented(const char* url, const char* path, unsigned long long segments) {
+    if (url == nullptr || path == nullptr || segments == 0) {
+        return nullptr;
+    }
+
+    cpr::SegmentedDownloadOptions options;
+    options.segments = static_cast<size_t>(segments);
+    return make_response(cpr::SegmentedDownload(
+        cpr::fs::u8path(path),
+        options,
+        cpr::Url{url},
+        cpr::Proxies{{"http", ""}, {"https", ""}},
+        cpr::ConnectTimeout{5000},
+        cpr::ResponseCookies{false},
+        connection_pool()
+    ));
+}
+
+static LuneCprBatch* get_many(const char* const* urls, unsigned long long count, const LuneCprBatchPolicy* policy, const long long* deadlines_ms = nullptr) {
+    if (urls == nullptr && count > 0) {
+        return nullptr;
+    }
+
+    auto* batch = new (std::nothrow) LuneCprBatch{};
+    if (batch == nullptr) {
+        return nullptr;
+    }
+
+    batch->count = count;
+    if (count == 0) {
+        return batch;
+    }
+
+    batch->responses.reset(new (std::nothrow) LuneCprResponse[count]());
+    if (batch->responses == nullptr) {
+        delete batch;
+        return nullptr;
+    }
+
+    cpr::MultiPerform multi;
+    multi.SetEngine(cpr::MultiPerform::Engine::SOCKET_ACTION);
+    for (unsigned long long index = 0; index < count; ++index) {
+        if (urls[index] == nullptr) {
+            delete batch;
+            return nullptr;
+        }
+
+        auto session = std::make_shared<cpr::Session>();
+        session->SetUrl(cpr::Url{urls[index]});
+        session->SetProxies(cpr::Proxies{{"http", ""}, {"https", ""}});
+        session->SetTimeout(cpr::Timeout{5000});
+        session->SetConnectionPool(connection_pool());
+        session->SetResponseCookies(false);
+        if (deadlines_ms != nullptr) {
+            session->SetDeadline(deadline_at(deadlines_ms[index]));
+        }
+        multi.AddSession(session);
+        if (policy != nullptr && policy->max_attempts > 1) {
+            cpr::MultiPerform::RetryPolicy retry;
+            retry.max_attempts = static_cast<size_t>(policy->max_attempts);
+            retry.base_delay = std::chrono::milliseconds{std::max(policy->base_delay_ms, 0LL)};
+            retry.max_delay = std::chrono::milliseconds{std::max(policy->max_delay_ms, 0LL)};
+            multi.SetRetryPolicy(session, retry);
+        }
+        if (policy != nullptr && policy->hedge_delay_ms > 0) {
+            cpr::MultiPerform::HedgePolicy hedge;
+            hedge.delay = std::chrono::milliseconds{policy->hedge_delay_ms};
+            multi.SetHedgePolicy(session, hedge);
+        }
+    }
+
+    multi.Get([batch](size_t index, cpr::Response&& response) { fill_response(batch->responses[index], std::move(response)); });
+    batch->policy_stats = multi.GetPolicyStats();
+
+    return batch;
+}
+
+LuneCprBatch* luneffi_cpr_get_many(const char* const* urls, unsigned long long count) {
+    return get_many(urls, count, nullptr);
+}
+
+// Like luneffi_cpr_get_many, but retries and hedges every request of the
+// batch as `policy` says, inside the same multi handle.
+LuneCprBatch* luneffi_cpr_get_many_with_policy(const char* const* urls, unsigned long long count, const LuneCprBatchPolicy* policy) {
+    if (policy == nullptr) {
+        return nullptr;
+    }
+
+    return get_many(urls, count, policy);
+}
+
+// Like luneffi_cpr_get_many, with a deadline per request on the clock of
+// luneffi_cpr_now_ms, 0 for none. Requests start earliest deadline first;
+// those whose deadline passes fail with OPERATION_TIMEDOUT, without being
+// sent if it passed before their turn came.
+LuneCprBatch* luneffi_cpr_get_many_with_deadlines(const char* const* urls, const long long* deadlines_ms, unsigned long long count) {
+    if (deadlines_ms == nullptr && count > 0) {
+        return nullptr;
+    }
+
+    return get_many(urls, count, nullptr, deadlines_ms);
+}
+
+int luneffi_cpr_batch_deadline_stats(const LuneCprBatch* batch, LuneCprBatchDeadlineStats* out) {
+    if (batch == nullptr || out == nullptr) {
+        return -1;
+    }
+
+    out->shed = batch->policy_stats.shed;
+    out->expired = batch->policy_stats.expired;
+    return 0;
+}
+
+int luneffi_cpr_batch_policy_stats(const LuneCprBatch* batch, LuneCprBatchPolicyStats* out) {
+    if (batch == nullptr || out == nullptr) {
+        return -1;
+    }
+
+    out->retries = batch->policy_stats.retries;
+    out->hedges = batch->policy_stats.hedges;
+    out->hedges_won = batch->policy_stats.hedges_won;
+    return 0;
+}
+
+void luneffi_cpr_batch_free(LuneCprBatch* batch) {
+    if (batch == nullptr) {
+        return;
+    }
+
+    for (unsigned long long index = 0; index < batch->count && batch->responses != nullptr; ++index) {
+        recycle_body(batch->responses[index]);
+    }
+    delete batch;
+}
+
+unsigned long long luneffi_cpr_batch_count(const LuneCprBatch* batch) {
+    return batch != nullptr ? batch->count : 0ULL;
+}
+
+const LuneCprResponse* luneffi_cpr_batch_response(const LuneCprBatch* batch, unsigned long long index) {
+    if (batch == nullptr || index >= batch->count) {
+        return nullptr;
+    }
+
+    return &batch->responses[index];
+}
+
+static std::shared_ptr<cpr::Session> make_submitted_session(const char* url) {
+    auto session = std::make_shared<cpr::Session>();
+    session->SetUrl(cpr::Url{url});
+    session->SetProxies(cpr::Proxies{{"http", ""}, {"https", ""}});
+    session->SetTimeout(cpr::Timeout{5000});
+    session->SetConnectionPool(connection_pool());
+    session->SetResponseCookies(false);
+    return session;
+}
+
+// Runs the transfers of luneffi_cpr_submit on `count` event loops, 0 for one
+// per available CPU, the default. Returns -1 once something was submitted.
+int luneffi_cpr_set_engine_shards(unsigned long long count) {
+    return engine().SetShardCount(static_cast<size_t>(count)) ? 0 : -1;
+}
+
+unsigned long long luneffi_cpr_engine_shards(void) {
+    return engine().ShardCount();
+}
+
+unsigned long long luneffi_cpr_submit(const char* url) {
+    if (url == nullptr) {
+        return 0;
+    }
+
+    return engine().Submit(make_submitted_session(url));
+}
+
+// Like luneffi_cpr_submit, failing the request with OPERATION_TIMEDOUT once
+// `deadline_ms` on the clock of luneffi_cpr_now_ms has passed: right away,
+// without being sent, if it already has when a shard picks it up. Shards
+// start what was submitted together earliest deadline first.
+unsigned long long luneffi_cpr_submit_with_deadline(const char* url, long long deadline_ms) {
+    if (url == nullptr) {
+        return 0;
+    }
+
+    std::shared_ptr<cpr::Session> session = make_submitted_session(url);
+    session->SetDeadline(deadline_at(deadline_ms));
+    return engine().Submit(std::move(session));
+}
+
+// Like luneffi_cpr_submit, but joins a GET of the same URL submitted this
+// way and still in flight instead of starting another transfer. Every
+// ticket of a shared transfer completes with its own response handle, all
+// viewing the same body. Cancelling one ticket leaves the others waiting.
+unsigned long long luneffi_cpr_submit_shared(const char* url) {
+    if (url == nullptr) {
+        return 0;
+    }
+
+    std::shared_ptr<cpr::Session> session = make_submitted_session(url);
+    std::string key = cpr::SingleFlight::KeyFor(*session);
+    return engine().Submit(std::move(session), std::move(key));
+}
+
+int luneffi_cpr_single_flight_stats(LuneCprSingleFlightStats* out) {
+    if (out == nullptr) {
+        return -1;
+    }
+
+    const cpr::SingleFlight::Stats stats = engine().FlightStats();
+    out->transfers = stats.transfers;
+    out->coalesced = stats.coalesced;
+    out->in_flight = stats.in_flight;
+    return 0;
+}
+
+// Cancels a submitted request: its transfer is removed from the background
+// multi handle and its connection dropped, instead of waiting for the next
+// progress tick. The cancelled request is still delivered through the
+// completion queue, with cpr's ABORTED_BY_CALLBACK error code. Returns 1 if
+// the ticket was outstanding, 0 if it is unknown or already completed.
+int luneffi_cpr_cancel(unsigned long long ticket) {
+    return engine().Cancel(ticket) ? 1 : 0;
+}
+
+LuneCprResponse* luneffi_cpr_poll(void) {
+    LuneCprResponse* response = nullptr;
+    return engine().Poll(&response, 1) == 1 ? response : nullptr;
+}
+
+unsigned long long luneffi_cpr_poll_completions(LuneCprResponse** out, unsigned long long max) {
+    if (out == nullptr) {
+        return 0;
+    }
+
+    return engine().Poll(out, max);
+}
+
+unsigned long long luneffi_cpr_wait_completions(long long timeout_ms) {
+    return engine().Wait(timeout_ms > 0 ? timeout_ms : 0);
+}
+
+unsigned long long luneffi_cpr_pending(void) {
+    return engine().Pending();
+}
+
+unsigned long long luneffi_cpr_prewarm(const char* const* hosts, unsigned long long count, unsigned long long connections_per_host) {
+    if (hosts == nullptr || count == 0 || connections_per_host == 0) {
+        return 0;
+    }
+
+    std::vector<std::string> origins;
+    origins.reserve(count);
+    for (unsigned long long index = 0; index < count; ++index) {
+        if (hosts[index] == nullptr) {
+            return 0;
+        }
+        origins.emplace_back(hosts[index]);
+    }
+
+    return connection_pool().Prewarm(origins, connections_per_host);
+}
+
+// Resolves the hosts in the background so the first requests to them skip
+// the lookup, waiting up to timeout_ms for all of them. Returns how many of
+// them have addresses by then; with no timeout only the hosts resolved
+// earlier count.
+unsigned long long luneffi_cpr_dns_prefetch(const char* const* hosts, unsigned long long count, long long timeout_ms) {
+    if (hosts == nullptr || count == 0) {
+        return 0;
+    }
+
+    std::vector<std::string> names;
+    names.reserve(count);
+    for (unsigned long long index = 0; index < count; ++index) {
+        if (hosts[index] == nullptr) {
+            return 0;
+        }
+        names.emplace_back(hosts[index]);
+    }
+
+    dns_cache()->Prefetch(names);
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{std::max(timeout_ms, 0LL)};
+    unsigned long long resolved = 0;
+    for (const std::string& name : names) {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (dns_cache()->Resolve(name, std::max(left, std::chrono::milliseconds{0}))) {
+            ++resolved;
+        }
+    }
+    return resolved;
+}
+
+int luneffi_cpr_dns_stats(LuneCprDnsStats* out) {
+    if (out == nullptr) {
+        return -1;
+    }
+
+    const cpr::DnsCache::Stats stats = dns_cache()->GetStats();
+    out->hits = stats.hits;
+    out->stale_hits = stats.stale_hits;
+    out->misses = stats.misses;
+    out->resolutions = stats.resolutions;
+    out->refreshes = stats.refreshes;
+    out->failures = stats.failures;
+    out->entries = stats.entries;
+    return 0;
+}
+
+int luneffi_cpr_body_pool_stats(LuneCprBodyPoolStats* out) {
+    if (out == nullptr) {
+        return -1;
+    }
+
+    const cpr::BodyPool::Stats stats = body_pool()->GetStats();
+    out->acquires = stats.acquires;
+    out->hits = stats.hits;
+    out->misses = stats.misses;
+    out->releases = stats.releases;
+    out->discarded = stats.discarded;
+    out->buffers = stats.buffers;
+    out->bytes = stats.bytes;
+    return 0;
+}
+
+int luneffi_cpr_compression_stats(LuneCprCompressionStats* out) {
+    if (out == nullptr) {
+        return -1;
+    }
+
+    const cpr::CompressorPool::Stats stats = cpr::CompressorPool::Global().GetStats();
+    out->created = stats.created;
+    out->reused = stats.reused;
+    out->bytes_in = stats.bytes_in;
+    out->bytes_out = stats.bytes_out;
+    out->idle = stats.idle;
+    return 0;
+}
+
+void luneffi_cpr_dns_clear(void) {
+    dns_cache()->Clear();
+}
+
+// Bounds the connections the bridge's requests keep, see
+// cpr::ConnectionPoolLimits; 0 keeps libcurl's default. Sessions created
+// before the call keep the limits they were created with.
+void luneffi_cpr_set_connection_limits(unsigned long long max_connections, unsigned long long max_host_connections, unsigned long long max_idle_seconds, unsigned long long max_lifetime_seconds) {
+    cpr::ConnectionPoolLimits limits;
+    limits.max_connections = static_cast<size_t>(max_connections);
+    limits.max_host_connections = static_cast<size_t>(max_host_connections);
+    limits.max_idle = std::chrono::seconds{static_cast<std::chrono::seconds::rep>(max_idle_seconds)};
+    limits.max_lifetime = std::chrono::seconds{static_cast<std::chrono::seconds::rep>(max_lifetime_seconds)};
+    connection_pool().SetLimits(limits);
+}
+
+int luneffi_cpr_connection_stats(LuneCprConnectionStats* out) {
+    if (out == nullptr) {
+        return -1;
+    }
+
+    const cpr::ConnectionPool::Stats stats = connection_pool().GetStats();
+    out->connected = stats.connected;
+    out->reused = stats.reused;
+    out->closed = stats.closed;
+    out->evicted = stats.evicted;
+    out->open = stats.open;
+    out->idle = stats.idle;
+    return 0;
+}
+
+LuneCprSession* luneffi_cpr_session_create(void) {
+    auto* session = new (std::nothrow) LuneCprSession{};
+    if (session == nullptr) {
+        return nullptr;
+    }
+
+    session->session.SetProxies(cpr::Proxies{{"http", ""}, {"https", ""}});
+    session->session.SetTimeout(cpr::Timeout{5000});
+    session->session.SetConnectionPool(connection_pool());
+    session->session.SetResponseCookies(false);
+    return session;
+}
+
+void luneffi_cpr_session_destroy(LuneCprSession* session) {
+    delete session;
+}
+
+int luneffi_cpr_session_set_url(LuneCprSession* session, const char* url) {
+    if (session == nullptr || url == nullptr) {
+        return -1;
+    }
+
+    session->session.SetUrl(cpr::Url{url});
+    return 0;
+}
 
-    const auto length = static_cast<unsigned long long>(input.size());
-    char* buffer = static_cast<char*>(std::malloc(length + 1));
-    if (buffer == nullptr) {
-        return result;
+int luneffi_cpr_session_set_timeout(LuneCprSession* session, long long timeout_ms) {
+    if (session == nullptr || timeout_ms < 0) {
+        return -1;
     }
 
-    if (length > 0) {
-        std::memcpy(buffer, input.data(), length);
+    session->session.SetTimeout(cpr::Timeout{std::chrono::milliseconds{timeout_ms}});
+    return 0;
+}
+
+// Milliseconds on the steady clock deadlines are given on. Take it once per
+// caller and add its budget, so every request made for the caller shares
+// one deadline however long the earlier ones took.
+long long luneffi_cpr_now_ms(void) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(cpr::Deadline::Clock::now().time_since_epoch()).count();
+}
+
+// Fails the session's requests once `deadline_ms` on the clock of
+// luneffi_cpr_now_ms has passed, shortening their timeout to the time left
+// and not sending them at all once none is; 0 or less removes the deadline.
+int luneffi_cpr_session_set_deadline(LuneCprSession* session, long long deadline_ms) {
+    if (session == nullptr) {
+        return -1;
     }
-    buffer[length] = '\0';
 
-    result.data = buffer;
-    result.length = length;
-    return result;
+    session->session.SetDeadline(deadline_at(deadline_ms));
+    return 0;
 }
 
-static void destroy_string(LuneCprString& value) {
-    if (value.data != nullptr) {
-        std::free(const_cast<char*>(value.data));
-        value.data = nullptr;
-        value.length = 0;
+// Sends the session's requests over the Unix domain socket at `path`, or with
+// `abstract` set over the one of that name in Linux's abstract namespace,
+// such as a local sidecar's. The URL still names the host for the Host
+// header. Connections to the socket are kept and reused like TCP ones; a
+// null path goes back to TCP.
+int luneffi_cpr_session_set_unix_socket(LuneCprSession* session, const char* path, int abstract) {
+    if (session == nullptr) {
+        return -1;
     }
+
+    session->session.SetUnixSocket(cpr::UnixSocket{path != nullptr ? path : "", abstract != 0});
+    return 0;
 }
 
-LuneCprResponse* luneffi_cpr_get(const char* url) {
-    if (url == nullptr) {
+int luneffi_cpr_session_set_header(LuneCprSession* session, const char* name, const char* value) {
+    if (session == nullptr || name == nullptr || value == nullptr) {
+        return -1;
+    }
+
+    session->session.UpdateHeader(cpr::Header{{name, value}});
+    return 0;
+}
+
+int luneffi_cpr_session_clear_headers(LuneCprSession* session) {
+    if (session == nullptr) {
+        return -1;
+    }
+
+    session->session.SetHeader(cpr::Header{});
+    return 0;
+}
+
+// A body set afterwards would otherwise still go out with the chunked
+// transfer encoding of a stream set by luneffi_cpr_session_set_read_callback.
+static void drop_read_callback(cpr::Session& s) {
+    s.SetReadCallback(cpr::ReadCallback{});
+}
+
+int luneffi_cpr_session_set_body(LuneCprSession* session, const char* data, unsigned long long length) {
+    if (session == nullptr || (data == nullptr && length > 0)) {
+        return -1;
+    }
+
+    drop_read_callback(session->session);
+    session->parts.clear();
+    session->session.SetBody(cpr::Body{data != nullptr ? std::string(data, length) : std::string{}});
+    return 0;
+}
+
+// Sends `data` as the request body without copying it, e.g. straight out of
+// a Luau buffer or ffi.new region. The memory must stay valid and unchanged
+// until the last request using it has finished.
+int luneffi_cpr_session_set_body_view(LuneCprSession* session, const char* data, unsigned long long length) {
+    if (session == nullptr || (data == nullptr && length > 0)) {
+        return -1;
+    }
+
+    drop_read_callback(session->session);
+    session->parts.clear();
+    session->session.SetBodyView(cpr::BodyView{data != nullptr ? std::string_view(data, length) : std::string_view{}});
+    return 0;
+}
+
+static int add_part(LuneCprSession* session, cpr::Part&& part) {
+    drop_read_callback(session->session);
+    session->parts.push_back(std::move(part));
+    session->session.SetMultipart(cpr::Multipart{session->parts});
+    return 0;
+}
+
+// Adds a text field to the session's multipart body, replacing any other
+// body. `content_type` may be null.
+int luneffi_cpr_session_add_part(LuneCprSession* session, const char* name, const char* value, const char* content_type) {
+    if (session == nullptr || name == nullptr || value == nullptr) {
+        return -1;
+    }
+
+    return add_part(session, cpr::Part{name, std::string{value}, content_type != nullptr ? content_type : ""});
+}
+
+// Adds a part sent straight out of `data`, e.g. a Luau buffer or ffi.new
+// region, without copying it. The memory must stay valid and unchanged until
+// the last request using it has finished.
+int luneffi_cpr_session_add_part_view(LuneCprSession* session, const char* name, const char* data, unsigned long long length, const char* filename, const char* content_type) {
+    if (session == nullptr || name == nullptr || (data == nullptr && length > 0)) {
+        return -1;
+    }
+
+    static const char empty = '\0';
+    const char* begin = data != nullptr ? data : &empty;
+    return add_part(session, cpr::Part{name, cpr::Buffer{begin, begin + length, cpr::fs::path{filename != nullptr ? filename : ""}}, content_type != nullptr ? content_type : ""});
+}
+
+// Adds `length` bytes of the file at `path` from `offset` on, the rest of
+// the file for a negative length, read in chunks while the request is sent.
+// The filename sent defaults to the one of `path`.
+int luneffi_cpr_session_add_part_file(LuneCprSession* session, const char* name, const char* path, long long offset, long long length, const char* filename, const char* content_type) {
+    if (session == nullptr || name == nullptr || path == nullptr || offset < 0) {
+        return -1;
+    }
+
+    return add_part(session, cpr::Part{name, cpr::FileRange{path, offset, length, filename != nullptr ? filename : ""}, content_type != nullptr ? content_type : ""});
+}
+
+// Like luneffi_cpr_session_add_part_file, from a descriptor the caller keeps
+// open until the last request using it has finished. Its file position is
+// left alone.
+int luneffi_cpr_session_add_part_fd(LuneCprSession* session, const char* name, int fd, long long offset, long long length, const char* filename, const char* content_type) {
+    if (session == nullptr || name == nullptr || fd < 0 || offset < 0) {
+        return -1;
+    }
+
+    return add_part(session, cpr::Part{name, cpr::FileRange{fd, offset, length, filename != nullptr ? filename : ""}, content_type != nullptr ? content_type : ""});
+}
+
+// Removes the multipart body and every part of it.
+int luneffi_cpr_session_clear_parts(LuneCprSession* session) {
+    if (session == nullptr) {
+        return -1;
+    }
+
+    session->session.RemoveContent();
+    session->parts.clear();
+    return 0;
+}
+
+// Fills `buffer` with up to `capacity` bytes of the request body and returns
+// how many were written, 0 at the end of the body or a negative value to
+// abort the transfer. Called on the thread performing the request.
+typedef long long (*LuneCprReadFn)(char* buffer, unsigned long long capacity, void* userdata);
+
+// Streams the request body from `read`, so uploads don't have to fit in
+// memory. A negative `size` sends the body with chunked transfer encoding.
+// Replaces any body set before; pass a null `read` to remove the stream.
+int luneffi_cpr_session_set_read_callback(LuneCprSession* session, LuneCprReadFn read, void* userdata, long long size) {
+    if (session == nullptr) {
+        return -1;
+    }
+
+    cpr::Session& s = session->session;
+    s.RemoveContent();
+    session->parts.clear();
+    if (read == nullptr) {
+        drop_read_callback(s);
+        return 0;
+    }
+
+    s.SetReadCallback(cpr::ReadCallback{size < 0 ? -1 : size, [read, userdata](char* buffer, size_t& length, intptr_t /*userdata*/) {
+        const long long written = read(buffer, static_cast<unsigned long long>(length), userdata);
+        if (written < 0 || static_cast<unsigned long long>(written) > length) {
+            return false;
+        }
+        length = static_cast<size_t>(written);
+        return true;
+    }});
+    return 0;
+}
+
+// Bodies are reserved from Content-Length by cpr already; this raises the
+// floor for servers that don't announce a length, e.g. chunked downloads.
+int luneffi_cpr_session_set_reserve_size(LuneCprSession* session, unsigned long long size) {
+    if (session == nullptr) {
+        return -1;
+    }
+
+    session->session.SetReserveSize(cpr::ReserveSize{static_cast<size_t>(size)});
+    return 0;
+}
+
+// Compresses request bodies with `coding`, "gzip" or "zstd" if the library was
+// built with it, at `level` (0 for the default); null turns it back off.
+// Bodies smaller than `min_size` are sent as they are; streamed ones always
+// go out compressed, with chunked transfer encoding.
+int luneffi_cpr_session_set_compression(LuneCprSession* session, const char* coding, int level, unsigned long long min_size) {
+    if (session == nullptr) {
+        return -1;
+    }
+
+    if (coding == nullptr) {
+        session->session.SetRequestCompression(std::nullopt);
+        return 0;
+    }
+
+    cpr::RequestCompression compression;
+    if (std::strcmp(coding, "gzip") == 0) {
+        compression.coding = cpr::ContentCoding::GZIP;
+    } else if (std::strcmp(coding, "zstd") == 0) {
+        compression.coding = cpr::ContentCoding::ZSTD;
+    } else {
+        return -1;
+    }
+    if (!cpr::ContentCodingSupported(compression.coding)) {
+        return -1;
+    }
+    compression.level = level;
+    compression.min_size = static_cast<size_t>(min_size);
+    session->session.SetRequestCompression(compression);
+    return 0;
+}
+
+static std::optional<cpr::Response> perform_method(cpr::Session& s, const char* method) {
+    if (std::strcmp(method, "GET") == 0) {
+        return s.Get();
+    } else if (std::strcmp(method, "POST") == 0) {
+        return s.Post();
+    } else if (std::strcmp(method, "PUT") == 0) {
+        return s.Put();
+    } else if (std::strcmp(method, "PATCH") == 0) {
+        return s.Patch();
+    } else if (std::strcmp(method, "DELETE") == 0) {
+        return s.Delete();
+    } else if (std::strcmp(method, "HEAD") == 0) {
+        return s.Head();
+    } else if (std::strcmp(method, "OPTIONS") == 0) {
+        return s.Options();
+    }
+
+    return std::nullopt;
+}
+
+LuneCprResponse* luneffi_cpr_session_perform(LuneCprSession* session, const char* method) {
+    if (session == nullptr || method == nullptr) {
         return nullptr;
     }
 
-    auto response = cpr::Get(
-        cpr::Url{url},
-        cpr::Proxies{{"http", ""}, {"https", ""}},
-        cpr::Timeout{5000}
-    );
+    std::optional<cpr::Response> response = perform_method(session->session, method);
+    return response ? make_response(std::move(*response)) : nullptr;
+}
 
-    auto* result = new (std::nothrow) LuneCprResponse{};
-    if (result == nullptr) {
+// Runs one request with the body routed through `write` instead of being
+// buffered in the response, then restores the default buffering.
+static std::optional<cpr::Response> perform_with_writer(cpr::Session& s, const char* method, cpr::WriteCallback&& write) {
+    s.SetWriteCallback(write);
+    std::optional<cpr::Response> response = perform_method(s, method);
+    s.SetWriteCallback(cpr::WriteCallback{});
+    return response;
+}
+
+// Writes the body straight into a caller owned buffer instead of the
+// response. The text view of the returned response points into `buffer`.
+// A body larger than `capacity` aborts the transfer with a write error.
+LuneCprResponse* luneffi_cpr_session_perform_into(LuneCprSession* session, const char* method, char* buffer, unsigned long long capacity) {
+    if (session == nullptr || method == nullptr || (buffer == nullptr && capacity > 0)) {
         return nullptr;
     }
 
-    result->status_code = response.status_code;
-    result->error_code = static_cast<int>(response.error.code);
-    result->text = make_string(response.text);
-    if (!response.error.message.empty()) {
-        result->error = make_string(response.error.message);
-    } else {
-        result->error = LuneCprString{nullptr, 0};
+    unsigned long long length = 0;
+    std::optional<cpr::Response> response = perform_with_writer(session->session, method, cpr::WriteCallback{[buffer, capacity, &length](const std::string_view& data, intptr_t /*userdata*/) {
+        if (data.size() > capacity - length) {
+            return false;
+        }
+        std::memcpy(buffer + length, data.data(), data.size());
+        length += data.size();
+        return true;
+    }});
+    if (!response) {
+        return nullptr;
     }
 
+    LuneCprResponse* result = make_response(std::move(*response));
+    if (result != nullptr) {
+        result->text = LuneCprString{buffer, length};
+    }
     return result;
 }
 
+// Receives each chunk of the body as it arrives. Returning 0 aborts the
+// transfer with a write error. The chunk is only valid during the call.
+typedef int (*LuneCprWriteFn)(const char* data, unsigned long long length, void* userdata);
+
+// Streams the body through `write` on the calling thread, so memory use
+// stays constant no matter how large the body is. The returned response
+// carries status and error, its text is empty.
+LuneCprResponse* luneffi_cpr_session_perform_stream(LuneCprSession* session, const char* method, LuneCprWriteFn write, void* userdata) {
+    if (session == nullptr || method == nullptr || write == nullptr) {
+        return nullptr;
+    }
+
+    std::optional<cpr::Response> response = perform_with_writer(session->session, method, cpr::WriteCallback{[write, userdata](const std::string_view& data, intptr_t /*userdata*/) {
+        return write(data.data(), static_cast<unsigned long long>(data.size()), userdata) != 0;
+    }});
+    return response ? make_response(std::move(*response)) : nullptr;
+}
+
+// A record of a delimited body, `length` bytes at `offset` from the base its
+// batch was delivered with.
+struct LuneCprRecord {
+    unsigned long long offset;
+    unsigned long long length;
+};
+
+// Receives up to the batch size of records, all relative to `base`, which is
+// only valid during the call. Returning 0 aborts the transfer.
+typedef int (*LuneCprRecordFn)(const char* base, const LuneCprRecord* records, unsigned long long count, void* userdata);
+
+// Record callback used when it is given 0 for either limit
+static constexpr unsigned long long DEFAULT_MAX_RECORD = 1024 * 1024;
+static constexpr unsigned long long DEFAULT_RECORD_BATCH = 256;
+
+// Splits a streamed body into records at a delimiter byte, without the
+// delimiter. Records lying within one chunk are delivered in place; only the
+// start of one spanning chunks is kept, up to `max_record` bytes, so memory
+// stays bounded by the largest record rather than the body. memchr() does
+// the scanning, vectorized by the C library. Empty records are skipped, and
+// with a '\n' delimiter a trailing '\r' is dropped too, so blank lines of
+// NDJSON and CRLF line endings are handled alike.
+class RecordSplitter {
+  public:
+    RecordSplitter(char delimiter, unsigned long long max_record, unsigned long long batch, LuneCprRecordFn deliver, void* userdata)
+        : delimiter_(delimiter), max_record_(max_record > 0 ? max_record : DEFAULT_MAX_RECORD), batch_(batch > 0 ? batch : DEFAULT_RECORD_BATCH), deliver_(deliver), userdata_(userdata) {
+        records_.reserve(static_cast<size_t>(std::min<unsigned long long>(batch_, DEFAULT_RECORD_BATCH)));
+    }
+
+    bool Feed(std::string_view data) {
+        const char* const base = data.data();
+        size_t position = 0;
+        if (!carry_.empty()) {
+            const void* found = std::memchr(base, delimiter_, data.size());
+            const size_t head = found != nullptr ? static_cast<const char*>(found) - base : data.size();
+            if (carry_.size() + head > max_record_) {
+                overflowed_ = true;
+                return false;
+            }
+            carry_.append(base, head);
+            if (found == nullptr) {
+                return true;
+            }
+            if (!push(carry_.data(), 0, carry_.size()) || !flush(carry_.data())) {
+                return false;
+            }
+            carry_.clear();
+            position = head + 1;
+        }
+
+        while (position < data.size()) {
+            const void* found = std::memchr(base + position, delimiter_, data.size() - position);
+            if (found == nullptr) {
+                break;
+            }
+            const size_t end = static_cast<const char*>(found) - base;
+            if (!push(base, position, end - position)) {
+                return false;
+            }
+            if (records_.size() >= batch_ && !flush(base)) {
+                return false;
+            }
+            position = end + 1;
+        }
+        if (!flush(base)) {
+            return false;
+        }
+
+        if (data.size() - position > max_record_) {
+            overflowed_ = true;
+            return false;
+        }
+        carry_.assign(base + position, data.size() - position);
+        return true;
+    }
+
+    // Delivers the record left without a delimiter at the end of the body
+    bool Finish() {
+        if (carry_.empty()) {
+            return true;
+        }
+        const bool delivered = push(carry_.data(), 0, carry_.size()) && flush(carry_.data());
+        carry_.clear();
+        return delivered;
+    }
+
+    [[nodiscard]] bool Overflowed() const {
+        return overflowed_;
+    }
+
+  private:
+    bool push(const char* base, size_t offset, size_t length) {
+        if (length > max_record_) {
+            overflowed_ = true;
+            return false;
+        }
+        if (delimiter_ == '\n' && length > 0 && base[offset + length - 1] == '\r') {
+            --length;
+        }
+        if (length > 0) {
+            records_.push_back(LuneCprRecord{offset, length});
+        }
+        return true;
+    }
+
+    bool flush(const char* base) {
+        if (records_.empty()) {
+            return true;
+        }
+        const bool keep_going = deliver_(base, records_.data(), records_.size(), userdata_) != 0;
+        records_.clear();
+        return keep_going;
+    }
+
+    const char delimiter_;
+    const unsigned long long max_record_;
+    const unsigned long long batch_;
+    const LuneCprRecordFn deliver_;
+    void* const userdata_;
+    std::string carry_;
+    std::vector<LuneCprRecord> records_;
+    bool overflowed_{false};
+};
+
+// Streams the body through a RecordSplitter, handing `on_records` batches of
+// up to `batch` records separated by `delimiter`, so an NDJSON or log stream
+// is never held as one string and Luau reads only the records it wants.
+// `max_record` bounds a record, longer ones abort the transfer; 0 for either
+// limit picks a default. The returned response carries status and error, its
+// text is empty.
+LuneCprResponse* luneffi_cpr_session_perform_records(LuneCprSession* session, const char* method, int delimiter, unsigned long long max_record, unsigned long long batch, LuneCprRecordFn on_records, void* userdata) {
+    if (session == nullptr || method == nullptr || on_records == nullptr || delimiter < 0 || delimiter > 255) {
+        return nullptr;
+    }
+
+    RecordSplitter splitter(static_cast<char>(delimiter), max_record, batch, on_records, userdata);
+    std::optional<cpr::Response> response = perform_with_writer(session->session, method, cpr::WriteCallback{[&splitter](const std::string_view& data, intptr_t /*userdata*/) {
+        return splitter.Feed(data);
+    }});
+    if (!response) {
+        return nullptr;
+    }
+
+    if (splitter.Overflowed()) {
+        response->error.message = "record longer than max_record";
+    } else if (response->error.code == cpr::ErrorCode::OK && !splitter.Finish()) {
+        response->error.code = cpr::ErrorCode::WRITE_ERROR;
+        response->error.message = "record callback aborted the transfer";
+    }
+    return make_response(std::move(*response));
+}
+
 void luneffi_cpr_response_free(LuneCprResponse* response) {
     if (response == nullptr) {
         return;
     }
 
-    destroy_string(response->text);
-    destroy_string(response->error);
+    recycle_body(*response);
     delete response;
 }
 
@@ -92,6 +1837,10 @@ int luneffi_cpr_response_error_code(const LuneCprResponse* response) {
     return response != nullptr ? response->error_code : -1;
 }
 
+unsigned long long luneffi_cpr_response_ticket(const LuneCprResponse* response) {
+    return response != nullptr ? response->ticket : 0ULL;
+}
+
 const char* luneffi_cpr_response_text_data(const LuneCprResponse* response) {
     return (response != nullptr && response->text.data != nullptr) ? response->text.data : nullptr;
 }
@@ -108,4 +1857,459 @@ unsigned long long luneffi_cpr_response_error_length(const LuneCprResponse* resp
     return response != nullptr ? response->error.length : 0ULL;
 }
 
+// The raw header block of the response, including the blocks of redirects
+// and interim responses before it. Borrowed like the text.
+const char* luneffi_cpr_response_headers_data(const LuneCprResponse* response) {
+    return response != nullptr ? stored_response(*response).raw_header.data() : nullptr;
+}
+
+unsigned long long luneffi_cpr_response_headers_length(const LuneCprResponse* response) {
+    return response != nullptr ? static_cast<unsigned long long>(stored_response(*response).raw_header.size()) : 0ULL;
+}
+
+// Header fields of the final response, in the order they arrived. Cached
+// responses have no raw block, their fields come from cpr::Response::header.
+unsigned long long luneffi_cpr_response_header_count(const LuneCprResponse* response) {
+    if (response == nullptr) {
+        return 0ULL;
+    }
+    const cpr::Response& stored = stored_response(*response);
+    return static_cast<unsigned long long>(stored.header_fields.empty() ? stored.header.size() : stored.header_fields.size());
+}
+
+int luneffi_cpr_response_header_at(const LuneCprResponse* response, unsigned long long index, LuneCprString* name, LuneCprString* value) {
+    if (response == nullptr || name == nullptr || value == nullptr || index >= luneffi_cpr_response_header_count(response)) {
+        return -1;
+    }
+
+    const cpr::Response& stored = stored_response(*response);
+    if (stored.header_fields.empty()) {
+        const auto field = std::next(stored.header.begin(), static_cast<std::ptrdiff_t>(index));
+        *name = view_string(field->first);
+        *value = view_string(field->second);
+        return 0;
+    }
+    const cpr::HeaderParser::Field& field = stored.header_fields[index];
+    *name = LuneCprString{stored.raw_header.data() + field.name.offset, static_cast<unsigned long long>(field.name.length)};
+    *value = LuneCprString{stored.raw_header.data() + field.value.offset, static_cast<unsigned long long>(field.value.length)};
+    return 0;
+}
+
+// The value of the last field called `name`, compared case-insensitively,
+// pointing into the response without copying and not NUL-terminated. Null
+// with a length of 0 if the response has no such field.
+const char* luneffi_cpr_response_header(const LuneCprResponse* response, const char* name, unsigned long long* length) {
+    if (length != nullptr) {
+        *length = 0;
+    }
+    if (response == nullptr || name == nullptr || length == nullptr) {
+        return nullptr;
+    }
+
+    const cpr::Response& stored = stored_response(*response);
+    const std::string_view wanted{name};
+    if (stored.header_fields.empty()) {
+        const auto found = stored.header.find(std::string{wanted});
+        if (found == stored.header.end()) {
+            return nullptr;
+        }
+        *length = static_cast<unsigned long long>(found->second.size());
+        return found->second.data();
+    }
+    const auto equals = [](unsigned char a, unsigned char b) { return std::tolower(a) == std::tolower(b); };
+    for (auto field = stored.header_fields.rbegin(); field != stored.header_fields.rend(); ++field) {
+        const std::string_view field_name{stored.raw_header.data() + field->name.offset, field->name.length};
+        if (std::equal(field_name.begin(), field_name.end(), wanted.begin(), wanted.end(), equals)) {
+            *length = static_cast<unsigned long long>(field->value.length);
+            return stored.raw_header.data() + field->value.offset;
+        }
+    }
+    return nullptr;
+}
+
+int luneffi_cpr_response_info(const LuneCprResponse* response, LuneCprResponseInfo* out) {
+    if (response == nullptr || out == nullptr) {
+        return -1;
+    }
+
+    out->status_code = response->status_code;
+    out->error_code = response->error_code;
+    out->text = response->text;
+    out->error = response->error;
+
+    const cpr::Response& stored = stored_response(*response);
+    out->headers = view_string(stored.raw_header);
+    out->elapsed = stored.elapsed;
+
+    const cpr::TransferTimings& timings = stored.timings;
+    out->namelookup_us = static_cast<long long>(timings.namelookup);
+    out->connect_us = static_cast<long long>(timings.connect);
+    out->appconnect_us = static_cast<long long>(timings.appconnect);
+    out->pretransfer_us = static_cast<long long>(timings.pretransfer);
+    out->starttransfer_us = static_cast<long long>(timings.starttransfer);
+    out->total_us = static_cast<long long>(timings.total);
+    out->num_connects = static_cast<long long>(stored.num_connects);
+    out->connection_reused = stored.connection_reused ? 1 : 0;
+    return 0;
+}
+
+// Copies the counters every request through the bridge updates: requests
+// in flight, bytes, connection reuse, errors by code and latency
+// percentiles per host. Cheap enough to poll from a metrics loop.
+int luneffi_cpr_metrics_snapshot(LuneCprMetrics* out) {
+    if (out == nullptr) {
+        return -1;
+    }
+
+    const cpr::Metrics::Snapshot snapshot = cpr::Metrics::Global().Take();
+    *out = LuneCprMetrics{};
+    out->in_flight = snapshot.in_flight;
+    out->requests = snapshot.requests;
+    out->reused_connections = snapshot.reused_connections;
+    out->new_connections = snapshot.new_connections;
+    out->bytes_in = snapshot.bytes_in;
+    out->bytes_out = snapshot.bytes_out;
+    out->multi_errors = snapshot.multi_errors;
+    std::copy(snapshot.errors.begin(), snapshot.errors.end(), out->errors);
+
+    cpr::GlobalThreadPool* pool = cpr::GlobalThreadPool::GetInstance();
+    out->pool_threads = pool->GetCurrentThreadNum();
+    out->pool_idle_threads = pool->GetIdleThreadNum();
+    out->pool_queued_tasks = pool->GetQueuedTaskNum();
+
+    const size_t host_count = std::min(snapshot.hosts.size(), sizeof(out->hosts) / sizeof(out->hosts[0]));
+    out->host_count = host_count;
+    for (size_t index = 0; index < host_count; ++index) {
+        const cpr::Metrics::HostSnapshot& host = snapshot.hosts[index];
+        LuneCprHostMetrics& target = out->hosts[index];
+        std::strncpy(target.host, host.host.c_str(), sizeof(target.host) - 1);
+        target.requests = host.requests;
+        target.errors = host.errors;
+        target.p50_us = static_cast<long long>(cpr::LatencyHistogram::Percentile(host.latency, 50));
+        target.p90_us = static_cast<long long>(cpr::LatencyHistogram::Percentile(host.latency, 90));
+        target.p99_us = static_cast<long long>(cpr::LatencyHistogram::Percentile(host.latency, 99));
+        target.max_us = static_cast<long long>(cpr::LatencyHistogram::Percentile(host.latency, 100));
+    }
+    return 0;
+}
+
+// Configures the lanes through which cpr::GlobalThreadPool schedules tasks.
+// With `strict` set, urgent lanes always go first, otherwise lanes take
+// turns by `weights` (3 values, nullptr keeps the current ones).
+// `reserved_threads` workers stay free for interactive tasks.
+int luneffi_cpr_pool_set_lanes(int strict, const unsigned long long* weights, unsigned long long reserved_threads) {
+    cpr::GlobalThreadPool* pool = cpr::GlobalThreadPool::GetInstance();
+    pool->SetLaneScheduling(strict != 0 ? cpr::ThreadPool::LaneScheduling::STRICT : cpr::ThreadPool::LaneScheduling::WEIGHTED);
+    if (weights != nullptr) {
+        std::array<size_t, cpr::ThreadPool::kPriorityCount> lane_weights{};
+        std::copy(weights, weights + lane_weights.size(), lane_weights.begin());
+        pool->SetLaneWeights(lane_weights);
+    }
+    pool->SetReservedThreadNum(static_cast<size_t>(reserved_threads));
+    return 0;
+}
+
+int luneffi_cpr_pool_lanes(LuneCprPoolLanes* out) {
+    if (out == nullptr) {
+        return -1;
+    }
+
+    const cpr::GlobalThreadPool* pool = cpr::GlobalThreadPool::GetInstance();
+    out->strict = pool->GetLaneScheduling() == cpr::ThreadPool::LaneScheduling::STRICT ? 1 : 0;
+    out->reserved_threads = pool->GetReservedThreadNum();
+    const std::array<size_t, cpr::ThreadPool::kPriorityCount> weights = pool->GetLaneWeights();
+    std::copy(weights.begin(), weights.end(), out->weights);
+    for (size_t lane = 0; lane < cpr::ThreadPool::kPriorityCount; ++lane) {
+        out->queued[lane] = pool->GetQueuedTaskNum(static_cast<cpr::ThreadPool::Priority>(lane));
+    }
+    return 0;
+}
+
+// With `enabled` set, cpr's free request functions, which luneffi_cpr_get
+// and the downloads use, run on a curl handle their thread keeps instead of
+// a new one per request. See cpr::CurlHolder::SetThreadReuse.
+void luneffi_cpr_set_thread_reuse(int enabled) {
+    cpr::CurlHolder::SetThreadReuse(enabled != 0);
+}
+
+// Sends cpr's trace events, transfers with their phases and thread pool
+// tasks, to `sink`, such as the one ffi.traceSink returns; nullptr stops
+// them.
+void luneffi_cpr_set_trace_sink(cpr::trace::Sink sink) {
+    cpr::trace::SetSink(sink);
+}
+
+// Creates a cache for GET responses, bounded to `max_bytes` in memory (0 for
+// the default 16 MiB). With a `disk_directory`, responses are also kept there
+// up to `max_disk_bytes` (0 for 256 MiB) and found again by later processes.
+LuneCprCache* luneffi_cpr_cache_create(unsigned long long max_bytes, const char* disk_directory, unsigned long long max_disk_bytes) {
+    cpr::ResponseCacheOptions options;
+    if (max_bytes > 0) {
+        options.max_bytes = static_cast<size_t>(max_bytes);
+    }
+    if (disk_directory != nullptr) {
+        options.disk_directory = disk_directory;
+    }
+    if (max_disk_bytes > 0) {
+        options.max_disk_bytes = static_cast<size_t>(max_disk_bytes);
+    }
+
+    auto* cache = new (std::nothrow) LuneCprCache{};
+    if (cache == nullptr) {
+        return nullptr;
+    }
+    try {
+        cache->cache = std::make_shared<cpr::ResponseCache>(std::move(options));
+    } catch (const std::exception&) {
+        delete cache;
+        return nullptr;
+    }
+    return cache;
+}
+
+// Sessions the cache is set on keep it alive until they are destroyed.
+void luneffi_cpr_cache_destroy(LuneCprCache* cache) {
+    delete cache;
+}
+
+// GET requests of the session are answered from `cache` while fresh and
+// revalidated with If-None-Match / If-Modified-Since once stale. Requests
+// streamed to a callback or a buffer bypass it.
+int luneffi_cpr_session_set_cache(LuneCprSession* session, LuneCprCache* cache) {
+    if (session == nullptr || cache == nullptr) {
+        return -1;
+    }
+
+    session->session.SetResponseCache(cache->cache);
+    return 0;
+}
+
+int luneffi_cpr_cache_stats(const LuneCprCache* cache, LuneCprCacheStats* out) {
+    if (cache == nullptr || out == nullptr) {
+        return -1;
+    }
+
+    const cpr::ResponseCache::Stats stats = cache->cache->GetStats();
+    out->hits = stats.hits;
+    out->revalidated = stats.revalidated;
+    out->misses = stats.misses;
+    out->stores = stats.stores;
+    out->evictions = stats.evictions;
+    out->disk_hits = stats.disk_hits;
+    out->entries = stats.entries;
+    out->bytes = stats.bytes;
+    return 0;
+}
+
+// Drops every stored response, from the disk directory too.
+int luneffi_cpr_cache_clear(LuneCprCache* cache) {
+    if (cache == nullptr) {
+        return -1;
+    }
+
+    cache->cache->Clear();
+    return 0;
+}
+
+// Creates a budget of `receive_rate` and `send_rate` bytes per second (0 for
+// no limit) for the sessions it is set on to share. With a `parent`, their
+// bytes also count against the parent, which stays alive as long as this one.
+LuneCprBandwidth* luneffi_cpr_bandwidth_create(unsigned long long receive_rate, unsigned long long send_rate, const LuneCprBandwidth* parent) {
+    auto* bandwidth = new (std::nothrow) LuneCprBandwidth{};
+    if (bandwidth == nullptr) {
+        return nullptr;
+    }
+    try {
+        bandwidth->budget = std::make_shared<cpr::BandwidthBudget>(cpr::BandwidthLimits{receive_rate, send_rate, 0}, parent != nullptr ? parent->budget : nullptr);
+    } catch (const std::exception&) {
+        delete bandwidth;
+        return nullptr;
+    }
+    return bandwidth;
+}
+
+// Sessions the budget is set on keep it alive until they are destroyed.
+void luneffi_cpr_bandwidth_destroy(LuneCprBandwidth* bandwidth) {
+    delete bandwidth;
+}
+
+// Transfers of the session draw from `bandwidth` from the next request on,
+// uploads only when their body comes from a read callback. nullptr removes
+// the budget.
+int luneffi_cpr_session_set_bandwidth(LuneCprSession* session, const LuneCprBandwidth* bandwidth) {
+    if (session == nullptr) {
+        return -1;
+    }
+
+    session->session.SetBandwidthBudget(bandwidth != nullptr ? bandwidth->budget : nullptr);
+    return 0;
+}
+
+int luneffi_cpr_bandwidth_stats(const LuneCprBandwidth* bandwidth, LuneCprBandwidthStats* out) {
+    if (bandwidth == nullptr || out == nullptr) {
+        return -1;
+    }
+
+    const cpr::BandwidthBudget::Stats stats = bandwidth->budget->GetStats();
+    out->received = stats.received;
+    out->sent = stats.sent;
+    out->pauses = stats.pauses;
+    return 0;
+}
+
+// A WebSocket connection made by luneffi_cpr_ws_connect. Its frames are read
+// by the engine; only one thread may take them at a time, while sending and
+// closing work from any thread.
+struct LuneCprWebSocket {
+    std::shared_ptr<LuneCprEngine::Stream> stream;
+};
+
+int luneffi_cpr_ws_supported(void) {
+    return cpr::WebSocket::Supported() ? 1 : 0;
+}
+
+// Connects to the ws:// or wss:// `url`, blocking until the handshake is
+// done. `headers` holds `header_count` name and value pairs, one after the
+// other, for the upgrade request; `ring_capacity` bounds the frames received
+// but not released yet, 0 for 1 MiB, and frames larger than half of it end
+// the connection. With `handshake` set it receives the upgrade's response,
+// to be freed with luneffi_cpr_response_free. Returns null on failure.
+//
+// Received frames are read into the ring on the engine's shards, without a
+// request per message: luneffi_cpr_wait_completions counts a connection with
+// new frames until luneffi_cpr_ws_frames looks at them.
+LuneCprWebSocket* luneffi_cpr_ws_connect(const char* url, const char* const* headers, unsigned long long header_count, unsigned long long ring_capacity, LuneCprResponse** handshake) {
+    if (handshake != nullptr) {
+        *handshake = nullptr;
+    }
+    if (url == nullptr || (headers == nullptr && header_count > 0)) {
+        return nullptr;
+    }
+
+    // Not on connection_pool(): the connection belongs to the WebSocket
+    // from the upgrade on, and a total timeout would end it
+    auto session = std::make_shared<cpr::Session>();
+    session->SetUrl(cpr::Url{url});
+    session->SetProxies(cpr::Proxies{{"http", ""}, {"https", ""}});
+    session->SetConnectTimeout(cpr::ConnectTimeout{5000});
+    session->SetResponseCookies(false);
+    for (unsigned long long index = 0; index < header_count; ++index) {
+        const char* name = headers[index * 2];
+        const char* value = headers[index * 2 + 1];
+        if (name == nullptr || value == nullptr) {
+            return nullptr;
+        }
+        session->UpdateHeader(cpr::Header{{name, value}});
+    }
+
+    auto stream = std::make_shared<LuneCprEngine::Stream>();
+    stream->socket = std::make_shared<cpr::WebSocket>(session, ring_capacity > 0 ? static_cast<size_t>(ring_capacity) : cpr::MessageRing::kDefaultCapacity);
+    cpr::Response response = stream->socket->Connect();
+    const bool connected = response.error.code == cpr::ErrorCode::OK;
+    if (handshake != nullptr) {
+        *handshake = make_response(std::move(response));
+    }
+    if (!connected) {
+        return nullptr;
+    }
+
+    auto* ws = new (std::nothrow) LuneCprWebSocket{stream};
+    if (ws == nullptr || engine().Open(stream, url) == 0) {
+        stream->socket->Close(1011);
+        delete ws;
+        return nullptr;
+    }
+    return ws;
+}
+
+// The completion ticket of the connection, delivered once it closed with
+// the close frame's status code as the response status, its reason as the
+// text and the error that ended it, if any. luneffi_cpr_cancel on it closes
+// the connection.
+unsigned long long luneffi_cpr_ws_ticket(const LuneCprWebSocket* ws) {
+    return ws != nullptr ? ws->stream->ticket : 0;
+}
+
+// Sends `length` bytes of `data` as one text frame, or binary with `binary`
+// set. Returns cpr's error code, 0 once the socket took all of it, or -1.
+int luneffi_cpr_ws_send(LuneCprWebSocket* ws, const char* data, unsigned long long length, int binary) {
+    if (ws == nullptr || (data == nullptr && length > 0)) {
+        return -1;
+    }
+
+    const cpr::Error error = ws->stream->socket->Send(std::string_view{data, static_cast<size_t>(length)}, binary != 0 ? CURLWS_BINARY : CURLWS_TEXT);
+    return static_cast<int>(error.code);
+}
+
+// Views up to `max`, and at most 1024 at a time, of the oldest frames
+// received and not released yet, returning how many. The views stay valid
+// until the frames are released with luneffi_cpr_ws_release, oldest first;
+// they are never copied.
+unsigned long long luneffi_cpr_ws_frames(LuneCprWebSocket* ws, LuneCprWsFrame* out, unsigned long long max) {
+    if (ws == nullptr || out == nullptr) {
+        return 0;
+    }
+
+    engine().Acknowledge(*ws->stream);
+    thread_local std::vector<cpr::MessageRing::View> views;
+    views.resize(static_cast<size_t>(std::min<unsigned long long>(max, 1024)));
+    const size_t count = ws->stream->socket->Ring().Peek(views.data(), views.size());
+    for (size_t index = 0; index < count; ++index) {
+        out[index] = LuneCprWsFrame{views[index].data, static_cast<unsigned long long>(views[index].length), views[index].flags};
+    }
+    return count;
+}
+
+// Hands the room of the `count` oldest frames back to the connection,
+// returning how many there were.
+unsigned long long luneffi_cpr_ws_release(LuneCprWebSocket* ws, unsigned long long count) {
+    if (ws == nullptr) {
+        return 0;
+    }
+
+    const size_t released = ws->stream->socket->Ring().Release(static_cast<size_t>(count));
+    if (ws->stream->blocked.load(std::memory_order_acquire)) {
+        // A frame waits for the room
+        engine().Nudge(*ws->stream);
+    }
+    return released;
+}
+
+// Sends a close frame with `code` and `reason`, which may be null, and
+// completes the connection's ticket. Returns cpr's error code or -1.
+int luneffi_cpr_ws_close(LuneCprWebSocket* ws, int code, const char* reason) {
+    if (ws == nullptr || code < 0 || code > 0xffff) {
+        return -1;
+    }
+
+    const cpr::Error error = ws->stream->socket->Close(static_cast<uint16_t>(code), reason != nullptr ? reason : "");
+    engine().Nudge(*ws->stream);
+    return static_cast<int>(error.code);
+}
+
+// Closes the connection if it is open and frees the handle; its ticket
+// still completes.
+void luneffi_cpr_ws_free(LuneCprWebSocket* ws) {
+    if (ws == nullptr) {
+        return;
+    }
+
+    ws->stream->socket->Close();
+    engine().Nudge(*ws->stream);
+    delete ws;
+}
+
+int luneffi_cpr_ws_stats(const LuneCprWebSocket* ws, LuneCprWsStats* out) {
+    if (ws == nullptr || out == nullptr) {
+        return -1;
+    }
+
+    const cpr::WebSocket::Stats stats = ws->stream->socket->GetStats();
+    out->frames_received = stats.frames_received;
+    out->bytes_received = stats.bytes_received;
+    out->frames_sent = stats.frames_sent;
+    out->bytes_sent = stats.bytes_sent;
+    out->stalls = stats.stalls;
+    return 0;
+}
 }
@@ -1,12 +1,31 @@
 #ifndef LUNEFFI_LOADER_H
 #define LUNEFFI_LOADER_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Flags for luneffi_dlopen_ex. Flags that do not exist on the platform are ignored, except
+ * LUNEFFI_DEEPBIND, which fails the load where RTLD_DEEPBIND is unavailable. */
+#define LUNEFFI_BIND_NOW 0x1
+#define LUNEFFI_GLOBAL 0x2
+#define LUNEFFI_NODELETE 0x4
+#define LUNEFFI_DEEPBIND 0x8
+/* LoadLibraryEx search locations (Windows only) */
+#define LUNEFFI_SEARCH_DLL_LOAD_DIR 0x10
+#define LUNEFFI_SEARCH_APPLICATION_DIR 0x20
+#define LUNEFFI_SEARCH_USER_DIRS 0x40
+#define LUNEFFI_SEARCH_SYSTEM32 0x80
+#define LUNEFFI_SEARCH_DEFAULT_DIRS 0x100
+
 void* luneffi_dlopen(const char* path);
+void* luneffi_dlopen_ex(const char* path, int flags);
 void* luneffi_dlsym(void* handle, const char* name);
+/* Resolves every name into `out` (NULL when missing) and returns how many were found; the error
+ * names the first symbol that was not */
+size_t luneffi_dlsym_many(void* handle, const char* const* names, void** out, size_t count);
 int luneffi_dlclose(void* handle);
 const char* luneffi_dlerror(void);
 
@@ -1,3 +1,8 @@
+// RTLD_NODELETE and RTLD_DEEPBIND are GNU extensions on glibc
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "luneffi_loader.h"
 
 #include <dlfcn.h>
@@ -24,9 +29,25 @@ static void luneffi_set_error(const char* message) {
     luneffi_last_error[len] = '\0';
 }
 
-void* luneffi_dlopen(const char* path) {
+void* luneffi_dlopen_ex(const char* path, int flags) {
     luneffi_set_error(NULL);
-    void* handle = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+    int mode = (flags & LUNEFFI_BIND_NOW) ? RTLD_NOW : RTLD_LAZY;
+    mode |= (flags & LUNEFFI_GLOBAL) ? RTLD_GLOBAL : RTLD_LOCAL;
+#ifdef RTLD_NODELETE
+    if (flags & LUNEFFI_NODELETE) {
+        mode |= RTLD_NODELETE;
+    }
+#endif
+    if (flags & LUNEFFI_DEEPBIND) {
+#ifdef RTLD_DEEPBIND
+        mode |= RTLD_DEEPBIND;
+#else
+        luneffi_set_error("RTLD_DEEPBIND is not supported on this platform");
+        return NULL;
+#endif
+    }
+
+    void* handle = dlopen(path, mode);
     if (handle == NULL) {
         const char* err = dlerror();
         luneffi_set_error(err ? err : "unknown dlopen error");
@@ -34,6 +55,10 @@ void* luneffi_dlopen(const char* path) {
     return handle;
 }
 
+void* luneffi_dlopen(const char* path) {
+    return luneffi_dlopen_ex(path, 0);
+}
+
 void* luneffi_dlsym(void* handle, const char* name) {
     luneffi_set_error(NULL);
     void* resolved = dlsym(handle ? handle : RTLD_DEFAULT, name);
@@ -44,6 +69,24 @@ void* luneffi_dlsym(void* handle, const char* name) {
     return resolved;
 }
 
+size_t luneffi_dlsym_many(void* handle, const char* const* names, void** out, size_t count) {
+    luneffi_set_error(NULL);
+    void* scope = handle ? handle : RTLD_DEFAULT;
+    size_t resolved = 0;
+    int reported = 0;
+    for (size_t index = 0; index < count; index++) {
+        out[index] = dlsym(scope, names[index]);
+        if (out[index] != NULL) {
+            resolved++;
+        } else if (!reported) {
+            const char* err = dlerror();
+            luneffi_set_error(err ? err : "symbol lookup failed");
+            reported = 1;
+        }
+    }
+    return resolved;
+}
+
 int luneffi_dlclose(void* handle) {
     if (handle == NULL) {
         return 0;
@@ -59,6 +59,49 @@ static void luneffi_capture_last_error(const char* context) {
     );
 }
 
+// LoadLibrary always binds imports at load time and has no symbol scopes, so LUNEFFI_BIND_NOW,
+// LUNEFFI_GLOBAL and LUNEFFI_DEEPBIND change nothing here
+void* luneffi_dlopen_ex(const char* path, int flags) {
+    if (path == NULL || path[0] == '\0') {
+        return luneffi_dlopen(path);
+    }
+
+    luneffi_set_error(NULL);
+    DWORD search = 0;
+    if (flags & LUNEFFI_SEARCH_DLL_LOAD_DIR) {
+        search |= LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR;
+    }
+    if (flags & LUNEFFI_SEARCH_APPLICATION_DIR) {
+        search |= LOAD_LIBRARY_SEARCH_APPLICATION_DIR;
+    }
+    if (flags & LUNEFFI_SEARCH_USER_DIRS) {
+        search |= LOAD_LIBRARY_SEARCH_USER_DIRS;
+    }
+    if (flags & LUNEFFI_SEARCH_SYSTEM32) {
+        search |= LOAD_LIBRARY_SEARCH_SYSTEM32;
+    }
+    if (flags & LUNEFFI_SEARCH_DEFAULT_DIRS) {
+        search |= LOAD_LIBRARY_SEARCH_DEFAULT_DIRS;
+    }
+
+    HMODULE handle = LoadLibraryExA(path, NULL, search);
+    if (handle == NULL) {
+        luneffi_capture_last_error("LoadLibraryExA failed");
+        return NULL;
+    }
+
+    if (flags & LUNEFFI_NODELETE) {
+        // Pinning keeps the module loaded regardless of later FreeLibrary calls, like RTLD_NODELETE
+        HMODULE pinned;
+        if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_PIN, path, &pinned)) {
+            luneffi_capture_last_error("GetModuleHandleExA failed");
+            FreeLibrary(handle);
+            return NULL;
+        }
+    }
+    return handle;
+}
+
 void* luneffi_dlopen(const char* path) {
     luneffi_set_error(NULL);
     HMODULE handle;
@@ -94,6 +137,34 @@ void* luneffi_dlsym(void* handle, const char* name) {
     return (void*)proc;
 }
 
+size_t luneffi_dlsym_many(void* handle, const char* const* names, void** out, size_t count) {
+    luneffi_set_error(NULL);
+    HMODULE module = (HMODULE)handle;
+    if (module == NULL) {
+        module = GetModuleHandleA(NULL);
+        if (module == NULL) {
+            luneffi_capture_last_error("GetModuleHandleA(NULL)");
+            for (size_t index = 0; index < count; index++) {
+                out[index] = NULL;
+            }
+            return 0;
+        }
+    }
+
+    size_t resolved = 0;
+    int reported = 0;
+    for (size_t index = 0; index < count; index++) {
+        out[index] = (void*)GetProcAddress(module, names[index]);
+        if (out[index] != NULL) {
+            resolved++;
+        } else if (!reported) {
+            luneffi_capture_last_error("GetProcAddress failed");
+            reported = 1;
+        }
+    }
+    return resolved;
+}
+
 int luneffi_dlclose(void* handle) {
     luneffi_set_error(NULL);
     if (handle == NULL) {
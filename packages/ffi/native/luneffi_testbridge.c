@@ -1,12 +1,18 @@
 #include "luneffi_loader.h"
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #if defined(_WIN32)
+#include <windows.h>
 #define LUNEFFI_TEST_EXPORT __declspec(dllexport)
 #else
+#include <pthread.h>
 #define LUNEFFI_TEST_EXPORT __attribute__((visibility("default")))
 #endif
 
@@ -39,6 +45,12 @@ LUNEFFI_TEST_EXPORT int luneffi_test_variadic_format(char* buffer, size_t size,
     return written;
 }
 
+/* Fails the way syscall wrappers do: -1 with errno set */
+LUNEFFI_TEST_EXPORT int luneffi_test_fail_with_errno(int value) {
+    errno = value;
+    return -1;
+}
+
 typedef int (*luneffi_unary_callback)(int);
 
 LUNEFFI_TEST_EXPORT int luneffi_test_call_callback(luneffi_unary_callback cb, int value) {
@@ -48,6 +60,78 @@ LUNEFFI_TEST_EXPORT int luneffi_test_call_callback(luneffi_unary_callback cb, in
     return cb(value);
 }
 
+/* One callback call on a thread of its own, started and joined separately so the caller's
+   thread is free in between */
+typedef struct {
+    luneffi_unary_callback cb;
+    int value;
+    int result;
+} luneffi_thread_call;
+
+static luneffi_thread_call luneffi_pending_call;
+
+#if defined(_WIN32)
+static HANDLE luneffi_pending_thread = NULL;
+
+static DWORD WINAPI luneffi_run_thread_call(LPVOID arg) {
+    luneffi_thread_call* call = (luneffi_thread_call*)arg;
+    call->result = call->cb(call->value);
+    return 0;
+}
+#else
+static pthread_t luneffi_pending_thread;
+static int luneffi_pending_started = 0;
+
+static void* luneffi_run_thread_call(void* arg) {
+    luneffi_thread_call* call = (luneffi_thread_call*)arg;
+    call->result = call->cb(call->value);
+    return NULL;
+}
+#endif
+
+LUNEFFI_TEST_EXPORT int luneffi_test_start_callback_thread(luneffi_unary_callback cb, int value) {
+    if (cb == NULL) {
+        return -1;
+    }
+    luneffi_pending_call.cb = cb;
+    luneffi_pending_call.value = value;
+    luneffi_pending_call.result = 0;
+#if defined(_WIN32)
+    if (luneffi_pending_thread != NULL) {
+        return -1;
+    }
+    luneffi_pending_thread = CreateThread(NULL, 0, luneffi_run_thread_call, &luneffi_pending_call, 0, NULL);
+    return luneffi_pending_thread != NULL ? 0 : -1;
+#else
+    if (luneffi_pending_started) {
+        return -1;
+    }
+    if (pthread_create(&luneffi_pending_thread, NULL, luneffi_run_thread_call, &luneffi_pending_call) != 0) {
+        return -1;
+    }
+    luneffi_pending_started = 1;
+    return 0;
+#endif
+}
+
+LUNEFFI_TEST_EXPORT int luneffi_test_join_callback_thread(void) {
+#if defined(_WIN32)
+    if (luneffi_pending_thread == NULL) {
+        return -1;
+    }
+    WaitForSingleObject(luneffi_pending_thread, INFINITE);
+    CloseHandle(luneffi_pending_thread);
+    luneffi_pending_thread = NULL;
+#else
+    if (!luneffi_pending_started) {
+        return -1;
+    }
+    pthread_join(luneffi_pending_thread, NULL);
+    luneffi_pending_started = 0;
+#endif
+    return luneffi_pending_call.result;
+}
+
 typedef struct {
     int x;
     double y;
@@ -61,6 +145,53 @@ LUNEFFI_TEST_EXPORT double luneffi_test_struct_get_y(const RuntimeStructInit* va
     return value != NULL ? value->y : 0.0;
 }
 
+LUNEFFI_TEST_EXPORT double luneffi_test_struct_sum(RuntimeStructInit value) {
+    return value.x + value.y;
+}
+
+LUNEFFI_TEST_EXPORT RuntimeStructInit luneffi_test_struct_make(int x, double y) {
+    RuntimeStructInit value = {x, y};
+    return value;
+}
+
+static volatile int luneffi_slow_count = -1;
+
+/* Counts the bytes of `text` equal to `byte` only after sleeping for `delay_ms`, so a caller
+   that frees `text` meanwhile shows up in the count, kept for luneffi_test_slow_counted. */
+LUNEFFI_TEST_EXPORT RuntimeStructInit luneffi_test_slow_count(const char* text, int byte, int delay_ms) {
+#if defined(_WIN32)
+    Sleep((DWORD)delay_ms);
+#else
+    struct timespec delay = {delay_ms / 1000, (long)(delay_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+#endif
+    int count = 0;
+    for (const char* cursor = text; *cursor != '\0'; ++cursor) {
+        count += *cursor == (char)byte;
+    }
+    luneffi_slow_count = count;
+    RuntimeStructInit value = {count, (double)delay_ms};
+    return value;
+}
+
+/* The count of the last luneffi_test_slow_count to return, or -1 before then. */
+LUNEFFI_TEST_EXPORT int luneffi_test_slow_counted(void) {
+    int count = luneffi_slow_count;
+    luneffi_slow_count = -1;
+    return count;
+}
+
+typedef struct {
+    double x;
+    double y;
+    double z;
+} RuntimeVec3;
+
+LUNEFFI_TEST_EXPORT RuntimeVec3 luneffi_test_vec3_scale(RuntimeVec3 value, double factor) {
+    RuntimeVec3 scaled = {value.x * factor, value.y * factor, value.z * factor};
+    return scaled;
+}
+
 typedef struct {
     int* target;
     int flag;
@@ -92,3 +223,40 @@ LUNEFFI_TEST_EXPORT int luneffi_test_union_is_ptr(const RuntimeTaggedUnion* valu
     }
     return value->as_ptr == ptr;
 }
+
+LUNEFFI_TEST_EXPORT int luneffi_test_argv_count(const char* const* argv) {
+    int count = 0;
+    while (argv[count] != NULL) {
+        ++count;
+    }
+    return count;
+}
+
+/*
+ * Kernels for packages/ffi/bench, each doing as little as possible so the time measured is the
+ * call's overhead. The existing helpers cover int(int, int), struct pointer reads and variadics.
+ */
+LUNEFFI_TEST_EXPORT int luneffi_bench_nullary(void) {
+    return 0;
+}
+
+LUNEFFI_TEST_EXPORT double luneffi_bench_mixed8(int a, double b, int64_t c, float d, const void* e, uint32_t f, double g, int8_t h) {
+    return (double)a + b + (double)c + (double)d + (e != NULL ? 1.0 : 0.0) + (double)f + g + (double)h;
+}
+
+LUNEFFI_TEST_EXPORT size_t luneffi_bench_strlen(const char* text) {
+    return text != NULL ? strlen(text) : 0;
+}
+
+LUNEFFI_TEST_EXPORT const char* luneffi_bench_echo(const char* text) {
+    return text;
+}
+
+/* Calls `cb` once per element, for the cost of a callback round trip */
+LUNEFFI_TEST_EXPORT int luneffi_bench_each(luneffi_unary_callback cb, int count) {
+    int total = 0;
+    for (int index = 0; index < count; ++index) {
+        total += cb(index);
+    }
+    return total;
+}